@@ -0,0 +1,116 @@
+#pragma once
+#include <vector>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <stdexcept>
+
+// The thread pool as it was before the work stealing one: a single unbounded
+// queue behind one mutex and one condition variable. Kept for the pool bench
+// only, as the baseline the current ThreadPool is measured against.
+// Post queues the task without a future, the old callers used Commit and dropped it.
+class BaselineThreadPool
+{
+public:
+    BaselineThreadPool()
+        : m_bStoped(false)
+        , m_nThread(0)
+        , m_nMaxThread(1)
+    {
+    }
+
+    ~BaselineThreadPool()
+    {
+        Stop();
+    }
+
+public:
+    void Start(unsigned short size = 1, int nMaxThread = 1)
+    {
+        m_nMaxThread = nMaxThread;
+        add_thread(size);
+    }
+
+    void Stop()
+    {
+        m_bStoped.store(true);
+        m_cvTask.notify_all();
+        for (std::thread& thread : m_vecPool)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+    template<class F>
+    bool Post(F&& f)
+    {
+        if (m_bStoped.load())
+            return false;
+        {
+            std::lock_guard<std::mutex> lock{ m_lock };
+            m_queTasks.emplace(std::forward<F>(f));
+        }
+        m_cvTask.notify_one();
+        return true;
+    }
+
+    template<class F, class... Args>
+    auto Commit(F&& f, Args&&... args) ->std::future<decltype(f(args...))>
+    {
+        if (m_bStoped.load())
+            throw std::runtime_error("commit on BaselineThreadPool is stopped.");
+
+        using RetType = decltype(f(args...));
+        auto task = std::make_shared<std::packaged_task<RetType()> >(
+            std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        std::future<RetType> future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock{ m_lock };
+            m_queTasks.emplace([task]() {(*task)(); });
+        }
+        m_cvTask.notify_one();
+        return future;
+    }
+
+private:
+    void add_thread(int size)
+    {
+        for (; (int)m_vecPool.size() < m_nMaxThread && size > 0; --size)
+        {
+            m_vecPool.emplace_back([this] {
+                while (!this->m_bStoped)
+                {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock{ this->m_lock };
+                        this->m_cvTask.wait(lock,
+                            [this] {return this->m_bStoped.load() || !this->m_queTasks.empty(); });
+                        if (this->m_bStoped && this->m_queTasks.empty())return;
+                        task = std::move(this->m_queTasks.front());
+                        this->m_queTasks.pop();
+                    }
+                    --m_nThread;
+                    task();
+                    ++m_nThread;
+                }
+            });
+            ++m_nThread;
+        }
+    }
+
+private:
+    using Task = std::function<void()>;
+    std::vector<std::thread> m_vecPool;
+    std::queue<Task> m_queTasks;
+    std::mutex m_lock;
+    std::condition_variable m_cvTask;
+    std::atomic<bool> m_bStoped;
+    // idle threads
+    std::atomic<int> m_nThread;
+    int m_nMaxThread;
+};
@@ -0,0 +1,162 @@
+#include "BenchReport.h"
+#include <cmath>
+#include <cstdio>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+ProcessUsage ProcessUsage::Query()
+{
+    ProcessUsage usage;
+#ifdef _WIN32
+    FILETIME tmCreate, tmExit, tmKernel, tmUser;
+    if (GetProcessTimes(GetCurrentProcess(), &tmCreate, &tmExit, &tmKernel, &tmUser)) {
+        ULARGE_INTEGER nKernel, nUser;
+        nKernel.LowPart = tmKernel.dwLowDateTime;
+        nKernel.HighPart = tmKernel.dwHighDateTime;
+        nUser.LowPart = tmUser.dwLowDateTime;
+        nUser.HighPart = tmUser.dwHighDateTime;
+        // 100 ns units
+        usage.dCpuSeconds = (nKernel.QuadPart + nUser.QuadPart) / 1e7;
+    }
+    PROCESS_MEMORY_COUNTERS counters = { 0 };
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        usage.nPeakRssBytes = (int64_t)counters.PeakWorkingSetSize;
+#else
+    struct rusage info = {};
+    if (0 == getrusage(RUSAGE_SELF, &info)) {
+        usage.dCpuSeconds = info.ru_utime.tv_sec + info.ru_utime.tv_usec / 1e6
+            + info.ru_stime.tv_sec + info.ru_stime.tv_usec / 1e6;
+        // kilobytes on Linux
+        usage.nPeakRssBytes = (int64_t)info.ru_maxrss * 1024;
+    }
+#endif
+    return usage;
+}
+
+JsonWriter& JsonWriter::BeginObject(const std::string& strKey)
+{
+    key(strKey);
+    m_ssJson << "{";
+    m_vecFirst.push_back(true);
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndObject()
+{
+    m_vecFirst.pop_back();
+    m_ssJson << "}";
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginArray(const std::string& strKey)
+{
+    key(strKey);
+    m_ssJson << "[";
+    m_vecFirst.push_back(true);
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndArray()
+{
+    m_vecFirst.pop_back();
+    m_ssJson << "]";
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const std::string& strKey, const std::string& strValue)
+{
+    key(strKey);
+    m_ssJson << quote(strValue);
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const std::string& strKey, const char* szValue)
+{
+    return Add(strKey, std::string(szValue));
+}
+
+JsonWriter& JsonWriter::Add(const std::string& strKey, int64_t nValue)
+{
+    key(strKey);
+    m_ssJson << nValue;
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const std::string& strKey, uint64_t nValue)
+{
+    key(strKey);
+    m_ssJson << nValue;
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const std::string& strKey, int nValue)
+{
+    return Add(strKey, (int64_t)nValue);
+}
+
+JsonWriter& JsonWriter::Add(const std::string& strKey, double dValue)
+{
+    key(strKey);
+    // JSON has no nan or inf
+    if (std::isfinite(dValue)) {
+        char szValue[32] = { 0 };
+        snprintf(szValue, sizeof(szValue), "%.3f", dValue);
+        m_ssJson << szValue;
+    }
+    else
+        m_ssJson << "null";
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const std::string& strKey, bool bValue)
+{
+    key(strKey);
+    m_ssJson << (bValue ? "true" : "false");
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const std::string& strKey, const HistogramSnapshot& histogram)
+{
+    BeginObject(strKey);
+    Add("count", histogram.nCount);
+    Add("avg_ms", histogram.AverageMs());
+    Add("p50_ms", histogram.PercentileMs(0.5));
+    Add("p99_ms", histogram.PercentileMs(0.99));
+    Add("max_ms", histogram.nMaxUs / 1000.0);
+    return EndObject();
+}
+
+void JsonWriter::key(const std::string& strKey)
+{
+    if (!m_vecFirst.empty()) {
+        if (!m_vecFirst.back())
+            m_ssJson << ",";
+        m_vecFirst.back() = false;
+    }
+    if (!strKey.empty())
+        m_ssJson << quote(strKey) << ":";
+}
+
+std::string JsonWriter::quote(const std::string& strValue)
+{
+    std::string strQuoted = "\"";
+    for (char ch : strValue)
+    {
+        if ('"' == ch || '\\' == ch) {
+            strQuoted += '\\';
+            strQuoted += ch;
+        }
+        else if ((unsigned char)ch < 0x20) {
+            char szEscape[8] = { 0 };
+            snprintf(szEscape, sizeof(szEscape), "\\u%04x", ch);
+            strQuoted += szEscape;
+        }
+        else
+            strQuoted += ch;
+    }
+    return strQuoted + "\"";
+}
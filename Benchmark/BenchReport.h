@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include "Metrics.h"
+
+// cpu time and peak memory of this process
+struct ProcessUsage
+{
+    double dCpuSeconds = 0;             // user plus system
+    int64_t nPeakRssBytes = 0;
+
+    static ProcessUsage Query();
+};
+
+// Minimal JSON writer for the benchmark report. Objects and arrays nest,
+// commas are inserted as values are added.
+class JsonWriter
+{
+public:
+    JsonWriter& BeginObject(const std::string& strKey = "");
+    JsonWriter& EndObject();
+    JsonWriter& BeginArray(const std::string& strKey = "");
+    JsonWriter& EndArray();
+    JsonWriter& Add(const std::string& strKey, const std::string& strValue);
+    JsonWriter& Add(const std::string& strKey, const char* szValue);
+    JsonWriter& Add(const std::string& strKey, int64_t nValue);
+    JsonWriter& Add(const std::string& strKey, uint64_t nValue);
+    JsonWriter& Add(const std::string& strKey, int nValue);
+    JsonWriter& Add(const std::string& strKey, double dValue);
+    JsonWriter& Add(const std::string& strKey, bool bValue);
+    // count, average, p50, p99 and max in ms
+    JsonWriter& Add(const std::string& strKey, const HistogramSnapshot& histogram);
+    std::string ToString() const { return m_ssJson.str(); }
+
+private:
+    void key(const std::string& strKey);
+    static std::string quote(const std::string& strValue);
+
+private:
+    std::ostringstream m_ssJson;
+    std::vector<bool> m_vecFirst;       // per open scope: nothing written yet
+};
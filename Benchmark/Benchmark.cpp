@@ -0,0 +1,861 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <algorithm>
+#include <functional>
+#include "StreamHandle.h"
+#include "ColorKernels.h"
+#include "StreamManager.h"
+#include "ThreadPool.h"
+#include "BaselinePool.h"
+#include "Metrics.h"
+#include "SyntheticSource.h"
+#include "BenchReport.h"
+#include "RecordBench.h"
+#include "MotionBench.h"
+#include "WatchdogBench.h"
+
+// Runs StreamHandle in each mode on a synthetic clip (or a local file) as
+// fast as the input can be read and prints one JSON report. Progress and
+// library messages go to stderr, use --out to keep the report separate.
+
+struct BenchConfig
+{
+    std::vector<std::string> vecMode;
+    std::string strInput;               // empty: synthetic clip
+    SyntheticInfo infoSynthetic;
+    std::string strHw = "none";
+    AVHWDeviceType nHDType = AV_HWDEVICE_TYPE_NONE;
+    int nStreams = 4;                   // streams mode runs 1, 2, 4 ... up to this, then the open pair
+    int nTimeoutSeconds = 600;          // per run
+    int nPoolTasks = 1000000;
+    bool bColorKernels = false;         // stream modes convert on ColorKernels
+    RecordBenchInfo infoRecord;
+    std::string strOutput;              // report file, empty: stdout
+};
+
+// one run of one mode
+struct BenchResult
+{
+    std::string strMode;
+    int nStreams = 1;
+    std::string strOpen;                // streams mode open pair: "probe" or "cache", empty otherwise
+    bool bCompleted = false;            // input read to the end before the timeout
+    double dElapsedSeconds = 0;         // StartDecode to StopDecode
+    uint64_t nPackets = 0;
+    uint64_t nFrames = 0;               // decoded
+    uint64_t nConsumed = 0;             // popped by the consumer thread
+    uint64_t nReadBytes = 0;
+    uint64_t nPacketAlloc = 0;          // pool misses, flat once the pools are warm
+    uint64_t nFrameAlloc = 0;
+    uint64_t nBufferAlloc = 0;
+    uint64_t nPreEventAlloc = 0;
+    bool bWarmedUp = false;             // allocation counters taken after the warm-up
+    uint64_t nWarmAlloc = 0;            // all pools, at that point
+    uint64_t nSteadyAlloc = 0;          // allocated after the warm-up, must stay 0
+    double dCpuSeconds = 0;
+    int nThreads = 0;
+    int nDecodeThreads = 0;             // software decoder threads given by the StreamManager, all streams
+    std::vector<OpenTiming> vecTiming;
+    std::vector<HistogramSnapshot> vecLatency;
+    SnapshotStats statsSnapshot;
+    std::vector<SubscriberStats> vecSubscriber;
+};
+
+static const int kWarmupGops = 3;       // per stream, the pools are warm after this
+
+static const char* kAllModes[] = { "remux", "decode", "bgr", "subscribe", "snapshot", "streams", "pool", "kernels", "record", "motion", "watchdog" };
+
+static void print_usage()
+{
+    fprintf(stderr,
+        "usage: Benchmark [options]\n"
+        "  --mode <list>      comma separated: remux,decode,bgr,subscribe,snapshot,streams,\n"
+        "                     pool,kernels,record,motion,watchdog or all (default)\n"
+        "  --input <file>     local media instead of a synthetic clip\n"
+        "  --codec h264|hevc  synthetic clip codec (h264)\n"
+        "  --size <WxH>       synthetic clip size (1920x1080)\n"
+        "  --fps <n>          synthetic clip frame rate (25)\n"
+        "  --gop <n>          synthetic clip keyframe interval (50)\n"
+        "  --seconds <n>      synthetic clip length (20)\n"
+        "  --hw <type>        decoder device, e.g. cuda, dxva2, vaapi (none)\n"
+        "  --streams <n>      largest stream count of the streams mode (4), which then\n"
+        "                     opens one stream probed and one from the stream info cache\n"
+        "  --tasks <n>        tasks per thread pool case (1000000)\n"
+        "  --recorders <list> simultaneous recorders of the record mode (1,16,64)\n"
+        "  --record-seconds <n> length of every record case (10)\n"
+        "  --direct-io 0|1    record mode FileWriter with O_DIRECT (0)\n"
+        "  --kernels 0|1      stream modes convert on ColorKernels instead of swscale (0)\n"
+        "  --timeout <s>      give up a run after this long (600)\n"
+        "  --out <file>       write the JSON report here instead of stdout\n"
+        "Peak RSS is per process, run one mode per process to compare it.\n");
+}
+
+static std::vector<std::string> split(const std::string& strText, char chSeparator)
+{
+    std::vector<std::string> vecItem;
+    size_t nStart = 0;
+    while (nStart <= strText.size())
+    {
+        size_t nEnd = strText.find(chSeparator, nStart);
+        if (std::string::npos == nEnd)
+            nEnd = strText.size();
+        if (nEnd > nStart)
+            vecItem.push_back(strText.substr(nStart, nEnd - nStart));
+        nStart = nEnd + 1;
+    }
+    return vecItem;
+}
+
+static bool parse_args(int argc, char** argv, BenchConfig& config)
+{
+    for (int nIndex = 1; nIndex < argc; ++nIndex)
+    {
+        std::string strArg = argv[nIndex];
+        if ("--help" == strArg || "-h" == strArg)
+            return false;
+        if (nIndex + 1 >= argc) {
+            fprintf(stderr, "Missing value of %s\n", strArg.c_str());
+            return false;
+        }
+        std::string strValue = argv[++nIndex];
+        if ("--mode" == strArg)
+            config.vecMode = split(strValue, ',');
+        else if ("--input" == strArg)
+            config.strInput = strValue;
+        else if ("--codec" == strArg)
+            config.infoSynthetic.strCodec = strValue;
+        else if ("--size" == strArg) {
+            if (2 != sscanf(strValue.c_str(), "%dx%d", &config.infoSynthetic.nWidth, &config.infoSynthetic.nHeight))
+                return false;
+        }
+        else if ("--fps" == strArg)
+            config.infoSynthetic.nFrameRate = atoi(strValue.c_str());
+        else if ("--gop" == strArg)
+            config.infoSynthetic.nGop = atoi(strValue.c_str());
+        else if ("--seconds" == strArg)
+            config.infoSynthetic.nSeconds = atoi(strValue.c_str());
+        else if ("--hw" == strArg) {
+            config.strHw = strValue;
+            if ("none" != strValue) {
+                config.nHDType = av_hwdevice_find_type_by_name(strValue.c_str());
+                if (AV_HWDEVICE_TYPE_NONE == config.nHDType) {
+                    fprintf(stderr, "Unknown device type %s\n", strValue.c_str());
+                    return false;
+                }
+            }
+        }
+        else if ("--streams" == strArg)
+            config.nStreams = std::max(1, atoi(strValue.c_str()));
+        else if ("--tasks" == strArg)
+            config.nPoolTasks = std::max(1, atoi(strValue.c_str()));
+        else if ("--recorders" == strArg) {
+            config.infoRecord.vecRecorders.clear();
+            for (auto& strCount : split(strValue, ','))
+                config.infoRecord.vecRecorders.push_back(std::max(1, atoi(strCount.c_str())));
+        }
+        else if ("--record-seconds" == strArg)
+            config.infoRecord.nSeconds = std::max(1, atoi(strValue.c_str()));
+        else if ("--direct-io" == strArg)
+            config.infoRecord.infoWriter.bDirectIo = 0 != atoi(strValue.c_str());
+        else if ("--kernels" == strArg)
+            config.bColorKernels = 0 != atoi(strValue.c_str());
+        else if ("--timeout" == strArg)
+            config.nTimeoutSeconds = std::max(1, atoi(strValue.c_str()));
+        else if ("--out" == strArg)
+            config.strOutput = strValue;
+        else {
+            fprintf(stderr, "Unknown option %s\n", strArg.c_str());
+            return false;
+        }
+    }
+    if (config.vecMode.empty() || "all" == config.vecMode.front())
+        config.vecMode.assign(std::begin(kAllModes), std::end(kAllModes));
+    for (auto& strMode : config.vecMode)
+    {
+        if (std::find(std::begin(kAllModes), std::end(kAllModes), strMode) == std::end(kAllModes)) {
+            fprintf(stderr, "Unknown mode %s\n", strMode.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static StreamInfo make_stream_info(const BenchConfig& config, const std::string& strMode)
+{
+    StreamInfo infoStream;
+    infoStream.strInput = config.strInput;
+    infoStream.nHDType = config.nHDType;
+    infoStream.bDumpFormat = false;
+    infoStream.nIoTimeoutMs = 0;
+    infoStream.bColorKernels = config.bColorKernels;
+    if ("remux" == strMode)
+        infoStream.bSaveVideo = true;
+    else if ("snapshot" == strMode) {
+        // every frame is offered, the writer drops what it cannot encode in time
+        infoStream.bSavePic = true;
+        infoStream.infoSnapshot.nIntervalMs = 0;
+        infoStream.infoSnapshot.nMaxPending = std::max(2u, std::thread::hardware_concurrency());
+    }
+    else if ("streams" == strMode) {
+        // decode everything and keep a snapshot a second, a typical analytics load
+        infoStream.bSavePic = true;
+    }
+    return infoStream;
+}
+
+// a file input is done once it is read to the end and every stage queue is empty
+static bool is_drained(StreamHandle& stream)
+{
+    if (!stream.IsDemuxEnded())
+        return false;
+    for (auto& stats : stream.GetStageStats())
+    {
+        if (stats.nQueueDepth > 0)
+            return false;
+    }
+    return true;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point tmStart)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+}
+
+// pool allocations of the streams, flat in steady state: the first call after
+// the warm-up keeps the total, later calls count what was allocated since
+static void watch_allocations(const std::vector<std::shared_ptr<StreamHandle>>& vecStream, const BenchConfig& config,
+    BenchResult& result)
+{
+    uint64_t nDemuxed = 0;
+    uint64_t nAlloc = 0;
+    for (auto& pStream : vecStream)
+    {
+        StreamMetrics metrics = pStream->GetMetrics();
+        for (auto& stats : metrics.vecStages)
+        {
+            if ("demux" == stats.strName)
+                nDemuxed += stats.nProcessed;
+            nAlloc += stats.nPacketAlloc;
+        }
+        nAlloc += metrics.statsFramePool.nFrameAlloc + metrics.statsFramePool.nBufferAlloc + metrics.nPreEventAlloc;
+    }
+    if (result.bWarmedUp)
+        result.nSteadyAlloc = nAlloc - result.nWarmAlloc;
+    else if (nDemuxed >= (uint64_t)kWarmupGops * config.infoSynthetic.nGop * vecStream.size()) {
+        result.bWarmedUp = true;
+        result.nWarmAlloc = nAlloc;
+    }
+}
+
+// totals and latencies of the streams, read before they are stopped
+static void collect_result(const std::vector<std::shared_ptr<StreamHandle>>& vecStream, BenchResult& result)
+{
+    for (auto& pStream : vecStream)
+    {
+        StreamMetrics metrics = pStream->GetMetrics();
+        for (auto& stats : metrics.vecStages)
+        {
+            if ("demux" == stats.strName)
+                result.nPackets += stats.nProcessed;
+            result.nPacketAlloc += stats.nPacketAlloc;
+        }
+        result.nFrameAlloc += metrics.statsFramePool.nFrameAlloc;
+        result.nBufferAlloc += metrics.statsFramePool.nBufferAlloc;
+        result.nPreEventAlloc += metrics.nPreEventAlloc;
+        result.nFrames += metrics.nDecodedFrames;
+        result.nReadBytes += metrics.nReadBytes;
+        result.statsSnapshot.nSampled += metrics.statsSnapshot.nSampled;
+        result.statsSnapshot.nWritten += metrics.statsSnapshot.nWritten;
+        result.statsSnapshot.nDropped += metrics.statsSnapshot.nDropped;
+        result.statsSnapshot.nFailed += metrics.statsSnapshot.nFailed;
+        result.vecTiming.push_back(metrics.timing);
+        // per frame latency of the first stream, the others run the same code
+        if (result.vecLatency.empty()) {
+            for (auto& histogram : metrics.vecStageLatency)
+                result.vecLatency.push_back(histogram);
+            for (auto& histogram : metrics.vecStepLatency)
+                result.vecLatency.push_back(histogram);
+        }
+    }
+}
+
+// one StreamHandle on its own threads
+static bool run_single(const BenchConfig& config, const std::string& strMode, BenchResult& result)
+{
+    result.strMode = strMode;
+    result.nStreams = 1;
+    bool bSubscribe = "subscribe" == strMode;
+    bool bConsumer = "decode" == strMode || "bgr" == strMode || bSubscribe;
+    bool bBgr = "bgr" == strMode;
+    auto pStream = std::make_shared<StreamHandle>();
+    std::vector<int> vecSubscriber;
+    std::atomic<uint64_t> nCallback(0);
+    if (bSubscribe) {
+        // a detector, a full size viewer and a recorder on one stream
+        SubscriberInfo infoDetect;
+        infoDetect.nWidth = 640;
+        infoDetect.nHeight = 360;
+        infoDetect.nPixFmt = AV_PIX_FMT_GRAY8;
+        infoDetect.dMaxFps = 5;
+        SubscriberInfo infoView;
+        SubscriberInfo infoRecord;
+        infoRecord.nPixFmt = AV_PIX_FMT_NONE;
+        vecSubscriber.push_back(pStream->Subscribe(infoDetect));
+        vecSubscriber.push_back(pStream->Subscribe(infoView));
+        pStream->Subscribe(infoRecord, [&](const SubscribedFrame&) { ++nCallback; });
+    }
+    else if (bConsumer)
+        pStream->AttachFrameConsumer();
+
+    ProcessUsage usageStart = ProcessUsage::Query();
+    auto tmStart = std::chrono::steady_clock::now();
+    if (!pStream->StartDecode(make_stream_info(config, strMode))) {
+        pStream->StopDecode();
+        return false;
+    }
+    std::atomic<bool> bStop(false);
+    std::atomic<uint64_t> nConsumed(0);
+    std::thread thConsumer;
+    if (bConsumer) {
+        thConsumer = std::thread([&]() {
+            FrameHandle frame;
+            SubscribedFrame subscribed;
+            cv::Mat image;
+            while (!bStop)
+            {
+                bool bPopped = false;
+                if (bSubscribe) {
+                    // the image is converted here, on the consumer thread
+                    for (int nId : vecSubscriber)
+                    {
+                        if (pStream->PopFrame(nId, subscribed) && !subscribed.Image().empty()) {
+                            ++nConsumed;
+                            bPopped = true;
+                        }
+                    }
+                }
+                else if (bBgr ? pStream->PopFrame(image) : pStream->PopFrame(frame)) {
+                    ++nConsumed;
+                    bPopped = true;
+                }
+                if (!bPopped)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+    while (!(result.bCompleted = is_drained(*pStream)) && seconds_since(tmStart) < config.nTimeoutSeconds)
+    {
+        watch_allocations({ pStream }, config, result);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    watch_allocations({ pStream }, config, result);
+    bStop = true;
+    if (thConsumer.joinable())
+        thConsumer.join();
+    collect_result({ pStream }, result);
+    result.vecSubscriber = pStream->GetSubscriberStats();
+    pStream->StopDecode();
+    result.dElapsedSeconds = seconds_since(tmStart);
+    result.dCpuSeconds = ProcessUsage::Query().dCpuSeconds - usageStart.dCpuSeconds;
+    result.nConsumed = nConsumed + nCallback;
+    return true;
+}
+
+// nStreams copies of the input on a StreamManager. strOpen "probe" clears the
+// StreamParamCache entry of the input and probes, "cache" opens from it.
+static bool run_streams(const BenchConfig& config, int nStreams, BenchResult& result, const std::string& strOpen = "")
+{
+    result.strMode = "streams";
+    result.nStreams = nStreams;
+    result.strOpen = strOpen;
+    StreamInfo infoStream = make_stream_info(config, "streams");
+    infoStream.bCacheStreamInfo = !strOpen.empty();
+    if ("probe" == strOpen)
+        StreamParamCache::Instance().Remove(infoStream.strInput);
+    StreamManager manager;
+    ProcessUsage usageStart = ProcessUsage::Query();
+    auto tmStart = std::chrono::steady_clock::now();
+    manager.Start();
+    std::vector<std::shared_ptr<StreamHandle>> vecStream;
+    for (int nIndex = 0; nIndex < nStreams; ++nIndex)
+    {
+        int nId = manager.AddStream(infoStream);
+        if (nId < 0) {
+            manager.Stop();
+            return false;
+        }
+        vecStream.push_back(manager.GetStream(nId));
+    }
+    auto fnDrained = [&]() {
+        for (auto& pStream : vecStream)
+        {
+            if (!is_drained(*pStream))
+                return false;
+        }
+        return true;
+    };
+    while (!(result.bCompleted = fnDrained()) && seconds_since(tmStart) < config.nTimeoutSeconds)
+    {
+        watch_allocations(vecStream, config, result);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    watch_allocations(vecStream, config, result);
+    // given when each decoder came up, the budget is released once a stream ends
+    for (auto& pStream : vecStream)
+        result.nDecodeThreads += pStream->GetStreamInfo().nDecodeThreads;
+    result.nThreads = manager.GetThreadCount();
+    collect_result(vecStream, result);
+    vecStream.clear();
+    manager.Stop();
+    result.dElapsedSeconds = seconds_since(tmStart);
+    result.dCpuSeconds = ProcessUsage::Query().dCpuSeconds - usageStart.dCpuSeconds;
+    return true;
+}
+
+static void write_result(JsonWriter& json, const BenchResult& result)
+{
+    double dElapsed = std::max(result.dElapsedSeconds, 1e-6);
+    json.BeginObject();
+    json.Add("mode", result.strMode);
+    json.Add("streams", result.nStreams);
+    if (!result.strOpen.empty())
+        json.Add("open_case", result.strOpen);
+    json.Add("completed", result.bCompleted);
+    json.Add("elapsed_s", result.dElapsedSeconds);
+    json.Add("packets", result.nPackets);
+    json.Add("packets_per_s", result.nPackets / dElapsed);
+    json.Add("frames", result.nFrames);
+    json.Add("frames_per_s", result.nFrames / dElapsed);
+    json.Add("frames_per_s_per_stream", result.nFrames / dElapsed / result.nStreams);
+    json.Add("consumed", result.nConsumed);
+    json.Add("read_mbit_per_s", result.nReadBytes * 8 / 1e6 / dElapsed);
+    json.Add("cpu_s", result.dCpuSeconds);
+    json.Add("cpu_percent_per_stream", result.dCpuSeconds * 100 / dElapsed / result.nStreams);
+    json.Add("peak_rss_bytes", ProcessUsage::Query().nPeakRssBytes);
+    if (result.nThreads > 0) {
+        json.Add("threads", result.nThreads);
+        json.Add("decode_threads", result.nDecodeThreads);
+    }
+    json.BeginObject("allocations");
+    json.Add("packets", result.nPacketAlloc);
+    json.Add("frames", result.nFrameAlloc);
+    json.Add("buffers", result.nBufferAlloc);
+    json.Add("pre_event_packets", result.nPreEventAlloc);
+    json.Add("warmed_up", result.bWarmedUp);
+    json.Add("steady_state", result.nSteadyAlloc);
+    json.EndObject();
+    if (result.statsSnapshot.nSampled > 0) {
+        json.BeginObject("snapshots");
+        json.Add("sampled", result.statsSnapshot.nSampled);
+        json.Add("written", result.statsSnapshot.nWritten);
+        json.Add("dropped", result.statsSnapshot.nDropped);
+        json.Add("failed", result.statsSnapshot.nFailed);
+        json.EndObject();
+    }
+    if (!result.vecSubscriber.empty()) {
+        json.BeginArray("subscribers");
+        for (auto& stats : result.vecSubscriber)
+        {
+            json.BeginObject();
+            json.Add("id", stats.nId);
+            json.Add("delivered", stats.nDelivered);
+            json.Add("skipped", stats.nSkipped);
+            json.Add("dropped", stats.nDropped);
+            json.EndObject();
+        }
+        json.EndArray();
+    }
+    json.BeginArray("open");
+    for (auto& timing : result.vecTiming)
+    {
+        json.BeginObject();
+        json.Add("from_cache", timing.bFromCache);
+        json.Add("open_ms", timing.nOpenMs);
+        json.Add("first_packet_ms", timing.nFirstPacketMs);
+        json.Add("first_keyframe_ms", timing.nFirstKeyFrameMs);
+        json.Add("first_frame_ms", timing.nFirstFrameMs);
+        json.EndObject();
+    }
+    json.EndArray();
+    json.BeginObject("latency");
+    for (auto& histogram : result.vecLatency)
+    {
+        if (histogram.nCount > 0)
+            json.Add(histogram.strName, histogram);
+    }
+    json.EndObject();
+    json.EndObject();
+}
+
+// time to first frame of one stream probed, then opened from the
+// StreamParamCache; the second open must hit the cache
+static int run_open_pair(const BenchConfig& config, JsonWriter& json)
+{
+    int64_t vecFirstFrameMs[2] = { -1, -1 };
+    int nIndex = 0;
+    for (const char* szOpen : { "probe", "cache" })
+    {
+        fprintf(stderr, "running streams open %s\n", szOpen);
+        BenchResult result;
+        if (!run_streams(config, 1, result, szOpen) || result.vecTiming.empty()) {
+            fprintf(stderr, "Could not open %s with %s\n", config.strInput.c_str(), szOpen);
+            return 1;
+        }
+        write_result(json, result);
+        const OpenTiming& timing = result.vecTiming.front();
+        if (timing.bFromCache != ("cache" == std::string(szOpen))) {
+            fprintf(stderr, "streams open %s: from_cache is %d\n", szOpen, (int)timing.bFromCache);
+            return 1;
+        }
+        vecFirstFrameMs[nIndex++] = timing.nFirstFrameMs;
+    }
+    fprintf(stderr, "first frame %lld ms probed, %lld ms from the cache\n",
+        (long long)vecFirstFrameMs[0], (long long)vecFirstFrameMs[1]);
+    return 0;
+}
+
+// Thread pool cost per task: posting from outside, the Commit/future path,
+// and tasks that post their successor from a pool thread the way stages
+// reschedule their drain. Run on pool and write the case, return its ns per task
+template<class Pool>
+static double run_pool_case(Pool& pool, const std::string& strCase, const char* szPool,
+    int nThread, int nTasks, double dBaselineNs, JsonWriter& json)
+{
+    std::atomic<int> nDone(0);
+    LatencyHistogram histQueue;
+    std::function<void(int)> fnStep;
+    auto tmStart = std::chrono::steady_clock::now();
+    if ("post" == strCase) {
+        for (int nIndex = 0; nIndex < nTasks; ++nIndex)
+        {
+            auto tmPost = std::chrono::steady_clock::now();
+            pool.Post([&nDone, &histQueue, tmPost, nIndex]() {
+                // sample the post to run delay, reading the clock on every task would dominate
+                if (0 == (nIndex & 63))
+                    histQueue.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - tmPost).count());
+                ++nDone;
+            });
+        }
+    }
+    else if ("commit" == strCase) {
+        std::vector<std::future<void>> vecFuture;
+        for (int nIndex = 0; nIndex < nTasks; ++nIndex)
+        {
+            vecFuture.push_back(pool.Commit([&nDone]() { ++nDone; }));
+            if (vecFuture.size() >= 1024) {
+                for (auto& future : vecFuture)
+                    future.get();
+                vecFuture.clear();
+            }
+        }
+        for (auto& future : vecFuture)
+            future.get();
+    }
+    else {
+        // one chain per thread, every task posts the next one
+        int nChain = nThread;
+        int nLength = std::max(1, nTasks / nChain);
+        nTasks = nChain * nLength;
+        fnStep = [&](int nLeft) {
+            ++nDone;
+            if (nLeft > 1)
+                pool.Post([&fnStep, nLeft]() { fnStep(nLeft - 1); });
+        };
+        for (int nIndex = 0; nIndex < nChain; ++nIndex)
+            pool.Post([&fnStep, nLength]() { fnStep(nLength); });
+    }
+    while (nDone.load() < nTasks)
+        std::this_thread::yield();
+    double dElapsed = std::max(seconds_since(tmStart), 1e-6);
+    pool.Stop();
+
+    double dNsPerTask = dElapsed * 1e9 / nTasks;
+    json.BeginObject();
+    json.Add("case", strCase);
+    json.Add("pool", szPool);
+    json.Add("tasks", nTasks);
+    json.Add("elapsed_s", dElapsed);
+    json.Add("tasks_per_s", nTasks / dElapsed);
+    json.Add("ns_per_task", dNsPerTask);
+    if (dBaselineNs > 0)
+        json.Add("speedup", dBaselineNs / dNsPerTask);
+    if (histQueue.GetCount() > 0)
+        json.Add("post_to_run", histQueue.Snapshot());
+    json.EndObject();
+    return dNsPerTask;
+}
+
+// every case on the old single queue pool first, then on ThreadPool with its
+// speedup over the single queue
+static void run_pool(const BenchConfig& config, JsonWriter& json)
+{
+    int nThread = (int)std::max(1u, std::thread::hardware_concurrency());
+    json.BeginObject("pool");
+    json.Add("threads", nThread);
+    json.BeginArray("cases");
+    for (const char* szCase : { "post", "commit", "chain" })
+    {
+        double dBaselineNs = 0;
+        {
+            BaselineThreadPool pool;
+            pool.Start(nThread, nThread);
+            dBaselineNs = run_pool_case(pool, szCase, "single_queue", nThread, config.nPoolTasks, 0, json);
+        }
+        ThreadPool pool;
+        pool.Start(nThread, nThread);
+        run_pool_case(pool, szCase, "work_stealing", nThread, config.nPoolTasks, dBaselineNs, json);
+    }
+    json.EndArray();
+    json.EndObject();
+}
+
+// a noisy gradient, random enough that every kernel lane sees different values
+static void fill_kernel_frame(AVFrame* pFrame)
+{
+    uint32_t nSeed = 2166136261u;
+    for (int nPlane = 0; nPlane < AV_NUM_DATA_POINTERS && pFrame->data[nPlane]; ++nPlane)
+    {
+        int nHeight = 0 == nPlane ? pFrame->height : (pFrame->height + 1) / 2;
+        for (int y = 0; y < nHeight; ++y)
+        {
+            uint8_t* pLine = pFrame->data[nPlane] + y * pFrame->linesize[nPlane];
+            for (int x = 0; x < pFrame->linesize[nPlane]; ++x)
+            {
+                nSeed = nSeed * 1664525u + 1013904223u;
+                pLine[x] = (uint8_t)(((x + y) >> 2) + (nSeed >> 28));
+            }
+        }
+    }
+}
+
+// ColorKernels at 720p, 1080p and 4K: every instruction set must give the bytes
+// of the scalar code, and BGR from BT.709 or full range frames must be left to
+// swscale. swscale (SWS_FAST_BILINEAR) is the speed and difference baseline,
+// the kernels are opt-in since their filters differ. Return the number of mismatches
+static int run_kernels(JsonWriter& json)
+{
+    const double kSecondsPerCase = 0.2;
+    struct KernelCase
+    {
+        AVPixelFormat nDstFmt;
+        int nScaleShift;
+    };
+    const KernelCase kCases[] = { { AV_PIX_FMT_BGR24, 0 }, { AV_PIX_FMT_BGR24, 1 }, { AV_PIX_FMT_BGR24, 2 },
+        { AV_PIX_FMT_GRAY8, 1 }, { AV_PIX_FMT_GRAY8, 2 } };
+    const int kSizes[][2] = { { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+    KernelIsa nBest = ColorKernels::GetBestIsa();
+    FrameConverter converter;
+    converter.SetUseKernels(false);
+    int nMismatch = 0;
+
+    json.BeginObject("kernels");
+    json.Add("best_isa", ColorKernels::GetIsaName(nBest));
+    json.BeginArray("cases");
+    for (auto& size : kSizes)
+    {
+        for (AVPixelFormat nSrcFmt : { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12 })
+        {
+            AVFrame* pFrame = av_frame_alloc();
+            pFrame->format = nSrcFmt;
+            pFrame->width = size[0];
+            pFrame->height = size[1];
+            if (av_frame_get_buffer(pFrame, 32) < 0) {
+                av_frame_free(&pFrame);
+                continue;
+            }
+            fill_kernel_frame(pFrame);
+            // the kernels only know BT.601 limited range
+            pFrame->colorspace = AVCOL_SPC_BT709;
+            bool bFallback = ColorKernels::GetScaleShift(pFrame, AV_PIX_FMT_BGR24, size[0], size[1]) < 0;
+            pFrame->colorspace = AVCOL_SPC_BT470BG;
+            pFrame->color_range = AVCOL_RANGE_JPEG;
+            bFallback = bFallback && ColorKernels::GetScaleShift(pFrame, AV_PIX_FMT_BGR24, size[0], size[1]) < 0;
+            pFrame->color_range = AVCOL_RANGE_MPEG;
+            if (!bFallback || ColorKernels::GetScaleShift(pFrame, AV_PIX_FMT_BGR24, size[0], size[1]) != 0) {
+                fprintf(stderr, "Kernel colorspace check failed at %dx%d\n", size[0], size[1]);
+                ++nMismatch;
+            }
+            for (auto& item : kCases)
+            {
+                int nWidth = size[0] >> item.nScaleShift;
+                int nHeight = size[1] >> item.nScaleShift;
+                int nStride = nWidth * (AV_PIX_FMT_BGR24 == item.nDstFmt ? 3 : 1);
+                std::vector<uint8_t> vecRef((size_t)nStride * nHeight);
+                std::vector<uint8_t> vecOut(vecRef.size());
+                ColorKernels::Convert(pFrame, item.nDstFmt, vecRef.data(), nStride, item.nScaleShift, kIsaScalar);
+
+                json.BeginObject();
+                json.Add("width", size[0]);
+                json.Add("height", size[1]);
+                json.Add("format", AV_PIX_FMT_NV12 == nSrcFmt ? "nv12" : "yuv420p");
+                json.Add("output", AV_PIX_FMT_BGR24 == item.nDstFmt ? "bgr24" : "gray8");
+                json.Add("scale", 1.0 / (1 << item.nScaleShift));
+                json.BeginObject("frames_per_s");
+                bool bExact = true;
+                for (int nIsa = kIsaScalar; nIsa <= nBest; ++nIsa)
+                {
+                    int nCount = 0;
+                    auto tmStart = std::chrono::steady_clock::now();
+                    do
+                    {
+                        ColorKernels::Convert(pFrame, item.nDstFmt, vecOut.data(), nStride, item.nScaleShift, (KernelIsa)nIsa);
+                        ++nCount;
+                    } while (seconds_since(tmStart) < kSecondsPerCase);
+                    json.Add(ColorKernels::GetIsaName((KernelIsa)nIsa), nCount / seconds_since(tmStart));
+                    bExact = bExact && vecOut == vecRef;
+                }
+                uint8_t* pDstData[1] = { vecOut.data() };
+                int nDstLinesize[1] = { nStride };
+                int nCount = 0;
+                auto tmStart = std::chrono::steady_clock::now();
+                do
+                {
+                    converter.Convert(pFrame, item.nDstFmt, pDstData, nDstLinesize, nWidth, nHeight);
+                    ++nCount;
+                } while (seconds_since(tmStart) < kSecondsPerCase);
+                json.Add("swscale", nCount / seconds_since(tmStart));
+                json.EndObject();
+                // filters differ (box and repeated chroma against bilinear), a few levels are expected
+                int nMaxDiff = 0;
+                int64_t nSumDiff = 0;
+                for (size_t nIndex = 0; nIndex < vecRef.size(); ++nIndex)
+                {
+                    int nDiff = std::abs((int)vecRef[nIndex] - (int)vecOut[nIndex]);
+                    nMaxDiff = std::max(nMaxDiff, nDiff);
+                    nSumDiff += nDiff;
+                }
+                json.Add("exact", bExact);
+                json.Add("swscale_max_diff", nMaxDiff);
+                json.Add("swscale_mean_diff", (double)nSumDiff / std::max<size_t>(vecRef.size(), 1));
+                json.EndObject();
+                if (!bExact) {
+                    fprintf(stderr, "Kernel mismatch at %dx%d\n", size[0], size[1]);
+                    ++nMismatch;
+                }
+            }
+            av_frame_free(&pFrame);
+        }
+    }
+    json.EndArray();
+    json.EndObject();
+    return nMismatch;
+}
+
+int main(int argc, char** argv)
+{
+    BenchConfig config;
+    if (!parse_args(argc, argv, config)) {
+        print_usage();
+        return 2;
+    }
+    av_log_set_level(AV_LOG_ERROR);
+    bool bStream = std::any_of(config.vecMode.begin(), config.vecMode.end(),
+        [](const std::string& strMode) { return "pool" != strMode && "kernels" != strMode && "motion" != strMode; });
+    bool bSynthetic = config.strInput.empty();
+    if (bStream && bSynthetic) {
+        config.strInput = SyntheticSource::Prepare(config.infoSynthetic);
+        if (config.strInput.empty())
+            return 1;
+    }
+
+    JsonWriter json;
+    json.BeginObject();
+    json.Add("benchmark", "FfmpegHelper");
+    json.Add("cpu_count", (int)std::thread::hardware_concurrency());
+    json.Add("hw", config.strHw);
+    json.BeginObject("input");
+    json.Add("path", config.strInput);
+    json.Add("synthetic", bSynthetic);
+    if (bSynthetic) {
+        json.Add("codec", config.infoSynthetic.strCodec);
+        json.Add("width", config.infoSynthetic.nWidth);
+        json.Add("height", config.infoSynthetic.nHeight);
+        json.Add("fps", config.infoSynthetic.nFrameRate);
+        json.Add("gop", config.infoSynthetic.nGop);
+        json.Add("seconds", config.infoSynthetic.nSeconds);
+    }
+    json.EndObject();
+
+    int nFailed = 0;
+    json.BeginArray("runs");
+    for (auto& strMode : config.vecMode)
+    {
+        if ("pool" == strMode || "kernels" == strMode || "record" == strMode || "motion" == strMode
+            || "watchdog" == strMode)
+            continue;
+        std::vector<int> vecCount;
+        if ("streams" == strMode) {
+            for (int nCount = 1; nCount < config.nStreams; nCount *= 2)
+                vecCount.push_back(nCount);
+            vecCount.push_back(config.nStreams);
+        }
+        else
+            vecCount.push_back(1);
+        for (int nCount : vecCount)
+        {
+            fprintf(stderr, "running %s x%d\n", strMode.c_str(), nCount);
+            BenchResult result;
+            bool bResult = "streams" == strMode ? run_streams(config, nCount, result)
+                : run_single(config, strMode, result);
+            if (!bResult) {
+                fprintf(stderr, "Could not start %s on %s\n", strMode.c_str(), config.strInput.c_str());
+                ++nFailed;
+                continue;
+            }
+            write_result(json, result);
+            if (result.nSteadyAlloc > 0) {
+                fprintf(stderr, "%s x%d allocated %llu times after the warm-up\n", strMode.c_str(), nCount,
+                    (unsigned long long)result.nSteadyAlloc);
+                ++nFailed;
+            }
+        }
+        if ("streams" == strMode)
+            nFailed += run_open_pair(config, json);
+    }
+    json.EndArray();
+    if (std::find(config.vecMode.begin(), config.vecMode.end(), "pool") != config.vecMode.end()) {
+        fprintf(stderr, "running pool\n");
+        run_pool(config, json);
+    }
+    if (std::find(config.vecMode.begin(), config.vecMode.end(), "kernels") != config.vecMode.end()) {
+        fprintf(stderr, "running kernels\n");
+        nFailed += run_kernels(json);
+    }
+    if (std::find(config.vecMode.begin(), config.vecMode.end(), "motion") != config.vecMode.end()) {
+        fprintf(stderr, "running motion\n");
+        nFailed += MotionBench::Run(json);
+    }
+    if (std::find(config.vecMode.begin(), config.vecMode.end(), "record") != config.vecMode.end()) {
+        fprintf(stderr, "running record\n");
+        if (!RecordBench::Run(config.strInput, config.infoRecord, json))
+            nFailed++;
+    }
+    if (std::find(config.vecMode.begin(), config.vecMode.end(), "watchdog") != config.vecMode.end()) {
+        fprintf(stderr, "running watchdog\n");
+        nFailed += WatchdogBench::Run(config.strInput, json);
+    }
+    json.EndObject();
+
+    std::string strReport = json.ToString() + "\n";
+    if (config.strOutput.empty())
+        fputs(strReport.c_str(), stdout);
+    else {
+        FILE* pFile = fopen(config.strOutput.c_str(), "wb");
+        if (nullptr == pFile || fwrite(strReport.data(), 1, strReport.size(), pFile) != strReport.size()) {
+            fprintf(stderr, "Could not write %s\n", config.strOutput.c_str());
+            nFailed++;
+        }
+        if (pFile)
+            fclose(pFile);
+    }
+    return nFailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+#include "MotionBench.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "BenchReport.h"
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+static const int kSceneWidth = 1280;
+static const int kSceneHeight = 720;
+static const int kSceneFps = 25;
+static const int kSceneSeconds = 20;
+static const double kSecondsPerCase = 0.2;
+
+// one generated clip and the events it must give with the default MotionConfig
+struct MotionBench::Scenario
+{
+    const char* szName;
+    AVPixelFormat nFormat;
+    int nBlockSize;             // moving block, 0: none
+    int nBlockStartMs;
+    int nBlockEndMs;
+    int nLightMs;               // the luma steps up by nLight from here, 0: never
+    int nLight;
+    bool bMotion;               // a start in the block time and a stop nStopMs after it, else no event
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point tmStart)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+}
+
+static AVFrame* alloc_frame(AVPixelFormat nFormat, int nWidth, int nHeight)
+{
+    AVFrame* pFrame = av_frame_alloc();
+    if (nullptr == pFrame)
+        return nullptr;
+    pFrame->format = nFormat;
+    pFrame->width = nWidth;
+    pFrame->height = nHeight;
+    if (av_frame_get_buffer(pFrame, 32) < 0) {
+        av_frame_free(&pFrame);
+        return nullptr;
+    }
+    // grey chroma, the detector never reads it
+    for (int nPlane = 1; nPlane < AV_NUM_DATA_POINTERS && pFrame->data[nPlane]; ++nPlane)
+        memset(pFrame->data[nPlane], 128, (size_t)pFrame->linesize[nPlane] * ((nHeight + 1) / 2));
+    return pFrame;
+}
+
+static std::vector<uint8_t> make_scene(int nWidth, int nHeight)
+{
+    // a gradient with fixed texture, like a wall and a floor
+    std::vector<uint8_t> vecScene((size_t)nWidth * nHeight);
+    uint32_t nSeed = 2166136261u;
+    for (int y = 0; y < nHeight; ++y)
+    {
+        for (int x = 0; x < nWidth; ++x)
+        {
+            nSeed = nSeed * 1664525u + 1013904223u;
+            vecScene[(size_t)y * nWidth + x] = (uint8_t)(40 + ((x + y) >> 4) + (nSeed >> 27));
+        }
+    }
+    return vecScene;
+}
+
+int MotionBench::Run(JsonWriter& json)
+{
+    const Scenario kScenarios[] = {
+        { "still", AV_PIX_FMT_YUV420P, 0, 0, 0, 0, 0, false },
+        { "moving_block", AV_PIX_FMT_YUV420P, 128, 4000, 8000, 0, 0, true },
+        { "moving_block_nv12", AV_PIX_FMT_NV12, 128, 4000, 8000, 0, 0, true },
+        { "small_block", AV_PIX_FMT_YUV420P, 16, 4000, 8000, 0, 0, false },
+        { "light_switch", AV_PIX_FMT_YUV420P, 0, 0, 0, 10000, 60, false },
+        { "block_then_light", AV_PIX_FMT_NV12, 128, 2000, 6000, 14000, -50, true },
+    };
+    const int kSizes[][2] = { { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+    int nFailed = 0;
+
+    json.BeginObject("motion");
+    json.Add("best_isa", ColorKernels::GetIsaName(kIsaBest));
+    json.BeginArray("scenarios");
+    for (auto& scenario : kScenarios)
+        nFailed += run_scenario(scenario, json);
+    json.EndArray();
+    json.BeginArray("sizes");
+    for (auto& size : kSizes)
+        nFailed += run_size(size[0], size[1], json);
+    json.EndArray();
+    json.EndObject();
+    return nFailed;
+}
+
+int MotionBench::run_scenario(const Scenario& scenario, JsonWriter& json)
+{
+    AVFrame* pFrame = alloc_frame(scenario.nFormat, kSceneWidth, kSceneHeight);
+    if (nullptr == pFrame)
+        return 1;
+    std::vector<uint8_t> vecScene = make_scene(kSceneWidth, kSceneHeight);
+    // the same frames through the scalar and the best kernels
+    MotionConfig config;
+    config.bEnable = true;
+    MotionDetector detector[2];
+    KernelIsa nIsa[2] = { kIsaScalar, kIsaBest };
+    std::vector<MotionEvent> vecEvent[2];
+    for (int nIndex = 0; nIndex < 2; ++nIndex)
+    {
+        config.nIsa = nIsa[nIndex];
+        detector[nIndex].Init(config);
+    }
+    uint32_t nSeed = 1;
+    int nFrames = kSceneFps * kSceneSeconds;
+    int nBlockY = (kSceneHeight - scenario.nBlockSize) / 2;
+    for (int nFrame = 0; nFrame < nFrames; ++nFrame)
+    {
+        int64_t nPtsMs = (int64_t)nFrame * 1000 / kSceneFps;
+        int nBlockX = -1;
+        if (scenario.nBlockSize > 0 && nPtsMs >= scenario.nBlockStartMs && nPtsMs < scenario.nBlockEndMs) {
+            // 8 pixels a frame across the picture and back
+            int nRange = kSceneWidth - scenario.nBlockSize;
+            int nStep = (nFrame * 8) % (2 * nRange);
+            nBlockX = nStep < nRange ? nStep : 2 * nRange - nStep;
+        }
+        int nLight = scenario.nLightMs > 0 && nPtsMs >= scenario.nLightMs ? scenario.nLight : 0;
+        fill_luma(pFrame, vecScene, nSeed, nBlockX, nBlockY, scenario.nBlockSize, nLight);
+        for (int nIndex = 0; nIndex < 2; ++nIndex)
+        {
+            MotionEvent event;
+            if (kMotionEvent == detector[nIndex].Analyze(pFrame, nPtsMs, event))
+                vecEvent[nIndex].push_back(event);
+        }
+    }
+    av_frame_free(&pFrame);
+
+    // exact: the same events at the same frames with the same ratios
+    bool bExact = vecEvent[0].size() == vecEvent[1].size();
+    for (size_t nIndex = 0; bExact && nIndex < vecEvent[0].size(); ++nIndex)
+    {
+        bExact = vecEvent[0][nIndex].bMotion == vecEvent[1][nIndex].bMotion
+            && vecEvent[0][nIndex].nPtsMs == vecEvent[1][nIndex].nPtsMs
+            && vecEvent[0][nIndex].dRatio == vecEvent[1][nIndex].dRatio;
+    }
+    // expected: a start within the start frames after the block shows up, a stop
+    // nStopMs after the last analyzed frame with the block
+    const std::vector<MotionEvent>& vecResult = vecEvent[1];
+    int64_t nIntervalMs = 1000 / config.nAnalyzeFps;
+    bool bExpected = vecResult.empty();
+    if (scenario.bMotion) {
+        bExpected = 2 == vecResult.size() && vecResult[0].bMotion && !vecResult[1].bMotion
+            && vecResult[0].nPtsMs >= scenario.nBlockStartMs
+            && vecResult[0].nPtsMs <= scenario.nBlockStartMs + (config.nStartFrames + 1) * nIntervalMs
+            && vecResult[1].nPtsMs >= scenario.nBlockEndMs - nIntervalMs + config.nStopMs
+            && vecResult[1].nPtsMs <= scenario.nBlockEndMs + nIntervalMs + config.nStopMs;
+    }
+    MotionStats stats = detector[1].GetStats();
+
+    json.BeginObject();
+    json.Add("scenario", scenario.szName);
+    json.Add("format", AV_PIX_FMT_NV12 == scenario.nFormat ? "nv12" : "yuv420p");
+    json.Add("analyzed", stats.nAnalyzed);
+    json.Add("relearns", stats.nRelearns);
+    json.BeginArray("events");
+    for (auto& event : vecResult)
+    {
+        json.BeginObject();
+        json.Add("motion", event.bMotion);
+        json.Add("pts_ms", event.nPtsMs);
+        json.Add("ratio", event.dRatio);
+        json.EndObject();
+    }
+    json.EndArray();
+    json.Add("exact", bExact);
+    json.Add("expected", bExpected);
+    json.EndObject();
+    if (!bExact || !bExpected)
+        fprintf(stderr, "Motion scenario %s failed%s\n", scenario.szName, bExact ? "" : ", kernels differ");
+    return (bExact ? 0 : 1) + (bExpected ? 0 : 1);
+}
+
+int MotionBench::run_size(int nWidth, int nHeight, JsonWriter& json)
+{
+    AVFrame* pFrame[2] = { alloc_frame(AV_PIX_FMT_YUV420P, nWidth, nHeight), alloc_frame(AV_PIX_FMT_YUV420P, nWidth, nHeight) };
+    if (nullptr == pFrame[0] || nullptr == pFrame[1]) {
+        av_frame_free(&pFrame[0]);
+        av_frame_free(&pFrame[1]);
+        return 1;
+    }
+    std::vector<uint8_t> vecScene = make_scene(nWidth, nHeight);
+    uint32_t nSeed = 1;
+    int nBlockSize = nHeight / 6;
+    fill_luma(pFrame[0], vecScene, nSeed, nWidth / 4, nHeight / 3, nBlockSize, 0);
+    fill_luma(pFrame[1], vecScene, nSeed, nWidth / 4 + nBlockSize / 2, nHeight / 3, nBlockSize, 0);
+    MotionConfig config;
+    config.bEnable = true;
+    config.nAnalyzeFps = 0;
+    config.nWarmupFrames = 0;
+    int nShift = MotionDetector::GetCellShift(nWidth, config.nMaxWidth);
+    size_t nCells = (size_t)(nWidth >> nShift) * (nHeight >> nShift);
+
+    // kernels alone: cells, then three background updates from the same start
+    std::vector<uint8_t> vecCellRef(nCells);
+    std::vector<uint16_t> vecBackRef(nCells, 100 << 4);
+    int nChangedRef = 0;
+    MotionDetector::Downsample(pFrame[0]->data[0], pFrame[0]->linesize[0], nWidth, nHeight, nShift, vecCellRef.data(), kIsaScalar);
+    for (int nPass = 0; nPass < 3; ++nPass)
+        nChangedRef += MotionDetector::UpdateBackground(vecCellRef.data(), vecBackRef.data(), (int)nCells,
+            config.nPixelThreshold, config.nLearnShift, kIsaScalar);
+    bool bExact = true;
+
+    json.BeginObject();
+    json.Add("width", nWidth);
+    json.Add("height", nHeight);
+    json.Add("cell", 1 << nShift);
+    json.Add("cells", (int64_t)nCells);
+    json.BeginObject("us_per_frame");
+    double dBestUs = 0;
+    for (int nIsa = kIsaScalar; nIsa <= ColorKernels::GetBestIsa(); ++nIsa)
+    {
+        std::vector<uint8_t> vecCell(nCells);
+        std::vector<uint16_t> vecBack(nCells, 100 << 4);
+        int nChanged = 0;
+        MotionDetector::Downsample(pFrame[0]->data[0], pFrame[0]->linesize[0], nWidth, nHeight, nShift, vecCell.data(), (KernelIsa)nIsa);
+        for (int nPass = 0; nPass < 3; ++nPass)
+            nChanged += MotionDetector::UpdateBackground(vecCell.data(), vecBack.data(), (int)nCells,
+                config.nPixelThreshold, config.nLearnShift, (KernelIsa)nIsa);
+        bExact = bExact && vecCell == vecCellRef && vecBack == vecBackRef && nChanged == nChangedRef;
+
+        // whole Analyze calls on two frames in turn, every one is analyzed
+        config.nIsa = (KernelIsa)nIsa;
+        MotionDetector detector;
+        detector.Init(config);
+        MotionEvent event;
+        int nCount = 0;
+        auto tmStart = std::chrono::steady_clock::now();
+        do
+        {
+            detector.Analyze(pFrame[nCount & 1], nCount * 40, event);
+            ++nCount;
+        } while (seconds_since(tmStart) < kSecondsPerCase);
+        dBestUs = seconds_since(tmStart) * 1e6 / nCount;
+        json.Add(ColorKernels::GetIsaName((KernelIsa)nIsa), dBestUs);
+    }
+    // what the same frame costs as BGR, the input of a detector on cv::Mat
+    std::vector<uint8_t> vecBgr((size_t)nWidth * nHeight * 3);
+    int nCount = 0;
+    auto tmStart = std::chrono::steady_clock::now();
+    do
+    {
+        ColorKernels::Convert(pFrame[0], AV_PIX_FMT_BGR24, vecBgr.data(), nWidth * 3, 0);
+        ++nCount;
+    } while (seconds_since(tmStart) < kSecondsPerCase);
+    json.Add("bgr_convert", seconds_since(tmStart) * 1e6 / nCount);
+    json.EndObject();
+    // one core at the default 5 analyzed frames a second
+    json.Add("cameras_per_core", dBestUs > 0 ? 1e6 / (dBestUs * 5) : 0.0);
+    json.Add("exact", bExact);
+    json.EndObject();
+    av_frame_free(&pFrame[0]);
+    av_frame_free(&pFrame[1]);
+    if (!bExact)
+        fprintf(stderr, "Motion kernel mismatch at %dx%d\n", nWidth, nHeight);
+    return bExact ? 0 : 1;
+}
+
+void MotionBench::fill_luma(AVFrame* pFrame, const std::vector<uint8_t>& vecScene, uint32_t& nSeed,
+    int nBlockX, int nBlockY, int nBlockSize, int nLight)
+{
+    for (int y = 0; y < pFrame->height; ++y)
+    {
+        uint8_t* pLine = pFrame->data[0] + (size_t)y * pFrame->linesize[0];
+        const uint8_t* pScene = vecScene.data() + (size_t)y * pFrame->width;
+        bool bBlockRow = nBlockX >= 0 && y >= nBlockY && y < nBlockY + nBlockSize;
+        for (int x = 0; x < pFrame->width; ++x)
+        {
+            // sensor noise of a few levels on every frame
+            nSeed = nSeed * 1664525u + 1013904223u;
+            int nValue = pScene[x] + nLight + (int)(nSeed >> 30);
+            if (bBlockRow && x >= nBlockX && x < nBlockX + nBlockSize)
+                nValue = 220 + (int)(nSeed >> 30);
+            pLine[x] = (uint8_t)std::min(std::max(nValue, 0), 255);
+        }
+    }
+}
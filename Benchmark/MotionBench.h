@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "MotionDetector.h"
+
+class JsonWriter;
+
+// MotionDetector on generated luma, no clip and no decoder: every instruction
+// set must give the cells, background and events of the scalar code, the
+// scenarios must give the expected events, and the cost per analyzed frame is
+// measured at 720p, 1080p and 4K next to a full size BGR conversion.
+class MotionBench
+{
+public:
+    // return the number of failed checks
+    static int Run(JsonWriter& json);
+
+private:
+    struct Scenario;
+    static int run_scenario(const Scenario& scenario, JsonWriter& json);
+    static int run_size(int nWidth, int nHeight, JsonWriter& json);
+    // noisy still background, a bright block at nBlockX (none if < 0), luma + nLight
+    static void fill_luma(AVFrame* pFrame, const std::vector<uint8_t>& vecScene, uint32_t& nSeed,
+        int nBlockX, int nBlockY, int nBlockSize, int nLight);
+};
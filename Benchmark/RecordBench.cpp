@@ -0,0 +1,358 @@
+#include "RecordBench.h"
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include "BenchReport.h"
+#include "Storage.h"
+#include "Time.h"
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+// the clip in memory, read once
+struct RecordBench::Clip
+{
+    std::vector<AVCodecParameters*> vecPar;
+    std::vector<AVRational> vecTimeBase;
+    std::vector<int64_t> vecLoopTs;     // per stream, length of the clip, added to the timestamps on every pass
+    std::vector<AVPacket*> vecPacket;
+    ~Clip()
+    {
+        for (auto& pPar : vecPar)
+            avcodec_parameters_free(&pPar);
+        for (auto& pPacket : vecPacket)
+            av_packet_free(&pPacket);
+    }
+};
+
+struct RecordBench::RecorderResult
+{
+    int64_t nBytes = 0;
+    int nSegments = 0;
+    bool bFailed = false;
+};
+
+bool RecordBench::Run(const std::string& strInput, const RecordBenchInfo& info, JsonWriter& json)
+{
+    Clip clip;
+    if (!load_clip(strInput, clip) || clip.vecPacket.empty()) {
+        fprintf(stderr, "Could not read %s\n", strInput.c_str());
+        return false;
+    }
+    if (!Storage::MakeDirectory(info.strDir)) {
+        fprintf(stderr, "Could not create %s\n", info.strDir.c_str());
+        return false;
+    }
+    bool bResult = true;
+    json.BeginObject("record");
+    json.Add("dir", info.strDir);
+    json.Add("seconds", info.nSeconds);
+    json.Add("segment_bytes", info.nSegmentBytes);
+    json.Add("buffer_bytes", info.infoWriter.nBufferSize);
+    json.Add("direct_io", info.infoWriter.bDirectIo);
+    json.BeginArray("cases");
+    for (int nRecorders : info.vecRecorders)
+    {
+        for (bool bFileWriter : { false, true })
+        {
+            fprintf(stderr, "recording x%d, %s\n", nRecorders, bFileWriter ? "file_writer" : "avio");
+            clear_dir(info.strDir);
+            std::vector<RecorderResult> vecResult(nRecorders);
+            std::vector<std::thread> vecThread;
+            FileWriterStats statsStart = FileWriter::GetStats();
+            auto tmStart = std::chrono::steady_clock::now();
+            int64_t nDeadlineMs = Time::GetSteadyMilliTimestamp() + info.nSeconds * 1000LL;
+            for (int nIndex = 0; nIndex < nRecorders; ++nIndex)
+            {
+                vecThread.emplace_back(&RecordBench::record, std::cref(clip), std::cref(info), bFileWriter, nIndex,
+                    nDeadlineMs, std::ref(vecResult[nIndex]));
+            }
+            for (auto& thRecorder : vecThread)
+                thRecorder.join();
+            // the last segments are closed and synced inside the time
+            double dElapsed = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count(), 1e-6);
+            FileWriterStats statsEnd = FileWriter::GetStats();
+            int64_t nBytes = 0;
+            int nSegments = 0;
+            bool bFailed = false;
+            for (auto& result : vecResult)
+            {
+                nBytes += result.nBytes;
+                nSegments += result.nSegments;
+                bFailed = bFailed || result.bFailed;
+            }
+
+            json.BeginObject();
+            json.Add("writer", bFileWriter ? "file_writer" : "avio");
+            json.Add("recorders", nRecorders);
+            json.Add("elapsed_s", dElapsed);
+            json.Add("segments", nSegments);
+            json.Add("mb_per_s", nBytes / dElapsed / (1024 * 1024));
+            if (bFileWriter) {
+                uint64_t nWrites = statsEnd.nWrites - statsStart.nWrites;
+                json.Add("writes_per_s", nWrites / dElapsed);
+                json.Add("avg_write_kb", nWrites > 0 ? (statsEnd.nWriteBytes - statsStart.nWriteBytes) / 1024.0 / nWrites : 0.0);
+                json.Add("block_reads", statsEnd.nReads - statsStart.nReads);
+            }
+            json.Add("failed", bFailed);
+            json.EndObject();
+            bResult = bResult && !bFailed;
+        }
+    }
+    json.EndArray();
+    fprintf(stderr, "recording fragmented mp4, cut mid-fragment\n");
+    bResult = check_truncated(clip, info.strDir, json) && bResult;
+    json.EndObject();
+    clear_dir(info.strDir);
+    return bResult;
+}
+
+bool RecordBench::check_truncated(const Clip& clip, const std::string& strDir, JsonWriter& json)
+{
+    // one pass of the clip with the movflags of StreamHandle::bFragmentedMp4
+    std::string strPath = strDir + "/fragmented.mp4";
+    AVFormatContext* pFormatCtx = nullptr;
+    if (avformat_alloc_output_context2(&pFormatCtx, nullptr, "mp4", strPath.c_str()) < 0)
+        return false;
+    int nVideoIndex = -1;
+    bool bResult = true;
+    for (size_t nIndex = 0; bResult && nIndex < clip.vecPar.size(); ++nIndex)
+    {
+        AVStream* pStream = avformat_new_stream(pFormatCtx, nullptr);
+        bResult = pStream && avcodec_parameters_copy(pStream->codecpar, clip.vecPar[nIndex]) >= 0;
+        if (bResult)
+            pStream->time_base = clip.vecTimeBase[nIndex];
+        if (AVMEDIA_TYPE_VIDEO == clip.vecPar[nIndex]->codec_type && nVideoIndex < 0)
+            nVideoIndex = (int)nIndex;
+    }
+    AVDictionary* pOptions = nullptr;
+    av_dict_set(&pOptions, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    bResult = bResult && nVideoIndex >= 0 && avio_open(&pFormatCtx->pb, strPath.c_str(), AVIO_FLAG_WRITE) >= 0
+        && avformat_write_header(pFormatCtx, &pOptions) >= 0;
+    av_dict_free(&pOptions);
+    // end of every finished fragment and the video frames in the file up to it
+    std::vector<std::pair<int64_t, int64_t>> vecFragment;
+    int64_t nVideoFrames = 0;
+    AVPacket* pPacket = av_packet_alloc();
+    for (size_t nNext = 0; bResult && pPacket && nNext < clip.vecPacket.size(); ++nNext)
+    {
+        const AVPacket* pSource = clip.vecPacket[nNext];
+        bool bVideo = pSource->stream_index == nVideoIndex;
+        bResult = av_packet_ref(pPacket, pSource) >= 0;
+        if (!bResult)
+            break;
+        av_packet_rescale_ts(pPacket, clip.vecTimeBase[pSource->stream_index],
+            pFormatCtx->streams[pSource->stream_index]->time_base);
+        bResult = av_write_frame(pFormatCtx, pPacket) >= 0;
+        av_packet_unref(pPacket);
+        // a video keyframe makes the muxer write out the fragment before it
+        if (bVideo && (pSource->flags & AV_PKT_FLAG_KEY) && nVideoFrames > 0) {
+            avio_flush(pFormatCtx->pb);
+            vecFragment.push_back({ avio_tell(pFormatCtx->pb), nVideoFrames });
+        }
+        if (bVideo)
+            ++nVideoFrames;
+    }
+    av_packet_free(&pPacket);
+    if (pFormatCtx->pb) {
+        if (bResult)
+            av_write_trailer(pFormatCtx);
+        avio_closep(&pFormatCtx->pb);
+    }
+    avformat_free_context(pFormatCtx);
+    if (!bResult || vecFragment.size() < 2) {
+        fprintf(stderr, "Could not record %s with at least two fragments\n", strPath.c_str());
+        return false;
+    }
+
+    // cut halfway into the fragment after the middle one, as a killed process leaves the file
+    size_t nLast = vecFragment.size() / 2;
+    int64_t nCut = (vecFragment[nLast - 1].first + vecFragment[nLast].first) / 2;
+    int64_t nExpected = vecFragment[nLast - 1].second;
+    std::string strCut = strDir + "/fragmented_cut.mp4";
+    std::vector<char> vecData((size_t)nCut);
+    FILE* pInput = fopen(strPath.c_str(), "rb");
+    FILE* pOutput = fopen(strCut.c_str(), "wb");
+    bool bCut = pInput && pOutput && fread(vecData.data(), 1, vecData.size(), pInput) == vecData.size()
+        && fwrite(vecData.data(), 1, vecData.size(), pOutput) == vecData.size();
+    if (pInput)
+        fclose(pInput);
+    if (pOutput)
+        fclose(pOutput);
+    int64_t nDecoded = bCut ? decode_video(strCut) : -1;
+    bool bPassed = bCut && nDecoded >= nExpected;
+    if (!bPassed)
+        fprintf(stderr, "Cut fragmented mp4 decoded %lld of %lld frames\n", (long long)nDecoded, (long long)nExpected);
+
+    json.BeginObject("kill_mid_write");
+    json.Add("fragments", (int)vecFragment.size());
+    json.Add("cut_bytes", nCut);
+    json.Add("expected_frames", nExpected);
+    json.Add("decoded_frames", nDecoded);
+    json.Add("passed", bPassed);
+    json.EndObject();
+    return bPassed;
+}
+
+int64_t RecordBench::decode_video(const std::string& strPath)
+{
+    AVFormatContext* pFormatCtx = nullptr;
+    if (avformat_open_input(&pFormatCtx, strPath.c_str(), nullptr, nullptr) < 0)
+        return -1;
+    int64_t nFrames = -1;
+    int nVideoIndex = avformat_find_stream_info(pFormatCtx, nullptr) >= 0
+        ? av_find_best_stream(pFormatCtx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0) : -1;
+    const AVCodec* pCodec = nVideoIndex >= 0
+        ? avcodec_find_decoder(pFormatCtx->streams[nVideoIndex]->codecpar->codec_id) : nullptr;
+    AVCodecContext* pCodecCtx = pCodec ? avcodec_alloc_context3(pCodec) : nullptr;
+    AVPacket* pPacket = av_packet_alloc();
+    AVFrame* pFrame = av_frame_alloc();
+    if (pCodecCtx && pPacket && pFrame
+        && avcodec_parameters_to_context(pCodecCtx, pFormatCtx->streams[nVideoIndex]->codecpar) >= 0
+        && avcodec_open2(pCodecCtx, pCodec, nullptr) >= 0) {
+        nFrames = 0;
+        // the cut fragment ends the reading with an error, what came before must decode
+        bool bEnd = false;
+        while (!bEnd)
+        {
+            bEnd = av_read_frame(pFormatCtx, pPacket) < 0;
+            if (!bEnd && pPacket->stream_index != nVideoIndex) {
+                av_packet_unref(pPacket);
+                continue;
+            }
+            avcodec_send_packet(pCodecCtx, bEnd ? nullptr : pPacket);
+            av_packet_unref(pPacket);
+            while (avcodec_receive_frame(pCodecCtx, pFrame) >= 0)
+                ++nFrames;
+        }
+    }
+    av_frame_free(&pFrame);
+    av_packet_free(&pPacket);
+    avcodec_free_context(&pCodecCtx);
+    avformat_close_input(&pFormatCtx);
+    return nFrames;
+}
+
+bool RecordBench::load_clip(const std::string& strInput, Clip& clip)
+{
+    AVFormatContext* pFormatCtx = nullptr;
+    if (avformat_open_input(&pFormatCtx, strInput.c_str(), nullptr, nullptr) < 0)
+        return false;
+    bool bResult = avformat_find_stream_info(pFormatCtx, nullptr) >= 0;
+    for (unsigned int nIndex = 0; bResult && nIndex < pFormatCtx->nb_streams; ++nIndex)
+    {
+        AVCodecParameters* pPar = avcodec_parameters_alloc();
+        if (nullptr == pPar || avcodec_parameters_copy(pPar, pFormatCtx->streams[nIndex]->codecpar) < 0) {
+            avcodec_parameters_free(&pPar);
+            bResult = false;
+            break;
+        }
+        pPar->codec_tag = 0;
+        clip.vecPar.push_back(pPar);
+        clip.vecTimeBase.push_back(pFormatCtx->streams[nIndex]->time_base);
+    }
+    std::vector<int64_t> vecFirstTs(clip.vecPar.size(), INT64_MAX);
+    std::vector<int64_t> vecEndTs(clip.vecPar.size(), INT64_MIN);
+    AVPacket* pPacket = av_packet_alloc();
+    while (bResult && pPacket && av_read_frame(pFormatCtx, pPacket) >= 0)
+    {
+        int64_t nTs = AV_NOPTS_VALUE != pPacket->dts ? pPacket->dts : pPacket->pts;
+        if (AV_NOPTS_VALUE == nTs) {
+            av_packet_unref(pPacket);
+            continue;
+        }
+        int nStream = pPacket->stream_index;
+        vecFirstTs[nStream] = std::min(vecFirstTs[nStream], nTs);
+        vecEndTs[nStream] = std::max(vecEndTs[nStream], nTs + std::max<int64_t>(pPacket->duration, 1));
+        clip.vecPacket.push_back(pPacket);
+        pPacket = av_packet_alloc();
+    }
+    av_packet_free(&pPacket);
+    for (size_t nIndex = 0; nIndex < vecFirstTs.size(); ++nIndex)
+        clip.vecLoopTs.push_back(vecEndTs[nIndex] > vecFirstTs[nIndex] ? vecEndTs[nIndex] - vecFirstTs[nIndex] : 0);
+    avformat_close_input(&pFormatCtx);
+    return bResult;
+}
+
+void RecordBench::record(const Clip& clip, const RecordBenchInfo& info, bool bFileWriter, int nRecorder,
+    int64_t nDeadlineMs, RecorderResult& result)
+{
+    AVPacket* pPacket = av_packet_alloc();
+    result.bFailed = nullptr == pPacket;
+    while (!result.bFailed && Time::GetSteadyMilliTimestamp() < nDeadlineMs)
+    {
+        std::string strPath = info.strDir + "/" + std::to_string(nRecorder) + "_" + std::to_string(result.nSegments) + ".mp4";
+        AVFormatContext* pFormatCtx = nullptr;
+        if (avformat_alloc_output_context2(&pFormatCtx, nullptr, "mp4", strPath.c_str()) < 0) {
+            result.bFailed = true;
+            break;
+        }
+        for (size_t nIndex = 0; nIndex < clip.vecPar.size(); ++nIndex)
+        {
+            AVStream* pStream = avformat_new_stream(pFormatCtx, nullptr);
+            if (nullptr == pStream || avcodec_parameters_copy(pStream->codecpar, clip.vecPar[nIndex]) < 0)
+                result.bFailed = true;
+            else
+                pStream->time_base = clip.vecTimeBase[nIndex];
+        }
+        if (!result.bFailed) {
+            if (bFileWriter)
+                pFormatCtx->pb = FileWriter::Open(strPath, info.infoWriter);
+            else if (avio_open(&pFormatCtx->pb, strPath.c_str(), AVIO_FLAG_WRITE) < 0)
+                pFormatCtx->pb = nullptr;
+            result.bFailed = nullptr == pFormatCtx->pb || avformat_write_header(pFormatCtx, nullptr) < 0;
+        }
+        // every segment starts at the first packet of the clip, a keyframe, and at time 0
+        int64_t nPass = 0;
+        size_t nNext = 0;
+        while (!result.bFailed && avio_tell(pFormatCtx->pb) < info.nSegmentBytes
+            && Time::GetSteadyMilliTimestamp() < nDeadlineMs)
+        {
+            const AVPacket* pSource = clip.vecPacket[nNext];
+            if (av_packet_ref(pPacket, pSource) < 0) {
+                result.bFailed = true;
+                break;
+            }
+            int64_t nOffset = nPass * clip.vecLoopTs[pSource->stream_index];
+            if (AV_NOPTS_VALUE != pPacket->pts)
+                pPacket->pts += nOffset;
+            if (AV_NOPTS_VALUE != pPacket->dts)
+                pPacket->dts += nOffset;
+            av_packet_rescale_ts(pPacket, clip.vecTimeBase[pSource->stream_index],
+                pFormatCtx->streams[pSource->stream_index]->time_base);
+            result.bFailed = av_write_frame(pFormatCtx, pPacket) < 0;
+            av_packet_unref(pPacket);
+            if (++nNext == clip.vecPacket.size()) {
+                nNext = 0;
+                ++nPass;
+            }
+        }
+        if (pFormatCtx->pb) {
+            if (!result.bFailed)
+                av_write_trailer(pFormatCtx);
+            result.nBytes += avio_tell(pFormatCtx->pb);
+            if (bFileWriter)
+                result.bFailed = !FileWriter::Close(pFormatCtx->pb) || result.bFailed;
+            else
+                avio_closep(&pFormatCtx->pb);
+        }
+        avformat_free_context(pFormatCtx);
+        ++result.nSegments;
+    }
+    av_packet_free(&pPacket);
+}
+
+void RecordBench::clear_dir(const std::string& strDir)
+{
+    std::vector<StorageEntry> vecEntry;
+    Storage::ListDirectory(strDir, vecEntry);
+    for (auto& entry : vecEntry)
+    {
+        if (!entry.bDirectory)
+            Storage::RemoveFile(strDir + "/" + entry.strName);
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "FileWriter.h"
+
+class JsonWriter;
+struct AVPacket;
+struct AVCodecParameters;
+
+// what the record mode runs
+struct RecordBenchInfo
+{
+    std::vector<int> vecRecorders = { 1, 16, 64 };
+    int nSeconds = 10;                          // per case
+    int64_t nSegmentBytes = 64 * 1024 * 1024;   // a segment is closed (and synced) at this size
+    std::string strDir = "bench_record";        // on the disk under test, emptied after every case
+    FileWriterConfig infoWriter;
+
+    RecordBenchInfo() { infoWriter.nBufferSize = FileWriterConfig::kDefaultBufferSize; }
+};
+
+// Sustained recording to one local disk: every recorder thread remuxes the
+// clip from memory into mp4 segments as fast as the disk takes them, once
+// through plain avio_open and once through FileWriter. Reports MB/s and, for
+// FileWriter, write calls per second and their average size. Then a fragmented
+// mp4 is cut in the middle of a fragment, as a killed process leaves it, and
+// every complete fragment must still open and decode.
+class RecordBench
+{
+public:
+    static bool Run(const std::string& strInput, const RecordBenchInfo& info, JsonWriter& json);
+
+private:
+    struct Clip;
+    struct RecorderResult;
+    static bool load_clip(const std::string& strInput, Clip& clip);
+    static void record(const Clip& clip, const RecordBenchInfo& info, bool bFileWriter, int nRecorder,
+        int64_t nDeadlineMs, RecorderResult& result);
+    static void clear_dir(const std::string& strDir);
+    static bool check_truncated(const Clip& clip, const std::string& strDir, JsonWriter& json);
+    // video frames decoded from strPath, -1 if it does not open
+    static int64_t decode_video(const std::string& strPath);
+};
@@ -0,0 +1,168 @@
+#include "SyntheticSource.h"
+#include <cstdio>
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+}
+
+std::string SyntheticSource::GetFileName(const SyntheticInfo& info)
+{
+    char szName[256] = { 0 };
+    snprintf(szName, sizeof(szName), "synthetic_%s_%dx%d_%dfps_g%d_%ds.mp4", info.strCodec.c_str(),
+        info.nWidth, info.nHeight, info.nFrameRate, info.nGop, info.nSeconds);
+    return szName;
+}
+
+std::string SyntheticSource::Prepare(const SyntheticInfo& info, const std::string& strDir)
+{
+    std::string strPath = strDir + "/" + GetFileName(info);
+    FILE* pFile = fopen(strPath.c_str(), "rb");
+    if (pFile) {
+        fclose(pFile);
+        return strPath;
+    }
+    fprintf(stderr, "generating %s\n", strPath.c_str());
+    return Generate(info, strPath) ? strPath : "";
+}
+
+bool SyntheticSource::Generate(const SyntheticInfo& info, const std::string& strPath)
+{
+    // prefer the x264/x265 encoders, any other encoder of the codec will do
+    bool bHevc = "hevc" == info.strCodec || "h265" == info.strCodec;
+    AVCodec* pCodec = avcodec_find_encoder_by_name(bHevc ? "libx265" : "libx264");
+    if (nullptr == pCodec)
+        pCodec = avcodec_find_encoder(bHevc ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+    if (nullptr == pCodec) {
+        fprintf(stderr, "No %s encoder in this ffmpeg build\n", info.strCodec.c_str());
+        return false;
+    }
+
+    AVFormatContext* pFormatCtx = nullptr;
+    AVCodecContext* pCodecCtx = nullptr;
+    AVFrame* pFrame = nullptr;
+    AVPacket* pPacket = nullptr;
+    AVStream* pStream = nullptr;
+    AVDictionary* pOptions = nullptr;
+    bool bHeader = false;
+    bool bResult = false;
+    int nCode = 0;
+    int nFrameCount = info.nFrameRate * info.nSeconds;
+    char szError[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+
+    if ((nCode = avformat_alloc_output_context2(&pFormatCtx, nullptr, "mp4", strPath.c_str())) < 0)
+        goto end;
+    pCodecCtx = avcodec_alloc_context3(pCodec);
+    pCodecCtx->width = info.nWidth;
+    pCodecCtx->height = info.nHeight;
+    pCodecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+    pCodecCtx->time_base = { 1, info.nFrameRate };
+    pCodecCtx->framerate = { info.nFrameRate, 1 };
+    pCodecCtx->gop_size = info.nGop;
+    pCodecCtx->keyint_min = info.nGop;
+    pCodecCtx->max_b_frames = 0;        // like most cameras
+    pCodecCtx->bit_rate = info.nBitRate > 0 ? info.nBitRate
+        : (int64_t)info.nWidth * info.nHeight * info.nFrameRate / 10;
+    if (pFormatCtx->oformat->flags & AVFMT_GLOBALHEADER)
+        pCodecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    av_dict_set(&pOptions, "preset", "veryfast", 0);
+    nCode = avcodec_open2(pCodecCtx, pCodec, &pOptions);
+    av_dict_free(&pOptions);
+    if (nCode < 0)
+        goto end;
+
+    pStream = avformat_new_stream(pFormatCtx, nullptr);
+    if (nullptr == pStream)
+        goto end;
+    pStream->time_base = pCodecCtx->time_base;
+    if ((nCode = avcodec_parameters_from_context(pStream->codecpar, pCodecCtx)) < 0)
+        goto end;
+    if ((nCode = avio_open(&pFormatCtx->pb, strPath.c_str(), AVIO_FLAG_WRITE)) < 0)
+        goto end;
+    if ((nCode = avformat_write_header(pFormatCtx, nullptr)) < 0)
+        goto end;
+    bHeader = true;
+
+    pFrame = av_frame_alloc();
+    pFrame->format = pCodecCtx->pix_fmt;
+    pFrame->width = pCodecCtx->width;
+    pFrame->height = pCodecCtx->height;
+    if ((nCode = av_frame_get_buffer(pFrame, 0)) < 0)
+        goto end;
+    pPacket = av_packet_alloc();
+    // one extra round with no frame drains the encoder
+    for (int nIndex = 0; nIndex <= nFrameCount; ++nIndex)
+    {
+        if (nIndex < nFrameCount) {
+            if ((nCode = av_frame_make_writable(pFrame)) < 0)
+                goto end;
+            fill_frame(pFrame, nIndex);
+            pFrame->pts = nIndex;
+        }
+        if ((nCode = avcodec_send_frame(pCodecCtx, nIndex < nFrameCount ? pFrame : nullptr)) < 0)
+            goto end;
+        while ((nCode = avcodec_receive_packet(pCodecCtx, pPacket)) >= 0)
+        {
+            av_packet_rescale_ts(pPacket, pCodecCtx->time_base, pStream->time_base);
+            pPacket->stream_index = pStream->index;
+            if ((nCode = av_interleaved_write_frame(pFormatCtx, pPacket)) < 0)
+                goto end;
+        }
+        if (AVERROR(EAGAIN) != nCode && AVERROR_EOF != nCode)
+            goto end;
+    }
+    nCode = 0;
+    bResult = true;
+
+end:
+    if (nCode < 0)
+        fprintf(stderr, "Could not generate %s: %s\n", strPath.c_str(),
+            av_make_error_string(szError, sizeof(szError), nCode));
+    if (bHeader)
+        av_write_trailer(pFormatCtx);
+    if (pFormatCtx && pFormatCtx->pb)
+        avio_closep(&pFormatCtx->pb);
+    avformat_free_context(pFormatCtx);
+    avcodec_free_context(&pCodecCtx);
+    av_frame_free(&pFrame);
+    av_packet_free(&pPacket);
+    if (!bResult)
+        remove(strPath.c_str());
+    return bResult;
+}
+
+void SyntheticSource::fill_frame(AVFrame* pFrame, int nIndex)
+{
+    // a scrolling gradient with a moving block and some noise, so that both
+    // intra and inter prediction have work to do
+    int nWidth = pFrame->width;
+    int nHeight = pFrame->height;
+    int nBlock = nHeight / 4;
+    int nBlockX = (nIndex * 8) % (nWidth > nBlock ? nWidth - nBlock : 1);
+    int nBlockY = nHeight / 2 - nBlock / 2;
+    uint32_t nSeed = 2166136261u ^ (uint32_t)nIndex;
+    for (int y = 0; y < nHeight; ++y)
+    {
+        uint8_t* pLine = pFrame->data[0] + y * pFrame->linesize[0];
+        bool bBlockLine = y >= nBlockY && y < nBlockY + nBlock;
+        for (int x = 0; x < nWidth; ++x)
+        {
+            nSeed = nSeed * 1664525u + 1013904223u;
+            int nValue = (x + y + nIndex * 3) & 0xff;
+            if (bBlockLine && x >= nBlockX && x < nBlockX + nBlock)
+                nValue = 235;
+            nValue += (int)(nSeed >> 29) - 4;
+            pLine[x] = (uint8_t)(nValue < 16 ? 16 : (nValue > 235 ? 235 : nValue));
+        }
+    }
+    for (int y = 0; y < nHeight / 2; ++y)
+    {
+        uint8_t* pU = pFrame->data[1] + y * pFrame->linesize[1];
+        uint8_t* pV = pFrame->data[2] + y * pFrame->linesize[2];
+        for (int x = 0; x < nWidth / 2; ++x)
+        {
+            pU[x] = (uint8_t)(128 + ((x + nIndex) & 0x3f) - 32);
+            pV[x] = (uint8_t)(128 + ((y - nIndex) & 0x3f) - 32);
+        }
+    }
+}
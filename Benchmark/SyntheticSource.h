@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+struct AVFrame;
+
+// a generated test clip, see SyntheticSource
+struct SyntheticInfo
+{
+    std::string strCodec = "h264";     // h264 or hevc
+    int nWidth = 1920;
+    int nHeight = 1080;
+    int nFrameRate = 25;
+    int nGop = 50;                      // frames between two keyframes
+    int nSeconds = 20;
+    int64_t nBitRate = 0;               // 0: about 0.1 bit per pixel
+};
+
+// Encodes a moving test pattern to an mp4 file, so a benchmark run needs no
+// camera and no sample media. The same info always gives the same file name,
+// an existing file is reused.
+class SyntheticSource
+{
+public:
+    // e.g. synthetic_h264_1920x1080_25fps_g50_20s.mp4
+    static std::string GetFileName(const SyntheticInfo& info);
+    // generate into strDir unless the file is there, return its path or empty on failure
+    static std::string Prepare(const SyntheticInfo& info, const std::string& strDir = ".");
+    static bool Generate(const SyntheticInfo& info, const std::string& strPath);
+
+private:
+    static void fill_frame(AVFrame* pFrame, int nIndex);
+};
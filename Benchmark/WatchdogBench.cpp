@@ -0,0 +1,159 @@
+#include "WatchdogBench.h"
+#include <cstdio>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include "BenchReport.h"
+#include "StreamHandle.h"
+#include "Time.h"
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+static const int kIoTimeoutMs = 1000;
+static const int kMarginMs = 1500;      // a read gives up within the timeout plus this
+static const int kPort = 47011;
+
+int WatchdogBench::Run(const std::string& strInput, JsonWriter& json)
+{
+    std::vector<uint8_t> vecTs;
+    if (!remux_to_ts(strInput, vecTs)) {
+        fprintf(stderr, "Could not remux %s to MPEG-TS\n", strInput.c_str());
+        return 1;
+    }
+    int nFailed = 0;
+    json.BeginObject("watchdog");
+    json.Add("io_timeout_ms", kIoTimeoutMs);
+    json.BeginArray("cases");
+    // nothing at all after the accept, then half the clip and nothing more
+    const char* szCase[] = { "silent_open", "silent_read" };
+    size_t nSendBytes[] = { 0, vecTs.size() / 2 };
+    for (int nCase = 0; nCase < 2; ++nCase)
+    {
+        fprintf(stderr, "watchdog %s\n", szCase[nCase]);
+        std::string strUrl = "tcp://127.0.0.1:" + std::to_string(kPort + nCase);
+        std::atomic<bool> bRelease(false);
+        std::atomic<int64_t> nSilentMs(0);
+        std::thread thServer(&WatchdogBench::serve, strUrl + "?listen=1&listen_timeout=5000", std::cref(vecTs),
+            nSendBytes[nCase], std::cref(bRelease), std::ref(nSilentMs));
+        // give the listener time to bind
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        StreamInfo infoStream;
+        infoStream.strInput = strUrl;
+        infoStream.bDumpFormat = false;
+        infoStream.bReconnect = false;
+        infoStream.nIoTimeoutMs = kIoTimeoutMs;
+        StreamHandle stream;
+        // StartDecode wants something to do, the queued frames are never popped
+        stream.AttachFrameConsumer();
+        int64_t nStartMs = Time::GetSteadyMilliTimestamp();
+        bool bOpened = stream.StartDecode(infoStream);
+        // the silent read case must open, then end on its own
+        while (bOpened && !stream.IsDemuxEnded() && Time::GetSteadyMilliTimestamp() - nStartMs < 20000)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        int64_t nEndMs = Time::GetSteadyMilliTimestamp();
+        bool bEnded = bOpened ? stream.IsDemuxEnded() : true;
+        uint64_t nPackets = 0;
+        for (auto& stats : stream.GetStageStats())
+        {
+            if ("demux" == stats.strName)
+                nPackets = stats.nProcessed;
+        }
+        stream.StopDecode();
+        bRelease = true;
+        thServer.join();
+
+        // from the last byte the server sent to the stream giving up
+        int64_t nDetectMs = nSilentMs > 0 ? nEndMs - nSilentMs : -1;
+        bool bPassed = bEnded && nSilentMs > 0 && nDetectMs <= kIoTimeoutMs + kMarginMs
+            && (0 == nCase ? !bOpened : bOpened && nPackets > 0);
+        if (!bPassed) {
+            fprintf(stderr, "watchdog %s failed: opened %d, ended %d, %lld ms after the server went silent\n",
+                szCase[nCase], bOpened, bEnded, (long long)nDetectMs);
+            ++nFailed;
+        }
+        json.BeginObject();
+        json.Add("case", szCase[nCase]);
+        json.Add("opened", bOpened);
+        json.Add("packets", nPackets);
+        json.Add("detect_ms", nDetectMs);
+        json.Add("passed", bPassed);
+        json.EndObject();
+    }
+    json.EndArray();
+    json.EndObject();
+    return nFailed;
+}
+
+bool WatchdogBench::remux_to_ts(const std::string& strInput, std::vector<uint8_t>& vecTs)
+{
+    AVFormatContext* pInputCtx = nullptr;
+    if (avformat_open_input(&pInputCtx, strInput.c_str(), nullptr, nullptr) < 0)
+        return false;
+    AVFormatContext* pOutputCtx = nullptr;
+    bool bResult = avformat_find_stream_info(pInputCtx, nullptr) >= 0
+        && avformat_alloc_output_context2(&pOutputCtx, nullptr, "mpegts", nullptr) >= 0;
+    std::vector<int> vecMap(pInputCtx->nb_streams, -1);
+    for (unsigned int nIndex = 0; bResult && nIndex < pInputCtx->nb_streams; ++nIndex)
+    {
+        AVStream* pInput = pInputCtx->streams[nIndex];
+        if (AVMEDIA_TYPE_VIDEO != pInput->codecpar->codec_type)
+            continue;
+        AVStream* pOutput = avformat_new_stream(pOutputCtx, nullptr);
+        bResult = pOutput && avcodec_parameters_copy(pOutput->codecpar, pInput->codecpar) >= 0;
+        if (bResult) {
+            pOutput->codecpar->codec_tag = 0;
+            vecMap[nIndex] = pOutput->index;
+        }
+    }
+    bResult = bResult && avio_open_dyn_buf(&pOutputCtx->pb) >= 0;
+    bool bHeader = bResult && avformat_write_header(pOutputCtx, nullptr) >= 0;
+    AVPacket* pPacket = av_packet_alloc();
+    while (bHeader && pPacket && av_read_frame(pInputCtx, pPacket) >= 0)
+    {
+        int nStream = vecMap[pPacket->stream_index];
+        if (nStream >= 0) {
+            av_packet_rescale_ts(pPacket, pInputCtx->streams[pPacket->stream_index]->time_base,
+                pOutputCtx->streams[nStream]->time_base);
+            pPacket->stream_index = nStream;
+            pPacket->pos = -1;
+            av_interleaved_write_frame(pOutputCtx, pPacket);
+        }
+        av_packet_unref(pPacket);
+    }
+    av_packet_free(&pPacket);
+    if (bHeader)
+        av_write_trailer(pOutputCtx);
+    if (pOutputCtx && pOutputCtx->pb) {
+        uint8_t* pBuffer = nullptr;
+        int nSize = avio_close_dyn_buf(pOutputCtx->pb, &pBuffer);
+        pOutputCtx->pb = nullptr;
+        if (bHeader && nSize > 0)
+            vecTs.assign(pBuffer, pBuffer + nSize);
+        av_free(pBuffer);
+    }
+    avformat_free_context(pOutputCtx);
+    avformat_close_input(&pInputCtx);
+    return bHeader && !vecTs.empty();
+}
+
+void WatchdogBench::serve(const std::string& strUrl, const std::vector<uint8_t>& vecTs, size_t nSendBytes,
+    const std::atomic<bool>& bRelease, std::atomic<int64_t>& nSilentMs)
+{
+    // blocks in accept until the stream connects
+    AVIOContext* pIo = nullptr;
+    if (avio_open2(&pIo, strUrl.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr) < 0) {
+        fprintf(stderr, "Could not listen on %s\n", strUrl.c_str());
+        return;
+    }
+    if (nSendBytes > 0) {
+        avio_write(pIo, vecTs.data(), (int)nSendBytes);
+        avio_flush(pIo);
+    }
+    nSilentMs = Time::GetSteadyMilliTimestamp();
+    // the connection stays up, only the data stops
+    while (!bRelease)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    avio_closep(&pIo);
+}
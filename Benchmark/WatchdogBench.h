@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+class JsonWriter;
+
+// The input watchdog against a local TCP server that goes silent without
+// closing the connection, the way a camera behind a dropped link does: once
+// during the open and once after part of the clip (as MPEG-TS) was sent. The
+// stream must give up within nIoTimeoutMs plus a margin, not hang.
+class WatchdogBench
+{
+public:
+    // return the number of failed checks
+    static int Run(const std::string& strInput, JsonWriter& json);
+
+private:
+    static bool remux_to_ts(const std::string& strInput, std::vector<uint8_t>& vecTs);
+    // accept one client, send nSendBytes of vecTs, then hold the connection until bRelease
+    static void serve(const std::string& strUrl, const std::vector<uint8_t>& vecTs, size_t nSendBytes,
+        const std::atomic<bool>& bRelease, std::atomic<int64_t>& nSilentMs);
+};
@@ -0,0 +1,274 @@
+#include "AudioTranscoder.h"
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
+}
+
+AudioTranscoder::AudioTranscoder()
+    : m_tbIn(AVRational{ 1, 1000 })
+    , m_pDecoderCtx(nullptr)
+    , m_pEncoderCtx(nullptr)
+    , m_pCodecPar(nullptr)
+    , m_pSwrCtx(nullptr)
+    , m_nSwrFormat(-1)
+    , m_nSwrSampleRate(0)
+    , m_nSwrLayout(0)
+    , m_pFifo(nullptr)
+    , m_ppSamples(nullptr)
+    , m_nSampleCapacity(0)
+    , m_pDecodeFrame(nullptr)
+    , m_pEncodeFrame(nullptr)
+    , m_pPacket(nullptr)
+    , m_nFifoPts(AV_NOPTS_VALUE)
+{
+}
+
+AudioTranscoder::~AudioTranscoder()
+{
+    Close();
+}
+
+bool AudioTranscoder::NeedTranscode(const AVCodecParameters* pCodecPar, AudioTranscodeMode nMode)
+{
+    if (nullptr == pCodecPar || AVMEDIA_TYPE_AUDIO != pCodecPar->codec_type || kAudioCopy == nMode)
+        return false;
+    if (kAudioTranscodeAac == nMode)
+        return true;
+    return AV_CODEC_ID_AAC != pCodecPar->codec_id && AV_CODEC_ID_MP3 != pCodecPar->codec_id;
+}
+
+bool AudioTranscoder::Open(const AVCodecParameters* pCodecPar, AVRational tbIn, const AudioTranscodeInfo& info)
+{
+    Close();
+    AVCodec* pDecoder = avcodec_find_decoder(pCodecPar->codec_id);
+    AVCodec* pEncoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (nullptr == pDecoder || nullptr == pEncoder) {
+        printf("No audio decoder for %s or no AAC encoder\n", avcodec_get_name(pCodecPar->codec_id));
+        return false;
+    }
+    m_tbIn = tbIn;
+    m_pDecoderCtx = avcodec_alloc_context3(pDecoder);
+    if (nullptr == m_pDecoderCtx || avcodec_parameters_to_context(m_pDecoderCtx, pCodecPar) < 0) {
+        Close();
+        return false;
+    }
+    m_pDecoderCtx->pkt_timebase = tbIn;
+    if (avcodec_open2(m_pDecoderCtx, pDecoder, nullptr) < 0) {
+        printf("Can't open audio decoder %s\n", pDecoder->name);
+        Close();
+        return false;
+    }
+
+    int nChannels = std::max(1, std::min(pCodecPar->channels, std::max(1, info.nMaxChannels)));
+    m_pEncoderCtx = avcodec_alloc_context3(pEncoder);
+    if (nullptr == m_pEncoderCtx) {
+        Close();
+        return false;
+    }
+    m_pEncoderCtx->sample_fmt = pEncoder->sample_fmts ? pEncoder->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+    m_pEncoderCtx->sample_rate = pick_sample_rate(pEncoder, info.nSampleRate > 0 ? info.nSampleRate : pCodecPar->sample_rate);
+    m_pEncoderCtx->channels = nChannels;
+    m_pEncoderCtx->channel_layout = av_get_default_channel_layout(nChannels);
+    m_pEncoderCtx->bit_rate = info.nBitRate;
+    m_pEncoderCtx->time_base = AVRational{ 1, m_pEncoderCtx->sample_rate };
+    // AudioSpecificConfig in extradata, FLV and MP4 both want it there
+    m_pEncoderCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(m_pEncoderCtx, pEncoder, nullptr) < 0) {
+        printf("Can't open AAC encoder at %d Hz\n", m_pEncoderCtx->sample_rate);
+        Close();
+        return false;
+    }
+    m_pCodecPar = avcodec_parameters_alloc();
+    if (nullptr == m_pCodecPar || avcodec_parameters_from_context(m_pCodecPar, m_pEncoderCtx) < 0) {
+        Close();
+        return false;
+    }
+
+    int nFrameSize = m_pEncoderCtx->frame_size > 0 ? m_pEncoderCtx->frame_size : 1024;
+    m_pFifo = av_audio_fifo_alloc(m_pEncoderCtx->sample_fmt, nChannels, nFrameSize * 4);
+    m_pDecodeFrame = av_frame_alloc();
+    m_pEncodeFrame = av_frame_alloc();
+    m_pPacket = av_packet_alloc();
+    if (nullptr == m_pFifo || nullptr == m_pDecodeFrame || nullptr == m_pEncodeFrame || nullptr == m_pPacket) {
+        Close();
+        return false;
+    }
+    m_pEncodeFrame->nb_samples = nFrameSize;
+    m_pEncodeFrame->format = m_pEncoderCtx->sample_fmt;
+    m_pEncodeFrame->channels = nChannels;
+    m_pEncodeFrame->channel_layout = m_pEncoderCtx->channel_layout;
+    m_pEncodeFrame->sample_rate = m_pEncoderCtx->sample_rate;
+    if (av_frame_get_buffer(m_pEncodeFrame, 0) < 0) {
+        Close();
+        return false;
+    }
+    printf("Audio %s %d Hz -> AAC %d Hz %d ch %lld bit/s\n", pDecoder->name, pCodecPar->sample_rate,
+        m_pEncoderCtx->sample_rate, nChannels, (long long)m_pEncoderCtx->bit_rate);
+    return true;
+}
+
+void AudioTranscoder::Close()
+{
+    avcodec_free_context(&m_pDecoderCtx);
+    avcodec_free_context(&m_pEncoderCtx);
+    avcodec_parameters_free(&m_pCodecPar);
+    swr_free(&m_pSwrCtx);
+    m_nSwrFormat = -1;
+    m_nSwrSampleRate = 0;
+    m_nSwrLayout = 0;
+    if (m_pFifo) {
+        av_audio_fifo_free(m_pFifo);
+        m_pFifo = nullptr;
+    }
+    if (m_ppSamples) {
+        av_freep(&m_ppSamples[0]);
+        av_freep(&m_ppSamples);
+    }
+    m_nSampleCapacity = 0;
+    av_frame_free(&m_pDecodeFrame);
+    av_frame_free(&m_pEncodeFrame);
+    av_packet_free(&m_pPacket);
+    m_nFifoPts = AV_NOPTS_VALUE;
+}
+
+bool AudioTranscoder::Transcode(const AVPacket* pPacket, const PacketCallback& fnOutput)
+{
+    if (!IsOpened())
+        return false;
+    int nCode = avcodec_send_packet(m_pDecoderCtx, pPacket);
+    // a broken packet costs its samples, not the stream
+    if (nCode < 0 && AVERROR_EOF != nCode && pPacket)
+        return false;
+    while (true)
+    {
+        nCode = avcodec_receive_frame(m_pDecoderCtx, m_pDecodeFrame);
+        if (AVERROR(EAGAIN) == nCode || AVERROR_EOF == nCode)
+            break;
+        if (nCode < 0)
+            return false;
+        bool bResult = resample(m_pDecodeFrame);
+        av_frame_unref(m_pDecodeFrame);
+        if (!bResult)
+            return false;
+    }
+    // the resampler holds back a few samples of filter delay
+    int nSamples = 0;
+    while (nullptr == pPacket && m_pSwrCtx && m_ppSamples
+        && (nSamples = swr_convert(m_pSwrCtx, m_ppSamples, m_nSampleCapacity, nullptr, 0)) > 0)
+    {
+        if (av_audio_fifo_write(m_pFifo, (void**)m_ppSamples, nSamples) < nSamples)
+            return false;
+    }
+    return encode_fifo(nullptr == pPacket, fnOutput);
+}
+
+int AudioTranscoder::pick_sample_rate(const AVCodec* pEncoder, int nSampleRate)
+{
+    if (nSampleRate <= 0)
+        nSampleRate = 44100;
+    if (nullptr == pEncoder->supported_samplerates)
+        return nSampleRate;
+    // the rate itself, else the lowest one above (no quality lost), else the highest
+    int nAbove = 0;
+    int nHighest = 0;
+    for (const int* pRate = pEncoder->supported_samplerates; *pRate; ++pRate)
+    {
+        if (*pRate == nSampleRate)
+            return nSampleRate;
+        if (*pRate > nSampleRate && (0 == nAbove || *pRate < nAbove))
+            nAbove = *pRate;
+        nHighest = std::max(nHighest, *pRate);
+    }
+    return nAbove > 0 ? nAbove : (nHighest > 0 ? nHighest : nSampleRate);
+}
+
+bool AudioTranscoder::resample(const AVFrame* pFrame)
+{
+    int64_t nLayout = pFrame->channel_layout ? (int64_t)pFrame->channel_layout
+        : av_get_default_channel_layout(pFrame->channels);
+    if (nullptr == m_pSwrCtx || pFrame->format != m_nSwrFormat || pFrame->sample_rate != m_nSwrSampleRate
+        || nLayout != m_nSwrLayout) {
+        swr_free(&m_pSwrCtx);
+        m_pSwrCtx = swr_alloc_set_opts(nullptr, m_pEncoderCtx->channel_layout, m_pEncoderCtx->sample_fmt,
+            m_pEncoderCtx->sample_rate, nLayout, (AVSampleFormat)pFrame->format, pFrame->sample_rate, 0, nullptr);
+        if (nullptr == m_pSwrCtx || swr_init(m_pSwrCtx) < 0) {
+            printf("Can't resample audio of format %d at %d Hz\n", pFrame->format, pFrame->sample_rate);
+            swr_free(&m_pSwrCtx);
+            return false;
+        }
+        m_nSwrFormat = pFrame->format;
+        m_nSwrSampleRate = pFrame->sample_rate;
+        m_nSwrLayout = nLayout;
+    }
+    int nMaxOut = swr_get_out_samples(m_pSwrCtx, pFrame->nb_samples);
+    if (nMaxOut > m_nSampleCapacity) {
+        if (m_ppSamples) {
+            av_freep(&m_ppSamples[0]);
+            av_freep(&m_ppSamples);
+        }
+        m_nSampleCapacity = 0;
+        if (av_samples_alloc_array_and_samples(&m_ppSamples, nullptr, m_pEncoderCtx->channels, nMaxOut,
+            m_pEncoderCtx->sample_fmt, 0) < 0)
+            return false;
+        m_nSampleCapacity = nMaxOut;
+    }
+    int nSamples = swr_convert(m_pSwrCtx, m_ppSamples, m_nSampleCapacity,
+        (const uint8_t**)pFrame->extended_data, pFrame->nb_samples);
+    if (nSamples < 0)
+        return false;
+
+    // follow the input clock, a jump (lost packets, reconnect) restarts the count
+    AVRational tbOut = m_pEncoderCtx->time_base;
+    int64_t nPts = pFrame->best_effort_timestamp;
+    int nQueued = av_audio_fifo_size(m_pFifo);
+    if (AV_NOPTS_VALUE != nPts) {
+        int64_t nFramePts = av_rescale_q(nPts, m_tbIn, tbOut);
+        if (AV_NOPTS_VALUE == m_nFifoPts || std::llabs(nFramePts - (m_nFifoPts + nQueued)) > tbOut.den / 2)
+            m_nFifoPts = nFramePts - nQueued;
+    }
+    else if (AV_NOPTS_VALUE == m_nFifoPts)
+        m_nFifoPts = 0;
+    return av_audio_fifo_write(m_pFifo, (void**)m_ppSamples, nSamples) >= nSamples;
+}
+
+bool AudioTranscoder::encode_fifo(bool bFlush, const PacketCallback& fnOutput)
+{
+    int nFrameSize = m_pEncoderCtx->frame_size > 0 ? m_pEncoderCtx->frame_size : 1024;
+    // the last, shorter frame only when draining
+    while (av_audio_fifo_size(m_pFifo) >= nFrameSize || (bFlush && av_audio_fifo_size(m_pFifo) > 0))
+    {
+        if (av_frame_make_writable(m_pEncodeFrame) < 0)
+            return false;
+        int nSamples = std::min(nFrameSize, av_audio_fifo_size(m_pFifo));
+        m_pEncodeFrame->nb_samples = nSamples;
+        if (av_audio_fifo_read(m_pFifo, (void**)m_pEncodeFrame->data, nSamples) < nSamples)
+            return false;
+        m_pEncodeFrame->pts = m_nFifoPts;
+        m_nFifoPts += nSamples;
+        int nCode = avcodec_send_frame(m_pEncoderCtx, m_pEncodeFrame);
+        m_pEncodeFrame->nb_samples = nFrameSize;
+        if (nCode < 0 || !receive_packets(fnOutput))
+            return false;
+    }
+    if (bFlush && avcodec_send_frame(m_pEncoderCtx, nullptr) >= 0)
+        return receive_packets(fnOutput);
+    return true;
+}
+
+bool AudioTranscoder::receive_packets(const PacketCallback& fnOutput)
+{
+    while (true)
+    {
+        int nCode = avcodec_receive_packet(m_pEncoderCtx, m_pPacket);
+        if (AVERROR(EAGAIN) == nCode || AVERROR_EOF == nCode)
+            return true;
+        if (nCode < 0)
+            return false;
+        av_packet_rescale_ts(m_pPacket, m_pEncoderCtx->time_base, m_tbIn);
+        fnOutput(m_pPacket);
+        av_packet_unref(m_pPacket);
+    }
+}
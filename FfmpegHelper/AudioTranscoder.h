@@ -0,0 +1,74 @@
+#pragma once
+#include <functional>
+#include <cstdint>
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libswresample/swresample.h>
+}
+
+// what the outputs get from the audio of a stream
+enum AudioTranscodeMode
+{
+    kAudioCopy,             // the packets as they are
+    kAudioTranscodeAuto,    // AAC and MP3 are copied, anything else (G.711, PCM, ADPCM) becomes AAC
+    kAudioTranscodeAac,     // always AAC
+};
+
+struct AudioTranscodeInfo
+{
+    AudioTranscodeMode nMode = kAudioTranscodeAuto;
+    int nBitRate = 64000;
+    int nSampleRate = 0;        // 0: the input rate if AAC has it, else the closest one above
+    int nMaxChannels = 2;       // more input channels are mixed down
+};
+
+// Audio only transcode for outputs that take no G.711 or PCM (FLV/RTMP, MP4):
+// decode, resample with swresample into a FIFO, encode AAC frames. The FIFO,
+// the sample buffer and the frames are allocated once, the resampler only
+// again when the decoded format changes. Video never comes here.
+class AudioTranscoder
+{
+public:
+    using PacketCallback = std::function<void(AVPacket* pPacket)>;
+
+    AudioTranscoder();
+    ~AudioTranscoder();
+    AudioTranscoder(const AudioTranscoder&) = delete;
+    AudioTranscoder& operator=(const AudioTranscoder&) = delete;
+
+    static bool NeedTranscode(const AVCodecParameters* pCodecPar, AudioTranscodeMode nMode);
+    // tbIn: time base of the input packets, the AAC packets come out in it as well
+    bool Open(const AVCodecParameters* pCodecPar, AVRational tbIn, const AudioTranscodeInfo& info);
+    void Close();
+    bool IsOpened() const { return m_pEncoderCtx != nullptr; }
+    // of the AAC stream for avformat_new_stream, taken from the encoder
+    const AVCodecParameters* GetCodecPar() const { return m_pCodecPar; }
+    // one input packet, every AAC packet ready is passed to fnOutput and unreferenced
+    // afterwards. nullptr drains decoder, FIFO and encoder, Open again to go on
+    bool Transcode(const AVPacket* pPacket, const PacketCallback& fnOutput);
+
+private:
+    static int pick_sample_rate(const AVCodec* pEncoder, int nSampleRate);
+    bool resample(const AVFrame* pFrame);
+    bool encode_fifo(bool bFlush, const PacketCallback& fnOutput);
+    bool receive_packets(const PacketCallback& fnOutput);
+
+private:
+    AVRational m_tbIn;
+    AVCodecContext* m_pDecoderCtx;
+    AVCodecContext* m_pEncoderCtx;
+    AVCodecParameters* m_pCodecPar;
+    SwrContext* m_pSwrCtx;
+    // input format the resampler was set up for
+    int m_nSwrFormat;
+    int m_nSwrSampleRate;
+    int64_t m_nSwrLayout;
+    AVAudioFifo* m_pFifo;
+    uint8_t** m_ppSamples;          // resampler output, grown on demand
+    int m_nSampleCapacity;
+    AVFrame* m_pDecodeFrame;
+    AVFrame* m_pEncodeFrame;
+    AVPacket* m_pPacket;
+    int64_t m_nFifoPts;             // encoder time base, first sample in the FIFO
+};
@@ -0,0 +1,469 @@
+#include "ColorKernels.h"
+#include <cstring>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FFH_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC compiles any intrinsic, the caller checks the CPU
+#define FFH_TARGET_SSE41
+#define FFH_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define FFH_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define FFH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// BT.601 limited range in Q14, the same integer math on every instruction set
+static const int kCoefShift = 14;
+static const int kCoefRound = 1 << (kCoefShift - 1);
+static const int kCoefY = 19077;        // 255 / 219
+static const int kCoefRV = 26149;       // 1.596
+static const int kCoefGU = 6419;        // 0.392
+static const int kCoefGV = 13320;       // 0.813
+static const int kCoefBU = 33050;       // 2.017
+
+// one output row is made of these, nWidth counts output samples
+struct RowKernels
+{
+    void(*fnBox2)(const uint8_t* pRow0, const uint8_t* pRow1, uint8_t* pDst, int nWidth);
+    void(*fnBox4)(const uint8_t* const pRows[4], uint8_t* pDst, int nWidth);
+    void(*fnSplitUv)(const uint8_t* pUv, uint8_t* pU, uint8_t* pV, int nWidth);
+    void(*fnDouble)(const uint8_t* pSrc, uint8_t* pDst, int nWidth);
+    void(*fnYuvToBgr)(const uint8_t* pY, const uint8_t* pU, const uint8_t* pV, uint8_t* pBgr, int nWidth);
+};
+
+static inline uint8_t clamp_u8(int nValue)
+{
+    return (uint8_t)(nValue < 0 ? 0 : (nValue > 255 ? 255 : nValue));
+}
+
+static void box2_c(const uint8_t* pRow0, const uint8_t* pRow1, uint8_t* pDst, int nWidth)
+{
+    for (int x = 0; x < nWidth; ++x)
+        pDst[x] = (uint8_t)((pRow0[2 * x] + pRow0[2 * x + 1] + pRow1[2 * x] + pRow1[2 * x + 1] + 2) >> 2);
+}
+
+static void box4_c(const uint8_t* const pRows[4], uint8_t* pDst, int nWidth)
+{
+    for (int x = 0; x < nWidth; ++x)
+    {
+        int nSum = 8;
+        for (int nRow = 0; nRow < 4; ++nRow)
+        {
+            const uint8_t* pSrc = pRows[nRow] + 4 * x;
+            nSum += pSrc[0] + pSrc[1] + pSrc[2] + pSrc[3];
+        }
+        pDst[x] = (uint8_t)(nSum >> 4);
+    }
+}
+
+static void split_uv_c(const uint8_t* pUv, uint8_t* pU, uint8_t* pV, int nWidth)
+{
+    for (int x = 0; x < nWidth; ++x)
+    {
+        pU[x] = pUv[2 * x];
+        pV[x] = pUv[2 * x + 1];
+    }
+}
+
+static void double_c(const uint8_t* pSrc, uint8_t* pDst, int nWidth)
+{
+    for (int x = 0; x < nWidth; ++x)
+        pDst[x] = pSrc[x >> 1];
+}
+
+static void yuv_to_bgr_c(const uint8_t* pY, const uint8_t* pU, const uint8_t* pV, uint8_t* pBgr, int nWidth)
+{
+    for (int x = 0; x < nWidth; ++x)
+    {
+        int nY = (pY[x] - 16) * kCoefY + kCoefRound;
+        int nU = pU[x] - 128;
+        int nV = pV[x] - 128;
+        pBgr[3 * x] = clamp_u8((nY + kCoefBU * nU) >> kCoefShift);
+        pBgr[3 * x + 1] = clamp_u8((nY - kCoefGU * nU - kCoefGV * nV) >> kCoefShift);
+        pBgr[3 * x + 2] = clamp_u8((nY + kCoefRV * nV) >> kCoefShift);
+    }
+}
+
+#ifdef FFH_KERNELS_X86
+FFH_TARGET_SSE41 static void box2_sse41(const uint8_t* pRow0, const uint8_t* pRow1, uint8_t* pDst, int nWidth)
+{
+    const __m128i nOnes = _mm_set1_epi8(1);
+    const __m128i nTwo = _mm_set1_epi16(2);
+    int x = 0;
+    for (; x + 16 <= nWidth; x += 16)
+    {
+        // horizontal pairs summed by maddubs, then the two rows
+        __m128i nLo = _mm_add_epi16(
+            _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)(pRow0 + 2 * x)), nOnes),
+            _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)(pRow1 + 2 * x)), nOnes));
+        __m128i nHi = _mm_add_epi16(
+            _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)(pRow0 + 2 * x + 16)), nOnes),
+            _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)(pRow1 + 2 * x + 16)), nOnes));
+        nLo = _mm_srli_epi16(_mm_add_epi16(nLo, nTwo), 2);
+        nHi = _mm_srli_epi16(_mm_add_epi16(nHi, nTwo), 2);
+        _mm_storeu_si128((__m128i*)(pDst + x), _mm_packus_epi16(nLo, nHi));
+    }
+    box2_c(pRow0 + 2 * x, pRow1 + 2 * x, pDst + x, nWidth - x);
+}
+
+FFH_TARGET_SSE41 static void box4_sse41(const uint8_t* const pRows[4], uint8_t* pDst, int nWidth)
+{
+    const __m128i nOnes = _mm_set1_epi8(1);
+    const __m128i nEight = _mm_set1_epi16(8);
+    int x = 0;
+    for (; x + 8 <= nWidth; x += 8)
+    {
+        __m128i nLo = _mm_setzero_si128();
+        __m128i nHi = _mm_setzero_si128();
+        for (int nRow = 0; nRow < 4; ++nRow)
+        {
+            const uint8_t* pSrc = pRows[nRow] + 4 * x;
+            nLo = _mm_add_epi16(nLo, _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)pSrc), nOnes));
+            nHi = _mm_add_epi16(nHi, _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)(pSrc + 16)), nOnes));
+        }
+        // neighbouring pair sums make the 4x4 sums
+        __m128i nSum = _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi16(nLo, nHi), nEight), 4);
+        _mm_storel_epi64((__m128i*)(pDst + x), _mm_packus_epi16(nSum, nSum));
+    }
+    const uint8_t* pTail[4] = { pRows[0] + 4 * x, pRows[1] + 4 * x, pRows[2] + 4 * x, pRows[3] + 4 * x };
+    box4_c(pTail, pDst + x, nWidth - x);
+}
+
+FFH_TARGET_SSE41 static void split_uv_sse41(const uint8_t* pUv, uint8_t* pU, uint8_t* pV, int nWidth)
+{
+    const __m128i nShuffle = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    int x = 0;
+    for (; x + 16 <= nWidth; x += 16)
+    {
+        __m128i nLo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pUv + 2 * x)), nShuffle);
+        __m128i nHi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pUv + 2 * x + 16)), nShuffle);
+        _mm_storeu_si128((__m128i*)(pU + x), _mm_unpacklo_epi64(nLo, nHi));
+        _mm_storeu_si128((__m128i*)(pV + x), _mm_unpackhi_epi64(nLo, nHi));
+    }
+    split_uv_c(pUv + 2 * x, pU + x, pV + x, nWidth - x);
+}
+
+FFH_TARGET_SSE41 static void double_sse41(const uint8_t* pSrc, uint8_t* pDst, int nWidth)
+{
+    int x = 0;
+    for (; x + 32 <= nWidth; x += 32)
+    {
+        __m128i nSrc = _mm_loadu_si128((const __m128i*)(pSrc + x / 2));
+        _mm_storeu_si128((__m128i*)(pDst + x), _mm_unpacklo_epi8(nSrc, nSrc));
+        _mm_storeu_si128((__m128i*)(pDst + x + 16), _mm_unpackhi_epi8(nSrc, nSrc));
+    }
+    double_c(pSrc + x / 2, pDst + x, nWidth - x);
+}
+
+// 16 B, G and R bytes to 48 bytes of BGR24
+FFH_TARGET_SSE41 static inline void store_bgr_sse41(__m128i nB, __m128i nG, __m128i nR, uint8_t* pBgr)
+{
+    const __m128i nB0 = _mm_setr_epi8(0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128, 5);
+    const __m128i nG0 = _mm_setr_epi8(-128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128);
+    const __m128i nR0 = _mm_setr_epi8(-128, -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128);
+    const __m128i nB1 = _mm_setr_epi8(-128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10, -128);
+    const __m128i nG1 = _mm_setr_epi8(5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10);
+    const __m128i nR1 = _mm_setr_epi8(-128, 5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128);
+    const __m128i nB2 = _mm_setr_epi8(-128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128, -128);
+    const __m128i nG2 = _mm_setr_epi8(-128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128);
+    const __m128i nR2 = _mm_setr_epi8(10, -128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15);
+    _mm_storeu_si128((__m128i*)pBgr, _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(nB, nB0), _mm_shuffle_epi8(nG, nG0)), _mm_shuffle_epi8(nR, nR0)));
+    _mm_storeu_si128((__m128i*)(pBgr + 16), _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(nB, nB1), _mm_shuffle_epi8(nG, nG1)), _mm_shuffle_epi8(nR, nR1)));
+    _mm_storeu_si128((__m128i*)(pBgr + 32), _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(nB, nB2), _mm_shuffle_epi8(nG, nG2)), _mm_shuffle_epi8(nR, nR2)));
+}
+
+// 4 pixels in 32 bit lanes
+FFH_TARGET_SSE41 static inline void yuv_to_bgr4_sse41(__m128i nY, __m128i nU, __m128i nV,
+    __m128i& nB, __m128i& nG, __m128i& nR)
+{
+    nY = _mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(nY, _mm_set1_epi32(16)), _mm_set1_epi32(kCoefY)),
+        _mm_set1_epi32(kCoefRound));
+    nU = _mm_sub_epi32(nU, _mm_set1_epi32(128));
+    nV = _mm_sub_epi32(nV, _mm_set1_epi32(128));
+    nB = _mm_srai_epi32(_mm_add_epi32(nY, _mm_mullo_epi32(nU, _mm_set1_epi32(kCoefBU))), kCoefShift);
+    nG = _mm_srai_epi32(_mm_sub_epi32(_mm_sub_epi32(nY, _mm_mullo_epi32(nU, _mm_set1_epi32(kCoefGU))),
+        _mm_mullo_epi32(nV, _mm_set1_epi32(kCoefGV))), kCoefShift);
+    nR = _mm_srai_epi32(_mm_add_epi32(nY, _mm_mullo_epi32(nV, _mm_set1_epi32(kCoefRV))), kCoefShift);
+}
+
+FFH_TARGET_SSE41 static void yuv_to_bgr_sse41(const uint8_t* pY, const uint8_t* pU, const uint8_t* pV,
+    uint8_t* pBgr, int nWidth)
+{
+    int x = 0;
+    for (; x + 16 <= nWidth; x += 16)
+    {
+        __m128i nY = _mm_loadu_si128((const __m128i*)(pY + x));
+        __m128i nU = _mm_loadu_si128((const __m128i*)(pU + x));
+        __m128i nV = _mm_loadu_si128((const __m128i*)(pV + x));
+        __m128i nB[4], nG[4], nR[4];
+        for (int nPart = 0; nPart < 4; ++nPart)
+        {
+            yuv_to_bgr4_sse41(_mm_cvtepu8_epi32(nY), _mm_cvtepu8_epi32(nU), _mm_cvtepu8_epi32(nV),
+                nB[nPart], nG[nPart], nR[nPart]);
+            nY = _mm_srli_si128(nY, 4);
+            nU = _mm_srli_si128(nU, 4);
+            nV = _mm_srli_si128(nV, 4);
+        }
+        // saturating packs clamp to 0..255 like clamp_u8
+        store_bgr_sse41(
+            _mm_packus_epi16(_mm_packs_epi32(nB[0], nB[1]), _mm_packs_epi32(nB[2], nB[3])),
+            _mm_packus_epi16(_mm_packs_epi32(nG[0], nG[1]), _mm_packs_epi32(nG[2], nG[3])),
+            _mm_packus_epi16(_mm_packs_epi32(nR[0], nR[1]), _mm_packs_epi32(nR[2], nR[3])),
+            pBgr + 3 * x);
+    }
+    yuv_to_bgr_c(pY + x, pU + x, pV + x, pBgr + 3 * x, nWidth - x);
+}
+
+// 8 pixels in 32 bit lanes
+FFH_TARGET_AVX2 static inline void yuv_to_bgr8_avx2(__m256i nY, __m256i nU, __m256i nV,
+    __m256i& nB, __m256i& nG, __m256i& nR)
+{
+    nY = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(nY, _mm256_set1_epi32(16)),
+        _mm256_set1_epi32(kCoefY)), _mm256_set1_epi32(kCoefRound));
+    nU = _mm256_sub_epi32(nU, _mm256_set1_epi32(128));
+    nV = _mm256_sub_epi32(nV, _mm256_set1_epi32(128));
+    nB = _mm256_srai_epi32(_mm256_add_epi32(nY, _mm256_mullo_epi32(nU, _mm256_set1_epi32(kCoefBU))), kCoefShift);
+    nG = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_sub_epi32(nY, _mm256_mullo_epi32(nU, _mm256_set1_epi32(kCoefGU))),
+        _mm256_mullo_epi32(nV, _mm256_set1_epi32(kCoefGV))), kCoefShift);
+    nR = _mm256_srai_epi32(_mm256_add_epi32(nY, _mm256_mullo_epi32(nV, _mm256_set1_epi32(kCoefRV))), kCoefShift);
+}
+
+// two 8 lane results to 16 bytes in pixel order
+FFH_TARGET_AVX2 static inline __m128i pack_u8_avx2(__m256i nLo, __m256i nHi)
+{
+    // packs works per 128 bit lane, put the quarters back in order
+    __m256i nPacked = _mm256_permute4x64_epi64(_mm256_packs_epi32(nLo, nHi), 0xD8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(nPacked), _mm256_extracti128_si256(nPacked, 1));
+}
+
+FFH_TARGET_AVX2 static void yuv_to_bgr_avx2(const uint8_t* pY, const uint8_t* pU, const uint8_t* pV,
+    uint8_t* pBgr, int nWidth)
+{
+    int x = 0;
+    for (; x + 16 <= nWidth; x += 16)
+    {
+        __m256i nB[2], nG[2], nR[2];
+        for (int nPart = 0; nPart < 2; ++nPart)
+        {
+            int nOffset = x + 8 * nPart;
+            yuv_to_bgr8_avx2(
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pY + nOffset))),
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pU + nOffset))),
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pV + nOffset))),
+                nB[nPart], nG[nPart], nR[nPart]);
+        }
+        store_bgr_sse41(pack_u8_avx2(nB[0], nB[1]), pack_u8_avx2(nG[0], nG[1]),
+            pack_u8_avx2(nR[0], nR[1]), pBgr + 3 * x);
+    }
+    yuv_to_bgr_c(pY + x, pU + x, pV + x, pBgr + 3 * x, nWidth - x);
+}
+
+static void get_cpuid(int nInfo[4], int nLeaf)
+{
+#ifdef _MSC_VER
+    __cpuidex(nInfo, nLeaf, 0);
+#else
+    unsigned int nA = 0, nB = 0, nC = 0, nD = 0;
+    __cpuid_count(nLeaf, 0, nA, nB, nC, nD);
+    nInfo[0] = (int)nA;
+    nInfo[1] = (int)nB;
+    nInfo[2] = (int)nC;
+    nInfo[3] = (int)nD;
+#endif
+}
+
+static uint64_t get_xcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int nLow = 0, nHigh = 0;
+    __asm__("xgetbv" : "=a"(nLow), "=d"(nHigh) : "c"(0));
+    return ((uint64_t)nHigh << 32) | nLow;
+#endif
+}
+
+static KernelIsa detect_isa()
+{
+    int nInfo[4] = { 0 };
+    get_cpuid(nInfo, 0);
+    int nMaxLeaf = nInfo[0];
+    get_cpuid(nInfo, 1);
+    bool bSse41 = (nInfo[2] & (1 << 19)) && (nInfo[2] & (1 << 9));     // SSE4.1 and SSSE3
+    // AVX2 also needs the OS to save the ymm registers
+    bool bAvx = (nInfo[2] & (1 << 27)) && (nInfo[2] & (1 << 28)) && 6 == (get_xcr0() & 6);
+    bool bAvx2 = false;
+    if (bAvx && nMaxLeaf >= 7) {
+        get_cpuid(nInfo, 7);
+        bAvx2 = (nInfo[1] & (1 << 5)) != 0;
+    }
+    return bAvx2 && bSse41 ? kIsaAvx2 : (bSse41 ? kIsaSse41 : kIsaScalar);
+}
+#else
+static KernelIsa detect_isa()
+{
+    return kIsaScalar;
+}
+#endif
+
+static const RowKernels& get_kernels(KernelIsa nIsa)
+{
+    static const RowKernels kScalar = { box2_c, box4_c, split_uv_c, double_c, yuv_to_bgr_c };
+#ifdef FFH_KERNELS_X86
+    // box filters and shuffles are bound by memory, only the color math has an AVX2 version
+    static const RowKernels kSse41 = { box2_sse41, box4_sse41, split_uv_sse41, double_sse41, yuv_to_bgr_sse41 };
+    static const RowKernels kAvx2 = { box2_sse41, box4_sse41, split_uv_sse41, double_sse41, yuv_to_bgr_avx2 };
+    if (kIsaAvx2 == nIsa)
+        return kAvx2;
+    if (kIsaSse41 == nIsa)
+        return kSse41;
+#endif
+    return kScalar;
+}
+
+KernelIsa ColorKernels::GetBestIsa()
+{
+    static const KernelIsa nBest = detect_isa();
+    return nBest;
+}
+
+const char* ColorKernels::GetIsaName(KernelIsa nIsa)
+{
+    switch (nIsa)
+    {
+    case kIsaScalar:
+        return "scalar";
+    case kIsaSse41:
+        return "sse4.1";
+    case kIsaAvx2:
+        return "avx2";
+    default:
+        return GetIsaName(GetBestIsa());
+    }
+}
+
+int ColorKernels::GetScaleShift(const AVFrame* pFrame, AVPixelFormat nDstFmt, int nDstWidth, int nDstHeight)
+{
+    if (nullptr == pFrame || pFrame->width <= 0 || pFrame->height <= 0)
+        return -1;
+    // YUVJ420P is full range, left to swscale
+    if (AV_PIX_FMT_NV12 != pFrame->format && AV_PIX_FMT_YUV420P != pFrame->format)
+        return -1;
+    if (AV_PIX_FMT_BGR24 != nDstFmt && AV_PIX_FMT_GRAY8 != nDstFmt)
+        return -1;
+    // the BGR math is BT.601 limited range, BT.709, BT.2020 or full range frames are left to swscale
+    if (AV_PIX_FMT_BGR24 == nDstFmt && (AVCOL_RANGE_JPEG == pFrame->color_range
+        || (AVCOL_SPC_UNSPECIFIED != pFrame->colorspace && AVCOL_SPC_BT470BG != pFrame->colorspace
+            && AVCOL_SPC_SMPTE170M != pFrame->colorspace)))
+        return -1;
+    for (int nShift = 0; nShift <= 2; ++nShift)
+    {
+        int nWidth = pFrame->width >> nShift;
+        int nHeight = pFrame->height >> nShift;
+        if (nWidth > 0 && nHeight > 0 && nWidth == nDstWidth && nHeight == nDstHeight)
+            return nShift;
+    }
+    return -1;
+}
+
+bool ColorKernels::Convert(const AVFrame* pFrame, AVPixelFormat nDstFmt, uint8_t* pDst, int nDstStride,
+    int nScaleShift, KernelIsa nIsa)
+{
+    if (nScaleShift < 0 || nScaleShift > 2 || nullptr == pDst
+        || GetScaleShift(pFrame, nDstFmt, pFrame->width >> nScaleShift, pFrame->height >> nScaleShift) != nScaleShift)
+        return false;
+    if (kIsaBest == nIsa || nIsa > GetBestIsa())
+        nIsa = GetBestIsa();
+    const RowKernels& kernels = get_kernels(nIsa);
+    bool bNv12 = AV_PIX_FMT_NV12 == pFrame->format;
+    bool bGray = AV_PIX_FMT_GRAY8 == nDstFmt;
+    int nWidth = pFrame->width >> nScaleShift;
+    int nHeight = pFrame->height >> nScaleShift;
+    int nChromaWidth = (pFrame->width + 1) / 2;
+    const uint8_t* const* pData = pFrame->data;
+    const int* pLinesize = pFrame->linesize;
+
+    // row buffers: Y, U, V and the split chroma of two source rows, kept by the thread
+    thread_local std::vector<uint8_t> vecBuffer;
+    size_t nRowSize = (size_t)nChromaWidth * 2 + 64;
+    if (vecBuffer.size() < nRowSize * 7)
+        vecBuffer.resize(nRowSize * 7);
+    uint8_t* pBufY = vecBuffer.data();
+    uint8_t* pBufU = pBufY + nRowSize;
+    uint8_t* pBufV = pBufU + nRowSize;
+    uint8_t* pSplit[4] = { pBufV + nRowSize, pBufV + 2 * nRowSize, pBufV + 3 * nRowSize, pBufV + 4 * nRowSize };
+    int nLastChromaRow = -1;
+
+    for (int nRow = 0; nRow < nHeight; ++nRow)
+    {
+        uint8_t* pOut = pDst + (size_t)nRow * nDstStride;
+        // luma, box averaged over the source rows of this output row
+        uint8_t* pLuma = bGray ? pOut : pBufY;
+        const uint8_t* pY = pData[0] + (size_t)(nRow << nScaleShift) * pLinesize[0];
+        if (0 == nScaleShift) {
+            if (bGray)
+                memcpy(pOut, pY, nWidth);
+            pLuma = (uint8_t*)pY;
+        }
+        else if (1 == nScaleShift)
+            kernels.fnBox2(pY, pY + pLinesize[0], pLuma, nWidth);
+        else {
+            const uint8_t* pRows[4] = { pY, pY + pLinesize[0], pY + 2 * pLinesize[0], pY + 3 * pLinesize[0] };
+            kernels.fnBox4(pRows, pLuma, nWidth);
+        }
+        if (bGray)
+            continue;
+
+        // one U and one V sample per output pixel
+        const uint8_t* pU = pBufU;
+        const uint8_t* pV = pBufV;
+        if (0 == nScaleShift) {
+            // a chroma row serves two output rows
+            int nChromaRow = nRow >> 1;
+            if (nChromaRow != nLastChromaRow) {
+                nLastChromaRow = nChromaRow;
+                const uint8_t* pSrcU = pData[1] + (size_t)nChromaRow * pLinesize[1];
+                const uint8_t* pSrcV = bNv12 ? nullptr : pData[2] + (size_t)nChromaRow * pLinesize[2];
+                if (bNv12) {
+                    kernels.fnSplitUv(pSrcU, pSplit[0], pSplit[1], nChromaWidth);
+                    pSrcU = pSplit[0];
+                    pSrcV = pSplit[1];
+                }
+                kernels.fnDouble(pSrcU, pBufU, nWidth);
+                kernels.fnDouble(pSrcV, pBufV, nWidth);
+            }
+        }
+        else if (1 == nScaleShift) {
+            if (bNv12)
+                kernels.fnSplitUv(pData[1] + (size_t)nRow * pLinesize[1], pBufU, pBufV, nWidth);
+            else {
+                pU = pData[1] + (size_t)nRow * pLinesize[1];
+                pV = pData[2] + (size_t)nRow * pLinesize[2];
+            }
+        }
+        else {
+            const uint8_t* pSrcU = pData[1] + (size_t)(2 * nRow) * pLinesize[1];
+            if (bNv12) {
+                kernels.fnSplitUv(pSrcU, pSplit[0], pSplit[1], 2 * nWidth);
+                kernels.fnSplitUv(pSrcU + pLinesize[1], pSplit[2], pSplit[3], 2 * nWidth);
+                kernels.fnBox2(pSplit[0], pSplit[2], pBufU, nWidth);
+                kernels.fnBox2(pSplit[1], pSplit[3], pBufV, nWidth);
+            }
+            else {
+                const uint8_t* pSrcV = pData[2] + (size_t)(2 * nRow) * pLinesize[2];
+                kernels.fnBox2(pSrcU, pSrcU + pLinesize[1], pBufU, nWidth);
+                kernels.fnBox2(pSrcV, pSrcV + pLinesize[2], pBufV, nWidth);
+            }
+        }
+        kernels.fnYuvToBgr(pLuma, pU, pV, pOut, nWidth);
+    }
+    return true;
+}
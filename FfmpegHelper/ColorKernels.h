@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// instruction set of the conversion kernels
+enum KernelIsa
+{
+    kIsaScalar,
+    kIsaSse41,
+    kIsaAvx2,
+    kIsaBest,               // the best one this CPU runs, picked once
+};
+
+// Hand vectorized NV12/YUV420P (BT.601, limited range) to BGR24 or GRAY8 at
+// full, half or quarter size. Each output row is built from the source rows it
+// covers while they are in cache: luma is box averaged, chroma is repeated at
+// full size, taken as is at half size and box averaged at quarter size. Every
+// instruction set gives the same bytes as the scalar code.
+class ColorKernels
+{
+public:
+    static KernelIsa GetBestIsa();
+    static const char* GetIsaName(KernelIsa nIsa);
+    // size shift (0, 1 or 2) when the kernels can do this conversion, else -1;
+    // BGR24 only from BT.601 (or unspecified) limited range frames
+    static int GetScaleShift(const AVFrame* pFrame, AVPixelFormat nDstFmt, int nDstWidth, int nDstHeight);
+    // convert into a packed image of (width >> nScaleShift) x (height >> nScaleShift), any thread
+    static bool Convert(const AVFrame* pFrame, AVPixelFormat nDstFmt, uint8_t* pDst, int nDstStride,
+        int nScaleShift, KernelIsa nIsa = kIsaBest);
+};
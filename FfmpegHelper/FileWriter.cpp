@@ -0,0 +1,351 @@
+#include "FileWriter.h"
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <stdlib.h>
+#endif
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+}
+
+static const int kIoBufferSize = 64 * 1024;     // AVIOContext buffer in front of ours
+
+static std::atomic<uint64_t> g_nFiles(0);
+static std::atomic<uint64_t> g_nWriteBytes(0);
+static std::atomic<uint64_t> g_nWrites(0);
+static std::atomic<uint64_t> g_nReads(0);
+static std::atomic<uint64_t> g_nSyncs(0);
+
+static uint8_t* alloc_aligned(size_t nSize)
+{
+#ifdef _WIN32
+    return (uint8_t*)_aligned_malloc(nSize, FileWriter::kBlockSize);
+#else
+    void* pData = nullptr;
+    return 0 == posix_memalign(&pData, FileWriter::kBlockSize, nSize) ? (uint8_t*)pData : nullptr;
+#endif
+}
+
+static void free_aligned(uint8_t* pData)
+{
+#ifdef _WIN32
+    _aligned_free(pData);
+#else
+    free(pData);
+#endif
+}
+
+static int64_t align_down(int64_t nValue)
+{
+    return nValue & ~(int64_t)(FileWriter::kBlockSize - 1);
+}
+
+static int64_t align_up(int64_t nValue)
+{
+    return align_down(nValue + FileWriter::kBlockSize - 1);
+}
+
+AVIOContext* FileWriter::Open(const std::string& strPath, const FileWriterConfig& config)
+{
+    FileWriter* pWriter = new FileWriter();
+    uint8_t* pIoBuffer = (uint8_t*)av_malloc(kIoBufferSize);
+    AVIOContext* pIo = nullptr;
+    if (pIoBuffer && pWriter->open(strPath, config))
+        pIo = avio_alloc_context(pIoBuffer, kIoBufferSize, 1, pWriter, nullptr, &FileWriter::write_packet, &FileWriter::seek);
+    if (nullptr == pIo) {
+        av_free(pIoBuffer);
+        pWriter->close();
+        delete pWriter;
+        return nullptr;
+    }
+    ++g_nFiles;
+    return pIo;
+}
+
+bool FileWriter::IsWriterIo(const AVIOContext* pIo)
+{
+    return pIo && pIo->write_packet == &FileWriter::write_packet;
+}
+
+bool FileWriter::Flush(AVIOContext* pIo)
+{
+    if (!IsWriterIo(pIo))
+        return false;
+    avio_flush(pIo);
+    FileWriter* pWriter = (FileWriter*)pIo->opaque;
+    return !pWriter->m_bFailed && pWriter->write_out();
+}
+
+bool FileWriter::Close(AVIOContext*& pIo)
+{
+    if (!IsWriterIo(pIo))
+        return false;
+    avio_flush(pIo);
+    FileWriter* pWriter = (FileWriter*)pIo->opaque;
+    bool bResult = pIo->error >= 0 && pWriter->close();
+    delete pWriter;
+    av_freep(&pIo->buffer);
+    avio_context_free(&pIo);
+    return bResult;
+}
+
+FileWriterStats FileWriter::GetStats()
+{
+    FileWriterStats stats;
+    stats.nFiles = g_nFiles.load();
+    stats.nWriteBytes = g_nWriteBytes.load();
+    stats.nWrites = g_nWrites.load();
+    stats.nReads = g_nReads.load();
+    stats.nSyncs = g_nSyncs.load();
+    return stats;
+}
+
+FileWriter::FileWriter()
+    : m_nFd(-1)
+    , m_bDirect(false)
+    , m_pBuffer(nullptr)
+    , m_nCapacity(0)
+    , m_nBufferPos(0)
+    , m_nBufferLen(0)
+    , m_nWritten(0)
+    , m_nPos(0)
+    , m_bFailed(false)
+{
+}
+
+FileWriter::~FileWriter()
+{
+    free_aligned(m_pBuffer);
+}
+
+bool FileWriter::open(const std::string& strPath, const FileWriterConfig& config)
+{
+    m_nCapacity = (size_t)std::max<int64_t>(align_up(config.nBufferSize), kBlockSize);
+    m_pBuffer = alloc_aligned(m_nCapacity);
+    if (nullptr == m_pBuffer)
+        return false;
+#ifdef _WIN32
+    m_nFd = _open(strPath.c_str(), _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int nFlags = O_RDWR | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (config.bDirectIo) {
+        m_nFd = ::open(strPath.c_str(), nFlags | O_DIRECT, 0644);
+        m_bDirect = m_nFd >= 0;
+    }
+#endif
+    if (m_nFd < 0)
+        m_nFd = ::open(strPath.c_str(), nFlags, 0644);
+#ifdef __linux__
+    // reserve extents up front so a long recording stays contiguous, the size is not changed
+    if (m_nFd >= 0 && config.nPreallocateBytes > 0)
+        fallocate(m_nFd, FALLOC_FL_KEEP_SIZE, 0, config.nPreallocateBytes);
+#endif
+#endif
+    if (m_nFd < 0) {
+        printf("Can't create %s, errno %d\n", strPath.c_str(), errno);
+        return false;
+    }
+    return true;
+}
+
+bool FileWriter::close()
+{
+    if (m_nFd < 0)
+        return false;
+    bool bResult = !m_bFailed && write_out();
+    int64_t nSize = m_nBufferPos + (int64_t)m_nBufferLen;
+#ifdef _WIN32
+    // padding of the last block
+    bResult = bResult && 0 == _chsize_s(m_nFd, nSize);
+    bResult = bResult && 0 == _commit(m_nFd);
+    _close(m_nFd);
+#else
+    // padding of the last block and the preallocated rest
+    bResult = bResult && 0 == ftruncate(m_nFd, (off_t)nSize);
+#ifdef __linux__
+    bResult = bResult && 0 == fdatasync(m_nFd);
+#else
+    bResult = bResult && 0 == fsync(m_nFd);
+#endif
+    ::close(m_nFd);
+#endif
+    ++g_nSyncs;
+    m_nFd = -1;
+    return bResult;
+}
+
+int FileWriter::write_packet(void* pOpaque, uint8_t* pData, int nSize)
+{
+    FileWriter* pWriter = (FileWriter*)pOpaque;
+    if (pWriter->m_bFailed || !pWriter->write(pData, (size_t)nSize)) {
+        pWriter->m_bFailed = true;
+        return AVERROR(EIO);
+    }
+    return nSize;
+}
+
+int64_t FileWriter::seek(void* pOpaque, int64_t nOffset, int nWhence)
+{
+    FileWriter* pWriter = (FileWriter*)pOpaque;
+    int64_t nSize = pWriter->m_nBufferPos + (int64_t)pWriter->m_nBufferLen;
+    switch (nWhence & ~AVSEEK_FORCE)
+    {
+    case AVSEEK_SIZE:
+        return nSize;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        nOffset += pWriter->m_nPos;
+        break;
+    case SEEK_END:
+        nOffset += nSize;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (nOffset < 0)
+        return AVERROR(EINVAL);
+    pWriter->m_nPos = nOffset;
+    return nOffset;
+}
+
+bool FileWriter::write(const uint8_t* pData, size_t nSize)
+{
+    if (m_nPos < m_nBufferPos) {
+        size_t nBehind = (size_t)std::min<int64_t>(m_nBufferPos - m_nPos, (int64_t)nSize);
+        if (!patch(m_nPos, pData, nBehind))
+            return false;
+        m_nPos += nBehind;
+        pData += nBehind;
+        nSize -= nBehind;
+    }
+    // past the end of the file: zeros up to the position, as a plain file would read
+    static const uint8_t kZero[256] = { 0 };
+    while (m_nPos > m_nBufferPos + (int64_t)m_nBufferLen)
+    {
+        int64_t nGap = m_nPos - (m_nBufferPos + (int64_t)m_nBufferLen);
+        int64_t nPos = m_nPos;
+        m_nPos -= nGap;
+        if (!write(kZero, (size_t)std::min<int64_t>(nGap, sizeof(kZero))))
+            return false;
+        m_nPos = nPos;
+    }
+    while (nSize > 0)
+    {
+        if (m_nPos == m_nBufferPos + (int64_t)m_nCapacity) {
+            // full, the buffer moves on to the next range of the file
+            if (!write_out())
+                return false;
+            m_nBufferPos += m_nCapacity;
+            m_nBufferLen = 0;
+            m_nWritten = 0;
+        }
+        size_t nOffset = (size_t)(m_nPos - m_nBufferPos);
+        size_t nCopy = std::min(nSize, m_nCapacity - nOffset);
+        memcpy(m_pBuffer + nOffset, pData, nCopy);
+        // blocks rewritten after a Flush go out again
+        m_nWritten = std::min(m_nWritten, (size_t)align_down(nOffset));
+        m_nBufferLen = std::max(m_nBufferLen, nOffset + nCopy);
+        m_nPos += nCopy;
+        pData += nCopy;
+        nSize -= nCopy;
+    }
+    return true;
+}
+
+bool FileWriter::patch(int64_t nPos, const uint8_t* pData, size_t nSize)
+{
+    // everything before the buffer was written in whole blocks, read them back
+    int64_t nStart = align_down(nPos);
+    size_t nLen = (size_t)(align_up(nPos + (int64_t)nSize) - nStart);
+    uint8_t* pBlock = alloc_aligned(nLen);
+    bool bResult = pBlock && read_at(nStart, pBlock, nLen);
+    if (bResult) {
+        memcpy(pBlock + (nPos - nStart), pData, nSize);
+        bResult = write_at(nStart, pBlock, nLen);
+    }
+    free_aligned(pBlock);
+    return bResult;
+}
+
+bool FileWriter::write_out()
+{
+    size_t nEnd = (size_t)align_up((int64_t)m_nBufferLen);
+    if (nEnd <= m_nWritten)
+        return true;
+    // the last block goes out padded, close trims the file to its size
+    memset(m_pBuffer + m_nBufferLen, 0, nEnd - m_nBufferLen);
+    if (!write_at(m_nBufferPos + (int64_t)m_nWritten, m_pBuffer + m_nWritten, nEnd - m_nWritten))
+        return false;
+    m_nWritten = (size_t)align_down((int64_t)m_nBufferLen);
+    return true;
+}
+
+bool FileWriter::write_at(int64_t nOffset, const uint8_t* pData, size_t nSize)
+{
+    while (nSize > 0)
+    {
+#ifdef _WIN32
+        int nResult = -1;
+        if (_lseeki64(m_nFd, nOffset, SEEK_SET) == nOffset)
+            nResult = _write(m_nFd, pData, (unsigned int)std::min<size_t>(nSize, 1 << 30));
+#else
+        ssize_t nResult = pwrite(m_nFd, pData, nSize, (off_t)nOffset);
+#ifdef O_DIRECT
+        if (nResult < 0 && EINVAL == errno && m_bDirect) {
+            // the file system takes no direct I/O, go on buffered
+            fcntl(m_nFd, F_SETFL, fcntl(m_nFd, F_GETFL) & ~O_DIRECT);
+            m_bDirect = false;
+            continue;
+        }
+#endif
+#endif
+        if (nResult <= 0) {
+            printf("File write failed, errno %d\n", errno);
+            return false;
+        }
+        ++g_nWrites;
+        g_nWriteBytes += (uint64_t)nResult;
+        nOffset += nResult;
+        pData += nResult;
+        nSize -= (size_t)nResult;
+    }
+    return true;
+}
+
+bool FileWriter::read_at(int64_t nOffset, uint8_t* pData, size_t nSize)
+{
+    ++g_nReads;
+    while (nSize > 0)
+    {
+#ifdef _WIN32
+        int nResult = -1;
+        if (_lseeki64(m_nFd, nOffset, SEEK_SET) == nOffset)
+            nResult = _read(m_nFd, pData, (unsigned int)std::min<size_t>(nSize, 1 << 30));
+#else
+        ssize_t nResult = pread(m_nFd, pData, nSize, (off_t)nOffset);
+#endif
+        if (nResult < 0) {
+            printf("File read failed, errno %d\n", errno);
+            return false;
+        }
+        if (0 == nResult)
+            break;
+        nOffset += nResult;
+        pData += nResult;
+        nSize -= (size_t)nResult;
+    }
+    memset(pData, 0, nSize);
+    return true;
+}
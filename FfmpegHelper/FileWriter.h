@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// how recordings and clips are written
+struct FileWriterConfig
+{
+    const static int kDefaultBufferSize = 4 * 1024 * 1024;
+
+    int nBufferSize = 0;                // per file, rounded to blocks; 0: plain avio_open, e.g. kDefaultBufferSize
+    bool bDirectIo = false;             // O_DIRECT on Linux, buffered where the file system refuses it
+    int64_t nPreallocateBytes = 0;      // fallocate at open (Linux), the unused end is trimmed at close
+};
+
+// process wide, since start
+struct FileWriterStats
+{
+    uint64_t nFiles = 0;
+    uint64_t nWriteBytes = 0;       // padding of the last block included
+    uint64_t nWrites = 0;           // write calls that reached the file system
+    uint64_t nReads = 0;            // blocks read back to patch data behind the buffer
+    uint64_t nSyncs = 0;
+};
+
+// AVIOContext backend for recorded files. The muxer output is gathered in a
+// large block aligned buffer per file and written in whole blocks, so many
+// recorders on one disk issue a few large sequential writes instead of many
+// small ones. The buffer always holds the end of the file; writes behind it
+// (mdat size, moov offsets) read the blocks back and patch them. Data reaches
+// the disk when the buffer is full, on Flush and on Close, which trims the
+// padding and calls fdatasync once per segment.
+class FileWriter
+{
+public:
+    const static int kBlockSize = 4096;     // alignment of O_DIRECT offsets, sizes and memory
+
+    // nullptr if the file can't be created
+    static AVIOContext* Open(const std::string& strPath, const FileWriterConfig& config);
+    // true if pIo came from Open
+    static bool IsWriterIo(const AVIOContext* pIo);
+    // write out what is buffered, for readers of a growing file, no sync
+    static bool Flush(AVIOContext* pIo);
+    // flush, trim, fdatasync and close the file, frees pIo and sets it to nullptr
+    static bool Close(AVIOContext*& pIo);
+    static FileWriterStats GetStats();
+
+private:
+    FileWriter();
+    ~FileWriter();
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+    bool open(const std::string& strPath, const FileWriterConfig& config);
+    bool close();
+    static int write_packet(void* pOpaque, uint8_t* pData, int nSize);
+    static int64_t seek(void* pOpaque, int64_t nOffset, int nWhence);
+    bool write(const uint8_t* pData, size_t nSize);
+    // the part of a write that falls before the buffer, on disk already
+    bool patch(int64_t nPos, const uint8_t* pData, size_t nSize);
+    bool write_out();
+    bool write_at(int64_t nOffset, const uint8_t* pData, size_t nSize);
+    bool read_at(int64_t nOffset, uint8_t* pData, size_t nSize);
+
+private:
+    int m_nFd;
+    bool m_bDirect;
+    uint8_t* m_pBuffer;             // block aligned
+    size_t m_nCapacity;
+    int64_t m_nBufferPos;           // file offset of the buffer, block aligned
+    size_t m_nBufferLen;            // the buffer ends where the file ends
+    size_t m_nWritten;              // blocks of the buffer already on disk unchanged
+    int64_t m_nPos;                 // where the next write_packet goes
+    bool m_bFailed;
+};
@@ -0,0 +1,124 @@
+#include "FrameConverter.h"
+#include "ColorKernels.h"
+#include <cstdio>
+#include <tuple>
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+bool ConvertKey::operator<(const ConvertKey& other) const
+{
+    return std::tie(nSrcWidth, nSrcHeight, nSrcFmt, nDstWidth, nDstHeight, nDstFmt, nFlags, nColorspace, bFullRange)
+        < std::tie(other.nSrcWidth, other.nSrcHeight, other.nSrcFmt,
+            other.nDstWidth, other.nDstHeight, other.nDstFmt, other.nFlags, other.nColorspace, other.bFullRange);
+}
+
+FrameConverter::ContextSlot::~ContextSlot()
+{
+    if (pSwsCtx != nullptr) {
+        sws_freeContext(pSwsCtx);
+        pSwsCtx = nullptr;
+    }
+}
+
+FrameConverter::FrameConverter(size_t nMaxContext)
+    : m_nMaxContext(nMaxContext > 0 ? nMaxContext : 1)
+    , m_bUseKernels(false)
+    , m_nUseClock(0)
+{
+}
+
+FrameConverter::~FrameConverter()
+{
+    Clear();
+}
+
+bool FrameConverter::Convert(const AVFrame* pFrame, AVPixelFormat nDstFmt,
+    uint8_t* const pDstData[], const int nDstLinesize[],
+    int nDstWidth, int nDstHeight, int nFlags)
+{
+    if (nullptr == pFrame || pFrame->width <= 0 || pFrame->height <= 0)
+        return false;
+    ConvertKey key;
+    key.nSrcWidth = pFrame->width;
+    key.nSrcHeight = pFrame->height;
+    key.nSrcFmt = (AVPixelFormat)pFrame->format;
+    key.nDstWidth = nDstWidth > 0 ? nDstWidth : pFrame->width;
+    key.nDstHeight = nDstHeight > 0 ? nDstHeight : pFrame->height;
+    key.nDstFmt = nDstFmt;
+    key.nFlags = nFlags;
+    const AVPixFmtDescriptor* pDesc = av_pix_fmt_desc_get(key.nSrcFmt);
+    if (pDesc && !(pDesc->flags & AV_PIX_FMT_FLAG_RGB)) {
+        key.nColorspace = pFrame->colorspace;
+        key.bFullRange = AVCOL_RANGE_JPEG == pFrame->color_range;
+    }
+    if (m_bUseKernels && 0 == (nFlags & (SWS_ACCURATE_RND | SWS_BITEXACT))) {
+        // no context and no lock, the kernels are stateless
+        int nScaleShift = ColorKernels::GetScaleShift(pFrame, nDstFmt, key.nDstWidth, key.nDstHeight);
+        if (nScaleShift >= 0)
+            return ColorKernels::Convert(pFrame, nDstFmt, pDstData[0], nDstLinesize[0], nScaleShift);
+    }
+    // hold the slot, it stays valid even if it is evicted meanwhile
+    std::shared_ptr<ContextSlot> pSlot = get_slot(key);
+    if (!pSlot)
+        return false;
+    std::lock_guard<std::mutex> lock(pSlot->mtUse);
+    int nHeight = sws_scale(pSlot->pSwsCtx, pFrame->data, pFrame->linesize, 0, pFrame->height,
+        pDstData, nDstLinesize);
+    return nHeight > 0;
+}
+
+void FrameConverter::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mtSlots);
+    m_mapSlots.clear();
+}
+
+size_t FrameConverter::GetContextCount()
+{
+    std::lock_guard<std::mutex> lock(m_mtSlots);
+    return m_mapSlots.size();
+}
+
+std::shared_ptr<FrameConverter::ContextSlot> FrameConverter::get_slot(const ConvertKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mtSlots);
+    auto it = m_mapSlots.find(key);
+    if (it != m_mapSlots.end()) {
+        it->second->nLastUse = ++m_nUseClock;
+        return it->second;
+    }
+    // resolution or format changed, evict the least recently used context
+    if (m_mapSlots.size() >= m_nMaxContext) {
+        auto itOldest = m_mapSlots.begin();
+        for (auto itSlot = m_mapSlots.begin(); itSlot != m_mapSlots.end(); ++itSlot)
+        {
+            if (itSlot->second->nLastUse < itOldest->second->nLastUse)
+                itOldest = itSlot;
+        }
+        m_mapSlots.erase(itOldest);
+    }
+    auto pSlot = std::make_shared<ContextSlot>();
+    pSlot->pSwsCtx = sws_getCachedContext(nullptr, key.nSrcWidth, key.nSrcHeight, key.nSrcFmt,
+        key.nDstWidth, key.nDstHeight, key.nDstFmt, key.nFlags, nullptr, nullptr, nullptr);
+    if (nullptr == pSlot->pSwsCtx) {
+        fprintf(stderr, "Can't create scale context %dx%d -> %dx%d\n",
+            key.nSrcWidth, key.nSrcHeight, key.nDstWidth, key.nDstHeight);
+        return nullptr;
+    }
+    // swscale assumes BT.601 and the range of the pixel format (full for YUVJ), the frame knows better
+    if (AVCOL_SPC_UNSPECIFIED != key.nColorspace || key.bFullRange) {
+        int* pInvTable = nullptr;
+        int* pTable = nullptr;
+        int nSrcRange = 0, nDstRange = 0, nBrightness = 0, nContrast = 0, nSaturation = 0;
+        if (sws_getColorspaceDetails(pSlot->pSwsCtx, &pInvTable, &nSrcRange, &pTable, &nDstRange,
+            &nBrightness, &nContrast, &nSaturation) >= 0) {
+            const int* pCoef = AVCOL_SPC_UNSPECIFIED != key.nColorspace ? sws_getCoefficients(key.nColorspace) : pInvTable;
+            sws_setColorspaceDetails(pSlot->pSwsCtx, pCoef, key.bFullRange ? 1 : nSrcRange, pTable, nDstRange,
+                nBrightness, nContrast, nSaturation);
+        }
+    }
+    pSlot->nLastUse = ++m_nUseClock;
+    m_mapSlots[key] = pSlot;
+    return pSlot;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+extern "C" {
+#include <libswscale/swscale.h>
+#include <libavutil/frame.h>
+}
+
+// key of a cached scale context
+struct ConvertKey
+{
+    int nSrcWidth = 0;
+    int nSrcHeight = 0;
+    AVPixelFormat nSrcFmt = AV_PIX_FMT_NONE;
+    int nDstWidth = 0;
+    int nDstHeight = 0;
+    AVPixelFormat nDstFmt = AV_PIX_FMT_NONE;
+    int nFlags = 0;
+    int nColorspace = AVCOL_SPC_UNSPECIFIED;   // of a YUV source, swscale takes it as BT.601
+    bool bFullRange = false;
+
+    bool operator<(const ConvertKey& other) const;
+};
+
+// Keeps SwsContext alive across frames, one per ConvertKey, so the scaler
+// filter tables are only built again when the resolution or format changes.
+// Convert may be called from several threads, calls with the same key are
+// serialized on the context of that key. A YUV source is converted with the
+// matrix and range of the frame. With SetUseKernels, NV12/YUV420P to
+// BGR24/GRAY8 at 1, 1/2 or 1/4 size skips swscale and runs ColorKernels,
+// unless accurate or bit exact rounding is asked for. They are not bit exact
+// with swscale (box and repeated chroma against bilinear).
+class FrameConverter
+{
+public:
+    explicit FrameConverter(size_t nMaxContext = 8);
+    ~FrameConverter();
+    FrameConverter(const FrameConverter&) = delete;
+    FrameConverter& operator=(const FrameConverter&) = delete;
+
+    // convert frame into the destination planes, nDstWidth/nDstHeight 0 means keep the source size
+    bool Convert(const AVFrame* pFrame, AVPixelFormat nDstFmt,
+        uint8_t* const pDstData[], const int nDstLinesize[],
+        int nDstWidth = 0, int nDstHeight = 0, int nFlags = SWS_FAST_BILINEAR);
+    // drop all cached contexts
+    void Clear();
+    // ColorKernels on or off (off by default), before converting
+    void SetUseKernels(bool bUseKernels) { m_bUseKernels = bUseKernels; }
+    size_t GetContextCount();
+
+private:
+    struct ContextSlot
+    {
+        SwsContext* pSwsCtx = nullptr;
+        uint64_t nLastUse = 0;
+        std::mutex mtUse;
+        ~ContextSlot();
+    };
+    std::shared_ptr<ContextSlot> get_slot(const ConvertKey& key);
+
+private:
+    size_t m_nMaxContext;
+    bool m_bUseKernels;
+    uint64_t m_nUseClock;
+    std::mutex m_mtSlots;
+    std::map<ConvertKey, std::shared_ptr<ContextSlot>> m_mapSlots;
+};
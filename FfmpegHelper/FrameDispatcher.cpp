@@ -0,0 +1,396 @@
+#include "FrameDispatcher.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <tuple>
+
+// one size and format, the images converted for it come back once no frame uses them
+struct SubscribedFrame::ImageTarget
+{
+    const static size_t kMaxImage = 8;
+
+    int nWidth = 0;
+    int nHeight = 0;
+    AVPixelFormat nPixFmt = AV_PIX_FMT_NONE;
+    int nType = CV_8UC3;
+    std::mutex mtImage;
+    std::vector<cv::Mat> vecImage;
+
+    cv::Mat Convert(const FrameHandle& frame, FrameConverter& converter);
+    cv::Mat get_image();
+};
+
+// the image of one target for one frame, shared by its subscribers
+struct SubscribedFrame::ConvertedImage
+{
+    std::shared_ptr<ImageTarget> pTarget;
+    std::shared_ptr<FrameConverter> pConverter;
+    std::mutex mtImage;
+    bool bDone = false;
+    cv::Mat image;
+};
+
+struct FrameDispatcher::Subscriber
+{
+    int nId = 0;
+    SubscriberInfo info;
+    FrameCallback fnCallback;
+    int64_t nNextMs = INT64_MIN;            // decode thread
+    std::mutex mtCallback;                  // held while the callback runs
+    std::atomic<bool> bClosed;
+
+    std::mutex mtQueue;
+    std::condition_variable cvQueue;
+    std::vector<SubscribedFrame> vecQueue;  // ring of info.nQueueSize
+    size_t nHead = 0;
+    size_t nCount = 0;
+    uint64_t nWake = 0;                     // bumped by Flush and Unsubscribe
+
+    std::atomic<uint64_t> nDelivered;
+    std::atomic<uint64_t> nSkipped;
+    std::atomic<uint64_t> nDropped;
+
+    Subscriber() : bClosed(false), nDelivered(0), nSkipped(0), nDropped(0) {}
+};
+
+// the dispatcher whose Dispatch runs on this thread. Dispatch is a drain task on
+// a shared pool, so a worker id says nothing about who runs a callback right now
+static thread_local const FrameDispatcher* t_pDispatching = nullptr;
+
+// sets t_pDispatching for the duration of one Dispatch
+struct DispatchScope
+{
+    const FrameDispatcher* pPrevious;
+    explicit DispatchScope(const FrameDispatcher* pDispatcher) : pPrevious(t_pDispatching) { t_pDispatching = pDispatcher; }
+    ~DispatchScope() { t_pDispatching = pPrevious; }
+};
+
+static int get_image_type(AVPixelFormat nPixFmt)
+{
+    switch (nPixFmt)
+    {
+    case AV_PIX_FMT_GRAY8:
+        return CV_8UC1;
+    case AV_PIX_FMT_BGR24:
+    case AV_PIX_FMT_RGB24:
+        return CV_8UC3;
+    case AV_PIX_FMT_BGRA:
+    case AV_PIX_FMT_RGBA:
+        return CV_8UC4;
+    default:
+        return -1;
+    }
+}
+
+cv::Mat SubscribedFrame::Image() const
+{
+    if (!m_pImage)
+        return cv::Mat();
+    std::lock_guard<std::mutex> lock(m_pImage->mtImage);
+    if (!m_pImage->bDone) {
+        m_pImage->bDone = true;
+        m_pImage->image = m_pImage->pTarget->Convert(m_frame, *m_pImage->pConverter);
+    }
+    return m_pImage->image;
+}
+
+cv::Mat SubscribedFrame::ImageTarget::Convert(const FrameHandle& frame, FrameConverter& converter)
+{
+    // the source size needs no scaling, share what the frame already has
+    if (nWidth == frame.GetWidth() && nHeight == frame.GetHeight()) {
+        if (AV_PIX_FMT_BGR24 == nPixFmt)
+            return frame.BgrView();
+        if (AV_PIX_FMT_GRAY8 == nPixFmt) {
+            cv::Mat matLuma = frame.Luma();
+            if (!matLuma.empty())
+                return matLuma;
+        }
+    }
+    cv::Mat image = get_image();
+    int cvLinesizes[1];
+    cvLinesizes[0] = (int)image.step;
+    if (!converter.Convert(frame.GetFrame(), nPixFmt, &image.data, cvLinesizes, nWidth, nHeight))
+        return cv::Mat();
+    return image;
+}
+
+cv::Mat SubscribedFrame::ImageTarget::get_image()
+{
+    std::lock_guard<std::mutex> lock(mtImage);
+    // only the pool still refers to it
+    for (cv::Mat& image : vecImage)
+    {
+        if (image.u && 1 == image.u->refcount)
+            return image;
+    }
+    cv::Mat image(nHeight, nWidth, nType);
+    if (vecImage.size() < kMaxImage)
+        vecImage.push_back(image);
+    return image;
+}
+
+bool FrameDispatcher::TargetKey::operator<(const TargetKey& other) const
+{
+    return std::tie(nWidth, nHeight, nPixFmt) < std::tie(other.nWidth, other.nHeight, other.nPixFmt);
+}
+
+bool FrameDispatcher::TargetKey::operator==(const TargetKey& other) const
+{
+    return nWidth == other.nWidth && nHeight == other.nHeight && nPixFmt == other.nPixFmt;
+}
+
+FrameDispatcher::FrameDispatcher(const std::shared_ptr<FrameConverter>& pConverter)
+    : m_pConverter(pConverter)
+    , m_nSubscriber(0)
+    , m_nNextId(0)
+{
+}
+
+FrameDispatcher::~FrameDispatcher()
+{
+    Flush();
+}
+
+int FrameDispatcher::Subscribe(const SubscriberInfo& info, FrameCallback fnCallback)
+{
+    if (AV_PIX_FMT_NONE != info.nPixFmt && get_image_type(info.nPixFmt) < 0) {
+        fprintf(stderr, "Can't subscribe to pixel format %d\n", (int)info.nPixFmt);
+        return 0;
+    }
+    auto pSubscriber = std::make_shared<Subscriber>();
+    pSubscriber->info = info;
+    pSubscriber->fnCallback = fnCallback;
+    if (!fnCallback)
+        pSubscriber->vecQueue.resize(info.nQueueSize > 0 ? info.nQueueSize : 1);
+    std::lock_guard<std::mutex> lock(m_mtSubscriber);
+    pSubscriber->nId = ++m_nNextId;
+    m_vecSubscriber.push_back(pSubscriber);
+    ++m_nSubscriber;
+    return pSubscriber->nId;
+}
+
+bool FrameDispatcher::Unsubscribe(int nId)
+{
+    std::shared_ptr<Subscriber> pSubscriber;
+    {
+        std::lock_guard<std::mutex> lock(m_mtSubscriber);
+        for (auto it = m_vecSubscriber.begin(); it != m_vecSubscriber.end(); ++it)
+        {
+            if ((*it)->nId == nId) {
+                pSubscriber = *it;
+                m_vecSubscriber.erase(it);
+                --m_nSubscriber;
+                break;
+            }
+        }
+    }
+    if (!pSubscriber)
+        return false;
+    pSubscriber->bClosed = true;
+    if (pSubscriber->fnCallback && t_pDispatching != this) {
+        // the callback in flight finishes before its owner goes away. From a
+        // callback of this dispatcher none other runs, and waiting would deadlock
+        std::lock_guard<std::mutex> lock(pSubscriber->mtCallback);
+    }
+    {
+        std::lock_guard<std::mutex> lock(pSubscriber->mtQueue);
+        for (auto& frame : pSubscriber->vecQueue)
+            frame = SubscribedFrame();
+        pSubscriber->nCount = 0;
+        ++pSubscriber->nWake;
+    }
+    pSubscriber->cvQueue.notify_all();
+    return true;
+}
+
+bool FrameDispatcher::Pop(int nId, SubscribedFrame& frame, int nTimeoutMs)
+{
+    std::shared_ptr<Subscriber> pSubscriber = find_subscriber(nId);
+    if (!pSubscriber || pSubscriber->fnCallback)
+        return false;
+    Subscriber& subscriber = *pSubscriber;
+    std::unique_lock<std::mutex> lock(subscriber.mtQueue);
+    if (0 == subscriber.nCount && 0 != nTimeoutMs) {
+        uint64_t nWake = subscriber.nWake;
+        auto ready = [&]() { return subscriber.nCount > 0 || subscriber.nWake != nWake; };
+        if (nTimeoutMs < 0)
+            subscriber.cvQueue.wait(lock, ready);
+        else
+            subscriber.cvQueue.wait_for(lock, std::chrono::milliseconds(nTimeoutMs), ready);
+    }
+    if (0 == subscriber.nCount)
+        return false;
+    frame = std::move(subscriber.vecQueue[subscriber.nHead]);
+    subscriber.vecQueue[subscriber.nHead] = SubscribedFrame();
+    subscriber.nHead = (subscriber.nHead + 1) % subscriber.vecQueue.size();
+    --subscriber.nCount;
+    return true;
+}
+
+void FrameDispatcher::Dispatch(const FrameHandle& frame, int64_t nPtsMs)
+{
+    if (frame.Empty() || !HasSubscriber())
+        return;
+    DispatchScope scope(this);
+    {
+        std::lock_guard<std::mutex> lock(m_mtSubscriber);
+        m_vecDispatch.assign(m_vecSubscriber.begin(), m_vecSubscriber.end());
+    }
+    for (auto& pSubscriber : m_vecDispatch)
+    {
+        // nothing is converted for a frame its subscribers skip
+        if (!want_frame(*pSubscriber, nPtsMs)) {
+            pSubscriber->nSkipped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        SubscribedFrame subscribed;
+        subscribed.m_frame = frame;
+        subscribed.m_nPtsMs = nPtsMs;
+        if (AV_PIX_FMT_NONE != pSubscriber->info.nPixFmt)
+            subscribed.m_pImage = get_image(resolve_target(pSubscriber->info, frame));
+        deliver(*pSubscriber, subscribed);
+    }
+    // the frame and its images go back to their pools once the subscribers are done
+    m_vecDispatch.clear();
+    m_vecImage.clear();
+}
+
+void FrameDispatcher::Flush()
+{
+    std::lock_guard<std::mutex> lock(m_mtSubscriber);
+    for (auto& pSubscriber : m_vecSubscriber)
+    {
+        {
+            std::lock_guard<std::mutex> lockQueue(pSubscriber->mtQueue);
+            for (auto& frame : pSubscriber->vecQueue)
+                frame = SubscribedFrame();
+            pSubscriber->nCount = 0;
+            ++pSubscriber->nWake;
+        }
+        pSubscriber->cvQueue.notify_all();
+        pSubscriber->nNextMs = INT64_MIN;
+    }
+}
+
+std::vector<SubscriberStats> FrameDispatcher::GetStats()
+{
+    std::vector<SubscriberStats> vecStats;
+    std::lock_guard<std::mutex> lock(m_mtSubscriber);
+    for (auto& pSubscriber : m_vecSubscriber)
+    {
+        SubscriberStats stats;
+        stats.nId = pSubscriber->nId;
+        stats.nDelivered = pSubscriber->nDelivered.load(std::memory_order_relaxed);
+        stats.nSkipped = pSubscriber->nSkipped.load(std::memory_order_relaxed);
+        stats.nDropped = pSubscriber->nDropped.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lockQueue(pSubscriber->mtQueue);
+            stats.nQueued = pSubscriber->nCount;
+        }
+        vecStats.push_back(stats);
+    }
+    return vecStats;
+}
+
+std::shared_ptr<FrameDispatcher::Subscriber> FrameDispatcher::find_subscriber(int nId)
+{
+    std::lock_guard<std::mutex> lock(m_mtSubscriber);
+    for (auto& pSubscriber : m_vecSubscriber)
+    {
+        if (pSubscriber->nId == nId)
+            return pSubscriber;
+    }
+    return nullptr;
+}
+
+bool FrameDispatcher::want_frame(Subscriber& subscriber, int64_t nPtsMs)
+{
+    if (subscriber.info.dMaxFps <= 0)
+        return true;
+    int64_t nIntervalMs = (int64_t)(1000 / subscriber.info.dMaxFps);
+    // first frame, or the timestamps went back (a looped file)
+    if (INT64_MIN == subscriber.nNextMs || nPtsMs + 2 * nIntervalMs < subscriber.nNextMs) {
+        subscriber.nNextMs = nPtsMs + nIntervalMs;
+        return true;
+    }
+    // a millisecond of slack for rounded timestamps
+    if (nPtsMs + 1 < subscriber.nNextMs)
+        return false;
+    // keep the average rate, but don't catch up after a gap
+    subscriber.nNextMs = nPtsMs - subscriber.nNextMs >= nIntervalMs
+        ? nPtsMs + nIntervalMs : subscriber.nNextMs + nIntervalMs;
+    return true;
+}
+
+FrameDispatcher::TargetKey FrameDispatcher::resolve_target(const SubscriberInfo& info, const FrameHandle& frame) const
+{
+    TargetKey key = { info.nWidth, info.nHeight, info.nPixFmt };
+    int nSrcWidth = frame.GetWidth();
+    int nSrcHeight = frame.GetHeight();
+    if (key.nWidth <= 0 && key.nHeight <= 0) {
+        key.nWidth = nSrcWidth;
+        key.nHeight = nSrcHeight;
+    }
+    // keep the aspect ratio, even sizes for the chroma planes
+    else if (key.nWidth <= 0)
+        key.nWidth = std::max(2, (int)((int64_t)nSrcWidth * key.nHeight / std::max(nSrcHeight, 1)) & ~1);
+    else if (key.nHeight <= 0)
+        key.nHeight = std::max(2, (int)((int64_t)nSrcHeight * key.nWidth / std::max(nSrcWidth, 1)) & ~1);
+    return key;
+}
+
+std::shared_ptr<FrameDispatcher::ConvertedImage> FrameDispatcher::get_image(const TargetKey& key)
+{
+    // subscribers of the same target share one conversion of this frame
+    for (auto& item : m_vecImage)
+    {
+        if (item.first == key)
+            return item.second;
+    }
+    auto itTarget = m_mapTarget.find(key);
+    if (itTarget == m_mapTarget.end()) {
+        if (m_mapTarget.size() >= kMaxTarget)
+            m_mapTarget.clear();
+        auto pTarget = std::make_shared<ImageTarget>();
+        pTarget->nWidth = key.nWidth;
+        pTarget->nHeight = key.nHeight;
+        pTarget->nPixFmt = key.nPixFmt;
+        pTarget->nType = get_image_type(key.nPixFmt);
+        itTarget = m_mapTarget.insert(std::make_pair(key, pTarget)).first;
+    }
+    auto pImage = std::make_shared<ConvertedImage>();
+    pImage->pTarget = itTarget->second;
+    pImage->pConverter = m_pConverter;
+    m_vecImage.push_back(std::make_pair(key, pImage));
+    return pImage;
+}
+
+void FrameDispatcher::deliver(Subscriber& subscriber, const SubscribedFrame& frame)
+{
+    if (subscriber.fnCallback) {
+        std::lock_guard<std::mutex> lock(subscriber.mtCallback);
+        if (subscriber.bClosed)
+            return;
+        subscriber.fnCallback(frame);
+        subscriber.nDelivered.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(subscriber.mtQueue);
+        if (subscriber.bClosed)
+            return;
+        size_t nCapacity = subscriber.vecQueue.size();
+        if (subscriber.nCount >= nCapacity) {
+            // a slow consumer gets the newest frames
+            subscriber.vecQueue[subscriber.nHead] = SubscribedFrame();
+            subscriber.nHead = (subscriber.nHead + 1) % nCapacity;
+            --subscriber.nCount;
+            subscriber.nDropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        subscriber.vecQueue[(subscriber.nHead + subscriber.nCount) % nCapacity] = frame;
+        ++subscriber.nCount;
+    }
+    subscriber.nDelivered.fetch_add(1, std::memory_order_relaxed);
+    subscriber.cvQueue.notify_one();
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <cstdint>
+#include "FrameHandle.h"
+#include "FrameConverter.h"
+
+// what a subscriber wants from the decoded video
+struct SubscriberInfo
+{
+    int nWidth = 0;                             // 0 and 0: source size, one of them 0 keeps the aspect ratio
+    int nHeight = 0;
+    AVPixelFormat nPixFmt = AV_PIX_FMT_BGR24;   // GRAY8, BGR24, RGB24, BGRA or RGBA; NONE: the decoded frame only
+    double dMaxFps = 0;                         // 0: every frame
+    size_t nQueueSize = 2;                      // frames queued for Pop, the oldest is dropped
+};
+
+struct SubscriberStats
+{
+    int nId = 0;
+    uint64_t nDelivered = 0;
+    uint64_t nSkipped = 0;          // over the frame rate, never converted
+    uint64_t nDropped = 0;          // queue full
+    size_t nQueued = 0;
+};
+
+// A frame as one subscriber gets it. Copies share the frame and the image.
+class SubscribedFrame
+{
+public:
+    const FrameHandle& GetFrame() const { return m_frame; }
+    // presentation time of the stream in milliseconds
+    int64_t GetPtsMs() const { return m_nPtsMs; }
+    bool Empty() const { return m_frame.Empty(); }
+    // The subscriber's size and format, converted on the first call and shared
+    // with every subscriber of the same target. Read only, valid while a copy
+    // of this frame is alive. Empty for AV_PIX_FMT_NONE.
+    cv::Mat Image() const;
+
+private:
+    friend class FrameDispatcher;
+    struct ImageTarget;
+    struct ConvertedImage;
+    FrameHandle m_frame;
+    std::shared_ptr<ConvertedImage> m_pImage;
+    int64_t m_nPtsMs = 0;
+};
+
+// Hands decoded frames to subscribers. Each subscriber declares a target size,
+// pixel format and frame rate and takes frames from a bounded queue or in a
+// callback on the decode thread. Frames over a subscriber's rate are skipped
+// before anything is converted, and every distinct target is converted once per
+// frame, lazily, by whichever subscriber looks at it first.
+class FrameDispatcher
+{
+    const static size_t kMaxTarget = 16;        // cached targets, a resolution change starts over
+
+public:
+    using FrameCallback = std::function<void(const SubscribedFrame& frame)>;
+
+    explicit FrameDispatcher(const std::shared_ptr<FrameConverter>& pConverter);
+    ~FrameDispatcher();
+    FrameDispatcher(const FrameDispatcher&) = delete;
+    FrameDispatcher& operator=(const FrameDispatcher&) = delete;
+
+    // return the subscriber id, 0 if the format can't be produced. With a callback
+    // nothing is queued, keep the callback short, it runs on the decode thread
+    int Subscribe(const SubscriberInfo& info, FrameCallback fnCallback = nullptr);
+    bool Unsubscribe(int nId);
+    bool HasSubscriber() const { return m_nSubscriber.load() > 0; }
+    int GetSubscriberCount() const { return m_nSubscriber.load(); }
+    // wait up to nTimeoutMs (-1 forever) for the next queued frame
+    bool Pop(int nId, SubscribedFrame& frame, int nTimeoutMs = 0);
+    // decode thread
+    void Dispatch(const FrameHandle& frame, int64_t nPtsMs);
+    // drop the queued frames and wake the waiting Pop, subscriptions stay.
+    // Only while nothing is dispatched
+    void Flush();
+    std::vector<SubscriberStats> GetStats();
+
+private:
+    struct Subscriber;
+    using ImageTarget = SubscribedFrame::ImageTarget;
+    using ConvertedImage = SubscribedFrame::ConvertedImage;
+    struct TargetKey
+    {
+        int nWidth;
+        int nHeight;
+        AVPixelFormat nPixFmt;
+        bool operator<(const TargetKey& other) const;
+        bool operator==(const TargetKey& other) const;
+    };
+    std::shared_ptr<Subscriber> find_subscriber(int nId);
+    // decode thread
+    bool want_frame(Subscriber& subscriber, int64_t nPtsMs);
+    TargetKey resolve_target(const SubscriberInfo& info, const FrameHandle& frame) const;
+    std::shared_ptr<ConvertedImage> get_image(const TargetKey& key);
+    void deliver(Subscriber& subscriber, const SubscribedFrame& frame);
+
+private:
+    std::shared_ptr<FrameConverter> m_pConverter;
+    std::mutex m_mtSubscriber;
+    std::vector<std::shared_ptr<Subscriber>> m_vecSubscriber;
+    std::atomic<int> m_nSubscriber;
+    int m_nNextId;
+    // decode thread only
+    std::map<TargetKey, std::shared_ptr<ImageTarget>> m_mapTarget;
+    std::vector<std::shared_ptr<Subscriber>> m_vecDispatch;
+    std::vector<std::pair<TargetKey, std::shared_ptr<ConvertedImage>>> m_vecImage;
+};
@@ -0,0 +1,228 @@
+#include "FrameHandle.h"
+#include <cstdio>
+#include "FramePool.h"
+
+FrameHandle::SharedFrame::~SharedFrame()
+{
+    Clear();
+    if (pFrame != nullptr)
+        av_frame_free(&pFrame);
+}
+
+void FrameHandle::SharedFrame::Clear()
+{
+    if (pFrame != nullptr)
+        av_frame_unref(pFrame);
+    matBgr.release();
+    if (pBgrBuffer != nullptr)
+        av_buffer_unref(&pBgrBuffer);
+    bBgr = false;
+}
+
+FrameHandle::FrameHandle(SharedFrame* pShared)
+    : m_pShared(pShared)
+{
+    if (m_pShared)
+        m_pShared->nRef.fetch_add(1, std::memory_order_relaxed);
+}
+
+FrameHandle::FrameHandle(const FrameHandle& other)
+    : FrameHandle(other.m_pShared)
+{
+}
+
+FrameHandle::FrameHandle(FrameHandle&& other)
+    : m_pShared(other.m_pShared)
+{
+    other.m_pShared = nullptr;
+}
+
+FrameHandle& FrameHandle::operator=(const FrameHandle& other)
+{
+    if (m_pShared != other.m_pShared) {
+        FrameHandle copy(other);
+        std::swap(m_pShared, copy.m_pShared);
+    }
+    return *this;
+}
+
+FrameHandle& FrameHandle::operator=(FrameHandle&& other)
+{
+    if (this != &other) {
+        release();
+        std::swap(m_pShared, other.m_pShared);
+    }
+    return *this;
+}
+
+FrameHandle::~FrameHandle()
+{
+    release();
+}
+
+void FrameHandle::release()
+{
+    SharedFrame* pShared = m_pShared;
+    m_pShared = nullptr;
+    if (nullptr == pShared || pShared->nRef.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    if (pShared->pFreeList)
+        pShared->pFreeList->Recycle(pShared);
+    else
+        delete pShared;
+}
+
+FrameHandle FrameHandle::Wrap(const AVFrame* pFrame, const std::shared_ptr<FrameConverter>& pConverter)
+{
+    if (nullptr == pFrame)
+        return FrameHandle();
+    SharedFrame* pShared = new SharedFrame;
+    pShared->pFrame = av_frame_alloc();
+    if (nullptr == pShared->pFrame || av_frame_ref(pShared->pFrame, pFrame) < 0) {
+        fprintf(stderr, "Can't reference frame\n");
+        delete pShared;
+        return FrameHandle();
+    }
+    pShared->pConverter = pConverter;
+    return FrameHandle(pShared);
+}
+
+int FrameHandle::GetWidth() const
+{
+    return m_pShared ? m_pShared->pFrame->width : 0;
+}
+
+int FrameHandle::GetHeight() const
+{
+    return m_pShared ? m_pShared->pFrame->height : 0;
+}
+
+AVPixelFormat FrameHandle::GetFormat() const
+{
+    return m_pShared ? (AVPixelFormat)m_pShared->pFrame->format : AV_PIX_FMT_NONE;
+}
+
+int64_t FrameHandle::GetPts() const
+{
+    return m_pShared ? m_pShared->pFrame->pts : AV_NOPTS_VALUE;
+}
+
+bool FrameHandle::IsKeyFrame() const
+{
+    return m_pShared && m_pShared->pFrame->key_frame;
+}
+
+const AVFrame* FrameHandle::GetFrame() const
+{
+    return m_pShared ? m_pShared->pFrame : nullptr;
+}
+
+cv::Mat FrameHandle::Luma() const
+{
+    return Plane(0);
+}
+
+cv::Mat FrameHandle::Plane(int nIndex) const
+{
+    if (!m_pShared || nIndex < 0 || nIndex >= AV_NUM_DATA_POINTERS)
+        return cv::Mat();
+    AVFrame* pFrame = m_pShared->pFrame;
+    if (nullptr == pFrame->data[nIndex])
+        return cv::Mat();
+    int nWidth = pFrame->width;
+    int nHeight = pFrame->height;
+    int nType = CV_8UC1;
+    switch (pFrame->format)
+    {
+    case AV_PIX_FMT_NV12:
+        if (nIndex > 1)
+            return cv::Mat();
+        if (1 == nIndex) {
+            nWidth = (nWidth + 1) / 2;
+            nHeight = (nHeight + 1) / 2;
+            nType = CV_8UC2;
+        }
+        break;
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        if (nIndex > 2)
+            return cv::Mat();
+        if (nIndex > 0) {
+            nWidth = (nWidth + 1) / 2;
+            nHeight = (nHeight + 1) / 2;
+        }
+        break;
+    case AV_PIX_FMT_GRAY8:
+        if (nIndex > 0)
+            return cv::Mat();
+        break;
+    default:    // packed or unknown layout
+        return cv::Mat();
+    }
+    return cv::Mat(nHeight, nWidth, nType, pFrame->data[nIndex], pFrame->linesize[nIndex]);
+}
+
+cv::Mat FrameHandle::Bgr() const
+{
+    cv::Mat image = BgrView();
+    // a view on a pooled buffer owns nothing, the buffer goes back with the frame
+    return image.u ? image : image.clone();
+}
+
+cv::Mat FrameHandle::BgrView() const
+{
+    if (!m_pShared)
+        return cv::Mat();
+    SharedFrame* pShared = m_pShared;
+    std::lock_guard<std::mutex> lock(pShared->mtBgr);
+    if (pShared->bBgr)
+        return pShared->matBgr;
+    pShared->bBgr = true;
+    const AVFrame* pFrame = pShared->pFrame;
+    if (!pShared->pConverter)
+        return cv::Mat();
+    cv::Mat image;
+    AVBufferRef* pBuffer = nullptr;
+    if (pShared->pBgrPool) {
+        // rows padded for the converter, a view on the pooled buffer
+        size_t nStep = FFALIGN(pFrame->width * 3, 32);
+        pBuffer = pShared->pBgrPool->Get((int)(nStep * pFrame->height));
+        if (pBuffer)
+            image = cv::Mat(pFrame->height, pFrame->width, CV_8UC3, pBuffer->data, nStep);
+    }
+    if (image.empty())
+        image.create(pFrame->height, pFrame->width, CV_8UC3);
+    int cvLinesizes[1];
+    cvLinesizes[0] = (int)image.step1();
+    if (pShared->pConverter->Convert(pFrame, AV_PIX_FMT_BGR24, &image.data, cvLinesizes)) {
+        pShared->matBgr = image;
+        pShared->pBgrBuffer = pBuffer;
+    }
+    else if (pBuffer)
+        av_buffer_unref(&pBuffer);
+    return pShared->matBgr;
+}
+
+bool FrameHandle::CopyBgr(cv::Mat& image) const
+{
+    if (!m_pShared || !m_pShared->pConverter)
+        return false;
+    {
+        // already converted for another consumer
+        std::lock_guard<std::mutex> lock(m_pShared->mtBgr);
+        if (m_pShared->bBgr) {
+            if (m_pShared->matBgr.empty())
+                return false;
+            m_pShared->matBgr.copyTo(image);
+            return true;
+        }
+    }
+    const AVFrame* pFrame = m_pShared->pFrame;
+    // never write into a buffer another cv::Mat still looks at
+    if (image.u && image.u->refcount > 1)
+        image.release();
+    image.create(pFrame->height, pFrame->width, CV_8UC3);
+    int cvLinesizes[1];
+    cvLinesizes[0] = (int)image.step1();
+    return m_pShared->pConverter->Convert(pFrame, AV_PIX_FMT_BGR24, &image.data, cvLinesizes);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <opencv2/core.hpp>
+#include "FrameConverter.h"
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+}
+
+class ImageBufferPool;
+struct FrameFreeList;
+
+// Reference to a decoded frame, copies of the handle share the same AVFrame.
+// The planes are exposed as cv::Mat views without copying, the views are only
+// valid while a handle to the frame is alive. BGR is converted the first time
+// it is asked for and cached for the other consumers of the frame.
+// Handles made by a FramePool go back to the pool with their last copy.
+class FrameHandle
+{
+public:
+    FrameHandle() = default;
+    FrameHandle(const FrameHandle& other);
+    FrameHandle(FrameHandle&& other);
+    FrameHandle& operator=(const FrameHandle& other);
+    FrameHandle& operator=(FrameHandle&& other);
+    ~FrameHandle();
+    // take a new reference (av_frame_ref) to the frame
+    static FrameHandle Wrap(const AVFrame* pFrame, const std::shared_ptr<FrameConverter>& pConverter);
+
+    bool Empty() const { return nullptr == m_pShared; }
+    int GetWidth() const;
+    int GetHeight() const;
+    AVPixelFormat GetFormat() const;
+    int64_t GetPts() const;
+    bool IsKeyFrame() const;
+    const AVFrame* GetFrame() const;
+
+    // Y plane, CV_8UC1, no copy
+    cv::Mat Luma() const;
+    // plane view, no copy: NV12 plane 1 is CV_8UC2 (interleaved UV),
+    // YUV420P planes 1/2 are CV_8UC1 at half resolution
+    cv::Mat Plane(int nIndex) const;
+    // BGR24 CV_8UC3, converted once on first call, an image of its own that
+    // outlives the frame
+    cv::Mat Bgr() const;
+    // the same without a copy: a pooled frame converts into a pooled buffer and
+    // the image is a view like the planes, valid while a copy of the handle lives
+    cv::Mat BgrView() const;
+    // BGR24 into an image the caller owns. Its buffer is reused when the size
+    // matches and no other cv::Mat shares it.
+    bool CopyBgr(cv::Mat& image) const;
+
+private:
+    friend class FramePool;
+    friend struct FrameFreeList;
+    struct SharedFrame
+    {
+        std::atomic<int> nRef;
+        AVFrame* pFrame = nullptr;
+        std::shared_ptr<FrameConverter> pConverter;
+        std::shared_ptr<ImageBufferPool> pBgrPool;      // nullptr: Bgr allocates its image
+        std::shared_ptr<FrameFreeList> pFreeList;       // nullptr: not pooled
+        std::mutex mtBgr;
+        bool bBgr = false;                              // conversion tried
+        cv::Mat matBgr;
+        AVBufferRef* pBgrBuffer = nullptr;
+        SharedFrame() : nRef(0) {}
+        ~SharedFrame();
+        // drop the picture and the BGR image, the AVFrame stays allocated
+        void Clear();
+    };
+    // take a reference of a shared frame
+    explicit FrameHandle(SharedFrame* pShared);
+    void release();
+
+private:
+    SharedFrame* m_pShared = nullptr;
+};
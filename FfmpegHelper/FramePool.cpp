@@ -0,0 +1,135 @@
+#include "FramePool.h"
+#include <cstdio>
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+ImageBufferPool::ImageBufferPool()
+    : m_pPool(nullptr)
+    , m_nSize(0)
+    , m_nAlloc(0)
+{
+}
+
+ImageBufferPool::~ImageBufferPool()
+{
+    // buffers still out keep the pool alive until they come back
+    av_buffer_pool_uninit(&m_pPool);
+}
+
+AVBufferRef* ImageBufferPool::Get(int nSize)
+{
+    if (nSize <= 0)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(m_mtPool);
+    if (nSize != m_nSize || nullptr == m_pPool) {
+        av_buffer_pool_uninit(&m_pPool);
+        m_pPool = av_buffer_pool_init2(nSize, this, alloc_buffer, nullptr);
+        m_nSize = m_pPool ? nSize : 0;
+        if (nullptr == m_pPool)
+            return nullptr;
+    }
+    return av_buffer_pool_get(m_pPool);
+}
+
+AVBufferRef* ImageBufferPool::alloc_buffer(void* pOpaque, int nSize)
+{
+    // called from av_buffer_pool_get, under m_mtPool
+    static_cast<ImageBufferPool*>(pOpaque)->m_nAlloc.fetch_add(1, std::memory_order_relaxed);
+    return av_buffer_alloc(nSize);
+}
+
+void FrameFreeList::Recycle(FrameHandle::SharedFrame* pShared)
+{
+    // give the decoder its buffers back right away
+    pShared->Clear();
+    {
+        std::lock_guard<std::mutex> lock(mtFree);
+        if (!bClosed && vecFree.size() < nMaxFree) {
+            vecFree.push_back(pShared);
+            return;
+        }
+    }
+    delete pShared;
+}
+
+FramePool::FramePool(size_t nMaxFree)
+    : m_pFreeList(std::make_shared<FrameFreeList>())
+    , m_pBgrPool(std::make_shared<ImageBufferPool>())
+    , m_nWrapped(0)
+    , m_nFrameAlloc(0)
+{
+    m_pFreeList->nMaxFree = nMaxFree;
+    m_pFreeList->vecFree.reserve(nMaxFree);
+}
+
+FramePool::~FramePool()
+{
+    // frames still out are deleted by their last handle
+    std::vector<FrameHandle::SharedFrame*> vecFree;
+    {
+        std::lock_guard<std::mutex> lock(m_pFreeList->mtFree);
+        m_pFreeList->bClosed = true;
+        vecFree.swap(m_pFreeList->vecFree);
+    }
+    for (FrameHandle::SharedFrame* pShared : vecFree)
+        delete pShared;
+}
+
+FrameHandle FramePool::Wrap(AVFrame* pFrame, const std::shared_ptr<FrameConverter>& pConverter)
+{
+    if (nullptr == pFrame)
+        return FrameHandle();
+    FrameHandle::SharedFrame* pShared = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_pFreeList->mtFree);
+        if (!m_pFreeList->vecFree.empty()) {
+            pShared = m_pFreeList->vecFree.back();
+            m_pFreeList->vecFree.pop_back();
+        }
+    }
+    if (nullptr == pShared) {
+        pShared = new FrameHandle::SharedFrame;
+        pShared->pFrame = av_frame_alloc();
+        if (nullptr == pShared->pFrame) {
+            fprintf(stderr, "Can't allocate frame\n");
+            delete pShared;
+            return FrameHandle();
+        }
+        pShared->pBgrPool = m_pBgrPool;
+        pShared->pFreeList = m_pFreeList;
+        m_nFrameAlloc.fetch_add(1, std::memory_order_relaxed);
+    }
+    av_frame_move_ref(pShared->pFrame, pFrame);
+    pShared->pConverter = pConverter;
+    m_nWrapped.fetch_add(1, std::memory_order_relaxed);
+    return FrameHandle(pShared);
+}
+
+bool FramePool::GetTransferBuffer(AVFrame* pFrame, AVPixelFormat nFormat, int nWidth, int nHeight)
+{
+    int nSize = av_image_get_buffer_size(nFormat, nWidth, nHeight, 32);
+    AVBufferRef* pBuffer = nSize > 0 ? m_poolTransfer.Get(nSize) : nullptr;
+    if (nullptr == pBuffer) {
+        fprintf(stderr, "Can't get transfer buffer\n");
+        return false;
+    }
+    if (av_image_fill_arrays(pFrame->data, pFrame->linesize, pBuffer->data, nFormat, nWidth, nHeight, 32) < 0) {
+        av_buffer_unref(&pBuffer);
+        return false;
+    }
+    pFrame->buf[0] = pBuffer;
+    pFrame->format = nFormat;
+    pFrame->width = nWidth;
+    pFrame->height = nHeight;
+    return true;
+}
+
+FramePoolStats FramePool::GetStats() const
+{
+    FramePoolStats stats;
+    stats.nWrapped = m_nWrapped.load(std::memory_order_relaxed);
+    stats.nFrameAlloc = m_nFrameAlloc.load(std::memory_order_relaxed);
+    stats.nBufferAlloc = m_pBgrPool->GetAllocCount() + m_poolTransfer.GetAllocCount();
+    return stats;
+}
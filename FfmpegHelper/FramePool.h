@@ -0,0 +1,82 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include "FrameHandle.h"
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+}
+
+// AVBufferPool of one buffer size, built again when the size changes. A
+// buffer outlives the pool it came from and goes back to it when released.
+class ImageBufferPool
+{
+public:
+    ImageBufferPool();
+    ~ImageBufferPool();
+    ImageBufferPool(const ImageBufferPool&) = delete;
+    ImageBufferPool& operator=(const ImageBufferPool&) = delete;
+
+    // any thread, nullptr on failure
+    AVBufferRef* Get(int nSize);
+    // buffers allocated, stays flat once every size in use has enough buffers
+    uint64_t GetAllocCount() const { return m_nAlloc.load(std::memory_order_relaxed); }
+
+private:
+    static AVBufferRef* alloc_buffer(void* pOpaque, int nSize);
+
+private:
+    std::mutex m_mtPool;
+    AVBufferPool* m_pPool;
+    int m_nSize;
+    std::atomic<uint64_t> m_nAlloc;
+};
+
+// released pooled frames, shared by the pool and its frames so that a frame
+// released after the pool is gone is simply deleted
+struct FrameFreeList
+{
+    std::mutex mtFree;
+    bool bClosed = false;
+    size_t nMaxFree = 0;
+    std::vector<FrameHandle::SharedFrame*> vecFree;
+
+    // last handle of the frame released, any thread
+    void Recycle(FrameHandle::SharedFrame* pShared);
+};
+
+struct FramePoolStats
+{
+    uint64_t nWrapped = 0;          // handles made
+    uint64_t nFrameAlloc = 0;       // frames allocated
+    uint64_t nBufferAlloc = 0;      // BGR and transfer buffers allocated
+};
+
+// Per stream pool of decoded frames. Wrap moves the decoder's references into
+// a recycled frame, Bgr converts into pooled buffers and hardware frames are
+// downloaded into pooled buffers, so steady state decoding allocates nothing
+// for frames. The decode thread uses the pool, handles are released anywhere.
+class FramePool
+{
+public:
+    explicit FramePool(size_t nMaxFree = 32);
+    ~FramePool();
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // a handle owning the references of pFrame (av_frame_move_ref), pFrame is left blank
+    FrameHandle Wrap(AVFrame* pFrame, const std::shared_ptr<FrameConverter>& pConverter);
+    // give a blank pFrame pooled buffers for av_hwframe_transfer_data
+    bool GetTransferBuffer(AVFrame* pFrame, AVPixelFormat nFormat, int nWidth, int nHeight);
+    FramePoolStats GetStats() const;
+
+private:
+    std::shared_ptr<FrameFreeList> m_pFreeList;
+    std::shared_ptr<ImageBufferPool> m_pBgrPool;
+    ImageBufferPool m_poolTransfer;
+    std::atomic<uint64_t> m_nWrapped;
+    std::atomic<uint64_t> m_nFrameAlloc;
+};
@@ -0,0 +1,165 @@
+#include "Metrics.h"
+#include <cstdio>
+#include "Storage.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+double HistogramSnapshot::PercentileMs(double dRatio) const
+{
+    if (0 == nCount || vecBucket.empty())
+        return 0;
+    uint64_t nTarget = (uint64_t)(dRatio * nCount + 0.5);
+    uint64_t nSeen = 0;
+    for (size_t nIndex = 0; nIndex < vecBucket.size(); ++nIndex)
+    {
+        nSeen += vecBucket[nIndex];
+        if (nSeen >= nTarget && nSeen > 0) {
+            // the overflow bucket and the top one are bounded by the maximum seen
+            if (nIndex + 1 >= vecBucket.size())
+                return nMaxUs / 1000.0;
+            uint64_t nBoundUs = LatencyHistogram::GetBucketBoundUs((int)nIndex);
+            return (nBoundUs < nMaxUs ? nBoundUs : nMaxUs) / 1000.0;
+        }
+    }
+    return nMaxUs / 1000.0;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+void LatencyHistogram::Record(int64_t nLatencyUs)
+{
+    uint64_t nValueUs = nLatencyUs > 0 ? (uint64_t)nLatencyUs : 0;
+    m_arrBucket[bucket_of(nValueUs)].fetch_add(1, std::memory_order_relaxed);
+    m_nCount.fetch_add(1, std::memory_order_relaxed);
+    m_nSumUs.fetch_add(nValueUs, std::memory_order_relaxed);
+    uint64_t nMaxUs = m_nMaxUs.load(std::memory_order_relaxed);
+    while (nValueUs > nMaxUs && !m_nMaxUs.compare_exchange_weak(nMaxUs, nValueUs, std::memory_order_relaxed))
+    {
+    }
+}
+
+void LatencyHistogram::Reset()
+{
+    for (auto& nBucket : m_arrBucket)
+        nBucket.store(0, std::memory_order_relaxed);
+    m_nCount.store(0, std::memory_order_relaxed);
+    m_nSumUs.store(0, std::memory_order_relaxed);
+    m_nMaxUs.store(0, std::memory_order_relaxed);
+}
+
+HistogramSnapshot LatencyHistogram::Snapshot(const std::string& strName) const
+{
+    // not atomic as a whole, good enough for monitoring
+    HistogramSnapshot snapshot;
+    snapshot.strName = strName;
+    snapshot.vecBucket.resize(kBucketCount);
+    for (int nIndex = 0; nIndex < kBucketCount; ++nIndex)
+        snapshot.vecBucket[nIndex] = m_arrBucket[nIndex].load(std::memory_order_relaxed);
+    snapshot.nCount = m_nCount.load(std::memory_order_relaxed);
+    snapshot.nSumUs = m_nSumUs.load(std::memory_order_relaxed);
+    snapshot.nMaxUs = m_nMaxUs.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+int LatencyHistogram::bucket_of(uint64_t nLatencyUs)
+{
+    if (nLatencyUs <= 1)
+        return 0;
+    // ceil(log2(us)): the smallest power of two not below the value
+    uint64_t nValue = nLatencyUs - 1;
+#ifdef _MSC_VER
+    unsigned long nBit = 0;
+    _BitScanReverse64(&nBit, nValue);
+    int nBucket = (int)nBit + 1;
+#else
+    int nBucket = 64 - __builtin_clzll(nValue);
+#endif
+    return nBucket < kBucketCount ? nBucket : kBucketCount - 1;
+}
+
+void MetricsText::AddCounter(const std::string& strName, const std::string& strLabels, uint64_t nValue,
+    const std::string& strHelp)
+{
+    family(strName, "counter", strHelp) << strName << "{" << strLabels << "} " << nValue << "\n";
+}
+
+void MetricsText::AddGauge(const std::string& strName, const std::string& strLabels, double dValue,
+    const std::string& strHelp)
+{
+    family(strName, "gauge", strHelp) << strName << "{" << strLabels << "} " << dValue << "\n";
+}
+
+void MetricsText::AddHistogram(const std::string& strName, const std::string& strLabels,
+    const HistogramSnapshot& histogram, const std::string& strHelp)
+{
+    std::ostringstream& ssText = family(strName, "histogram", strHelp);
+    uint64_t nCumulative = 0;
+    for (size_t nIndex = 0; nIndex + 1 < histogram.vecBucket.size(); ++nIndex)
+    {
+        nCumulative += histogram.vecBucket[nIndex];
+        double dBound = LatencyHistogram::GetBucketBoundUs((int)nIndex) / 1e6;
+        std::ostringstream ssLe;
+        ssLe << dBound;
+        ssText << strName << "_bucket{" << join(strLabels, Label("le", ssLe.str())) << "} " << nCumulative << "\n";
+    }
+    ssText << strName << "_bucket{" << join(strLabels, Label("le", "+Inf")) << "} " << histogram.nCount << "\n";
+    ssText << strName << "_sum{" << strLabels << "} " << histogram.nSumUs / 1e6 << "\n";
+    ssText << strName << "_count{" << strLabels << "} " << histogram.nCount << "\n";
+}
+
+std::string MetricsText::ToString() const
+{
+    std::string strText;
+    for (auto& strName : m_vecName)
+        strText += m_mapFamily.at(strName).str();
+    return strText;
+}
+
+bool MetricsText::WriteFile(const std::string& strPath) const
+{
+    std::string strTemp = strPath + ".tmp";
+    FILE* pFile = fopen(strTemp.c_str(), "wb");
+    if (nullptr == pFile)
+        return false;
+    std::string strText = ToString();
+    bool bResult = fwrite(strText.data(), 1, strText.size(), pFile) == strText.size();
+    fclose(pFile);
+    return bResult && Storage::RenameFile(strTemp, strPath);
+}
+
+std::string MetricsText::Label(const std::string& strKey, const std::string& strValue)
+{
+    std::string strLabel = strKey + "=\"";
+    for (char ch : strValue)
+    {
+        if ('\\' == ch || '"' == ch)
+            strLabel += '\\';
+        if ('\n' == ch)
+            strLabel += "\\n";
+        else
+            strLabel += ch;
+    }
+    return strLabel + "\"";
+}
+
+std::ostringstream& MetricsText::family(const std::string& strName, const char* szType, const std::string& strHelp)
+{
+    auto it = m_mapFamily.find(strName);
+    if (it != m_mapFamily.end())
+        return it->second;
+    m_vecName.push_back(strName);
+    std::ostringstream& ssText = m_mapFamily[strName];
+    if (!strHelp.empty())
+        ssText << "# HELP " << strName << " " << strHelp << "\n";
+    ssText << "# TYPE " << strName << " " << szType << "\n";
+    return ssText;
+}
+
+std::string MetricsText::join(const std::string& strLabels, const std::string& strExtra)
+{
+    return strLabels.empty() ? strExtra : strLabels + "," + strExtra;
+}
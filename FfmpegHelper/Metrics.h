@@ -0,0 +1,73 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <sstream>
+#include <cstdint>
+
+// copy of a LatencyHistogram
+struct HistogramSnapshot
+{
+    std::string strName;
+    uint64_t nCount = 0;
+    uint64_t nSumUs = 0;
+    uint64_t nMaxUs = 0;
+    std::vector<uint64_t> vecBucket;    // bucket i counts values up to 2^i us, the last one the rest
+
+    double AverageMs() const { return nCount > 0 ? nSumUs / 1000.0 / nCount : 0; }
+    // upper bound of the bucket holding the given share of the values, ms
+    double PercentileMs(double dRatio) const;
+};
+
+// Latency distribution in power of two microsecond buckets. Record is a few
+// relaxed atomic adds, any number of threads may record while others read.
+class LatencyHistogram
+{
+public:
+    const static int kBucketCount = 28;     // up to 2^26 us (67 s), then overflow
+
+    LatencyHistogram();
+    void Record(int64_t nLatencyUs);
+    void Reset();
+    HistogramSnapshot Snapshot(const std::string& strName = "") const;
+    uint64_t GetCount() const { return m_nCount.load(std::memory_order_relaxed); }
+    static uint64_t GetBucketBoundUs(int nBucket) { return (uint64_t)1 << nBucket; }
+
+private:
+    static int bucket_of(uint64_t nLatencyUs);
+
+private:
+    std::atomic<uint64_t> m_arrBucket[kBucketCount];
+    std::atomic<uint64_t> m_nCount;
+    std::atomic<uint64_t> m_nSumUs;
+    std::atomic<uint64_t> m_nMaxUs;
+};
+
+// Prometheus text exposition format. The samples of one metric name are kept
+// together under a single HELP/TYPE, whatever order they are added in.
+class MetricsText
+{
+public:
+    // strLabels: already formatted, e.g. stream="1",stage="decode"
+    void AddCounter(const std::string& strName, const std::string& strLabels, uint64_t nValue,
+        const std::string& strHelp = "");
+    void AddGauge(const std::string& strName, const std::string& strLabels, double dValue,
+        const std::string& strHelp = "");
+    // in seconds, as Prometheus expects
+    void AddHistogram(const std::string& strName, const std::string& strLabels, const HistogramSnapshot& histogram,
+        const std::string& strHelp = "");
+    std::string ToString() const;
+    // write to a temporary file and rename it, a scraper never reads half a dump
+    bool WriteFile(const std::string& strPath) const;
+
+    static std::string Label(const std::string& strKey, const std::string& strValue);
+
+private:
+    std::ostringstream& family(const std::string& strName, const char* szType, const std::string& strHelp);
+    static std::string join(const std::string& strLabels, const std::string& strExtra);
+
+private:
+    std::vector<std::string> m_vecName;     // first use order
+    std::map<std::string, std::ostringstream> m_mapFamily;
+};
@@ -0,0 +1,317 @@
+#include "MotionDetector.h"
+#include <algorithm>
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FFH_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+// MSVC compiles any intrinsic, the caller checks the CPU
+#define FFH_TARGET_SSE41
+#else
+#define FFH_TARGET_SSE41 __attribute__((target("sse4.1")))
+#endif
+#endif
+
+static const int kMaxCellShift = 6;
+static const int kBackgroundShift = 4;     // background in Q4, differences stay in 16 bits
+
+static void downsample_c(const uint8_t* pLuma, int nStride, int nCellsX, int nCellsY, int nShift, uint8_t* pCell)
+{
+    int nSize = 1 << nShift;
+    int nRound = (1 << (2 * nShift)) >> 1;
+    for (int nCellY = 0; nCellY < nCellsY; ++nCellY)
+    {
+        const uint8_t* pBand = pLuma + (size_t)(nCellY << nShift) * nStride;
+        for (int nCellX = 0; nCellX < nCellsX; ++nCellX)
+        {
+            uint32_t nSum = 0;
+            for (int y = 0; y < nSize; ++y)
+            {
+                const uint8_t* pSrc = pBand + (size_t)y * nStride + (nCellX << nShift);
+                for (int x = 0; x < nSize; ++x)
+                    nSum += pSrc[x];
+            }
+            pCell[nCellX] = (uint8_t)((nSum + nRound) >> (2 * nShift));
+        }
+        pCell += nCellsX;
+    }
+}
+
+static int update_background_c(const uint8_t* pCell, uint16_t* pBackground, int nCount, int nThreshold, int nLearnShift)
+{
+    int nLimit = nThreshold << kBackgroundShift;
+    int nChanged = 0;
+    for (int nIndex = 0; nIndex < nCount; ++nIndex)
+    {
+        int nDiff = (pCell[nIndex] << kBackgroundShift) - pBackground[nIndex];
+        if (nDiff > nLimit || -nDiff > nLimit)
+            ++nChanged;
+        // arithmetic shift like psraw, the background never passes the cell
+        pBackground[nIndex] = (uint16_t)(pBackground[nIndex] + (nDiff >> nLearnShift));
+    }
+    return nChanged;
+}
+
+#ifdef FFH_KERNELS_X86
+// cells of 8 pixels and more, psadbw against zero sums 8 pixels per lane
+FFH_TARGET_SSE41 static void downsample_sse41(const uint8_t* pLuma, int nStride, int nCellsX, int nCellsY,
+    int nShift, uint8_t* pCell)
+{
+    const __m128i nZero = _mm_setzero_si128();
+    int nSize = 1 << nShift;
+    int nRound = (1 << (2 * nShift)) >> 1;
+    for (int nCellY = 0; nCellY < nCellsY; ++nCellY)
+    {
+        const uint8_t* pBand = pLuma + (size_t)(nCellY << nShift) * nStride;
+        int nCellX = 0;
+        if (3 == nShift) {
+            // two cells per load, one in each lane
+            for (; nCellX + 2 <= nCellsX; nCellX += 2)
+            {
+                __m128i nSum = nZero;
+                const uint8_t* pSrc = pBand + (nCellX << 3);
+                for (int y = 0; y < 8; ++y, pSrc += nStride)
+                    nSum = _mm_add_epi64(nSum, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)pSrc), nZero));
+                pCell[nCellX] = (uint8_t)((_mm_cvtsi128_si32(nSum) + nRound) >> 6);
+                pCell[nCellX + 1] = (uint8_t)((_mm_extract_epi32(nSum, 2) + nRound) >> 6);
+            }
+            if (nCellX < nCellsX) {
+                __m128i nSum = nZero;
+                const uint8_t* pSrc = pBand + (nCellX << 3);
+                for (int y = 0; y < 8; ++y, pSrc += nStride)
+                    nSum = _mm_add_epi64(nSum, _mm_sad_epu8(_mm_loadl_epi64((const __m128i*)pSrc), nZero));
+                pCell[nCellX] = (uint8_t)((_mm_cvtsi128_si32(nSum) + nRound) >> 6);
+            }
+        }
+        else {
+            for (; nCellX < nCellsX; ++nCellX)
+            {
+                __m128i nSum = nZero;
+                const uint8_t* pRow = pBand + (nCellX << nShift);
+                for (int y = 0; y < nSize; ++y, pRow += nStride)
+                {
+                    for (int x = 0; x < nSize; x += 16)
+                        nSum = _mm_add_epi64(nSum, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(pRow + x)), nZero));
+                }
+                uint32_t nTotal = (uint32_t)_mm_cvtsi128_si32(nSum) + (uint32_t)_mm_extract_epi32(nSum, 2);
+                pCell[nCellX] = (uint8_t)((nTotal + nRound) >> (2 * nShift));
+            }
+        }
+        pCell += nCellsX;
+    }
+}
+
+FFH_TARGET_SSE41 static int update_background_sse41(const uint8_t* pCell, uint16_t* pBackground, int nCount,
+    int nThreshold, int nLearnShift)
+{
+    const __m128i nLimit = _mm_set1_epi16((short)(nThreshold << kBackgroundShift));
+    const __m128i nLearn = _mm_cvtsi32_si128(nLearnShift);
+    const __m128i nOnes = _mm_set1_epi16(1);
+    int nChanged = 0;
+    int nIndex = 0;
+    while (nIndex + 8 <= nCount)
+    {
+        // 16 bit lane counters, summed before they can overflow
+        __m128i nLanes = _mm_setzero_si128();
+        int nEnd = std::min(nCount & ~7, nIndex + 8 * 4096);
+        for (; nIndex < nEnd; nIndex += 8)
+        {
+            __m128i nCur = _mm_slli_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(pCell + nIndex))),
+                kBackgroundShift);
+            __m128i nBack = _mm_loadu_si128((const __m128i*)(pBackground + nIndex));
+            __m128i nDiff = _mm_sub_epi16(nCur, nBack);
+            nLanes = _mm_sub_epi16(nLanes, _mm_cmpgt_epi16(_mm_abs_epi16(nDiff), nLimit));
+            _mm_storeu_si128((__m128i*)(pBackground + nIndex), _mm_add_epi16(nBack, _mm_sra_epi16(nDiff, nLearn)));
+        }
+        __m128i nSum = _mm_madd_epi16(nLanes, nOnes);
+        nSum = _mm_add_epi32(nSum, _mm_shuffle_epi32(nSum, _MM_SHUFFLE(1, 0, 3, 2)));
+        nSum = _mm_add_epi32(nSum, _mm_shuffle_epi32(nSum, _MM_SHUFFLE(2, 3, 0, 1)));
+        nChanged += _mm_cvtsi128_si32(nSum);
+    }
+    return nChanged + update_background_c(pCell + nIndex, pBackground + nIndex, nCount - nIndex, nThreshold, nLearnShift);
+}
+#endif
+
+MotionDetector::MotionDetector()
+    : m_nIsa(kIsaScalar)
+    , m_nWidth(0)
+    , m_nHeight(0)
+    , m_nShift(0)
+    , m_nNextMs(AV_NOPTS_VALUE)
+    , m_nWarmup(0)
+    , m_nAbove(0)
+    , m_nLastMotionMs(0)
+    , m_bMotion(false)
+    , m_nAnalyzed(0)
+    , m_nEvents(0)
+    , m_nRelearns(0)
+    , m_nRatioPpm(0)
+{
+}
+
+void MotionDetector::Init(const MotionConfig& config)
+{
+    m_config = config;
+    m_config.nMaxWidth = std::max(m_config.nMaxWidth, 16);
+    m_config.nPixelThreshold = std::min(std::max(m_config.nPixelThreshold, 0), 255);
+    m_config.nLearnShift = std::min(std::max(m_config.nLearnShift, 0), 8);
+    m_config.nStartFrames = std::max(m_config.nStartFrames, 1);
+    m_nIsa = kIsaBest == config.nIsa || config.nIsa > ColorKernels::GetBestIsa() ? ColorKernels::GetBestIsa() : config.nIsa;
+    // the buffers are sized by the first frame
+    m_nWidth = 0;
+    m_nHeight = 0;
+    m_nShift = 0;
+    m_nNextMs = AV_NOPTS_VALUE;
+    m_nWarmup = 0;
+    m_nAbove = 0;
+    m_nLastMotionMs = 0;
+    m_bMotion = false;
+    m_nAnalyzed = 0;
+    m_nEvents = 0;
+    m_nRelearns = 0;
+    m_nRatioPpm = 0;
+}
+
+int MotionDetector::Analyze(const AVFrame* pFrame, int64_t nPtsMs, MotionEvent& event)
+{
+    if (nullptr == pFrame || nullptr == pFrame->data[0] || !HasLuma(pFrame->format))
+        return kMotionSkipped;
+    if (m_config.nAnalyzeFps > 0) {
+        int64_t nIntervalMs = 1000 / m_config.nAnalyzeFps;
+        if (AV_NOPTS_VALUE != m_nNextMs && nPtsMs < m_nNextMs && m_nNextMs - nPtsMs <= nIntervalMs)
+            return kMotionSkipped;
+        // on schedule the rate holds on average, after a gap or a jump back it starts over here
+        bool bOnTime = AV_NOPTS_VALUE != m_nNextMs && nPtsMs >= m_nNextMs && nPtsMs - m_nNextMs < nIntervalMs;
+        m_nNextMs = (bOnTime ? m_nNextMs : nPtsMs) + nIntervalMs;
+    }
+    bool bSeed = false;
+    if (pFrame->width != m_nWidth || pFrame->height != m_nHeight) {
+        m_nWidth = pFrame->width;
+        m_nHeight = pFrame->height;
+        m_nShift = GetCellShift(m_nWidth, m_config.nMaxWidth);
+        size_t nCount = (size_t)(m_nWidth >> m_nShift) * (m_nHeight >> m_nShift);
+        m_vecCell.assign(nCount, 0);
+        m_vecBackground.assign(nCount, 0);
+        m_nWarmup = std::max(m_config.nWarmupFrames, 0);
+        m_nAbove = 0;
+        bSeed = true;
+    }
+    if (m_vecCell.empty())
+        return kMotionSkipped;
+
+    int nCount = (int)m_vecCell.size();
+    Downsample(pFrame->data[0], pFrame->linesize[0], m_nWidth, m_nHeight, m_nShift, m_vecCell.data(), m_nIsa);
+    m_nAnalyzed.fetch_add(1, std::memory_order_relaxed);
+    int nChanged = 0;
+    if (!bSeed) {
+        nChanged = UpdateBackground(m_vecCell.data(), m_vecBackground.data(), nCount, m_config.nPixelThreshold,
+            m_config.nLearnShift, m_nIsa);
+    }
+    double dRatio = (double)nChanged / nCount;
+    m_nRatioPpm.store((int)(dRatio * 1000000), std::memory_order_relaxed);
+    // most of the picture at once is light or the camera, the scene starts over from this frame
+    if (!bSeed && dRatio > m_config.dRelearnRatio) {
+        m_nRelearns.fetch_add(1, std::memory_order_relaxed);
+        m_nAbove = 0;
+        bSeed = true;
+    }
+    if (bSeed) {
+        for (int nIndex = 0; nIndex < nCount; ++nIndex)
+            m_vecBackground[nIndex] = (uint16_t)(m_vecCell[nIndex] << kBackgroundShift);
+        return kMotionAnalyzed;
+    }
+    if (m_nWarmup > 0) {
+        --m_nWarmup;
+        return kMotionAnalyzed;
+    }
+    return update_state(nPtsMs, dRatio, event) ? kMotionEvent : kMotionAnalyzed;
+}
+
+MotionStats MotionDetector::GetStats() const
+{
+    MotionStats stats;
+    stats.nAnalyzed = m_nAnalyzed.load(std::memory_order_relaxed);
+    stats.nEvents = m_nEvents.load(std::memory_order_relaxed);
+    stats.nRelearns = m_nRelearns.load(std::memory_order_relaxed);
+    stats.bMotion = m_bMotion.load(std::memory_order_relaxed);
+    stats.dRatio = m_nRatioPpm.load(std::memory_order_relaxed) / 1000000.0;
+    return stats;
+}
+
+bool MotionDetector::HasLuma(int nFormat)
+{
+    const AVPixFmtDescriptor* pDesc = av_pix_fmt_desc_get((AVPixelFormat)nFormat);
+    if (nullptr == pDesc || pDesc->nb_components < 1
+        || (pDesc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+        return false;
+    // one byte per pixel, nothing else in the plane
+    const AVComponentDescriptor& comp = pDesc->comp[0];
+    return 0 == comp.plane && 1 == comp.step && 0 == comp.offset && 0 == comp.shift && 8 == comp.depth;
+}
+
+int MotionDetector::GetCellShift(int nWidth, int nMaxWidth)
+{
+    int nShift = 0;
+    while (nShift < kMaxCellShift && (nWidth >> nShift) > nMaxWidth)
+        ++nShift;
+    return nShift;
+}
+
+void MotionDetector::Downsample(const uint8_t* pLuma, int nStride, int nWidth, int nHeight, int nShift,
+    uint8_t* pCell, KernelIsa nIsa)
+{
+    int nCellsX = nWidth >> nShift;
+    int nCellsY = nHeight >> nShift;
+    if (nCellsX <= 0 || nCellsY <= 0)
+        return;
+    if (kIsaBest == nIsa || nIsa > ColorKernels::GetBestIsa())
+        nIsa = ColorKernels::GetBestIsa();
+#ifdef FFH_KERNELS_X86
+    // smaller cells only come with small pictures, the scalar code is fast enough there
+    if (nIsa >= kIsaSse41 && nShift >= 3) {
+        downsample_sse41(pLuma, nStride, nCellsX, nCellsY, nShift, pCell);
+        return;
+    }
+#endif
+    downsample_c(pLuma, nStride, nCellsX, nCellsY, nShift, pCell);
+}
+
+int MotionDetector::UpdateBackground(const uint8_t* pCell, uint16_t* pBackground, int nCount, int nThreshold,
+    int nLearnShift, KernelIsa nIsa)
+{
+    if (kIsaBest == nIsa || nIsa > ColorKernels::GetBestIsa())
+        nIsa = ColorKernels::GetBestIsa();
+#ifdef FFH_KERNELS_X86
+    if (nIsa >= kIsaSse41)
+        return update_background_sse41(pCell, pBackground, nCount, nThreshold, nLearnShift);
+#endif
+    return update_background_c(pCell, pBackground, nCount, nThreshold, nLearnShift);
+}
+
+bool MotionDetector::update_state(int64_t nPtsMs, double dRatio, MotionEvent& event)
+{
+    bool bMotion = m_bMotion.load(std::memory_order_relaxed);
+    if (!bMotion) {
+        m_nAbove = dRatio >= m_config.dStartRatio ? m_nAbove + 1 : 0;
+        if (m_nAbove < m_config.nStartFrames)
+            return false;
+        m_nAbove = 0;
+        m_nLastMotionMs = nPtsMs;
+    }
+    else if (dRatio >= m_config.dStopRatio || nPtsMs < m_nLastMotionMs) {
+        m_nLastMotionMs = nPtsMs;
+        return false;
+    }
+    else if (nPtsMs - m_nLastMotionMs < m_config.nStopMs) {
+        return false;
+    }
+    m_bMotion.store(!bMotion, std::memory_order_relaxed);
+    m_nEvents.fetch_add(1, std::memory_order_relaxed);
+    event.bMotion = !bMotion;
+    event.nPtsMs = nPtsMs;
+    event.dRatio = dRatio;
+    return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include "ColorKernels.h"
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// what a stream analyzes, see MotionDetector
+struct MotionConfig
+{
+    bool bEnable = false;
+    int nAnalyzeFps = 5;            // frames analyzed per second of stream time, 0: every frame
+    int nMaxWidth = 160;            // the luma is box averaged by a power of two down to this width or less
+    int nPixelThreshold = 16;       // a cell changed when it differs from the background by more (0-255)
+    int nLearnShift = 5;            // the background moves by 1/2^n of the difference per analyzed frame
+    double dStartRatio = 0.01;      // share of changed cells that counts as motion
+    double dStopRatio = 0.004;      // below this the scene counts as still, between the two nothing changes
+    int nStartFrames = 2;           // analyzed frames in a row over dStartRatio to start
+    int nStopMs = 3000;             // still this long to stop
+    double dRelearnRatio = 0.7;     // more changed at once is a light switch or a moved camera, not motion
+    int nWarmupFrames = 5;          // analyzed frames that only build the background
+    KernelIsa nIsa = kIsaBest;
+};
+
+// a motion start or stop
+struct MotionEvent
+{
+    bool bMotion = false;           // true: started, false: stopped
+    int64_t nPtsMs = 0;             // of the frame that decided it
+    double dRatio = 0;              // changed share of that frame
+};
+
+struct MotionStats
+{
+    uint64_t nAnalyzed = 0;
+    uint64_t nEvents = 0;
+    uint64_t nRelearns = 0;
+    bool bMotion = false;
+    double dRatio = 0;              // of the last analyzed frame
+};
+
+// result of MotionDetector::Analyze
+enum MotionResult
+{
+    kMotionSkipped,         // not due yet (nAnalyzeFps) or no 8 bit luma
+    kMotionAnalyzed,
+    kMotionEvent,           // analyzed and the state changed
+};
+
+// Motion on the luma plane of decoded frames, no color conversion: the picture
+// is box averaged into cells of 2^n x 2^n pixels, every cell is compared with
+// a running average of the scene and updates it in the same pass. The share of
+// changed cells drives a start/stop state with hysteresis. Integer only, every
+// instruction set gives the same cells, background and events. One thread
+// calls Analyze, IsMotion and GetStats may be called from any thread.
+class MotionDetector
+{
+public:
+    MotionDetector();
+    MotionDetector(const MotionDetector&) = delete;
+    MotionDetector& operator=(const MotionDetector&) = delete;
+
+    // forget the scene and the state, the next frames warm up again
+    void Init(const MotionConfig& config);
+    // pFrame: a software frame with 8 bit luma in data[0] (NV12, YUV420P, YUVJ420P, GRAY8 ...)
+    int Analyze(const AVFrame* pFrame, int64_t nPtsMs, MotionEvent& event);
+    bool IsMotion() const { return m_bMotion.load(std::memory_order_relaxed); }
+    MotionStats GetStats() const;
+
+    static bool HasLuma(int nFormat);
+    // cells are 2^shift pixels wide and high
+    static int GetCellShift(int nWidth, int nMaxWidth);
+    // box average of the whole cells, (width >> shift) x (height >> shift), packed
+    static void Downsample(const uint8_t* pLuma, int nStride, int nWidth, int nHeight, int nShift,
+        uint8_t* pCell, KernelIsa nIsa = kIsaBest);
+    // count the cells off the background (Q4) by more than nThreshold and move
+    // the background towards them, return the count
+    static int UpdateBackground(const uint8_t* pCell, uint16_t* pBackground, int nCount, int nThreshold,
+        int nLearnShift, KernelIsa nIsa = kIsaBest);
+
+private:
+    bool update_state(int64_t nPtsMs, double dRatio, MotionEvent& event);
+
+private:
+    MotionConfig m_config;
+    KernelIsa m_nIsa;
+    int m_nWidth;                   // frame size the buffers are for
+    int m_nHeight;
+    int m_nShift;
+    std::vector<uint8_t> m_vecCell;
+    std::vector<uint16_t> m_vecBackground;  // Q4, 16 * luma
+    int64_t m_nNextMs;              // next frame due, AV_NOPTS_VALUE: any
+    int m_nWarmup;                  // analyzed frames left before the first event
+    int m_nAbove;                   // analyzed frames in a row over the start ratio
+    int64_t m_nLastMotionMs;        // last frame that was not still
+    std::atomic<bool> m_bMotion;
+    std::atomic<uint64_t> m_nAnalyzed;
+    std::atomic<uint64_t> m_nEvents;
+    std::atomic<uint64_t> m_nRelearns;
+    std::atomic<int> m_nRatioPpm;   // last ratio, parts per million
+};
@@ -0,0 +1,178 @@
+#include "OutputSink.h"
+#include <cstdio>
+#include "Time.h"
+
+OutputSink::OutputSink()
+    : m_nId(-1)
+    , m_nVideoIndex(-1)
+    , m_pFormatCtx(nullptr)
+    , m_nStartDts(AV_NOPTS_VALUE)
+    , m_tbStart(AVRational{ 1, 1000 })
+    , m_nRetryMs(0)
+    , m_bOpened(false)
+    , m_bStopped(true)
+{
+}
+
+OutputSink::~OutputSink()
+{
+    Stop();
+}
+
+bool OutputSink::Start(int nId, const OutputSinkInfo& infoSink, const std::vector<AVCodecParameters*>& vecCodecPar,
+    const std::vector<AVRational>& vecTimeBase, int nVideoIndex, ThreadPool* pPool)
+{
+    if (m_stage.IsRunning() || vecCodecPar.empty() || vecCodecPar.size() != vecTimeBase.size() || infoSink.strUrl.empty())
+        return false;
+    m_nId = nId;
+    m_infoSink = infoSink;
+    m_nVideoIndex = nVideoIndex;
+    for (size_t nIndex = 0; nIndex < vecCodecPar.size(); ++nIndex)
+    {
+        AVCodecParameters* pCodecPar = avcodec_parameters_alloc();
+        if (nullptr == pCodecPar || avcodec_parameters_copy(pCodecPar, vecCodecPar[nIndex]) < 0) {
+            avcodec_parameters_free(&pCodecPar);
+            free_stream_info();
+            return false;
+        }
+        m_vecCodecPar.push_back(pCodecPar);
+        m_vecTimeBase.push_back(vecTimeBase[nIndex]);
+    }
+    m_nStartDts = AV_NOPTS_VALUE;
+    m_nRetryMs = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mtPush);
+        m_bStopped = false;
+    }
+    // audio and video share the queue, only a video keyframe ends a drop
+    m_stage.SetKeyIndex(nVideoIndex);
+    return m_stage.Start("sink-" + std::to_string(nId), m_infoSink.nQueueSize, m_infoSink.nOverflowPolicy,
+        [this](AVPacket* pPacket) { write_packet(pPacket); }, pPool);
+}
+
+void OutputSink::Stop()
+{
+    // a push blocked on a full queue returns once the ring is closed
+    m_stage.Close();
+    {
+        std::lock_guard<std::mutex> lock(m_mtPush);
+        m_bStopped = true;
+    }
+    m_stage.Stop();
+    close_output();
+    free_stream_info();
+}
+
+bool OutputSink::Push(const AVPacket& packet)
+{
+    std::lock_guard<std::mutex> lock(m_mtPush);
+    if (m_bStopped)
+        return false;
+    return m_stage.Push(packet);
+}
+
+void OutputSink::write_packet(AVPacket* pPacket)
+{
+    if (pPacket->stream_index < 0 || pPacket->stream_index >= (int)m_vecCodecPar.size())
+        return;
+    if (nullptr == m_pFormatCtx) {
+        // (re)open at a keyframe, the target gets a stream it can decode from the start
+        if (m_nVideoIndex >= 0 && !(pPacket->stream_index == m_nVideoIndex && (pPacket->flags & AV_PKT_FLAG_KEY)))
+            return;
+        if (Time::GetMilliTimestamp() < m_nRetryMs || !open_output())
+            return;
+        int64_t nTs = AV_NOPTS_VALUE != pPacket->dts ? pPacket->dts : pPacket->pts;
+        m_nStartDts = AV_NOPTS_VALUE != nTs ? nTs : 0;
+        m_tbStart = m_vecTimeBase[pPacket->stream_index];
+    }
+    AVRational tbIn = m_vecTimeBase[pPacket->stream_index];
+    AVRational tbOut = m_pFormatCtx->streams[pPacket->stream_index]->time_base;
+    int64_t nOffset = av_rescale_q(m_nStartDts, m_tbStart, tbIn);
+    if (AV_NOPTS_VALUE != pPacket->pts)
+        pPacket->pts -= nOffset;
+    if (AV_NOPTS_VALUE != pPacket->dts)
+        pPacket->dts -= nOffset;
+    int64_t nTs = AV_NOPTS_VALUE != pPacket->dts ? pPacket->dts : pPacket->pts;
+    if (AV_NOPTS_VALUE != nTs && nTs < 0)
+        return;
+    // the stage owns this reference, rescale in place and hand it to the muxer
+    av_packet_rescale_ts(pPacket, tbIn, tbOut);
+    pPacket->pos = -1;
+    int nCode = av_interleaved_write_frame(m_pFormatCtx, pPacket);
+    if (nCode < 0) {
+        char szError[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+        av_strerror(nCode, szError, sizeof(szError));
+        printf("Sink %d write failed, %s: %s\n", m_nId, m_infoSink.strUrl.c_str(), szError);
+        close_output();
+        if (m_infoSink.nRetryIntervalMs > 0)
+            m_nRetryMs = Time::GetMilliTimestamp() + m_infoSink.nRetryIntervalMs;
+        else
+            m_nRetryMs = INT64_MAX;
+    }
+}
+
+bool OutputSink::open_output()
+{
+    std::string strFormat = m_infoSink.strFormat.empty() ? guess_format(m_infoSink.strUrl) : m_infoSink.strFormat;
+    avformat_alloc_output_context2(&m_pFormatCtx, NULL, strFormat.empty() ? NULL : strFormat.c_str(),
+        m_infoSink.strUrl.c_str());
+    bool bResult = m_pFormatCtx != nullptr;
+    for (size_t nIndex = 0; bResult && nIndex < m_vecCodecPar.size(); ++nIndex)
+    {
+        AVStream* pOutStream = avformat_new_stream(m_pFormatCtx, nullptr);
+        bResult = pOutStream && avcodec_parameters_copy(pOutStream->codecpar, m_vecCodecPar[nIndex]) >= 0;
+        if (bResult) {
+            pOutStream->codecpar->codec_tag = 0;
+            pOutStream->time_base = m_vecTimeBase[nIndex];
+        }
+    }
+    if (bResult && !(m_pFormatCtx->oformat->flags & AVFMT_NOFILE))
+        bResult = avio_open(&m_pFormatCtx->pb, m_infoSink.strUrl.c_str(), AVIO_FLAG_WRITE) >= 0;
+    if (bResult)
+        bResult = avformat_write_header(m_pFormatCtx, NULL) >= 0;
+    if (!bResult) {
+        printf("Sink %d can't open %s\n", m_nId, m_infoSink.strUrl.c_str());
+        if (m_pFormatCtx) {
+            if (!(m_pFormatCtx->oformat->flags & AVFMT_NOFILE))
+                avio_closep(&m_pFormatCtx->pb);
+            avformat_free_context(m_pFormatCtx);
+            m_pFormatCtx = nullptr;
+        }
+        m_nRetryMs = m_infoSink.nRetryIntervalMs > 0 ? Time::GetMilliTimestamp() + m_infoSink.nRetryIntervalMs : INT64_MAX;
+        return false;
+    }
+    m_bOpened = true;
+    return true;
+}
+
+void OutputSink::close_output()
+{
+    if (nullptr == m_pFormatCtx)
+        return;
+    av_write_trailer(m_pFormatCtx);
+    if (!(m_pFormatCtx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&m_pFormatCtx->pb);
+    avformat_free_context(m_pFormatCtx);
+    m_pFormatCtx = nullptr;
+    m_nStartDts = AV_NOPTS_VALUE;
+    m_bOpened = false;
+}
+
+void OutputSink::free_stream_info()
+{
+    for (AVCodecParameters*& pCodecPar : m_vecCodecPar)
+        avcodec_parameters_free(&pCodecPar);
+    m_vecCodecPar.clear();
+    m_vecTimeBase.clear();
+}
+
+std::string OutputSink::guess_format(const std::string& strUrl)
+{
+    if (0 == strUrl.compare(0, 7, "rtmp://") || 0 == strUrl.compare(0, 8, "rtmps://"))
+        return "flv";
+    if (0 == strUrl.compare(0, 7, "rtsp://"))
+        return "rtsp";
+    if (0 == strUrl.compare(0, 6, "udp://") || 0 == strUrl.compare(0, 5, "pipe:"))
+        return "mpegts";
+    return "";
+}
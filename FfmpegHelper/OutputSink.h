@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include "PipelineStage.h"
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// one output of a stream: file, rtmp, rtsp, udp or pipe
+struct OutputSinkInfo
+{
+    std::string strUrl;
+    std::string strFormat;      // empty: flv for rtmp, rtsp for rtsp, mpegts for udp and pipe, else by file name
+    PacketOverflowPolicy nOverflowPolicy = kOverflowDropUntilKey;   // a slow target must not stall the reader
+    int nQueueSize = 256;
+    int nRetryIntervalMs = 5000;    // reopen after a failed open or write, 0: give up
+};
+
+// Muxes the packets of one stream to one target on its own stage. Every sink
+// gets a reference of the demuxed packet, the payload is shared. The muxer is
+// opened on the stage at the first keyframe, so a slow server never delays
+// the reader, and timestamps start at zero from there.
+class OutputSink
+{
+public:
+    OutputSink();
+    ~OutputSink();
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    // copies the stream parameters, the input may close or reconnect afterwards
+    bool Start(int nId, const OutputSinkInfo& infoSink, const std::vector<AVCodecParameters*>& vecCodecPar,
+        const std::vector<AVRational>& vecTimeBase, int nVideoIndex, ThreadPool* pPool = nullptr);
+    // write what is queued and the trailer, safe while the demux thread pushes
+    void Stop();
+    // demux thread
+    bool Push(const AVPacket& packet);
+    bool IsBlocking() const { return m_stage.IsBlocking(); }
+    int GetId() const { return m_nId; }
+    const OutputSinkInfo& GetInfo() const { return m_infoSink; }
+    bool IsOpened() const { return m_bOpened.load(); }
+    StageStats GetStats() const { return m_stage.GetStats(); }
+    HistogramSnapshot GetLatency() const { return m_stage.GetLatency(); }
+
+private:
+    void write_packet(AVPacket* pPacket);
+    bool open_output();
+    void close_output();
+    void free_stream_info();
+    static std::string guess_format(const std::string& strUrl);
+
+private:
+    int m_nId;
+    OutputSinkInfo m_infoSink;
+    int m_nVideoIndex;
+    std::vector<AVCodecParameters*> m_vecCodecPar;
+    std::vector<AVRational> m_vecTimeBase;
+    PipelineStage m_stage;
+    // sink stage only
+    AVFormatContext* m_pFormatCtx;
+    int64_t m_nStartDts;
+    AVRational m_tbStart;
+    int64_t m_nRetryMs;         // no open before this time
+    std::atomic<bool> m_bOpened;
+    std::mutex m_mtPush;        // Push against Stop
+    bool m_bStopped;
+};
@@ -0,0 +1,282 @@
+#include "PacketRing.h"
+#include <chrono>
+#include <utility>
+
+PacketRing::PacketRing(size_t nCapacity, PacketOverflowPolicy nPolicy)
+    : m_nCapacity(0)
+    , m_nPolicy(nPolicy)
+    , m_nKeyIndex(-1)
+    , m_nHead(0)
+    , m_nTail(0)
+    , m_bClosed(false)
+    , m_bWaitKey(false)
+    , m_nFreeCapacity(0)
+    , m_nFreeHead(0)
+    , m_nFreeTail(0)
+    , m_pSpare(nullptr)
+    , m_nHighWater(0)
+    , m_nPushed(0)
+    , m_nDropped(0)
+    , m_nAllocated(0)
+    , m_nPopWaiter(0)
+    , m_nPushWaiter(0)
+{
+    Init(nCapacity, nPolicy);
+}
+
+PacketRing::~PacketRing()
+{
+    Close();
+    Clear();
+}
+
+void PacketRing::Init(size_t nCapacity, PacketOverflowPolicy nPolicy, int nKeyIndex)
+{
+    Clear();
+    m_nCapacity = nCapacity > 0 ? nCapacity : 1;
+    m_nPolicy = nPolicy;
+    m_nKeyIndex = nKeyIndex;
+    m_pSlots.reset(new std::atomic<AVPacket*>[m_nCapacity]);
+    for (size_t nIndex = 0; nIndex < m_nCapacity; ++nIndex)
+        m_pSlots[nIndex].store(nullptr, std::memory_order_relaxed);
+    m_nFreeCapacity = m_nCapacity + 2;
+    m_pFree.reset(new AVPacket*[m_nFreeCapacity]);
+    m_nFreeHead.store(0);
+    m_nFreeTail.store(0);
+    m_nHead.store(0);
+    m_nTail.store(0);
+    m_bClosed.store(false);
+    m_bWaitKey = false;
+    m_nHighWater.store(0);
+    m_nPushed.store(0);
+    m_nDropped.store(0);
+    m_nAllocated.store(0);
+}
+
+bool PacketRing::Push(const AVPacket& packet)
+{
+    if (m_bClosed.load())
+        return false;
+    // only the key stream waits, other streams never end or take part in the wait
+    bool bKeyStream = m_nKeyIndex < 0 || packet.stream_index == m_nKeyIndex;
+    bool bKey = bKeyStream && (packet.flags & AV_PKT_FLAG_KEY) != 0;
+    if (m_bWaitKey && bKeyStream) {
+        if (!bKey) {
+            m_nDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        m_bWaitKey = false;
+    }
+    AVPacket* pPacket = get_free_packet();
+    if (nullptr == pPacket || av_packet_ref(pPacket, &packet) < 0) {
+        av_packet_free(&pPacket);
+        return false;
+    }
+
+    uint64_t nHead = m_nHead.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint64_t nTail = m_nTail.load(std::memory_order_acquire);
+        if (nHead - nTail < m_nCapacity)
+            break;
+        if (m_bClosed.load()) {
+            put_spare(pPacket);
+            return false;
+        }
+        switch (m_nPolicy)
+        {
+        case kOverflowDropOldest:
+            drop_oldest(nTail);
+            break;
+        case kOverflowDropUntilKey:
+            // a keyframe is worth more than anything queued before it
+            if (bKey) {
+                drop_oldest(nTail);
+                break;
+            }
+            if (bKeyStream)
+                m_bWaitKey = true;
+            m_nDropped.fetch_add(1, std::memory_order_relaxed);
+            put_spare(pPacket);
+            return false;
+        default:
+            wait_for(m_nPushWaiter, -1, false);
+            break;
+        }
+    }
+    m_pSlots[nHead % m_nCapacity].store(pPacket, std::memory_order_relaxed);
+    m_nHead.store(nHead + 1);
+
+    size_t nSize = (size_t)(nHead + 1 - m_nTail.load());
+    if (nSize > m_nHighWater.load(std::memory_order_relaxed))
+        m_nHighWater.store(nSize, std::memory_order_relaxed);
+    m_nPushed.fetch_add(1, std::memory_order_relaxed);
+    wake(m_nPopWaiter);
+    return true;
+}
+
+bool PacketRing::Pop(AVPacket*& pPacket, int nTimeoutMs)
+{
+    if (TryPop(pPacket))
+        return true;
+    if (0 == nTimeoutMs)
+        return false;
+    auto tmDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(nTimeoutMs);
+    while (true)
+    {
+        if (m_bClosed.load())
+            return TryPop(pPacket);
+        int nWaitMs = -1;
+        if (nTimeoutMs > 0) {
+            auto nLeft = std::chrono::duration_cast<std::chrono::milliseconds>(
+                tmDeadline - std::chrono::steady_clock::now()).count();
+            if (nLeft <= 0)
+                return false;
+            nWaitMs = (int)nLeft;
+        }
+        wait_for(m_nPopWaiter, nWaitMs, true);
+        if (TryPop(pPacket))
+            return true;
+    }
+}
+
+bool PacketRing::TryPop(AVPacket*& pPacket)
+{
+    uint64_t nTail = m_nTail.load(std::memory_order_acquire);
+    while (true)
+    {
+        uint64_t nHead = m_nHead.load(std::memory_order_acquire);
+        if (nTail == nHead)
+            return false;
+        AVPacket* pSlot = m_pSlots[nTail % m_nCapacity].load(std::memory_order_acquire);
+        // the producer may have dropped this slot meanwhile, then nTail is reloaded
+        if (m_nTail.compare_exchange_strong(nTail, nTail + 1)) {
+            pPacket = pSlot;
+            wake(m_nPushWaiter);
+            return true;
+        }
+    }
+}
+
+void PacketRing::Recycle(AVPacket*& pPacket)
+{
+    if (nullptr == pPacket)
+        return;
+    av_packet_unref(pPacket);
+    uint64_t nHead = m_nFreeHead.load(std::memory_order_relaxed);
+    if (m_pFree && nHead - m_nFreeTail.load(std::memory_order_acquire) < m_nFreeCapacity) {
+        m_pFree[nHead % m_nFreeCapacity] = pPacket;
+        m_nFreeHead.store(nHead + 1, std::memory_order_release);
+        pPacket = nullptr;
+    }
+    else
+        av_packet_free(&pPacket);
+}
+
+void PacketRing::Close()
+{
+    m_bClosed.store(true);
+    {
+        std::lock_guard<std::mutex> lock(m_mtWait);
+    }
+    m_cvWait.notify_all();
+}
+
+void PacketRing::Clear()
+{
+    if (!m_pSlots)
+        return;
+    AVPacket* pPacket = nullptr;
+    while (TryPop(pPacket))
+        av_packet_free(&pPacket);
+    uint64_t nFreeHead = m_nFreeHead.load();
+    for (uint64_t nPos = m_nFreeTail.load(); nPos != nFreeHead; ++nPos)
+        av_packet_free(&m_pFree[nPos % m_nFreeCapacity]);
+    m_nFreeTail.store(nFreeHead);
+    av_packet_free(&m_pSpare);
+    m_bWaitKey = false;
+}
+
+size_t PacketRing::Size() const
+{
+    uint64_t nTail = m_nTail.load();
+    uint64_t nHead = m_nHead.load();
+    return nHead > nTail ? (size_t)(nHead - nTail) : 0;
+}
+
+PacketRingStats PacketRing::GetStats() const
+{
+    PacketRingStats stats;
+    stats.nCapacity = m_nCapacity;
+    stats.nSize = Size();
+    stats.nHighWater = m_nHighWater.load(std::memory_order_relaxed);
+    stats.nPushed = m_nPushed.load(std::memory_order_relaxed);
+    stats.nDropped = m_nDropped.load(std::memory_order_relaxed);
+    stats.nAllocated = m_nAllocated.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool PacketRing::drop_oldest(uint64_t nTail)
+{
+    AVPacket* pPacket = m_pSlots[nTail % m_nCapacity].load(std::memory_order_acquire);
+    // lose the race against the consumer and there is room again
+    if (!m_nTail.compare_exchange_strong(nTail, nTail + 1))
+        return false;
+    put_spare(pPacket);
+    m_nDropped.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+AVPacket* PacketRing::get_free_packet()
+{
+    if (m_pSpare) {
+        AVPacket* pPacket = m_pSpare;
+        m_pSpare = nullptr;
+        return pPacket;
+    }
+    uint64_t nTail = m_nFreeTail.load(std::memory_order_relaxed);
+    if (nTail != m_nFreeHead.load(std::memory_order_acquire)) {
+        AVPacket* pPacket = m_pFree[nTail % m_nFreeCapacity];
+        m_nFreeTail.store(nTail + 1, std::memory_order_release);
+        return pPacket;
+    }
+    m_nAllocated.fetch_add(1, std::memory_order_relaxed);
+    return av_packet_alloc();
+}
+
+void PacketRing::put_spare(AVPacket*& pPacket)
+{
+    av_packet_unref(pPacket);
+    if (nullptr == m_pSpare)
+        std::swap(m_pSpare, pPacket);
+    else
+        av_packet_free(&pPacket);
+}
+
+void PacketRing::wait_for(std::atomic<int>& nWaiter, int nTimeoutMs, bool bForPop)
+{
+    std::unique_lock<std::mutex> lock(m_mtWait);
+    nWaiter.fetch_add(1);
+    auto ready = [=]() {
+        if (m_bClosed.load())
+            return true;
+        uint64_t nTail = m_nTail.load();
+        uint64_t nHead = m_nHead.load();
+        return bForPop ? nHead != nTail : nHead - nTail < m_nCapacity;
+    };
+    if (nTimeoutMs < 0)
+        m_cvWait.wait(lock, ready);
+    else
+        m_cvWait.wait_for(lock, std::chrono::milliseconds(nTimeoutMs), ready);
+    nWaiter.fetch_sub(1);
+}
+
+void PacketRing::wake(std::atomic<int>& nWaiter)
+{
+    if (nWaiter.load() > 0) {
+        {
+            std::lock_guard<std::mutex> lock(m_mtWait);
+        }
+        m_cvWait.notify_all();
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// what Push does when the ring is full
+enum PacketOverflowPolicy
+{
+    kOverflowBlock,         // wait for the consumer
+    kOverflowDropOldest,    // discard the oldest queued packet
+    kOverflowDropUntilKey,  // discard the new packet and every non-key video packet until the next video keyframe
+};
+
+struct PacketRingStats
+{
+    size_t nCapacity = 0;
+    size_t nSize = 0;
+    size_t nHighWater = 0;
+    uint64_t nPushed = 0;
+    uint64_t nDropped = 0;
+    uint64_t nAllocated = 0;        // packets allocated, flat once recycling keeps up
+};
+
+// Fixed capacity single-producer/single-consumer ring of refcounted packets.
+// Push and Pop never take a lock, the mutex is only used to park a side that
+// has to wait (full ring with kOverflowBlock, or empty ring). Packets given
+// back with Recycle travel back to the producer through a second ring of the
+// same capacity, so a steady stream allocates no AVPacket.
+class PacketRing
+{
+public:
+    explicit PacketRing(size_t nCapacity = 256, PacketOverflowPolicy nPolicy = kOverflowBlock);
+    ~PacketRing();
+    PacketRing(const PacketRing&) = delete;
+    PacketRing& operator=(const PacketRing&) = delete;
+
+    // resize and reopen the ring, only while neither side is running. With
+    // nKeyIndex set, kOverflowDropUntilKey only waits for keyframes of that
+    // stream: audio packets are all flagged key and pass, or drop alone when full
+    void Init(size_t nCapacity, PacketOverflowPolicy nPolicy, int nKeyIndex = -1);
+    // producer: queue a new reference (av_packet_ref) of the packet,
+    // return false if the packet was dropped or the ring is closed
+    bool Push(const AVPacket& packet);
+    // consumer: wait up to nTimeoutMs (-1 forever) for a packet, the caller owns it
+    // and gives it back with Recycle (or av_packet_free). Return false on timeout or closed and empty
+    bool Pop(AVPacket*& pPacket, int nTimeoutMs = -1);
+    bool TryPop(AVPacket*& pPacket);
+    // consumer: unref a popped packet and keep it for a later Push
+    void Recycle(AVPacket*& pPacket);
+    // wake up both sides, later pushes are refused, queued packets can still be popped
+    void Close();
+    bool IsClosed() const { return m_bClosed.load(); }
+    // free the queued and the recycled packets
+    void Clear();
+    size_t Size() const;
+    PacketRingStats GetStats() const;
+
+private:
+    bool drop_oldest(uint64_t nTail);
+    AVPacket* get_free_packet();
+    void put_spare(AVPacket*& pPacket);
+    void wait_for(std::atomic<int>& nWaiter, int nTimeoutMs, bool bForPop);
+    void wake(std::atomic<int>& nWaiter);
+
+private:
+    size_t m_nCapacity;
+    PacketOverflowPolicy m_nPolicy;
+    int m_nKeyIndex;                    // -1: every packet is of the key stream
+    std::unique_ptr<std::atomic<AVPacket*>[]> m_pSlots;
+    // monotonic positions, slot = position % capacity
+    std::atomic<uint64_t> m_nHead;      // written by the producer
+    std::atomic<uint64_t> m_nTail;      // advanced by the consumer, or by the producer dropping
+    std::atomic<bool> m_bClosed;
+    bool m_bWaitKey;                    // producer only
+    // recycled packets, the consumer adds at m_nFreeHead, the producer takes at m_nFreeTail.
+    // Room for a full ring plus the packet each side holds
+    size_t m_nFreeCapacity;
+    std::unique_ptr<AVPacket*[]> m_pFree;
+    std::atomic<uint64_t> m_nFreeHead;
+    std::atomic<uint64_t> m_nFreeTail;
+    AVPacket* m_pSpare;                 // producer only, a dropped packet
+
+    std::atomic<size_t> m_nHighWater;
+    std::atomic<uint64_t> m_nPushed;
+    std::atomic<uint64_t> m_nDropped;
+    std::atomic<uint64_t> m_nAllocated;
+
+    // parking
+    std::mutex m_mtWait;
+    std::condition_variable m_cvWait;
+    std::atomic<int> m_nPopWaiter;
+    std::atomic<int> m_nPushWaiter;
+};
@@ -0,0 +1,127 @@
+#include "PipelineStage.h"
+#include <chrono>
+#include <cstdio>
+
+void StageCounter::Fill(StageStats& stats) const
+{
+    HistogramSnapshot snapshot = m_histLatency.Snapshot();
+    stats.nProcessed = snapshot.nCount;
+    stats.dAvgLatencyMs = snapshot.AverageMs();
+    stats.dP50LatencyMs = snapshot.PercentileMs(0.5);
+    stats.dP99LatencyMs = snapshot.PercentileMs(0.99);
+    stats.dMaxLatencyMs = snapshot.nMaxUs / 1000.0;
+}
+
+bool PipelineStage::Start(const std::string& strName, size_t nQueueSize,
+    PacketOverflowPolicy nPolicy, Handler handler, ThreadPool* pPool)
+{
+    if (m_bRunning)
+        return false;
+    m_strName = strName;
+    m_nPolicy = nPolicy;
+    m_handler = handler;
+    m_pPool = pPool;
+    m_bScheduled = false;
+    m_nDraining = 0;
+    m_counter.Reset();
+    m_ringPacket.Init(nQueueSize, nPolicy, m_nKeyIndex);
+    m_bRunning = true;
+    if (nullptr == m_pPool)
+        m_thStage = std::thread(std::bind(&PipelineStage::run, this));
+    return true;
+}
+
+void PipelineStage::Stop()
+{
+    m_ringPacket.Close();
+    if (m_thStage.joinable())
+        m_thStage.join();
+    if (m_pPool) {
+        // wait for the drain task in flight, then handle the rest here
+        std::unique_lock<std::mutex> lock(m_mtDrain);
+        m_cvDrain.wait(lock, [this]() { return !m_bScheduled.load() && 0 == m_nDraining; });
+        AVPacket* pPacket = nullptr;
+        while (m_ringPacket.TryPop(pPacket))
+            handle(pPacket);
+        m_pPool = nullptr;
+    }
+    m_ringPacket.Clear();
+    m_bRunning = false;
+}
+
+bool PipelineStage::IsBlocking() const
+{
+    return m_bRunning && kOverflowBlock == m_nPolicy
+        && m_ringPacket.Size() >= m_ringPacket.GetStats().nCapacity;
+}
+
+bool PipelineStage::Push(const AVPacket& packet)
+{
+    if (!m_bRunning)
+        return false;
+    if (!m_ringPacket.Push(packet))
+        return false;
+    if (m_pPool)
+        schedule();
+    return true;
+}
+
+StageStats PipelineStage::GetStats() const
+{
+    StageStats stats;
+    stats.strName = m_strName;
+    PacketRingStats statsRing = m_ringPacket.GetStats();
+    stats.nQueueDepth = statsRing.nSize;
+    stats.nQueueHighWater = statsRing.nHighWater;
+    stats.nDropped = statsRing.nDropped;
+    stats.nPacketAlloc = statsRing.nAllocated;
+    m_counter.Fill(stats);
+    return stats;
+}
+
+void PipelineStage::run()
+{
+    AVPacket* pPacket = nullptr;
+    // only fails once the ring is closed and drained
+    while (m_ringPacket.Pop(pPacket))
+        handle(pPacket);
+}
+
+void PipelineStage::schedule()
+{
+    if (m_bScheduled.exchange(true))
+        return;
+    if (!m_pPool->Post([this]() { drain(); })) {
+        // pool stopped, Stop() drains the ring
+        printf("Stage %s can't be scheduled\n", m_strName.c_str());
+        m_bScheduled = false;
+    }
+}
+
+void PipelineStage::drain()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtDrain);
+        ++m_nDraining;
+    }
+    AVPacket* pPacket = nullptr;
+    for (int nCount = 0; nCount < kDrainBatch && m_ringPacket.TryPop(pPacket); ++nCount)
+        handle(pPacket);
+    m_bScheduled = false;
+    // packets pushed while we were finishing, or a batch left over
+    if (m_ringPacket.Size() > 0 && !m_ringPacket.IsClosed())
+        schedule();
+    // Stop() may destroy the stage once this is released
+    std::lock_guard<std::mutex> lock(m_mtDrain);
+    --m_nDraining;
+    m_cvDrain.notify_all();
+}
+
+void PipelineStage::handle(AVPacket* pPacket)
+{
+    auto tmStart = std::chrono::steady_clock::now();
+    m_handler(pPacket);
+    m_counter.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - tmStart).count());
+    m_ringPacket.Recycle(pPacket);
+}
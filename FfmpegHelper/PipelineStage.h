@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "PacketRing.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+
+// snapshot of one pipeline stage
+struct StageStats
+{
+    std::string strName;
+    size_t nQueueDepth = 0;
+    size_t nQueueHighWater = 0;
+    uint64_t nDropped = 0;
+    uint64_t nProcessed = 0;
+    uint64_t nPacketAlloc = 0;  // AVPackets allocated by the queue, flat in steady state
+    double dAvgLatencyMs = 0;   // time spent handling one packet
+    double dP50LatencyMs = 0;
+    double dP99LatencyMs = 0;
+    double dMaxLatencyMs = 0;
+};
+
+// processed count and handling time of a stage
+class StageCounter
+{
+public:
+    void Record(int64_t nLatencyUs) { m_histLatency.Record(nLatencyUs); }
+    void Reset() { m_histLatency.Reset(); }
+    void Fill(StageStats& stats) const;
+    HistogramSnapshot Snapshot(const std::string& strName) const { return m_histLatency.Snapshot(strName); }
+
+private:
+    LatencyHistogram m_histLatency;
+};
+
+// One step of the demux -> decode -> mux pipeline: a bounded PacketRing fed by
+// the demux thread, and a consumer calling the handler for each packet. The
+// consumer is either a dedicated thread, or drain tasks on a shared pool of
+// which at most one runs at a time, so packets stay in order.
+class PipelineStage
+{
+    const static int kDrainBatch = 32;  // packets per pool task before yielding the worker
+
+public:
+    using Handler = std::function<void(AVPacket* pPacket)>;
+
+    PipelineStage() : m_nPolicy(kOverflowBlock), m_nKeyIndex(-1), m_pPool(nullptr), m_bScheduled(false), m_nDraining(0), m_bRunning(false) {}
+    ~PipelineStage() { Stop(); }
+    PipelineStage(const PipelineStage&) = delete;
+    PipelineStage& operator=(const PipelineStage&) = delete;
+
+    // the stream whose keyframes end a kOverflowDropUntilKey wait, set before Start
+    void SetKeyIndex(int nKeyIndex) { m_nKeyIndex = nKeyIndex; }
+    // pPool nullptr: run on a dedicated thread
+    bool Start(const std::string& strName, size_t nQueueSize, PacketOverflowPolicy nPolicy, Handler handler,
+        ThreadPool* pPool = nullptr);
+    // refuse new packets, let the handler drain the queue and wait for the consumer
+    void Stop();
+    // refuse new packets and wake a blocked producer, Stop still has to follow
+    void Close() { m_ringPacket.Close(); }
+    bool IsRunning() const { return m_bRunning; }
+    // a kOverflowBlock stage that would block the producer on the next push
+    bool IsBlocking() const;
+    // called from the demux thread, return false if the packet was dropped
+    bool Push(const AVPacket& packet);
+    StageStats GetStats() const;
+    HistogramSnapshot GetLatency() const { return m_counter.Snapshot(m_strName); }
+
+private:
+    void run();
+    void schedule();
+    void drain();
+    void handle(AVPacket* pPacket);
+
+private:
+    std::string m_strName;
+    PacketRing m_ringPacket;
+    PacketOverflowPolicy m_nPolicy;
+    int m_nKeyIndex;
+    Handler m_handler;
+    StageCounter m_counter;
+    std::thread m_thStage;
+    // shared pool mode
+    ThreadPool* m_pPool;
+    std::atomic<bool> m_bScheduled;
+    std::mutex m_mtDrain;
+    std::condition_variable m_cvDrain;
+    int m_nDraining;
+    bool m_bRunning;
+};
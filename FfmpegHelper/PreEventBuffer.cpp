@@ -0,0 +1,133 @@
+#include "PreEventBuffer.h"
+
+PreEventBuffer::PreEventBuffer()
+    : m_nVideoIndex(-1)
+    , m_nMaxDurationMs(0)
+    , m_nMaxBytes(0)
+    , m_nBytes(0)
+    , m_nAllocated(0)
+{
+}
+
+PreEventBuffer::~PreEventBuffer()
+{
+    Clear();
+    for (AVPacket*& pPacket : m_vecFree)
+        av_packet_free(&pPacket);
+}
+
+void PreEventBuffer::Init(int nVideoIndex, int64_t nMaxDurationMs, int64_t nMaxBytes)
+{
+    Clear();
+    m_nVideoIndex = nVideoIndex;
+    m_nMaxDurationMs = nMaxDurationMs > 0 ? nMaxDurationMs : 0;
+    m_nMaxBytes = nMaxBytes;
+}
+
+void PreEventBuffer::Push(const AVPacket& packet, int64_t nTsMs)
+{
+    if (!IsEnabled())
+        return;
+    bool bKey = is_key(packet);
+    // never start with a packet that can't be decoded on its own
+    if (m_deqEntry.empty() && !bKey)
+        return;
+    AVPacket* pPacket = get_free_packet();
+    if (nullptr == pPacket)
+        return;
+    if (av_packet_ref(pPacket, &packet) < 0) {
+        av_packet_free(&pPacket);
+        return;
+    }
+    m_deqEntry.push_back({ pPacket, nTsMs, bKey });
+    m_nBytes += pPacket->size;
+    if (bKey)
+        m_deqKeyMs.push_back(nTsMs);
+    trim();
+}
+
+void PreEventBuffer::Collect(int64_t nPreMs, std::vector<AVPacket*>& vecPacket) const
+{
+    if (m_deqEntry.empty())
+        return;
+    int64_t nStartMs = m_deqEntry.back().nTsMs - nPreMs;
+    size_t nStart = 0;
+    for (size_t nIndex = 0; nIndex < m_deqEntry.size() && m_deqEntry[nIndex].nTsMs <= nStartMs; ++nIndex)
+    {
+        if (m_deqEntry[nIndex].bKey)
+            nStart = nIndex;
+    }
+    vecPacket.reserve(vecPacket.size() + m_deqEntry.size() - nStart);
+    for (size_t nIndex = nStart; nIndex < m_deqEntry.size(); ++nIndex)
+    {
+        AVPacket* pPacket = av_packet_alloc();
+        if (pPacket && av_packet_ref(pPacket, m_deqEntry[nIndex].pPacket) >= 0)
+            vecPacket.push_back(pPacket);
+        else
+            av_packet_free(&pPacket);
+    }
+}
+
+void PreEventBuffer::Clear()
+{
+    while (!m_deqEntry.empty())
+        pop_front();
+    m_nBytes = 0;
+    m_deqKeyMs.clear();
+}
+
+int64_t PreEventBuffer::GetDurationMs() const
+{
+    return m_deqEntry.empty() ? 0 : m_deqEntry.back().nTsMs - m_deqEntry.front().nTsMs;
+}
+
+bool PreEventBuffer::is_key(const AVPacket& packet) const
+{
+    if (m_nVideoIndex < 0)
+        return true;
+    return packet.stream_index == m_nVideoIndex && (packet.flags & AV_PKT_FLAG_KEY);
+}
+
+AVPacket* PreEventBuffer::get_free_packet()
+{
+    if (m_vecFree.empty()) {
+        m_nAllocated.fetch_add(1, std::memory_order_relaxed);
+        return av_packet_alloc();
+    }
+    AVPacket* pPacket = m_vecFree.back();
+    m_vecFree.pop_back();
+    return pPacket;
+}
+
+void PreEventBuffer::pop_front()
+{
+    Entry& entry = m_deqEntry.front();
+    m_nBytes -= entry.pPacket->size;
+    if (entry.bKey)
+        m_deqKeyMs.pop_front();
+    if (m_vecFree.size() < kMaxFreePacket) {
+        av_packet_unref(entry.pPacket);
+        m_vecFree.push_back(entry.pPacket);
+    }
+    else
+        av_packet_free(&entry.pPacket);
+    m_deqEntry.pop_front();
+}
+
+void PreEventBuffer::trim()
+{
+    // drop the oldest GOP while the next one still reaches back far enough,
+    // or while over the byte limit
+    while (m_deqKeyMs.size() > 1
+        && (m_deqEntry.back().nTsMs - m_deqKeyMs[1] >= m_nMaxDurationMs
+        || (m_nMaxBytes > 0 && m_nBytes > m_nMaxBytes)))
+    {
+        do
+        {
+            pop_front();
+        } while (!m_deqEntry.front().bKey);
+    }
+    // a single GOP over the byte limit is useless in part, wait for the next keyframe
+    if (m_nMaxBytes > 0 && m_nBytes > m_nMaxBytes)
+        Clear();
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <deque>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// The last seconds of compressed packets of all streams, kept as references
+// so no payload is copied. Trimmed by whole GOPs: the oldest packet is always
+// a video keyframe and a clip can start from it. Demux thread only, except GetAllocated.
+class PreEventBuffer
+{
+public:
+    PreEventBuffer();
+    ~PreEventBuffer();
+    PreEventBuffer(const PreEventBuffer&) = delete;
+    PreEventBuffer& operator=(const PreEventBuffer&) = delete;
+
+    // nVideoIndex -1: every packet starts a GOP; nMaxDurationMs 0 disables the buffer
+    void Init(int nVideoIndex, int64_t nMaxDurationMs, int64_t nMaxBytes);
+    bool IsEnabled() const { return m_nMaxDurationMs > 0; }
+    // nTsMs: packet time in milliseconds, comparable between streams
+    void Push(const AVPacket& packet, int64_t nTsMs);
+    // new references from the last keyframe at least nPreMs before the newest
+    // packet, oldest first; the caller frees them with av_packet_free
+    void Collect(int64_t nPreMs, std::vector<AVPacket*>& vecPacket) const;
+    void Clear();
+
+    size_t GetCount() const { return m_deqEntry.size(); }
+    int64_t GetBytes() const { return m_nBytes; }
+    int64_t GetDurationMs() const;
+    // packets allocated so far, flat once the buffer is full
+    uint64_t GetAllocated() const { return m_nAllocated.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry
+    {
+        AVPacket* pPacket;
+        int64_t nTsMs;
+        bool bKey;
+    };
+    bool is_key(const AVPacket& packet) const;
+    AVPacket* get_free_packet();
+    void pop_front();
+    void trim();
+
+private:
+    int m_nVideoIndex;
+    int64_t m_nMaxDurationMs;
+    int64_t m_nMaxBytes;
+    int64_t m_nBytes;
+    std::deque<int64_t> m_deqKeyMs;    // time of every buffered keyframe
+    std::deque<Entry> m_deqEntry;
+    // trimmed packets, reused by Push; a GOP is trimmed at once
+    std::vector<AVPacket*> m_vecFree;
+    std::atomic<uint64_t> m_nAllocated;
+    const static size_t kMaxFreePacket = 256;
+};
@@ -0,0 +1,192 @@
+#include "SnapshotWriter.h"
+#include <cstdio>
+#include <chrono>
+#include <opencv2/imgcodecs.hpp>
+#include "Time.h"
+
+SnapshotWriter::SnapshotWriter()
+    : m_pPool(nullptr)
+    , m_bRunning(false)
+    , m_nLastSampleMs(0)
+    , m_nPending(0)
+    , m_nBatchOldestMs(0)
+    , m_bFlushPosted(false)
+    , m_nSampled(0)
+    , m_nWritten(0)
+    , m_nDropped(0)
+    , m_nFailed(0)
+{
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    Stop();
+}
+
+void SnapshotWriter::Start(ThreadPool* pPool, const SnapshotConfig& config, NameGenerator fnName)
+{
+    m_pPool = pPool;
+    m_config = config;
+    m_fnName = fnName;
+    m_nLastSampleMs = 0;
+    m_bRunning = m_pPool != nullptr;
+}
+
+void SnapshotWriter::Stop()
+{
+    if (!m_bRunning.exchange(false))
+        return;
+    {
+        std::unique_lock<std::mutex> lock(m_mtPending);
+        m_cvPending.wait(lock, [this]() { return 0 == m_nPending.load(); });
+    }
+    flush(true);
+}
+
+void SnapshotWriter::Offer(const FrameHandle& frame)
+{
+    if (!m_bRunning || frame.Empty())
+        return;
+    if (m_config.bKeyFrameOnly && !frame.IsKeyFrame())
+        return;
+    int64_t nNowMs = Time::GetMilliTimestamp();
+    if (m_config.nIntervalMs > 0 && nNowMs - m_nLastSampleMs < m_config.nIntervalMs)
+        return;
+    m_nLastSampleMs = nNowMs;
+    ++m_nSampled;
+    if (m_nPending.load() >= m_config.nMaxPending) {
+        ++m_nDropped;
+        return;
+    }
+    ++m_nPending;
+    // a Stop in between may have seen no pending encode already, nothing is posted then
+    bool bPosted = false;
+    if (m_bRunning.load()) {
+        std::string strFilename = m_fnName();
+        bPosted = m_pPool->TryPost([this, frame, strFilename]() {
+            encode(frame, strFilename);
+        }, kPriorityLow);
+    }
+    if (!bPosted) {
+        ++m_nDropped;
+        finish_pending();
+    }
+}
+
+void SnapshotWriter::Poll()
+{
+    int64_t nOldestMs = m_nBatchOldestMs.load(std::memory_order_relaxed);
+    if (0 == nOldestMs || Time::GetMilliTimestamp() - nOldestMs < m_config.nBatchDelayMs)
+        return;
+    if (!m_bRunning || m_bFlushPosted.exchange(true))
+        return;
+    // counted as pending so Stop waits for it
+    ++m_nPending;
+    bool bPosted = false;
+    if (m_bRunning.load()) {
+        bPosted = m_pPool->TryPost([this]() {
+            flush(false);
+            m_bFlushPosted = false;
+            finish_pending();
+        }, kPriorityLow);
+    }
+    if (!bPosted) {
+        m_bFlushPosted = false;
+        finish_pending();
+    }
+}
+
+void SnapshotWriter::finish_pending()
+{
+    std::lock_guard<std::mutex> lock(m_mtPending);
+    --m_nPending;
+    m_cvPending.notify_all();
+}
+
+void SnapshotWriter::GetLatency(std::vector<HistogramSnapshot>& vecLatency) const
+{
+    vecLatency.push_back(m_histConvert.Snapshot("convert"));
+    vecLatency.push_back(m_histEncode.Snapshot("jpeg_encode"));
+    vecLatency.push_back(m_histWrite.Snapshot("jpeg_write"));
+}
+
+SnapshotStats SnapshotWriter::GetStats() const
+{
+    SnapshotStats stats;
+    stats.nSampled = m_nSampled.load();
+    stats.nWritten = m_nWritten.load();
+    stats.nDropped = m_nDropped.load();
+    stats.nFailed = m_nFailed.load();
+    return stats;
+}
+
+void SnapshotWriter::encode(const FrameHandle& frame, const std::string& strFilename)
+{
+    EncodedFile file;
+    file.strFilename = strFilename;
+    {
+        std::lock_guard<std::mutex> lock(m_mtBatch);
+        if (!m_vecFreeBuffer.empty()) {
+            file.vecData.swap(m_vecFreeBuffer.back());
+            m_vecFreeBuffer.pop_back();
+        }
+    }
+    // the BGR conversion happens here, on the pool, not on the decode thread
+    auto tmStart = std::chrono::steady_clock::now();
+    cv::Mat image = frame.BgrView();
+    auto tmConverted = std::chrono::steady_clock::now();
+    m_histConvert.Record(std::chrono::duration_cast<std::chrono::microseconds>(tmConverted - tmStart).count());
+    std::vector<int> vecParam = { cv::IMWRITE_JPEG_QUALITY, m_config.nQuality };
+    bool bEncoded = !image.empty() && cv::imencode(".jpg", image, file.vecData, vecParam);
+    m_histEncode.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - tmConverted).count());
+    if (bEncoded) {
+        file.nEncodeMs = Time::GetMilliTimestamp();
+        std::lock_guard<std::mutex> lock(m_mtBatch);
+        if (m_vecBatch.empty())
+            m_nBatchOldestMs = file.nEncodeMs;
+        m_vecBatch.push_back(std::move(file));
+    }
+    else {
+        ++m_nFailed;
+        std::lock_guard<std::mutex> lock(m_mtBatch);
+        m_vecFreeBuffer.push_back(std::move(file.vecData));
+    }
+    flush(false);
+    finish_pending();
+}
+
+void SnapshotWriter::flush(bool bForce)
+{
+    std::vector<EncodedFile> vecWrite;
+    {
+        std::lock_guard<std::mutex> lock(m_mtBatch);
+        if (m_vecBatch.empty())
+            return;
+        bool bFull = (int)m_vecBatch.size() >= m_config.nBatchSize;
+        bool bOld = Time::GetMilliTimestamp() - m_vecBatch.front().nEncodeMs >= m_config.nBatchDelayMs;
+        if (!(bForce || bFull || bOld))
+            return;
+        vecWrite.swap(m_vecBatch);
+        m_nBatchOldestMs = 0;
+    }
+    for (auto& file : vecWrite)
+    {
+        auto tmStart = std::chrono::steady_clock::now();
+        FILE* pFile = fopen(file.strFilename.c_str(), "wb");
+        if (pFile && fwrite(file.vecData.data(), 1, file.vecData.size(), pFile) == file.vecData.size())
+            ++m_nWritten;
+        else
+            ++m_nFailed;
+        if (pFile)
+            fclose(pFile);
+        m_histWrite.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - tmStart).count());
+    }
+    std::lock_guard<std::mutex> lock(m_mtBatch);
+    for (auto& file : vecWrite)
+    {
+        file.vecData.clear();
+        m_vecFreeBuffer.push_back(std::move(file.vecData));
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include "FrameHandle.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+
+struct SnapshotConfig
+{
+    int nIntervalMs = 1000;         // minimum time between two snapshots, 0 takes every frame
+    bool bKeyFrameOnly = false;     // only sample keyframes
+    int nQuality = 85;              // jpeg quality
+    int nMaxPending = 2;            // encodes in flight, further frames are dropped
+    int nBatchSize = 4;             // files written together
+    int nBatchDelayMs = 2000;       // write a partial batch once its oldest file is this old
+};
+
+struct SnapshotStats
+{
+    uint64_t nSampled = 0;
+    uint64_t nWritten = 0;
+    uint64_t nDropped = 0;          // encoder behind or pool full
+    uint64_t nFailed = 0;
+};
+
+// Samples decoded frames and writes them as jpeg. Conversion and encoding run
+// on the pool at low priority into reused buffers, the files are written in
+// batches. When the encoder falls behind frames are dropped, never queued.
+class SnapshotWriter
+{
+public:
+    using NameGenerator = std::function<std::string()>;
+
+    SnapshotWriter();
+    ~SnapshotWriter();
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    void Start(ThreadPool* pPool, const SnapshotConfig& config, NameGenerator fnName);
+    // wait for the encodes in flight and write what is batched
+    void Stop();
+    // decode thread, cheap when the frame is not sampled
+    void Offer(const FrameHandle& frame);
+    // called often (demux thread): writes a partial batch once it is nBatchDelayMs
+    // old, also when no further snapshot comes to do it
+    void Poll();
+    SnapshotStats GetStats() const;
+    // convert, jpeg encode and file write times
+    void GetLatency(std::vector<HistogramSnapshot>& vecLatency) const;
+
+private:
+    struct EncodedFile
+    {
+        std::string strFilename;
+        std::vector<uchar> vecData;
+        int64_t nEncodeMs = 0;
+    };
+    void encode(const FrameHandle& frame, const std::string& strFilename);
+    void flush(bool bForce);
+    void finish_pending();
+
+private:
+    ThreadPool* m_pPool;
+    SnapshotConfig m_config;
+    NameGenerator m_fnName;
+    std::atomic<bool> m_bRunning;   // Stop may come from another thread than Offer
+    int64_t m_nLastSampleMs;        // decode thread only
+
+    std::atomic<int> m_nPending;
+    std::mutex m_mtPending;
+    std::condition_variable m_cvPending;
+
+    std::mutex m_mtBatch;
+    std::vector<EncodedFile> m_vecBatch;
+    std::atomic<int64_t> m_nBatchOldestMs;  // encode time of the first batched file, 0: empty
+    std::atomic<bool> m_bFlushPosted;
+    std::vector<std::vector<uchar>> m_vecFreeBuffer;   // encode buffers keep their capacity
+
+    std::atomic<uint64_t> m_nSampled;
+    std::atomic<uint64_t> m_nWritten;
+    std::atomic<uint64_t> m_nDropped;
+    std::atomic<uint64_t> m_nFailed;
+    LatencyHistogram m_histConvert;
+    LatencyHistogram m_histEncode;
+    LatencyHistogram m_histWrite;
+};
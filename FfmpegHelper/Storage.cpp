@@ -0,0 +1,126 @@
+#include "Storage.h"
+#include <cstdio>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+Storage& Storage::Instance()
+{
+    static Storage storage;
+    return storage;
+}
+
+Storage::Storage()
+{
+    // a single thread keeps the requests in order
+    m_poolIo.Start(1, 1, kMaxQueue);
+}
+
+Storage::~Storage()
+{
+    m_poolIo.Stop();
+}
+
+bool Storage::MakeDirectory(const std::string& strPath)
+{
+#ifdef _WIN32
+    return 0 == _mkdir(strPath.c_str()) || 0 == _access(strPath.c_str(), 0);
+#else
+    if (0 == mkdir(strPath.c_str(), 0755))
+        return true;
+    struct stat info;
+    return EEXIST == errno && 0 == stat(strPath.c_str(), &info) && S_ISDIR(info.st_mode);
+#endif
+}
+
+bool Storage::Exists(const std::string& strPath)
+{
+#ifdef _WIN32
+    return 0 == _access(strPath.c_str(), 0);
+#else
+    return 0 == access(strPath.c_str(), F_OK);
+#endif
+}
+
+bool Storage::RemoveFile(const std::string& strPath)
+{
+    return 0 == remove(strPath.c_str());
+}
+
+bool Storage::RenameFile(const std::string& strFrom, const std::string& strTo)
+{
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows
+    remove(strTo.c_str());
+#endif
+    return 0 == rename(strFrom.c_str(), strTo.c_str());
+}
+
+bool Storage::ListDirectory(const std::string& strPath, std::vector<StorageEntry>& vecEntry)
+{
+#ifdef _WIN32
+    _finddata64_t info;
+    intptr_t hFind = _findfirst64((strPath + "/*").c_str(), &info);
+    if (-1 == hFind)
+        return false;
+    do
+    {
+        std::string strName = info.name;
+        if ("." == strName || ".." == strName)
+            continue;
+        StorageEntry entry;
+        entry.strName = strName;
+        entry.bDirectory = 0 != (info.attrib & _A_SUBDIR);
+        entry.nSize = info.size;
+        entry.tmWrite = (time_t)info.time_write;
+        vecEntry.push_back(entry);
+    } while (0 == _findnext64(hFind, &info));
+    _findclose(hFind);
+#else
+    DIR* pDir = opendir(strPath.c_str());
+    if (nullptr == pDir)
+        return false;
+    while (struct dirent* pItem = readdir(pDir))
+    {
+        std::string strName = pItem->d_name;
+        if ("." == strName || ".." == strName)
+            continue;
+        struct stat info;
+        if (0 != stat((strPath + "/" + strName).c_str(), &info))
+            continue;
+        StorageEntry entry;
+        entry.strName = strName;
+        entry.bDirectory = S_ISDIR(info.st_mode);
+        entry.nSize = (int64_t)info.st_size;
+        entry.tmWrite = info.st_mtime;
+        vecEntry.push_back(entry);
+    }
+    closedir(pDir);
+#endif
+    return true;
+}
+
+std::string Storage::GetWorkingDirectory()
+{
+    char szPath[4096] = { 0 };
+#ifdef _WIN32
+    if (nullptr == _getcwd(szPath, sizeof(szPath)))
+        return "";
+#else
+    if (nullptr == getcwd(szPath, sizeof(szPath)))
+        return "";
+#endif
+    return szPath;
+}
+
+void Storage::Drain()
+{
+    m_poolIo.Commit([]() {}).wait();
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <functional>
+#include <ctime>
+#include <cstdint>
+#include "ThreadPool.h"
+
+// one entry of a directory listing
+struct StorageEntry
+{
+    std::string strName;
+    bool bDirectory = false;
+    int64_t nSize = 0;
+    time_t tmWrite = 0;
+};
+
+// File system calls on Windows (CRT) and Linux (POSIX), plus one process wide
+// I/O thread for the slow ones: mkdir, rename and unlink of retention run
+// there in order and never on a demux or mux thread.
+class Storage
+{
+    const static size_t kMaxQueue = 4096;
+
+public:
+    static Storage& Instance();
+    ~Storage();
+
+    // true if the directory exists afterwards, parents must exist
+    static bool MakeDirectory(const std::string& strPath);
+    static bool Exists(const std::string& strPath);
+    static bool RemoveFile(const std::string& strPath);
+    // replaces strTo
+    static bool RenameFile(const std::string& strFrom, const std::string& strTo);
+    // entries of strPath, without "." and ".."
+    static bool ListDirectory(const std::string& strPath, std::vector<StorageEntry>& vecEntry);
+    static std::string GetWorkingDirectory();
+
+    // run on the I/O thread, false if the queue is full
+    template<class F>
+    bool Post(F&& f)
+    {
+        return m_poolIo.TryPost(std::forward<F>(f));
+    }
+    // wait until everything posted so far has run
+    void Drain();
+    size_t GetQueueSize() { return m_poolIo.GetQueueSize(); }
+
+private:
+    Storage();
+    Storage(const Storage&) = delete;
+    Storage& operator=(const Storage&) = delete;
+
+private:
+    ThreadPool m_poolIo;
+};
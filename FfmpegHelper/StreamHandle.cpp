@@ -1,8 +1,11 @@
 #include "StreamHandle.h"
-#include <direct.h>
-#include <io.h>
 #include <iostream>
+#include <algorithm>
 #include "Time.h"
+#include "Storage.h"
+extern "C" {
+#include <libavutil/hwcontext.h>
+}
 
 
 static std::string kVidoeType = ".mp4";
@@ -13,7 +16,12 @@ static std::string kPictureDir = "picture";
 // return: 0(continue original call), other(interrupt original call)
 int StreamHandle::read_interrupt_cb(void* pContext)
 {
-    return 0;
+    StreamHandle* pHandle = (StreamHandle*)pContext;
+    if (pHandle->m_bExit)
+        return 1;
+    // no data from the server within the deadline
+    int64_t nDeadlineMs = pHandle->m_nIoDeadlineMs.load(std::memory_order_relaxed);
+    return nDeadlineMs > 0 && Time::GetSteadyMilliTimestamp() > nDeadlineMs ? 1 : 0;
 }
 
 enum AVPixelFormat StreamHandle::get_hw_format(AVCodecContext *ctx,
@@ -43,18 +51,87 @@ int StreamHandle::hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType
 
 StreamHandle::StreamHandle()
     : m_bExit(false)
-    , m_pInputAVFormatCtx(nullptr)
-    , m_pOutputFileAVFormatCtx(nullptr)
-    , m_pOutputStreamAVFormatCtx(nullptr)
-    , m_bInputInited(false)
-    , m_bOutputInited(false)
     , m_bFirstRun(true)
+    , m_pFrameConverter(std::make_shared<FrameConverter>())
+    , m_pInputAVFormatCtx(nullptr)
     , m_pVideoDecoderCtx(nullptr)
     , m_pAudioDecoderCtx(nullptr)
+    , m_pDecodeFrame(nullptr)
+    , m_pSwapFrame(nullptr)
+    , m_pOutputFileAVFormatCtx(nullptr)
+    , m_pOutputClipAVFormatCtx(nullptr)
     , m_pHDCtx(nullptr)
+    , m_bInputInited(false)
+    , m_nIoDeadlineMs(0)
+    , m_nLastDataMs(0)
+    , m_nReconnectAtMs(0)
+    , m_nReconnectDelayMs(0)
+    , m_bReconnecting(false)
+    , m_bWaitReconnectKey(false)
+    , m_nTsOffsetUs(0)
+    , m_nLastDtsUs(AV_NOPTS_VALUE)
+    , m_nOpenStartMs(0)
+    , m_nOpenMs(-1)
+    , m_nFirstPacketMs(-1)
+    , m_nFirstKeyFrameMs(-1)
+    , m_nFirstFrameMs(-1)
+    , m_bOpenFromCache(false)
+    , m_nReadBytes(0)
+    , m_nDecodedFrames(0)
+    , m_nGlassRefWallUs(0)
+    , m_nGlassRefPtsUs(0)
+    , m_bOutputInited(false)
+    , m_nFrameConsumer(0)
+    , m_bFeedVideoDecoder(false)
+    , m_bVideoDecoderFailed(false)
+    , m_pWorkerPool(nullptr)
+    , m_bDemuxEnded(false)
+    , m_nVideoPacket(0)
+    , m_tmDateCheck(0)
+    , m_tmNextDay(0)
+    , m_nLastKeyFrameMs(0)
+    , m_nLastDecodedKeyMs(0)
+    , m_bKeyFrameFallback(false)
+    , m_bFallbackPending(false)
+    , m_bTranscodeAudio(false)
+    , m_bMotionRecord(false)
+    , m_nMotionStartMs(0)
+    , m_bMotionFeed(false)
+    , m_bMotionFile(false)
+    , m_nNextSinkId(0)
+    , m_nSegmentStartDts(AV_NOPTS_VALUE)
+    , m_tbSegment(AVRational{ 1, 1000 })
+    , m_pClosingFileCtx(nullptr)
+    , m_nClosingStartDts(AV_NOPTS_VALUE)
+    , m_tbClosing(AVRational{ 1, 1000 })
+    , m_nFileFlushMs(0)
+    , m_nFileRetryAtMs(0)
+    , m_nFileRetryDelayMs(0)
+    , m_nFileOpenFailures(0)
+    , m_nLastPacketMs(0)
+    , m_bClipActive(false)
+    , m_nClipEndMs(0)
+    , m_bClipOpen(false)
+    , m_nClipStartDts(AV_NOPTS_VALUE)
+    , m_tbClip(AVRational{ 1, 1000 })
+    , m_nClipFlushMs(0)
+    , m_bClipRequest(false)
+    , m_nClipPreSeconds(0)
+    , m_nClipPostSeconds(0)
+    , m_vecFrame(kMaxCachedFrame)
+    , m_nFrameHead(0)
+    , m_nFrameCount(0)
+    , m_dispatcherFrame(m_pFrameConverter)
+    , m_nLastFileMs(0)
+    , m_nFileSeq(0)
 {
-    create_directory();
-    m_poolSavePic.Start();
+    // once, on the caller's thread, later days are prepared on the storage thread
+    time_t tmNow = time(nullptr);
+    std::string strToday = Time::GetDate(tmNow);
+    if (make_date_directories(strToday))
+        set_today(strToday, tmNow);
+    else
+        m_tmDateCheck = tmNow + 1;
 }
 
 StreamHandle::~StreamHandle()
@@ -73,32 +150,53 @@ void StreamHandle::ListSupportedHD()
     }
 }
 
-bool StreamHandle::StartDecode(const StreamInfo& infoStream)
+bool StreamHandle::StartDecode(const StreamInfo& infoStream, ThreadPool* pWorkerPool)
 {
     if (infoStream.strInput.empty())
     {
         printf("Invalid stream input\n");
         return false;
     }  
-    if (!(infoStream.bRtmp || infoStream.bSavePic || infoStream.bSaveVideo))
+    // a consumer attached before the start only wants decoded frames
+    if (!(infoStream.bRtmp || infoStream.bSavePic || infoStream.bSaveVideo || infoStream.nPreEventSeconds > 0
+        || !infoStream.vecOutput.empty() || m_nFrameConsumer.load() > 0 || infoStream.infoMotion.bEnable))
     {
         printf("Nothing tod do, save picture, save video of push rtmp\n");
         return false;
     }
     m_infoStream = infoStream;
+    if (m_infoStream.strRecordPrefix.empty())
+        m_infoStream.strRecordPrefix = default_record_prefix(m_infoStream.strInput);
+    m_pFrameConverter->SetUseKernels(m_infoStream.bColorKernels);
     if (!open_input_stream()) {
         printf("Can't open input:%s\n", m_infoStream.strInput.c_str());
         return false;
     }
-    // save with picture and video or rtmp
+    m_pWorkerPool = pWorkerPool;
+    // outputs are built on the AAC parameters when the audio is transcoded
+    open_audio_transcoder();
+    // save with picture and video or rtmp, a recording on motion opens with the first one
+    if (m_infoStream.bSaveVideo && !record_on_motion()) {
+        open_output_stream(m_pOutputFileAVFormatCtx, &m_strVideoFile);
+    }
     if (m_infoStream.bRtmp) {
-        open_output_stream(m_pOutputStreamAVFormatCtx, m_infoStream.bRtmp);
+        OutputSinkInfo infoRtmp;
+        infoRtmp.strUrl = m_infoStream.strOutput;
+        infoRtmp.strFormat = "flv";
+        infoRtmp.nOverflowPolicy = m_infoStream.nRtmpOverflowPolicy;
+        infoRtmp.nQueueSize = m_infoStream.nPacketQueueSize;
+        AddOutput(infoRtmp);
     }
-    if (m_infoStream.bSaveVideo) {
-        open_output_stream(m_pOutputFileAVFormatCtx);
+    for (auto& infoSink : m_infoStream.vecOutput)
+        AddOutput(infoSink);
+    if (m_infoStream.bSavePic) {
+        m_writerSnapshot.Start(get_task_pool(), m_infoStream.infoSnapshot,
+            [this]() { return generate_filename(kFileTypePicture); });
     }
-    m_thHandleFrame = std::thread(std::bind(&StreamHandle::handle_frame, this));
-    m_thDecode = std::thread(std::bind(&StreamHandle::do_decode, this));
+    start_stages();
+    // on a shared pool the owner drives DemuxOnce from its I/O threads
+    if (nullptr == m_pWorkerPool)
+        m_thDemux = std::thread(std::bind(&StreamHandle::do_demux, this));
 
     return true;
 }
@@ -106,11 +204,15 @@ bool StreamHandle::StartDecode(const StreamInfo& infoStream)
 void StreamHandle::StopDecode()
 {
     m_bExit = true;
-    m_cvFrame.notify_one();
-    if (m_thDecode.joinable())
-        m_thDecode.join();
-    if (m_thHandleFrame.joinable())
-        m_thHandleFrame.join();
+    if (m_thDemux.joinable())
+        m_thDemux.join();
+    // an open in flight is interrupted by m_bExit
+    wait_reconnect();
+    stop_stages();
+    stop_outputs();
+    m_transcoderAudio.Close();
+    m_writerSnapshot.Stop();
+    m_dispatcherFrame.Flush();
     close_input_stream();
     close_output_stream();
     if (m_pHDCtx != nullptr) {
@@ -121,29 +223,121 @@ void StreamHandle::StopDecode()
     free_frame_convert_info();
 }
 
-void StreamHandle::PushFrame(const cv::Mat& frame)
+void StreamHandle::PushFrame(const FrameHandle& frame)
 {
-    /*{
+    // every subscriber is a frame consumer too, the ring only serves PopFrame
+    // without an id, so a subscriber alone never holds a decoded frame there
+    if (m_nFrameConsumer.load() > m_dispatcherFrame.GetSubscriberCount()) {
+        // only a reference is cached, drop the oldest one if nobody pops
         std::lock_guard<std::mutex> lock(m_mtFrame);
-        m_listFrame.push_back(frame);
-    }*/
-    //m_poolSavePic.Commit([=]()
-    //{
-    //    std::string strFilename = generate_filename();
-    //    // it costs a little time15/50
-    //    cv::imwrite(strFilename.c_str(), frame);
-    //});
+        if (m_nFrameCount >= kMaxCachedFrame) {
+            m_nFrameHead = (m_nFrameHead + 1) % kMaxCachedFrame;
+            --m_nFrameCount;
+        }
+        m_vecFrame[(m_nFrameHead + m_nFrameCount) % kMaxCachedFrame] = frame;
+        ++m_nFrameCount;
+    }
+    // sampled and encoded on the pool, dropped if the encoder is behind
+    if (m_infoStream.bSavePic)
+        m_writerSnapshot.Offer(frame);
+    if (m_dispatcherFrame.HasSubscriber() && !frame.Empty()) {
+        // the rate of each subscriber is kept in stream time
+        m_dispatcherFrame.Dispatch(frame, frame_time_ms(frame.GetFrame()));
+    }
 }
 
-bool StreamHandle::PopFrame(cv::Mat& frame)
+bool StreamHandle::PopFrame(FrameHandle& frame)
 {
     std::lock_guard<std::mutex> lock(m_mtFrame);
-    if (m_listFrame.empty()) return false;
-    frame = m_listFrame.front();
-    m_listFrame.pop_front();
+    if (0 == m_nFrameCount) return false;
+    frame = std::move(m_vecFrame[m_nFrameHead]);
+    m_nFrameHead = (m_nFrameHead + 1) % kMaxCachedFrame;
+    --m_nFrameCount;
+    return true;
+}
+
+bool StreamHandle::PopFrame(cv::Mat& frame)
+{
+    FrameHandle handle;
+    if (!PopFrame(handle)) return false;
+    // convert outside the lock
+    auto tmStart = std::chrono::steady_clock::now();
+    // the caller owns the image, its buffer is reused from call to call
+    bool bResult = handle.CopyBgr(frame);
+    m_histConvert.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - tmStart).count());
+    return bResult;
+}
+
+int StreamHandle::Subscribe(const SubscriberInfo& info, FrameDispatcher::FrameCallback fnCallback)
+{
+    int nId = m_dispatcherFrame.Subscribe(info, fnCallback);
+    if (nId > 0)
+        AttachFrameConsumer();
+    return nId;
+}
+
+bool StreamHandle::Unsubscribe(int nId)
+{
+    if (!m_dispatcherFrame.Unsubscribe(nId))
+        return false;
+    DetachFrameConsumer();
     return true;
 }
 
+bool StreamHandle::PopFrame(int nId, SubscribedFrame& frame, int nTimeoutMs)
+{
+    return m_dispatcherFrame.Pop(nId, frame, nTimeoutMs);
+}
+
+void StreamHandle::AttachFrameConsumer()
+{
+    ++m_nFrameConsumer;
+}
+
+void StreamHandle::DetachFrameConsumer()
+{
+    if (m_nFrameConsumer.load() > 0)
+        --m_nFrameConsumer;
+}
+
+bool StreamHandle::IsPassthrough() const
+{
+    return !need_video_frames();
+}
+
+std::vector<StageStats> StreamHandle::GetStageStats()
+{
+    std::vector<StageStats> vecStats;
+    StageStats statsDemux;
+    statsDemux.strName = "demux";
+    m_counterDemux.Fill(statsDemux);
+    vecStats.push_back(statsDemux);
+    for (PipelineStage* pStage : { &m_stageVideoDecode, &m_stageAudioDecode, &m_stageAudioTranscode,
+        &m_stageFileMux, &m_stageClipMux })
+    {
+        if (pStage->IsRunning())
+            vecStats.push_back(pStage->GetStats());
+    }
+    if (m_bTranscodeAudio) {
+        PacketRingStats statsRing = m_ringAudioOut.GetStats();
+        StageStats statsAudioOut;
+        statsAudioOut.strName = "audio-out";
+        statsAudioOut.nQueueDepth = statsRing.nSize;
+        statsAudioOut.nQueueHighWater = statsRing.nHighWater;
+        statsAudioOut.nDropped = statsRing.nDropped;
+        statsAudioOut.nProcessed = statsRing.nPushed;
+        statsAudioOut.nPacketAlloc = statsRing.nAllocated;
+        vecStats.push_back(statsAudioOut);
+    }
+    std::shared_ptr<const SinkList> pSinkList = sink_list();
+    if (pSinkList) {
+        for (auto& pSink : *pSinkList)
+            vecStats.push_back(pSink->GetStats());
+    }
+    return vecStats;
+}
+
 bool StreamHandle::open_input_stream()
 {
     if (m_pInputAVFormatCtx)
@@ -151,75 +345,136 @@ bool StreamHandle::open_input_stream()
         std::string strError = "avformat already exists";
         return false;
     }
+    int64_t nStartMs = Time::GetSteadyMilliTimestamp();
+    m_nOpenStartMs = nStartMs;
+    m_nOpenMs = -1;
+    m_nFirstPacketMs = -1;
+    m_nFirstKeyFrameMs = -1;
+    m_nFirstFrameMs = -1;
+    m_bOpenFromCache = false;
     AVDictionary *pDict = NULL;
     m_pInputAVFormatCtx = avformat_alloc_context();
     av_dict_set(&pDict, "rtsp_transport", "tcp", 0);                //tcp
     av_dict_set(&pDict, "stimeout", "2000000", 0);
+    if (m_infoStream.nProbeSize > 0)
+        av_dict_set_int(&pDict, "probesize", m_infoStream.nProbeSize, 0);
+    if (m_infoStream.nAnalyzeDurationUs > 0)
+        av_dict_set_int(&pDict, "analyzeduration", m_infoStream.nAnalyzeDurationUs, 0);
     m_pInputAVFormatCtx->flags |= AVFMT_FLAG_NONBLOCK;
+    // the watchdog covers the open as well
+    m_pInputAVFormatCtx->interrupt_callback = { read_interrupt_cb, this };
+    m_nIoDeadlineMs = m_infoStream.nIoTimeoutMs > 0 ? Time::GetSteadyMilliTimestamp() + m_infoStream.nIoTimeoutMs : 0;
     // open input file, and allocate format context
     int nCode = avformat_open_input(&m_pInputAVFormatCtx, m_infoStream.strInput.c_str(), 0, &pDict);
+    av_dict_free(&pDict);
     if (nCode < 0)
     {
         std::string strError = "Can't open input:" + m_infoStream.strInput
             + get_error_msg(nCode);
+        printf("%s\n", strError.c_str());
         return false;
     }
-    m_pInputAVFormatCtx->interrupt_callback = { read_interrupt_cb, this };
-    // retrieve stream information
-    if (avformat_find_stream_info(m_pInputAVFormatCtx, 0) < 0)
-    {
-        std::string strError = "Can't find stream info";
-        return false;
+    // retrieve stream information, from the cache when this url was opened before
+    bool bFromCache = m_infoStream.bCacheStreamInfo
+        && StreamParamCache::Instance().Apply(m_infoStream.strInput, m_pInputAVFormatCtx);
+    if (!bFromCache) {
+        if (avformat_find_stream_info(m_pInputAVFormatCtx, 0) < 0)
+        {
+            std::string strError = "Can't find stream info";
+            printf("%s\n", strError.c_str());
+            close_input_format();
+            return false;
+        }
+        if (m_infoStream.bCacheStreamInfo)
+            StreamParamCache::Instance().Store(m_infoStream.strInput, m_pInputAVFormatCtx);
     }
     //ֹԺpFormatCtx->streams
-    av_dump_format(m_pInputAVFormatCtx, 0, m_infoStream.strInput.c_str(), 0);
-    // open codec contex for video
-    if (open_codec_context(m_infoStream.nVideoIndex, &m_pVideoDecoderCtx, m_pInputAVFormatCtx, AVMEDIA_TYPE_VIDEO)) {
-        m_infoStream.nWidth = m_pVideoDecoderCtx->width;
-        m_infoStream.nHeight = m_pVideoDecoderCtx->height;
-        m_infoStream.nPixFmt = m_pVideoDecoderCtx->pix_fmt;
-    }
-    else
-    {
-        printf("Open codec context failed\n");
-        return false;
-    }
-    // open codec contex for audio
-    open_codec_context(m_infoStream.nAudioIndex, &m_pAudioDecoderCtx, m_pInputAVFormatCtx, AVMEDIA_TYPE_AUDIO);
-    if (kInvalidStreamIndex== m_infoStream.nVideoIndex
-        && kInvalidStreamIndex == m_infoStream.nAudioIndex)
+    if (m_infoStream.bDumpFormat)
+        av_dump_format(m_pInputAVFormatCtx, 0, m_infoStream.strInput.c_str(), 0);
+    // decoders are opened later, only when somebody needs frames
+    int nVideoIndex = find_stream(AVMEDIA_TYPE_VIDEO);
+    int nAudioIndex = find_stream(AVMEDIA_TYPE_AUDIO);
+    if (kInvalidStreamIndex == nVideoIndex
+        && kInvalidStreamIndex == nAudioIndex)
     {
         std::string strError = "Can't find audio or video stream in the input";
+        printf("%s\n", strError.c_str());
+        close_input_format();
         return false;
     }
+    if (!m_bInputInited) {
+        // the first connection fixes the layout decoders and outputs are built on
+        m_infoStream.nVideoIndex = nVideoIndex;
+        m_infoStream.nAudioIndex = nAudioIndex;
+        for (unsigned int nIndex = 0; nIndex < m_pInputAVFormatCtx->nb_streams; ++nIndex)
+        {
+            AVCodecParameters* pCodecPar = avcodec_parameters_alloc();
+            avcodec_parameters_copy(pCodecPar, m_pInputAVFormatCtx->streams[nIndex]->codecpar);
+            m_vecStreamPar.push_back(pCodecPar);
+            m_vecStreamTimeBase.push_back(m_pInputAVFormatCtx->streams[nIndex]->time_base);
+        }
+        if (m_infoStream.nVideoIndex != kInvalidStreamIndex) {
+            AVCodecParameters* pCodecPar = m_vecStreamPar[m_infoStream.nVideoIndex];
+            m_infoStream.nWidth = pCodecPar->width;
+            m_infoStream.nHeight = pCodecPar->height;
+            AVRational rateFrame = av_guess_frame_rate(m_pInputAVFormatCtx,
+                m_pInputAVFormatCtx->streams[m_infoStream.nVideoIndex], nullptr);
+            if (rateFrame.num > 0 && rateFrame.den > 0)
+                m_infoStream.nFrameRate = std::max(1, (int)(av_q2d(rateFrame) + 0.5));
+        }
+        m_bInputInited = true;
+    }
+    // audio and video of this connection onto the layout, other streams are dropped
+    m_vecStreamMap.assign(m_pInputAVFormatCtx->nb_streams, kInvalidStreamIndex);
+    if (nVideoIndex != kInvalidStreamIndex)
+        m_vecStreamMap[nVideoIndex] = m_infoStream.nVideoIndex;
+    if (nAudioIndex != kInvalidStreamIndex)
+        m_vecStreamMap[nAudioIndex] = m_infoStream.nAudioIndex;
+    // the reads arm the watchdog themselves
+    int64_t nNowMs = Time::GetSteadyMilliTimestamp();
+    m_nIoDeadlineMs = 0;
+    m_nLastDataMs = nNowMs;
+    m_bOpenFromCache = bFromCache;
+    m_nOpenMs = nNowMs - nStartMs;
     return true;
 }
 
-bool StreamHandle::open_codec_context(int& nStreamIndex,
+int StreamHandle::find_stream(enum AVMediaType nMediaType)
+{
+    int nCode = av_find_best_stream(m_pInputAVFormatCtx, nMediaType, -1, -1, nullptr, 0);
+    if (nCode < 0)
+    {
+        fprintf(stderr, "Could not find %s stream in input\n",
+            av_get_media_type_string(nMediaType));
+        return kInvalidStreamIndex;
+    }
+    return nCode;
+}
+
+bool StreamHandle::open_codec_context(int nStreamIndex,
     AVCodecContext **pDecoderCtx,
-    AVFormatContext *pFmtCtx,
     enum AVMediaType nMediaType)
 {
-    AVStream *pStream = nullptr;
+    AVCodecParameters *pCodecPar = nullptr;
     AVCodec *pDecoder = nullptr;
     AVDictionary *pOptions = nullptr;
+    int nCode = 0;
 
-    int nCode = av_find_best_stream(pFmtCtx, nMediaType, -1, -1, &pDecoder, 0);
-    if (nCode < 0)
+    if (nStreamIndex < 0 || nStreamIndex >= (int)m_vecStreamPar.size())
+        return false;
+    pCodecPar = m_vecStreamPar[nStreamIndex];
+    pDecoder = avcodec_find_decoder(pCodecPar->codec_id);
+    if (nullptr == pDecoder)
     {
-        fprintf(stderr, "Could not find %s stream in input\n",
+        fprintf(stderr, "Could not find %s decoder\n",
             av_get_media_type_string(nMediaType));
         return false;
     }
-    nStreamIndex = nCode;
     AVPixelFormat nPixeFmt = AV_PIX_FMT_NONE;
     if (AVMEDIA_TYPE_VIDEO == nMediaType && m_infoStream.nHDType > AV_HWDEVICE_TYPE_NONE) {
         // get hard device
         for (int i = 0;; i++) {
             const AVCodecHWConfig *pConfig = avcodec_get_hw_config(pDecoder, i);
-            if (nullptr == pConfig) {
-                continue;
-            }
             if (!pConfig) {
                 fprintf(stderr, "Decoder %s does not support device type %s.\n",
                 pDecoder->name, av_hwdevice_get_type_name(m_infoStream.nHDType));
@@ -242,8 +497,7 @@ bool StreamHandle::open_codec_context(int& nStreamIndex,
     }
 
     /* Copy codec parameters from input stream to output codec context */
-    pStream = m_pInputAVFormatCtx->streams[nStreamIndex];
-    if ((nCode = avcodec_parameters_to_context(*pDecoderCtx, pStream->codecpar)) < 0)
+    if ((nCode = avcodec_parameters_to_context(*pDecoderCtx, pCodecPar)) < 0)
     {
         fprintf(stderr, "Failed to copy %s codec parameters to decoder context\n",
             av_get_media_type_string(nMediaType));
@@ -255,6 +509,20 @@ bool StreamHandle::open_codec_context(int& nStreamIndex,
         (*pDecoderCtx)->pix_fmt = nPixeFmt;
         hw_decoder_init(*pDecoderCtx, m_infoStream.nHDType);
     }
+    else if (AVMEDIA_TYPE_VIDEO == nMediaType) {
+        // software decode, ffmpeg's default is a single thread
+        if (m_infoStream.nDecodeThreads > 0)
+            (*pDecoderCtx)->thread_count = m_infoStream.nDecodeThreads;
+        if (kDecodeThreadFrame == m_infoStream.nDecodeThreadType)
+            (*pDecoderCtx)->thread_type = FF_THREAD_FRAME;
+        else if (kDecodeThreadSlice == m_infoStream.nDecodeThreadType)
+            (*pDecoderCtx)->thread_type = FF_THREAD_SLICE;
+        else
+            (*pDecoderCtx)->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        if (m_infoStream.bFastDecode)
+            (*pDecoderCtx)->flags2 |= AV_CODEC_FLAG2_FAST;
+        (*pDecoderCtx)->skip_loop_filter = m_infoStream.nSkipLoopFilter;
+    }
 
     /* Init the decoders, with or without reference counting */
     av_dict_set(&pOptions, "refcounted_frames", m_infoStream.nRefCount ? "1" : "0", 0);
@@ -267,26 +535,297 @@ bool StreamHandle::open_codec_context(int& nStreamIndex,
     return true;
 }
 
+AVCodecID StreamHandle::GetVideoCodecId() const
+{
+    int nVideoIndex = m_infoStream.nVideoIndex;
+    if (nVideoIndex < 0 || nVideoIndex >= (int)m_vecStreamPar.size())
+        return AV_CODEC_ID_NONE;
+    return m_vecStreamPar[nVideoIndex]->codec_id;
+}
+
+void StreamHandle::SetDecodeThreads(int nThreads, DecodeThreadType nThreadType)
+{
+    m_infoStream.nDecodeThreads = nThreads;
+    m_infoStream.nDecodeThreadType = nThreadType;
+}
+
+bool StreamHandle::open_video_decoder()
+{
+    if (m_pVideoDecoderCtx)
+        return true;
+    if (m_bVideoDecoderFailed)
+        return false;
+    if (!open_codec_context(m_infoStream.nVideoIndex, &m_pVideoDecoderCtx, AVMEDIA_TYPE_VIDEO))
+    {
+        printf("Open codec context failed\n");
+        avcodec_free_context(&m_pVideoDecoderCtx);
+        drop_cached_params();
+        m_bVideoDecoderFailed = true;
+        return false;
+    }
+    m_infoStream.nPixFmt = m_pVideoDecoderCtx->pix_fmt;
+    // still until the detector sees motion
+    if (m_infoStream.bGateFramesOnMotion && m_infoStream.infoMotion.bEnable)
+        m_pVideoDecoderCtx->skip_frame = AVDISCARD_NONREF;
+    if (!(m_pDecodeFrame = av_frame_alloc()) || !(m_pSwapFrame = av_frame_alloc())) {
+        fprintf(stderr, "Can't alloc frame\n");
+        avcodec_free_context(&m_pVideoDecoderCtx);
+        av_frame_free(&m_pDecodeFrame);
+        m_bVideoDecoderFailed = true;
+        return false;
+    }
+    return true;
+}
+
 void StreamHandle::close_input_stream()
+{
+    if (m_pVideoDecoderCtx)
+        avcodec_free_context(&m_pVideoDecoderCtx);
+    av_frame_free(&m_pDecodeFrame);
+    av_frame_free(&m_pSwapFrame);
+    if (m_pAudioDecoderCtx)
+        avcodec_free_context(&m_pAudioDecoderCtx);
+    close_input_format();
+    for (AVCodecParameters*& pCodecPar : m_vecStreamPar)
+        avcodec_parameters_free(&pCodecPar);
+    m_vecStreamPar.clear();
+    m_vecStreamTimeBase.clear();
+    m_bInputInited = false;
+}
+
+void StreamHandle::close_input_format()
 {
     if (m_pInputAVFormatCtx)
         avformat_close_input(&m_pInputAVFormatCtx);
+    m_vecStreamMap.clear();
 }
 
-bool StreamHandle::open_output_stream(AVFormatContext*& pFormatCtx, bool bRtmp)
+bool StreamHandle::reconnect_input()
 {
-    if (pFormatCtx)
+    // blocks the calling thread for the whole open, bounded by nIoTimeoutMs through
+    // the interrupt callback; on a shared pool that is a worker (start_reconnect)
+    if (!open_input_stream()) {
+        close_input_format();
+        m_nReconnectDelayMs = std::min(std::max(m_nReconnectDelayMs * 2, m_infoStream.nReconnectMinMs),
+            m_infoStream.nReconnectMaxMs);
+        m_nReconnectAtMs = Time::GetSteadyMilliTimestamp() + m_nReconnectDelayMs;
+        printf("Reconnect %s failed, next try in %d ms\n", m_infoStream.strInput.c_str(), m_nReconnectDelayMs);
+        return false;
+    }
+    printf("Reconnected %s\n", m_infoStream.strInput.c_str());
+    m_nReconnectDelayMs = 0;
+    // decoders and outputs go on from the first keyframe of the new connection
+    m_bWaitReconnectKey = true;
+    m_bFeedVideoDecoder = false;
+    return true;
+}
+
+void StreamHandle::drop_cached_params()
+{
+    if (m_infoStream.bCacheStreamInfo && m_bOpenFromCache.load()) {
+        printf("Cached stream info of %s rejected, the next open probes\n", m_infoStream.strInput.c_str());
+        StreamParamCache::Instance().Remove(m_infoStream.strInput);
+    }
+}
+
+void StreamHandle::start_reconnect()
+{
+    m_bReconnecting = true;
+    bool bPosted = m_pWorkerPool->TryPost([this]() {
+        reconnect_input();
+        {
+            std::lock_guard<std::mutex> lock(m_mtReconnect);
+            m_bReconnecting = false;
+        }
+        m_cvReconnect.notify_all();
+    });
+    // the pool is full, DemuxOnce tries again
+    if (!bPosted)
+        m_bReconnecting = false;
+}
+
+void StreamHandle::wait_reconnect()
+{
+    std::unique_lock<std::mutex> lock(m_mtReconnect);
+    m_cvReconnect.wait(lock, [this]() { return !m_bReconnecting.load(); });
+}
+
+OpenTiming StreamHandle::GetOpenTiming() const
+{
+    OpenTiming timing;
+    timing.bFromCache = m_bOpenFromCache.load();
+    timing.nOpenMs = m_nOpenMs.load();
+    timing.nFirstPacketMs = m_nFirstPacketMs.load();
+    timing.nFirstKeyFrameMs = m_nFirstKeyFrameMs.load();
+    timing.nFirstFrameMs = m_nFirstFrameMs.load();
+    return timing;
+}
+
+void StreamHandle::record_first_packet(const AVPacket& packet)
+{
+    if (m_nFirstKeyFrameMs.load(std::memory_order_relaxed) >= 0)
+        return;
+    int64_t nElapsedMs = Time::GetSteadyMilliTimestamp() - m_nOpenStartMs.load();
+    if (m_nFirstPacketMs.load(std::memory_order_relaxed) < 0) {
+        m_nFirstPacketMs = nElapsedMs;
+        // capture clock: the sender's wall clock (RTCP) when known, else the arrival of this packet
+        int64_t nTs = AV_NOPTS_VALUE != packet.pts ? packet.pts : packet.dts;
+        if (AV_NOPTS_VALUE != m_pInputAVFormatCtx->start_time_realtime && m_pInputAVFormatCtx->start_time_realtime > 0) {
+            m_nGlassRefWallUs = m_pInputAVFormatCtx->start_time_realtime;
+            m_nGlassRefPtsUs = m_nTsOffsetUs;
+        }
+        else if (AV_NOPTS_VALUE != nTs) {
+            m_nGlassRefWallUs = Time::GetMilliTimestamp() * 1000;
+            m_nGlassRefPtsUs = av_rescale_q(nTs, m_vecStreamTimeBase[packet.stream_index], AV_TIME_BASE_Q);
+        }
+    }
+    bool bKey = kInvalidStreamIndex == m_infoStream.nVideoIndex
+        || (packet.stream_index == m_infoStream.nVideoIndex && (packet.flags & AV_PKT_FLAG_KEY));
+    if (!bKey)
+        return;
+    m_nFirstKeyFrameMs = nElapsedMs;
+    printf("%s: open %lld ms%s, first packet %lld ms, first keyframe %lld ms\n", m_infoStream.strInput.c_str(),
+        (long long)m_nOpenMs.load(), m_bOpenFromCache.load() ? " (cached)" : "",
+        (long long)m_nFirstPacketMs.load(), (long long)nElapsedMs);
+}
+
+void StreamHandle::record_first_frame()
+{
+    // video decode stage
+    if (m_nFirstFrameMs.load(std::memory_order_relaxed) < 0)
+        m_nFirstFrameMs = Time::GetSteadyMilliTimestamp() - m_nOpenStartMs.load();
+}
+
+int64_t StreamHandle::glass_latency_us(int nStreamIndex, int64_t nPts) const
+{
+    int64_t nRefWallUs = m_nGlassRefWallUs.load(std::memory_order_relaxed);
+    if (0 == nRefWallUs || AV_NOPTS_VALUE == nPts)
+        return -1;
+    int64_t nPtsUs = av_rescale_q(nPts, m_vecStreamTimeBase[nStreamIndex], AV_TIME_BASE_Q);
+    int64_t nCaptureUs = nRefWallUs + nPtsUs - m_nGlassRefPtsUs.load(std::memory_order_relaxed);
+    return Time::GetMilliTimestamp() * 1000 - nCaptureUs;
+}
+
+StreamMetrics StreamHandle::GetMetrics()
+{
+    StreamMetrics metrics;
+    metrics.vecStages = GetStageStats();
+    HistogramSnapshot histRead = m_counterDemux.Snapshot("demux");
+    metrics.vecStageLatency.push_back(histRead);
+    for (PipelineStage* pStage : { &m_stageVideoDecode, &m_stageAudioDecode, &m_stageAudioTranscode,
+        &m_stageFileMux, &m_stageClipMux })
     {
-        printf("Already has output avformat \n");
+        if (pStage->IsRunning())
+            metrics.vecStageLatency.push_back(pStage->GetLatency());
+    }
+    std::shared_ptr<const SinkList> pSinkList = sink_list();
+    if (pSinkList) {
+        for (auto& pSink : *pSinkList)
+            metrics.vecStageLatency.push_back(pSink->GetLatency());
+    }
+    metrics.vecStepLatency.push_back(m_histHwTransfer.Snapshot("hw_transfer"));
+    metrics.vecStepLatency.push_back(m_histConvert.Snapshot("pop_convert"));
+    metrics.vecStepLatency.push_back(m_histMotion.Snapshot("motion"));
+    m_writerSnapshot.GetLatency(metrics.vecStepLatency);
+    metrics.vecGlassLatency.push_back(m_histGlassToFile.Snapshot("file"));
+    metrics.vecGlassLatency.push_back(m_histGlassToFrame.Snapshot("frame"));
+    metrics.nReadBytes = m_nReadBytes.load(std::memory_order_relaxed);
+    metrics.nDecodedFrames = m_nDecodedFrames.load(std::memory_order_relaxed);
+    metrics.nFileOpenFailures = m_nFileOpenFailures.load(std::memory_order_relaxed);
+    metrics.statsSnapshot = m_writerSnapshot.GetStats();
+    metrics.statsFramePool = m_poolFrame.GetStats();
+    metrics.nPreEventAlloc = m_bufferPreEvent.GetAllocated();
+    metrics.statsMotion = m_detectorMotion.GetStats();
+    metrics.timing = GetOpenTiming();
+    return metrics;
+}
+
+void StreamHandle::CollectMetrics(MetricsText& text, const std::string& strLabels)
+{
+    StreamMetrics metrics = GetMetrics();
+    std::string strPrefix = strLabels.empty() ? "" : strLabels + ",";
+    for (auto& stats : metrics.vecStages)
+    {
+        std::string strStage = strPrefix + MetricsText::Label("stage", stats.strName);
+        text.AddGauge("ffh_stage_queue_depth", strStage, (double)stats.nQueueDepth, "Packets queued in front of a stage");
+        text.AddGauge("ffh_stage_queue_high_water", strStage, (double)stats.nQueueHighWater);
+        text.AddCounter("ffh_stage_dropped_total", strStage, stats.nDropped, "Packets dropped by the overflow policy");
+        text.AddCounter("ffh_stage_packet_alloc_total", strStage, stats.nPacketAlloc);
+    }
+    for (auto& histogram : metrics.vecStageLatency)
+        text.AddHistogram("ffh_stage_latency_seconds", strPrefix + MetricsText::Label("stage", histogram.strName),
+            histogram, "Time to read or handle one packet");
+    for (auto& histogram : metrics.vecStepLatency)
+        text.AddHistogram("ffh_step_latency_seconds", strPrefix + MetricsText::Label("step", histogram.strName),
+            histogram, "Time of one frame conversion, encode or write");
+    for (auto& histogram : metrics.vecGlassLatency)
+        text.AddHistogram("ffh_glass_latency_seconds", strPrefix + MetricsText::Label("output", histogram.strName),
+            histogram, "Capture time (from pts) to output");
+    text.AddCounter("ffh_read_bytes_total", strLabels, metrics.nReadBytes);
+    text.AddCounter("ffh_decoded_frames_total", strLabels, metrics.nDecodedFrames);
+    text.AddCounter("ffh_file_open_failures_total", strLabels, metrics.nFileOpenFailures,
+        "Recording files that could not be opened");
+    text.AddCounter("ffh_frame_alloc_total", strLabels, metrics.statsFramePool.nFrameAlloc, "Frames allocated by the frame pool");
+    text.AddCounter("ffh_frame_buffer_alloc_total", strLabels, metrics.statsFramePool.nBufferAlloc);
+    text.AddCounter("ffh_pre_event_packet_alloc_total", strLabels, metrics.nPreEventAlloc);
+    text.AddCounter("ffh_snapshot_written_total", strLabels, metrics.statsSnapshot.nWritten);
+    text.AddCounter("ffh_snapshot_dropped_total", strLabels, metrics.statsSnapshot.nDropped);
+    if (m_infoStream.infoMotion.bEnable) {
+        text.AddGauge("ffh_motion_active", strLabels, metrics.statsMotion.bMotion ? 1 : 0, "Motion detected now");
+        text.AddGauge("ffh_motion_ratio", strLabels, metrics.statsMotion.dRatio, "Changed share of the last analyzed frame");
+        text.AddCounter("ffh_motion_events_total", strLabels, metrics.statsMotion.nEvents, "Motion starts and stops");
+        text.AddCounter("ffh_motion_analyzed_frames_total", strLabels, metrics.statsMotion.nAnalyzed);
+    }
+    text.AddGauge("ffh_open_seconds", strLabels, metrics.timing.nOpenMs / 1000.0, "Open time of the last connection");
+    text.AddGauge("ffh_first_keyframe_seconds", strLabels, metrics.timing.nFirstKeyFrameMs / 1000.0);
+}
+
+bool StreamHandle::remap_packet(AVPacket& packet)
+{
+    if (packet.stream_index < 0 || packet.stream_index >= (int)m_vecStreamMap.size()
+        || kInvalidStreamIndex == m_vecStreamMap[packet.stream_index])
         return false;
+    AVRational tbIn = m_pInputAVFormatCtx->streams[packet.stream_index]->time_base;
+    int nIndex = m_vecStreamMap[packet.stream_index];
+    AVRational tbOut = m_vecStreamTimeBase[nIndex];
+    packet.stream_index = nIndex;
+    if (m_bWaitReconnectKey) {
+        if (m_infoStream.nVideoIndex != kInvalidStreamIndex
+            && !(nIndex == m_infoStream.nVideoIndex && (packet.flags & AV_PKT_FLAG_KEY)))
+            return false;
+        m_bWaitReconnectKey = false;
+        // continue one frame after the last packet of the previous connection
+        int64_t nTs = AV_NOPTS_VALUE != packet.dts ? packet.dts : packet.pts;
+        if (AV_NOPTS_VALUE != nTs && AV_NOPTS_VALUE != m_nLastDtsUs)
+            m_nTsOffsetUs = m_nLastDtsUs + AV_TIME_BASE / std::max(1, m_infoStream.nFrameRate)
+                - av_rescale_q(nTs, tbIn, AV_TIME_BASE_Q);
+    }
+    if (tbIn.num != tbOut.num || tbIn.den != tbOut.den)
+        av_packet_rescale_ts(&packet, tbIn, tbOut);
+    if (0 != m_nTsOffsetUs) {
+        int64_t nOffset = av_rescale_q(m_nTsOffsetUs, AV_TIME_BASE_Q, tbOut);
+        if (AV_NOPTS_VALUE != packet.pts)
+            packet.pts += nOffset;
+        if (AV_NOPTS_VALUE != packet.dts)
+            packet.dts += nOffset;
+    }
+    if (AV_NOPTS_VALUE != packet.dts) {
+        int64_t nDtsUs = av_rescale_q(packet.dts, tbOut, AV_TIME_BASE_Q);
+        if (AV_NOPTS_VALUE == m_nLastDtsUs || nDtsUs > m_nLastDtsUs)
+            m_nLastDtsUs = nDtsUs;
     }
-    if (m_infoStream.strOutput.empty())
+    return true;
+}
+
+bool StreamHandle::open_output_stream(AVFormatContext*& pFormatCtx, std::string* pOutputPath)
+{
+    if (pFormatCtx)
     {
-        printf("Invalid output file\n");
+        printf("Already has output avformat \n");
         return false;
     }
-    std::string strFormatName = bRtmp ? "flv" : "mp4";
-    std::string strOutputPath = bRtmp ? m_infoStream.strOutput : generate_filename(kFileTypeVideo);
+    std::string strFormatName = "mp4";
+    std::string strOutputPath = generate_filename(kFileTypeVideo);
     int nCode = avformat_alloc_output_context2(&pFormatCtx, NULL, strFormatName.c_str(), strOutputPath.c_str());
     if (nullptr == pFormatCtx)
     {
@@ -294,25 +833,30 @@ bool StreamHandle::open_output_stream(AVFormatContext*& pFormatCtx, bool bRtmp)
         return false;
     }
 
+    // a failed open leaves no context behind, the other output keeps running
+    bool bInited = false;
     pFormatCtx->oformat->audio_codec = AV_CODEC_ID_AAC;     // videoΪAAC
     pFormatCtx->oformat->video_codec = AV_CODEC_ID_H264;
-    for (auto nIndex = 0; nIndex < m_pInputAVFormatCtx->nb_streams; ++nIndex)
+    std::vector<AVCodecParameters*> vecCodecPar = get_output_par();
+    for (size_t nIndex = 0; nIndex < vecCodecPar.size(); ++nIndex)
     {
-        AVStream *pInStream = m_pInputAVFormatCtx->streams[nIndex];
+        AVCodecParameters *pInCodecPar = vecCodecPar[nIndex];
         AVStream *pOutStream = avformat_new_stream(pFormatCtx, nullptr);
         if (!pOutStream)
         {
             printf("Can't new out stream");
+            release_output_format_context(bInited, pFormatCtx);
             return false;
         }
-        pOutStream->codecpar->codec_type = pInStream->codecpar->codec_type;
+        pOutStream->codecpar->codec_type = pInCodecPar->codec_type;
         //copy the encode info to output
-        nCode = avcodec_parameters_copy(pOutStream->codecpar, pInStream->codecpar);
+        nCode = avcodec_parameters_copy(pOutStream->codecpar, pInCodecPar);
         if (nCode < 0)
         {
             std::string strError = "Can't copy context, url: " + m_infoStream.strInput + ",errcode:"
                 + std::to_string(nCode) + ",err msg:" + get_error_msg(nCode);
             printf("%s \n", strError.c_str());
+            release_output_format_context(bInited, pFormatCtx);
             return false;
         }
         pOutStream->codecpar->codec_tag = 0;
@@ -320,115 +864,388 @@ bool StreamHandle::open_output_stream(AVFormatContext*& pFormatCtx, bool bRtmp)
     av_dump_format(pFormatCtx, 0, strOutputPath.c_str(), 1);
     if (!(pFormatCtx->oformat->flags & AVFMT_NOFILE))
     {
-        nCode = avio_open(&pFormatCtx->pb, strOutputPath.c_str(), AVIO_FLAG_WRITE);
+        if (m_infoStream.infoFileWriter.nBufferSize > 0) {
+            pFormatCtx->pb = FileWriter::Open(strOutputPath, m_infoStream.infoFileWriter);
+            nCode = pFormatCtx->pb ? 0 : AVERROR(EIO);
+        }
+        else
+            nCode = avio_open(&pFormatCtx->pb, strOutputPath.c_str(), AVIO_FLAG_WRITE);
         if (nCode < 0)
         {
             std::string strError = "Can't open output io, file:" + strOutputPath + ",errcode:" + std::to_string(nCode) + ", err msg:"
                 + get_error_msg(nCode);
             printf("%s \n", strError.c_str());
+            release_output_format_context(bInited, pFormatCtx);
             return false;
         }
     }
 
-    nCode = avformat_write_header(pFormatCtx, NULL);
+    AVDictionary* pOptions = nullptr;
+    if (m_infoStream.bFragmentedMp4) {
+        // moov up front, then a moof/mdat fragment per GOP. No frag_duration, it would also
+        // cut inside a GOP and is_fragment_start would no longer see every fragment
+        av_dict_set(&pOptions, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    nCode = avformat_write_header(pFormatCtx, &pOptions);
+    av_dict_free(&pOptions);
     if (nCode < 0)
     {
         std::string strError = "Can't write outputstream header, URL:" + strOutputPath + ",errcode:" + std::to_string(nCode) + ", err msg:"
             + get_error_msg(nCode);
         printf("%s \n", strError.c_str());
-        m_bOutputInited = false;
+        release_output_format_context(bInited, pFormatCtx);
+        drop_cached_params();
         return false;
     }
+    if (pOutputPath)
+        *pOutputPath = strOutputPath;
     m_bOutputInited = true;
     return true;
 }
 
 void StreamHandle::close_output_stream()
 {
-    bool bRtmp = m_infoStream.bRtmp;
+    close_closing_segment();
     bool bSaveVideo = m_infoStream.bSaveVideo;
-    release_output_format_context(m_infoStream.bSaveVideo, m_pOutputFileAVFormatCtx);
-    release_output_format_context(m_infoStream.bRtmp, m_pOutputStreamAVFormatCtx);
+    release_output_format_context(bSaveVideo, m_pOutputFileAVFormatCtx);
+    // a clip context only exists with its header written
+    bool bClipInited = m_pOutputClipAVFormatCtx != nullptr;
+    release_output_format_context(bClipInited, m_pOutputClipAVFormatCtx);
     m_bOutputInited = false;
 }
 
-void StreamHandle::do_decode()
+int StreamHandle::DemuxOnce()
 {
-    // decode stream
-    int64_t nFrame = 0;
+    if (m_bExit || m_bDemuxEnded)
+        return kDemuxEnd;
+    // a partial snapshot batch is written in time while no frame comes
+    if (m_infoStream.bSavePic)
+        m_writerSnapshot.Poll();
+    // a shared I/O thread must not block on a full stage, try again later
+    if (m_pWorkerPool && (m_stageVideoDecode.IsBlocking() || m_stageAudioDecode.IsBlocking()
+        || m_stageAudioTranscode.IsBlocking() || outputs_blocking()))
+        return kDemuxAgain;
+    if (m_bTranscodeAudio)
+        forward_audio(false);
+    // AAC still waiting for the outputs, no more audio into the transcoder before it is forwarded
+    if (m_pWorkerPool && m_bTranscodeAudio && m_ringAudioOut.Size() * 2 >= m_ringAudioOut.GetStats().nCapacity)
+        return kDemuxAgain;
+
+    // input lost. On a shared pool the open (up to nIoTimeoutMs) runs as a task
+    // and the I/O thread goes on with its other streams; on the own demux
+    // thread it blocks only this stream
+    if (m_bReconnecting.load())
+        return kDemuxAgain;
+    if (nullptr == m_pInputAVFormatCtx) {
+        if (Time::GetSteadyMilliTimestamp() < m_nReconnectAtMs)
+            return kDemuxAgain;
+        if (m_pWorkerPool) {
+            start_reconnect();
+            return kDemuxAgain;
+        }
+        if (!reconnect_input())
+            return kDemuxAgain;
+    }
+
+    auto tmStart = std::chrono::steady_clock::now();
     AVPacket packet;
+    // armed right before the read, time spent between two reads is not a stall
+    if (m_infoStream.nIoTimeoutMs > 0)
+        m_nIoDeadlineMs.store(Time::GetSteadyMilliTimestamp() + m_infoStream.nIoTimeoutMs, std::memory_order_relaxed);
+    int nCode = av_read_frame(m_pInputAVFormatCtx, &packet);
+    if (AVERROR(EAGAIN) == nCode) {
+        // a non-blocking input that stopped delivering is a stall as well
+        if (m_infoStream.nIoTimeoutMs <= 0
+            || Time::GetSteadyMilliTimestamp() - m_nLastDataMs <= m_infoStream.nIoTimeoutMs)
+            return kDemuxAgain;
+        nCode = AVERROR_EXIT;
+    }
+    if (nCode < 0)
+    {
+        printf("Read frame failed,%s\n", get_error_msg(nCode).c_str());
+        if (m_infoStream.bReconnect && !m_bExit) {
+            // the stages and outputs keep running, only the input is reopened
+            close_input_format();
+            m_nReconnectDelayMs = m_infoStream.nReconnectMinMs;
+            m_nReconnectAtMs = Time::GetSteadyMilliTimestamp() + m_nReconnectDelayMs;
+            printf("Input %s lost, reconnect in %d ms\n", m_infoStream.strInput.c_str(), m_nReconnectDelayMs);
+            return kDemuxAgain;
+        }
+        printf("Reading ended, read %lld video frames \n", (long long)m_nVideoPacket);
+        m_bDemuxEnded = true;
+        return kDemuxEnd;
+    }
+    m_nLastDataMs = Time::GetSteadyMilliTimestamp();
+    m_counterDemux.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - tmStart).count());
+    if (!remap_packet(packet)) {
+        av_packet_unref(&packet);
+        return kDemuxPacket;
+    }
+    m_nReadBytes.fetch_add(packet.size, std::memory_order_relaxed);
+    record_first_packet(packet);
+    time_t tmNow = time(nullptr);
+    if (tmNow >= m_tmDateCheck)     // near midnight, otherwise one compare per packet
+        check_date(tmNow);
+    if (m_infoStream.nVideoIndex == packet.stream_index)
+        ++m_nVideoPacket;
+    push_packet(packet);
+    av_packet_unref(&packet);
+    return kDemuxPacket;
+}
+
+void StreamHandle::do_demux()
+{
+    // read packets and hand them to the stages, never wait for a decoder or an output here
     while (!m_bExit)
     {
-        int nCode = 0;
-        if (nCode = av_read_frame(m_pInputAVFormatCtx, &packet), nCode < 0)
-        {
-            printf("Read frame failed,%s\n", get_error_msg(nCode).c_str());
+        int nResult = DemuxOnce();
+        if (kDemuxEnd == nResult)
             break;
+        if (kDemuxAgain == nResult)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void StreamHandle::push_packet(const AVPacket& packet)
+{
+    // every stage takes its own reference, a full stage drops by its own policy
+    if (packet.stream_index == m_infoStream.nVideoIndex) {
+        if (!need_video_frames()) {
+            // pass through, only remux
+            m_bFeedVideoDecoder = false;
         }
-        if (m_infoStream.nVideoIndex == packet.stream_index)
-            nCode = decode_video_packet(&packet);
-        else if (packet.stream_index == m_infoStream.nAudioIndex) {
-            nCode = decode_audio_packet(packet);
+        else if (m_bFeedVideoDecoder || (packet.flags & AV_PKT_FLAG_KEY)) {
+            // a consumer attached, bring the decoder up from a keyframe
+            if (!m_stageVideoDecode.IsRunning())
+                start_video_decode_stage();
+            m_bFeedVideoDecoder = true;
+            if (accept_video_packet(packet))
+                m_stageVideoDecode.Push(packet);
+        }
+    }
+    else if (packet.stream_index == m_infoStream.nAudioIndex) {
+        m_stageAudioDecode.Push(packet);
+        if (m_bTranscodeAudio) {
+            // the AAC packets come back through forward_audio
+            m_stageAudioTranscode.Push(packet);
+            return;
         }
-        save_stream(m_pOutputFileAVFormatCtx, packet);
-        save_stream(m_pOutputStreamAVFormatCtx, packet);
-        av_packet_unref(&packet);
     }
+    push_output(packet);
+}
 
-    printf("Reading ended, read %lld video frames \n", nFrame);
+void StreamHandle::push_output(const AVPacket& packet)
+{
+    int64_t nTsMs = packet_time_ms(packet);
+    m_bufferPreEvent.Push(packet, nTsMs);
+    if (record_on_motion())
+        feed_motion_file(packet, nTsMs);
+    else
+        m_stageFileMux.Push(packet);
+    // a blocking sink must not hold up AddOutput, RemoveOutput or the metrics
+    std::shared_ptr<const SinkList> pSinkList = sink_list();
+    if (pSinkList) {
+        for (auto& pSink : *pSinkList)
+            pSink->Push(packet);
+    }
+    feed_clip(packet, nTsMs);
 }
 
-void StreamHandle::push_packet(const AVPacket& packet)
+bool StreamHandle::outputs_blocking()
 {
+    if (m_stageFileMux.IsBlocking() || m_stageClipMux.IsBlocking())
+        return true;
+    std::shared_ptr<const SinkList> pSinkList = sink_list();
+    if (!pSinkList)
+        return false;
+    for (auto& pSink : *pSinkList)
     {
-        std::lock_guard<std::mutex> lock(m_mtPacket);
-        m_listPacket.push_back(packet);
+        if (pSink->IsBlocking())
+            return true;
+    }
+    return false;
+}
+
+void StreamHandle::open_audio_transcoder()
+{
+    m_bTranscodeAudio = false;
+    if (kInvalidStreamIndex == m_infoStream.nAudioIndex)
+        return;
+    const AVCodecParameters* pCodecPar = m_vecStreamPar[m_infoStream.nAudioIndex];
+    if (!AudioTranscoder::NeedTranscode(pCodecPar, m_infoStream.infoAudio.nMode))
+        return;
+    if (!m_transcoderAudio.Open(pCodecPar, m_vecStreamTimeBase[m_infoStream.nAudioIndex], m_infoStream.infoAudio)) {
+        printf("Audio of %s is copied as it is\n", m_infoStream.strInput.c_str());
+        return;
     }
-    m_cvFrame.notify_one();
+    m_bTranscodeAudio = true;
 }
 
-void StreamHandle::handle_frame()
+void StreamHandle::transcode_audio_packet(const AVPacket* pPacket)
 {
-    // handle frame of decode, save with video and picture
-    int nFrame = 0;
-    time_t tmStart = time(nullptr);
-    bool bSucc = false;
-    while (true)
+    // AAC in the time base of the input audio, the outputs can't tell it from a demuxed packet
+    m_transcoderAudio.Transcode(pPacket, [this](AVPacket* pAac) {
+        pAac->stream_index = m_infoStream.nAudioIndex;
+        m_ringAudioOut.Push(*pAac);
+    });
+}
+
+void StreamHandle::forward_audio(bool bWait)
+{
+    // the outputs are fed by one producer only, the demux thread
+    AVPacket* pPacket = nullptr;
+    while ((bWait || !m_pWorkerPool || !outputs_blocking()) && m_ringAudioOut.TryPop(pPacket))
     {
-        AVPacket packet;
-        {
-            std::unique_lock<std::mutex> lock(m_mtPacket);
-            m_cvFrame.wait(lock, [=]() {
-                return (m_bExit || !m_listPacket.empty());
-            });
-            if (m_bExit && m_listPacket.empty()) {
-                break;
-            }
-            packet = m_listPacket.front();
-            m_listPacket.pop_front();
-        }
-        if (time(nullptr) - tmStart >= 1)   // check per second
-            create_directory();
-        if (packet.stream_index == m_infoStream.nVideoIndex) {
-            bSucc = decode_video_packet(&packet);
-        }
-        else if (packet.stream_index == m_infoStream.nAudioIndex) {
-            bSucc = decode_audio_packet(packet);
+        push_output(*pPacket);
+        m_ringAudioOut.Recycle(pPacket);
+    }
+}
+
+std::vector<AVCodecParameters*> StreamHandle::get_output_par() const
+{
+    std::vector<AVCodecParameters*> vecCodecPar = m_vecStreamPar;
+    if (m_bTranscodeAudio)
+        vecCodecPar[m_infoStream.nAudioIndex] = const_cast<AVCodecParameters*>(m_transcoderAudio.GetCodecPar());
+    return vecCodecPar;
+}
+
+bool StreamHandle::need_video_frames() const
+{
+    return m_infoStream.nVideoIndex != kInvalidStreamIndex
+        && (m_infoStream.bSavePic || m_nFrameConsumer.load() > 0 || m_infoStream.infoMotion.bEnable);
+}
+
+void StreamHandle::start_video_decode_stage()
+{
+    // the owner may give the decoder its threads now
+    if (m_fnDecodeStart)
+        m_fnDecodeStart();
+    // the decoder is opened on the stage thread, the demux thread never waits for it
+    m_stageVideoDecode.Start("video-decode", m_infoStream.nPacketQueueSize, m_infoStream.nDecodeOverflowPolicy,
+        [this](AVPacket* pPacket) {
+        if (!open_video_decoder())
+            return;
+        decode_video_packet(pPacket);
+        // only keyframes come in, drain so the picture is out now and not with the next keyframe.
+        // Not once the P/B packets follow, they need the references of this keyframe
+        if ((pPacket->flags & AV_PKT_FLAG_KEY) && kDecodeKeyFrame == m_infoStream.nDecodeMode
+            && !m_bKeyFrameFallback.load() && !m_bFallbackPending.load()) {
+            decode_video_packet(nullptr);
+            avcodec_flush_buffers(m_pVideoDecoderCtx);
         }
-        if (!bSucc) {
-            continue;
+    }, m_pWorkerPool);
+}
+
+bool StreamHandle::accept_video_packet(const AVPacket& packet)
+{
+    if (kDecodeKeyFrame != m_infoStream.nDecodeMode)
+        return true;
+    int64_t nNowMs = Time::GetMilliTimestamp();
+    if (0 == m_nLastKeyFrameMs)
+        m_nLastKeyFrameMs = nNowMs;
+    // the GOP is long, every packet is decoded from here on
+    if (m_bKeyFrameFallback.load())
+        return true;
+    bool bLongGop = m_infoStream.nLongGopFallbackMs > 0 && nNowMs - m_nLastKeyFrameMs >= m_infoStream.nLongGopFallbackMs;
+    if (packet.flags & AV_PKT_FLAG_KEY) {
+        m_nLastKeyFrameMs = nNowMs;
+        if (m_bFallbackPending.load() || bLongGop) {
+            // the decoder gets its references with this keyframe, the P/B packets can follow
+            m_bKeyFrameFallback = true;
+            m_bFallbackPending = false;
+            m_nLastDecodedKeyMs = nNowMs;
+            return true;
         }
-        // save stream with video, rtmp
-        save_stream(m_pOutputFileAVFormatCtx, packet);
-        save_stream(m_pOutputStreamAVFormatCtx, packet);
-        ++nFrame;
+        if (nNowMs - m_nLastDecodedKeyMs < m_infoStream.nKeyFrameIntervalMs)
+            return false;
+        m_nLastDecodedKeyMs = nNowMs;
+        return true;
+    }
+    // a GOP longer than the fallback gives too few snapshots, decode everything
+    // from the next keyframe on. Starting here the decoder has no references
+    if (bLongGop && !m_bFallbackPending.load()) {
+        printf("No keyframe for %lld ms, decode all frames from the next one\n", (long long)(nNowMs - m_nLastKeyFrameMs));
+        m_bFallbackPending = true;
     }
-    printf("Save finished, %d frame\n", nFrame);
+    return false;
+}
+
+void StreamHandle::start_stages()
+{
+    size_t nQueueSize = m_infoStream.nPacketQueueSize;
+    m_bDemuxEnded = false;
+    m_nVideoPacket = 0;
+    m_bFeedVideoDecoder = false;
+    m_bVideoDecoderFailed = false;
+    m_nLastKeyFrameMs = 0;
+    m_nLastDecodedKeyMs = 0;
+    m_bKeyFrameFallback = false;
+    m_bFallbackPending = false;
+    int nPreEventSeconds = m_infoStream.nPreEventSeconds;
+    if (record_on_motion())
+        nPreEventSeconds = std::max(nPreEventSeconds, (int)kMotionPreEventSeconds);
+    m_bufferPreEvent.Init(m_infoStream.nVideoIndex, (int64_t)nPreEventSeconds * 1000, m_infoStream.nPreEventBytes);
+    m_nLastPacketMs = 0;
+    m_bClipActive = false;
+    m_bClipOpen = false;
+    m_detectorMotion.Init(m_infoStream.infoMotion);
+    m_bMotionRecord = false;
+    m_bMotionFeed = false;
+    m_bMotionFile = false;
+    // without frame consumers the video stays a pure remux
+    if (m_bTranscodeAudio) {
+        // a worker never waits on the demux thread, the oldest AAC is dropped when the
+        // ring is full. DemuxOnce stops reading at half full
+        m_ringAudioOut.Init(nQueueSize * kAudioOutPerPacket, kOverflowDropOldest);
+        m_stageAudioTranscode.Start("audio-transcode", nQueueSize, kOverflowBlock,
+            [this](AVPacket* pPacket) { transcode_audio_packet(pPacket); }, m_pWorkerPool);
+    }
+    if (m_infoStream.bDecodeAudio) {
+        if (open_codec_context(m_infoStream.nAudioIndex, &m_pAudioDecoderCtx, AVMEDIA_TYPE_AUDIO))
+            m_stageAudioDecode.Start("audio-decode", nQueueSize, m_infoStream.nDecodeOverflowPolicy,
+                [this](AVPacket* pPacket) { decode_audio_packet(*pPacket); }, m_pWorkerPool);
+        else
+            drop_cached_params();
+    }
+    if (m_infoStream.bSaveVideo) {
+        m_nSegmentStartDts = AV_NOPTS_VALUE;
+        m_nFileRetryDelayMs = 0;
+        // the first open in StartDecode failed (disk not mounted yet, permissions),
+        // the stage retries it like a failed rotation
+        if (nullptr == m_pOutputFileAVFormatCtx && !record_on_motion())
+            file_open_failed();
+        // room for the pre-event burst of a motion start
+        size_t nFileQueueSize = record_on_motion()
+            ? std::max(nQueueSize, (size_t)nPreEventSeconds * kClipPacketPerSecond) : nQueueSize;
+        m_stageFileMux.SetKeyIndex(m_infoStream.nVideoIndex);
+        m_stageFileMux.Start("mux-file", nFileQueueSize, m_infoStream.nFileOverflowPolicy,
+            [this](AVPacket* pPacket) { write_file_packet(pPacket); }, m_pWorkerPool);
+    }
+}
+
+void StreamHandle::stop_stages()
+{
+    // the demux thread has stopped, each stage drains what is queued
+    m_stageVideoDecode.Stop();
+    m_stageAudioDecode.Stop();
+    if (m_bTranscodeAudio) {
+        m_stageAudioTranscode.Stop();
+        // the last AAC frames, then what the demux thread did not take yet
+        transcode_audio_packet(nullptr);
+        forward_audio(true);
+        m_ringAudioOut.Clear();
+    }
+    m_stageFileMux.Stop();
+    m_stageClipMux.Stop();
+    m_bufferPreEvent.Clear();
 }
 
 bool StreamHandle::decode_video_packet(AVPacket* packet)
 {
-    AVFrame *pFrame = nullptr, *pSwapFrame = nullptr;
+    // the scratch frames are blank between calls, the decoder's references
+    // are moved into pooled frames so nothing is allocated per picture
+    AVFrame *pFrame = m_pDecodeFrame, *pSwapFrame = m_pSwapFrame;
     AVFrame *pTmpFrame = nullptr;
     int nCode = avcodec_send_packet(m_pVideoDecoderCtx, packet);
     if (nCode < 0) {
@@ -436,46 +1253,62 @@ bool StreamHandle::decode_video_packet(AVPacket* packet)
         return false;
     }
     while (1) {
-        if (!(pFrame = av_frame_alloc()) || !(pSwapFrame = av_frame_alloc()))
-        {
-            fprintf(stderr, "Can't alloc frame\n");
-            nCode = AVERROR(ENOMEM);
-            goto fail;
-        }
-
         nCode = avcodec_receive_frame(m_pVideoDecoderCtx, pFrame);
-        if (nCode == AVERROR(EAGAIN) || nCode == AVERROR_EOF) {
-            av_frame_free(&pFrame);
-            av_frame_free(&pSwapFrame);
+        if (nCode == AVERROR(EAGAIN) || nCode == AVERROR_EOF)
             return true;
-        }
         else if (nCode < 0)
         {
             fprintf(stderr, "Error while decoding,%s\n", get_error_msg(nCode).c_str());
             goto fail;
         }
 
-        if (m_infoStream.nPixFmt > AV_HWDEVICE_TYPE_NONE
+        if (m_pHDCtx != nullptr
             && pFrame->format == m_infoStream.nPixFmt)
         {
-            /* retrieve data from GPU to CPU */
+            /* retrieve data from GPU to CPU, into a pooled buffer */
+            auto tmStart = std::chrono::steady_clock::now();
+            AVPixelFormat nSwFormat = AV_PIX_FMT_NV12;
+            if (pFrame->hw_frames_ctx)
+                nSwFormat = ((AVHWFramesContext*)pFrame->hw_frames_ctx->data)->sw_format;
+            if (!m_poolFrame.GetTransferBuffer(pSwapFrame, nSwFormat, pFrame->width, pFrame->height)) {
+                nCode = AVERROR(ENOMEM);
+                goto fail;
+            }
             if ((nCode = av_hwframe_transfer_data(pSwapFrame, pFrame, 0)) < 0) {
                 fprintf(stderr, "Error transferring the data to system memory\n");
                 goto fail;
             }
+            m_histHwTransfer.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - tmStart).count());
+            pSwapFrame->pts = pFrame->pts;
+            pSwapFrame->best_effort_timestamp = pFrame->best_effort_timestamp;
+            pSwapFrame->key_frame = pFrame->key_frame;
+            // the surface goes back to the decoder now
+            av_frame_unref(pFrame);
             pTmpFrame = pSwapFrame;
         }
         else
             pTmpFrame = pFrame;
-        m_infoFrameConvert.pCvMat = avframe_to_mat(pTmpFrame);
-        PushFrame(m_infoFrameConvert.pCvMat);
+        record_first_frame();
+        m_nDecodedFrames.fetch_add(1, std::memory_order_relaxed);
+        {
+            int64_t nGlassUs = glass_latency_us(m_infoStream.nVideoIndex, pTmpFrame->best_effort_timestamp);
+            if (nGlassUs >= 0)
+                m_histGlassToFrame.Record(nGlassUs);
+        }
+        if (!analyze_motion(pTmpFrame)) {
+            // a still scene, nobody downstream sees this frame
+            av_frame_unref(pTmpFrame);
+            continue;
+        }
+        // leaves pTmpFrame blank
+        PushFrame(m_poolFrame.Wrap(pTmpFrame, m_pFrameConverter));
+        continue;
 
     fail:
-        av_frame_free(&pFrame);
-        av_frame_free(&pSwapFrame);
-        av_frame_unref(pTmpFrame);
-        if (nCode < 0)
-            return false;
+        av_frame_unref(pFrame);
+        av_frame_unref(pSwapFrame);
+        return false;
     }
 }
 
@@ -514,38 +1347,67 @@ bool StreamHandle::decode_audio_packet(const AVPacket& packet)
     return true;
 }
 
-void StreamHandle::save_stream(AVFormatContext* pFormatCtx, const AVPacket& packet)
+int64_t StreamHandle::frame_time_ms(const AVFrame* pFrame) const
 {
-    if (!m_bOutputInited || nullptr == packet.buf || 0 == packet.buf->size || nullptr == pFormatCtx) {
-        return;
-    }
-    AVPacket pktFrame /*= packet*/;
-    av_init_packet(&pktFrame);
-    av_copy_packet(&pktFrame, &packet);
-    AVStream *pInStream = m_pInputAVFormatCtx->streams[pktFrame.stream_index];
-    AVStream *pOutStream = pFormatCtx->streams[pktFrame.stream_index];
-    //תPTS/DTSʱ
-    try {
-        pktFrame.pts = av_rescale_q_rnd(pktFrame.pts, pInStream->time_base, pOutStream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-        pktFrame.dts = av_rescale_q_rnd(pktFrame.dts, pInStream->time_base, pOutStream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-        pktFrame.duration = av_rescale_q(pktFrame.duration, pInStream->time_base, pOutStream->time_base);
-        pktFrame.pos = -1;
+    // stream time, arrival time without pts
+    int64_t nPts = pFrame ? pFrame->best_effort_timestamp : AV_NOPTS_VALUE;
+    int nVideoIndex = m_infoStream.nVideoIndex;
+    if (AV_NOPTS_VALUE != nPts && nVideoIndex >= 0 && nVideoIndex < (int)m_vecStreamTimeBase.size())
+        return av_rescale_q(nPts, m_vecStreamTimeBase[nVideoIndex], AVRational{ 1, 1000 });
+    return Time::GetSteadyMilliTimestamp();
+}
+
+bool StreamHandle::analyze_motion(const AVFrame* pFrame)
+{
+    if (!m_infoStream.infoMotion.bEnable)
+        return true;
+    auto tmStart = std::chrono::steady_clock::now();
+    MotionEvent event;
+    int nResult = m_detectorMotion.Analyze(pFrame, frame_time_ms(pFrame), event);
+    if (kMotionSkipped != nResult) {
+        m_histMotion.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - tmStart).count());
     }
-    catch (const std::exception& e)
-    {
-        return;
+    if (kMotionEvent == nResult) {
+        printf("Motion %s on %s, %.1f%% changed\n", event.bMotion ? "started" : "stopped",
+            m_infoStream.strInput.c_str(), event.dRatio * 100);
+        if (event.bMotion)
+            m_nMotionStartMs = event.nPtsMs;
+        m_bMotionRecord = event.bMotion;
+        // while still only reference frames are decoded, enough to see the next motion
+        if (m_infoStream.bGateFramesOnMotion)
+            m_pVideoDecoderCtx->skip_frame = event.bMotion ? AVDISCARD_DEFAULT : AVDISCARD_NONREF;
+        if (m_fnMotion)
+            m_fnMotion(event);
     }
-    catch (...)
-    {
-        printf("Unkonw error\n");
+    return !m_infoStream.bGateFramesOnMotion || m_detectorMotion.IsMotion();
+}
+
+bool StreamHandle::record_on_motion() const
+{
+    return m_infoStream.bSaveVideo && m_infoStream.bRecordOnMotion && m_infoStream.infoMotion.bEnable
+        && m_infoStream.nVideoIndex != kInvalidStreamIndex;
+}
+
+void StreamHandle::save_stream(AVFormatContext* pFormatCtx, AVPacket* pPacket)
+{
+    if (!m_bOutputInited || nullptr == pPacket->buf || 0 == pPacket->buf->size || nullptr == pFormatCtx) {
         return;
     }
-    switch (pInStream->codecpar->codec_type)
+    // the stage owns this reference, no payload copy: rescale in place and hand it to the muxer
+    AVRational tbIn = m_vecStreamTimeBase[pPacket->stream_index];
+    AVStream *pOutStream = pFormatCtx->streams[pPacket->stream_index];
+    //תPTS/DTSʱ
+    pPacket->pts = av_rescale_q_rnd(pPacket->pts, tbIn, pOutStream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+    pPacket->dts = av_rescale_q_rnd(pPacket->dts, tbIn, pOutStream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+    pPacket->duration = av_rescale_q(pPacket->duration, tbIn, pOutStream->time_base);
+    pPacket->pos = -1;
+    switch (m_vecStreamPar[pPacket->stream_index]->codec_type)
     {
     case AVMEDIA_TYPE_AUDIO:
     case AVMEDIA_TYPE_VIDEO:
     {
-        int nError = av_interleaved_write_frame(pFormatCtx, &pktFrame);
+        int nError = av_interleaved_write_frame(pFormatCtx, pPacket);
         if (nError != 0)
         {
             printf("Error: %d while writing frame, %s\n", nError, get_error_msg(nError).c_str());
@@ -557,6 +1419,512 @@ void StreamHandle::save_stream(AVFormatContext* pFormatCtx, const AVPacket& pack
     }
 }
 
+void StreamHandle::write_file_packet(AVPacket* pPacket)
+{
+    if (record_on_motion() && !gate_file_output(*pPacket))
+        return;
+    if (nullptr == m_pOutputFileAVFormatCtx && !retry_output_file(*pPacket))
+        return;
+    if (AV_NOPTS_VALUE == m_nSegmentStartDts) {
+        // a segment starts with a video keyframe so every file plays on its own
+        bool bVideo = m_infoStream.nVideoIndex != kInvalidStreamIndex;
+        if (bVideo && !(pPacket->stream_index == m_infoStream.nVideoIndex && (pPacket->flags & AV_PKT_FLAG_KEY)))
+            return;
+        start_segment(*pPacket);
+    }
+    else if (need_new_segment(*pPacket)) {
+        if (!rotate_output_file())
+            return;
+        start_segment(*pPacket);
+    }
+    if (write_closing_segment(pPacket))
+        return;
+    int64_t nGlassUs = glass_latency_us(pPacket->stream_index, pPacket->pts);
+    if (nGlassUs >= 0)
+        m_histGlassToFile.Record(nGlassUs);
+    if (rebase_packet(pPacket, m_nSegmentStartDts, m_tbSegment)) {
+        bool bFragment = is_fragment_start(*pPacket);
+        save_stream(m_pOutputFileAVFormatCtx, pPacket);
+        flush_output(m_pOutputFileAVFormatCtx, m_nFileFlushMs, bFragment);
+    }
+}
+
+bool StreamHandle::write_closing_segment(AVPacket* pPacket)
+{
+    if (nullptr == m_pClosingFileCtx)
+        return false;
+    int64_t nTs = AV_NOPTS_VALUE != pPacket->dts ? pPacket->dts : pPacket->pts;
+    if (AV_NOPTS_VALUE == nTs)
+        return false;
+    // audio stamped before the cut (transcoded AAC lags the video) belongs to the previous file
+    AVRational tbPacket = m_vecStreamTimeBase[pPacket->stream_index];
+    bool bAudio = pPacket->stream_index == m_infoStream.nAudioIndex;
+    if (bAudio && av_compare_ts(nTs, tbPacket, m_nSegmentStartDts, m_tbSegment) < 0) {
+        if (rebase_packet(pPacket, m_nClosingStartDts, m_tbClosing))
+            save_stream(m_pClosingFileCtx, pPacket);
+        return true;
+    }
+    // the audio caught up with the cut, or there was none for a while
+    int64_t nHoldEnd = m_nSegmentStartDts + av_rescale_q(kClosingSegmentMs, AVRational{ 1, 1000 }, m_tbSegment);
+    if (bAudio || av_compare_ts(nTs, tbPacket, nHoldEnd, m_tbSegment) >= 0)
+        close_closing_segment();
+    return false;
+}
+
+void StreamHandle::close_closing_segment()
+{
+    bool bInited = m_pClosingFileCtx != nullptr;
+    release_output_format_context(bInited, m_pClosingFileCtx);
+    m_nClosingStartDts = AV_NOPTS_VALUE;
+    m_strClosingFile.clear();
+}
+
+void StreamHandle::feed_motion_file(const AVPacket& packet, int64_t nTsMs)
+{
+    // the decode stage sets the state, the demux thread follows it without waiting for the decoder
+    bool bMotion = m_bMotionRecord.load();
+    if (!bMotion) {
+        if (m_bMotionFeed)
+            push_file_command(kRecordStopIndex);
+        m_bMotionFeed = false;
+        return;
+    }
+    if (m_bMotionFeed) {
+        m_stageFileMux.Push(packet);
+        return;
+    }
+    // the start was decided on a frame demuxed a while ago, the file begins at the last
+    // keyframe before that frame. The buffer already holds this packet
+    m_bMotionFeed = true;
+    push_file_command(kRecordStartIndex);
+    std::vector<AVPacket*> vecPacket;
+    m_bufferPreEvent.Collect(std::max<int64_t>(0, nTsMs - m_nMotionStartMs.load()), vecPacket);
+    for (AVPacket* pPacket : vecPacket)
+    {
+        m_stageFileMux.Push(*pPacket);
+        av_packet_free(&pPacket);
+    }
+    if (vecPacket.empty())
+        m_stageFileMux.Push(packet);
+}
+
+void StreamHandle::push_file_command(int nCommandIndex)
+{
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = nullptr;
+    packet.size = 0;
+    packet.stream_index = nCommandIndex;
+    m_stageFileMux.Push(packet);
+}
+
+bool StreamHandle::gate_file_output(const AVPacket& packet)
+{
+    if (kRecordStartIndex == packet.stream_index || kRecordStopIndex == packet.stream_index) {
+        if (m_pOutputFileAVFormatCtx) {
+            close_closing_segment();
+            bool bInited = true;
+            release_output_format_context(bInited, m_pOutputFileAVFormatCtx);
+            m_nSegmentStartDts = AV_NOPTS_VALUE;
+        }
+        m_bMotionFile = kRecordStartIndex == packet.stream_index;
+        return false;
+    }
+    if (!m_bMotionFile)
+        return false;
+    if (m_pOutputFileAVFormatCtx)
+        return true;
+    // the file starts at a keyframe (the oldest buffered packet), the segment starts on the same packet
+    if (!(packet.stream_index == m_infoStream.nVideoIndex && (packet.flags & AV_PKT_FLAG_KEY)))
+        return false;
+    if (!open_output_stream(m_pOutputFileAVFormatCtx, &m_strVideoFile)) {
+        printf("Can't open motion recording of %s\n", m_infoStream.strInput.c_str());
+        m_nFileOpenFailures.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    m_nSegmentStartDts = AV_NOPTS_VALUE;
+    post_retention();
+    return true;
+}
+
+bool StreamHandle::need_new_segment(const AVPacket& packet)
+{
+    if (m_infoStream.nVideoIndex != kInvalidStreamIndex
+        && !(packet.stream_index == m_infoStream.nVideoIndex && (packet.flags & AV_PKT_FLAG_KEY)))
+        return false;
+    if (m_infoStream.bSegmentAtDateChange && get_today() != m_strSegmentDate)
+        return true;
+    if (m_infoStream.nSegmentSeconds <= 0)
+        return false;
+    // segment length in stream time, a file read faster than real time is cut the same way
+    int64_t nTs = AV_NOPTS_VALUE != packet.dts ? packet.dts : packet.pts;
+    if (AV_NOPTS_VALUE == nTs)
+        return false;
+    AVRational tbMs = { 1, 1000 };
+    int64_t nElapsedMs = av_rescale_q(nTs, m_vecStreamTimeBase[packet.stream_index], tbMs)
+        - av_rescale_q(m_nSegmentStartDts, m_tbSegment, tbMs);
+    return nElapsedMs >= (int64_t)m_infoStream.nSegmentSeconds * 1000;
+}
+
+void StreamHandle::start_segment(const AVPacket& packet)
+{
+    int64_t nTs = AV_NOPTS_VALUE != packet.dts ? packet.dts : packet.pts;
+    m_nSegmentStartDts = AV_NOPTS_VALUE != nTs ? nTs : 0;
+    m_tbSegment = m_vecStreamTimeBase[packet.stream_index];
+    m_strSegmentDate = get_today();
+}
+
+bool StreamHandle::rebase_packet(AVPacket* pPacket, int64_t nStartDts, AVRational tbStart)
+{
+    // every segment starts at 0, the offset is shared by all streams to keep them in sync
+    int64_t nOffset = av_rescale_q(nStartDts, tbStart,
+        m_vecStreamTimeBase[pPacket->stream_index]);
+    if (AV_NOPTS_VALUE != pPacket->pts)
+        pPacket->pts -= nOffset;
+    if (AV_NOPTS_VALUE != pPacket->dts)
+        pPacket->dts -= nOffset;
+    // audio queued just before the keyframe belongs to the previous segment
+    int64_t nTs = AV_NOPTS_VALUE != pPacket->dts ? pPacket->dts : pPacket->pts;
+    return AV_NOPTS_VALUE == nTs || nTs >= 0;
+}
+
+bool StreamHandle::rotate_output_file()
+{
+    // runs on the file mux stage, the demux thread keeps reading meanwhile. The old
+    // file stays open for the audio that arrives after the cut, see write_closing_segment
+    close_closing_segment();
+    m_pClosingFileCtx = m_pOutputFileAVFormatCtx;
+    m_strClosingFile = m_strVideoFile;
+    m_nClosingStartDts = m_nSegmentStartDts;
+    m_tbClosing = m_tbSegment;
+    m_pOutputFileAVFormatCtx = nullptr;
+    if (!open_output_stream(m_pOutputFileAVFormatCtx, &m_strVideoFile)) {
+        // nothing goes to the old file any more, the next segment is tried again later
+        close_closing_segment();
+        file_open_failed();
+        return false;
+    }
+    post_retention();
+    return true;
+}
+
+bool StreamHandle::retry_output_file(const AVPacket& packet)
+{
+    // after a failed first open or rotation, at a keyframe once the delay is over
+    if (m_nFileRetryDelayMs <= 0 || Time::GetSteadyMilliTimestamp() < m_nFileRetryAtMs)
+        return false;
+    if (m_infoStream.nVideoIndex != kInvalidStreamIndex
+        && !(packet.stream_index == m_infoStream.nVideoIndex && (packet.flags & AV_PKT_FLAG_KEY)))
+        return false;
+    if (!open_output_stream(m_pOutputFileAVFormatCtx, &m_strVideoFile)) {
+        file_open_failed();
+        return false;
+    }
+    printf("Recording of %s goes on in %s\n", m_infoStream.strInput.c_str(), m_strVideoFile.c_str());
+    m_nFileRetryDelayMs = 0;
+    m_nSegmentStartDts = AV_NOPTS_VALUE;
+    post_retention();
+    return true;
+}
+
+void StreamHandle::file_open_failed()
+{
+    m_nFileOpenFailures.fetch_add(1, std::memory_order_relaxed);
+    m_nFileRetryDelayMs = std::min(std::max(m_nFileRetryDelayMs * 2, (int)kFileRetryMinMs), (int)kFileRetryMaxMs);
+    m_nFileRetryAtMs = Time::GetSteadyMilliTimestamp() + m_nFileRetryDelayMs;
+    printf("Can't open a segment of %s, next try in %d ms\n", m_infoStream.strInput.c_str(), m_nFileRetryDelayMs);
+}
+
+void StreamHandle::post_retention()
+{
+    if (m_infoStream.nRetentionDays <= 0 && m_infoStream.nRetentionBytes <= 0)
+        return;
+    int nRetentionDays = m_infoStream.nRetentionDays;
+    int64_t nRetentionBytes = m_infoStream.nRetentionBytes;
+    std::string strPrefix = m_infoStream.strRecordPrefix;
+    // the segment being written and the one still taking late audio
+    std::vector<std::string> vecKeepFile = { m_strVideoFile, m_strClosingFile };
+    Storage::Instance().Post([nRetentionDays, nRetentionBytes, strPrefix, vecKeepFile]() {
+        enforce_retention(nRetentionDays, nRetentionBytes, strPrefix, vecKeepFile);
+    });
+}
+
+void StreamHandle::TriggerClip(int nPreSeconds, int nPostSeconds)
+{
+    std::lock_guard<std::mutex> lock(m_mtClip);
+    m_bClipRequest = true;
+    m_nClipPreSeconds = std::max(0, nPreSeconds);
+    m_nClipPostSeconds = std::max(0, nPostSeconds);
+}
+
+int StreamHandle::AddOutput(const OutputSinkInfo& infoSink)
+{
+    std::lock_guard<std::mutex> lock(m_mtSink);
+    if (m_bExit || !m_bInputInited)
+        return -1;
+    auto pSink = std::make_shared<OutputSink>();
+    int nId = m_nNextSinkId++;
+    if (!pSink->Start(nId, infoSink, get_output_par(), m_vecStreamTimeBase, m_infoStream.nVideoIndex, m_pWorkerPool)) {
+        printf("Can't add output %s\n", infoSink.strUrl.c_str());
+        return -1;
+    }
+    auto pSinkList = m_pSinkList ? std::make_shared<SinkList>(*m_pSinkList) : std::make_shared<SinkList>();
+    pSinkList->push_back(pSink);
+    m_pSinkList = pSinkList;
+    return nId;
+}
+
+bool StreamHandle::RemoveOutput(int nId)
+{
+    std::shared_ptr<OutputSink> pSink;
+    {
+        std::lock_guard<std::mutex> lock(m_mtSink);
+        if (!m_pSinkList)
+            return false;
+        auto pSinkList = std::make_shared<SinkList>(*m_pSinkList);
+        auto it = std::find_if(pSinkList->begin(), pSinkList->end(),
+            [nId](const std::shared_ptr<OutputSink>& pItem) { return pItem->GetId() == nId; });
+        if (it == pSinkList->end())
+            return false;
+        pSink = *it;
+        pSinkList->erase(it);
+        m_pSinkList = pSinkList;
+    }
+    // the demux thread may still push from its copy of the list, the sink
+    // refuses those once stopped; drain and write the trailer outside the lock
+    pSink->Stop();
+    return true;
+}
+
+std::vector<int> StreamHandle::GetOutputIds()
+{
+    std::vector<int> vecIds;
+    std::shared_ptr<const SinkList> pSinkList = sink_list();
+    if (pSinkList) {
+        for (auto& pSink : *pSinkList)
+            vecIds.push_back(pSink->GetId());
+    }
+    return vecIds;
+}
+
+void StreamHandle::stop_outputs()
+{
+    std::shared_ptr<const SinkList> pSinkList;
+    {
+        std::lock_guard<std::mutex> lock(m_mtSink);
+        pSinkList.swap(m_pSinkList);
+    }
+    if (pSinkList) {
+        for (auto& pSink : *pSinkList)
+            pSink->Stop();
+    }
+}
+
+std::shared_ptr<const StreamHandle::SinkList> StreamHandle::sink_list()
+{
+    std::lock_guard<std::mutex> lock(m_mtSink);
+    return m_pSinkList;
+}
+
+int64_t StreamHandle::packet_time_ms(const AVPacket& packet)
+{
+    int64_t nTs = AV_NOPTS_VALUE != packet.dts ? packet.dts : packet.pts;
+    if (AV_NOPTS_VALUE != nTs)
+        m_nLastPacketMs = av_rescale_q(nTs, m_vecStreamTimeBase[packet.stream_index], AVRational{ 1, 1000 });
+    return m_nLastPacketMs;
+}
+
+void StreamHandle::feed_clip(const AVPacket& packet, int64_t nTsMs)
+{
+    bool bRequest = false;
+    int nPreSeconds = 0;
+    int nPostSeconds = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mtClip);
+        std::swap(bRequest, m_bClipRequest);
+        nPreSeconds = m_nClipPreSeconds;
+        nPostSeconds = m_nClipPostSeconds;
+    }
+    if (bRequest) {
+        int64_t nEndMs = nTsMs + (int64_t)nPostSeconds * 1000;
+        if (m_bClipActive) {
+            m_nClipEndMs = std::max(m_nClipEndMs, nEndMs);
+        }
+        else {
+            if (!m_stageClipMux.IsRunning()) {
+                size_t nQueueSize = std::max((size_t)m_infoStream.nPacketQueueSize,
+                    (size_t)m_infoStream.nPreEventSeconds * kClipPacketPerSecond);
+                m_stageClipMux.Start("mux-clip", nQueueSize, kOverflowBlock,
+                    [this](AVPacket* pPacket) { write_clip_packet(pPacket); }, m_pWorkerPool);
+            }
+            push_clip_command(kClipStartIndex);
+            // the buffer already holds this packet, the clip goes on with the next one
+            std::vector<AVPacket*> vecPacket;
+            m_bufferPreEvent.Collect((int64_t)nPreSeconds * 1000, vecPacket);
+            for (AVPacket* pPacket : vecPacket)
+            {
+                m_stageClipMux.Push(*pPacket);
+                av_packet_free(&pPacket);
+            }
+            if (vecPacket.empty())
+                m_stageClipMux.Push(packet);
+            m_bClipActive = true;
+            m_nClipEndMs = nEndMs;
+            return;
+        }
+    }
+    if (!m_bClipActive)
+        return;
+    if (nTsMs >= m_nClipEndMs) {
+        push_clip_command(kClipEndIndex);
+        m_bClipActive = false;
+        return;
+    }
+    m_stageClipMux.Push(packet);
+}
+
+void StreamHandle::push_clip_command(int nCommandIndex)
+{
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = nullptr;
+    packet.size = 0;
+    packet.stream_index = nCommandIndex;
+    m_stageClipMux.Push(packet);
+}
+
+void StreamHandle::write_clip_packet(AVPacket* pPacket)
+{
+    if (kClipStartIndex == pPacket->stream_index || kClipEndIndex == pPacket->stream_index) {
+        if (m_pOutputClipAVFormatCtx) {
+            bool bInited = true;
+            release_output_format_context(bInited, m_pOutputClipAVFormatCtx);
+        }
+        m_bClipOpen = kClipStartIndex == pPacket->stream_index;
+        m_nClipStartDts = AV_NOPTS_VALUE;
+        return;
+    }
+    if (!m_bClipOpen)
+        return;
+    if (AV_NOPTS_VALUE == m_nClipStartDts) {
+        // the clip file starts with a keyframe, opened here so the demux thread never waits for it
+        if (m_infoStream.nVideoIndex != kInvalidStreamIndex
+            && !(pPacket->stream_index == m_infoStream.nVideoIndex && (pPacket->flags & AV_PKT_FLAG_KEY)))
+            return;
+        if (!open_output_stream(m_pOutputClipAVFormatCtx)) {
+            printf("Can't open clip of %s\n", m_infoStream.strInput.c_str());
+            m_bClipOpen = false;
+            return;
+        }
+        int64_t nTs = AV_NOPTS_VALUE != pPacket->dts ? pPacket->dts : pPacket->pts;
+        m_nClipStartDts = AV_NOPTS_VALUE != nTs ? nTs : 0;
+        m_tbClip = m_vecStreamTimeBase[pPacket->stream_index];
+    }
+    if (rebase_packet(pPacket, m_nClipStartDts, m_tbClip)) {
+        bool bFragment = is_fragment_start(*pPacket);
+        save_stream(m_pOutputClipAVFormatCtx, pPacket);
+        flush_output(m_pOutputClipAVFormatCtx, m_nClipFlushMs, bFragment);
+    }
+}
+
+bool StreamHandle::is_fragment_start(const AVPacket& packet) const
+{
+    // with frag_keyframe the muxer writes out the previous fragment when a video keyframe comes in
+    return m_infoStream.bFragmentedMp4 && packet.stream_index == m_infoStream.nVideoIndex
+        && (packet.flags & AV_PKT_FLAG_KEY);
+}
+
+void StreamHandle::flush_output(AVFormatContext* pFormatCtx, int64_t& nLastFlushMs, bool bFragment)
+{
+    // hand finished fragments to the OS, they survive a crash of this process
+    if (nullptr == pFormatCtx || nullptr == pFormatCtx->pb)
+        return;
+    int64_t nNowMs = Time::GetMilliTimestamp();
+    if (!bFragment && (m_infoStream.nFlushIntervalMs <= 0 || nNowMs - nLastFlushMs < m_infoStream.nFlushIntervalMs))
+        return;
+    nLastFlushMs = nNowMs;
+    if (FileWriter::IsWriterIo(pFormatCtx->pb))
+        FileWriter::Flush(pFormatCtx->pb);
+    else
+        avio_flush(pFormatCtx->pb);
+}
+
+ThreadPool* StreamHandle::get_task_pool()
+{
+    // a standalone stream brings up its own small pool on first use
+    if (m_pWorkerPool)
+        return m_pWorkerPool;
+    m_poolSavePic.Start(1, 2);
+    return &m_poolSavePic;
+}
+
+void StreamHandle::enforce_retention(int nRetentionDays, int64_t nRetentionBytes, const std::string& strPrefix,
+    const std::vector<std::string>& vecKeepFile)
+{
+    struct SegmentFile
+    {
+        std::string strPath;
+        int64_t nSize;
+        time_t tmWrite;
+    };
+    std::vector<SegmentFile> vecFile;
+    std::vector<StorageEntry> vecDir;
+    Storage::ListDirectory(".", vecDir);
+    for (auto& dir : vecDir)
+    {
+        // YYYY-MM-DD
+        if (!dir.bDirectory || dir.strName.size() != 10 || '-' != dir.strName[4] || '-' != dir.strName[7])
+            continue;
+        std::string strVideoDir = dir.strName + "/" + kVideoDir;
+        std::vector<StorageEntry> vecEntry;
+        Storage::ListDirectory(strVideoDir, vecEntry);
+        std::string strNamePrefix = strPrefix + "_";
+        for (auto& entry : vecEntry)
+        {
+            // other streams write to the same directory
+            if (!entry.bDirectory && entry.strName.size() > strNamePrefix.size() + kVidoeType.size()
+                && 0 == entry.strName.compare(0, strNamePrefix.size(), strNamePrefix)
+                && 0 == entry.strName.compare(entry.strName.size() - kVidoeType.size(), kVidoeType.size(), kVidoeType))
+                vecFile.push_back({ strVideoDir + "/" + entry.strName, entry.nSize, entry.tmWrite });
+        }
+    }
+
+    // date directory and millisecond name, oldest first
+    std::sort(vecFile.begin(), vecFile.end(),
+        [](const SegmentFile& a, const SegmentFile& b) { return a.strPath < b.strPath; });
+    int64_t nTotalBytes = 0;
+    for (auto& file : vecFile)
+        nTotalBytes += file.nSize;
+    time_t tmExpire = time(nullptr) - (time_t)nRetentionDays * 24 * 3600;
+    for (auto& file : vecFile)
+    {
+        bool bExpired = nRetentionDays > 0 && file.tmWrite < tmExpire;
+        bool bOverSize = nRetentionBytes > 0 && nTotalBytes > nRetentionBytes;
+        if (!bExpired && !bOverSize)
+            break;
+        if (std::find(vecKeepFile.begin(), vecKeepFile.end(), file.strPath) != vecKeepFile.end())
+            continue;
+        if (Storage::RemoveFile(file.strPath))
+            nTotalBytes -= file.nSize;
+        else
+            printf("Can't remove segment %s\n", file.strPath.c_str());
+    }
+}
+
+std::string StreamHandle::default_record_prefix(const std::string& strInput)
+{
+    // FNV-1a, stable from run to run so retention finds the older segments
+    uint32_t nHash = 2166136261u;
+    for (unsigned char ch : strInput)
+    {
+        nHash ^= ch;
+        nHash *= 16777619u;
+    }
+    char szPrefix[16] = { 0 };
+    snprintf(szPrefix, sizeof(szPrefix), "%08x", nHash);
+    return szPrefix;
+}
+
 void StreamHandle::free_frame_convert_info()
 {
     if (m_infoFrameConvert.pFrame != nullptr) {
@@ -572,7 +1940,13 @@ void StreamHandle::release_output_format_context(bool& bInited, AVFormatContext*
             av_write_trailer(pFmtContext);
         if (!(pFmtContext->oformat->flags & AVFMT_NOFILE))
         {
-            if (pFmtContext->pb)
+            if (FileWriter::IsWriterIo(pFmtContext->pb))
+            {
+                // the end of a segment, the only place it is synced
+                if (!FileWriter::Close(pFmtContext->pb))
+                    printf("Can't finish %s\n", pFmtContext->url ? pFmtContext->url : "");
+            }
+            else if (pFmtContext->pb)
             {
                 avio_close(pFmtContext->pb);
             }
@@ -583,34 +1957,89 @@ void StreamHandle::release_output_format_context(bool& bInited, AVFormatContext*
     bInited = false;
 }
 
-void StreamHandle::create_directory()
+bool StreamHandle::make_date_directories(const std::string& strDate)
 {
-    std::string strToday = Time::GetCurrentDate();
-    if (strToday == m_strToday)return;
-    if (0 == _mkdir(strToday.c_str()) || 0 == _access(strToday.c_str(), 0))
+    return Storage::MakeDirectory(strDate)
+        && Storage::MakeDirectory(strDate + "/" + kVideoDir)
+        && Storage::MakeDirectory(strDate + "/" + kPictureDir);
+}
+
+void StreamHandle::set_today(const std::string& strToday, time_t tmNow)
+{
+    {
+        // the file mux stage cuts a segment on the change
+        std::lock_guard<std::mutex> lock(m_mtFilename);
         m_strToday = strToday;
-    std::string strVideoDir = m_strToday + "/" + kVideoDir;
-    if (0 != _access(strVideoDir.c_str(), 0))
-        _mkdir(strVideoDir.c_str());
-    std::string strPictureDir = m_strToday + "/" + kPictureDir;
-    if (0 != _access(strPictureDir.c_str(), 0))
-        _mkdir(strPictureDir.c_str());
+    }
+    m_tmNextDay = Time::GetDayStart(tmNow, 1);
+    m_tmDateCheck = std::max(tmNow, m_tmNextDay - kPrepareDateSeconds);
+}
+
+void StreamHandle::prepare_date(const std::string& strDate)
+{
+    // a request in flight or done for this date is not repeated, a failed one is
+    if (strDate == m_strPendingDate && m_pPendingDate && kDateFailed != m_pPendingDate->load())
+        return;
+    auto pState = std::make_shared<std::atomic<int>>(kDatePending);
+    if (!Storage::Instance().Post([strDate, pState]() {
+        pState->store(make_date_directories(strDate) ? kDateReady : kDateFailed);
+    }))
+        pState->store(kDateFailed);
+    m_strPendingDate = strDate;
+    m_pPendingDate = pState;
+}
+
+void StreamHandle::check_date(time_t tmNow)
+{
+    std::string strDate = Time::GetDate(tmNow);
+    if (tmNow < m_tmNextDay && strDate == get_today()) {
+        // the last minutes of the day: directories of tomorrow, switched to at midnight
+        prepare_date(Time::GetDate(m_tmNextDay));
+        m_tmDateCheck = kDateFailed == m_pPendingDate->load() ? tmNow + 1 : m_tmNextDay;
+        return;
+    }
+    // a new day or a clock change, switch once the directories exist
+    if (strDate == m_strPendingDate && kDateReady == m_pPendingDate->load()) {
+        set_today(strDate, tmNow);
+        return;
+    }
+    prepare_date(strDate);
+    m_tmDateCheck = tmNow + 1;
+}
+
+std::string StreamHandle::get_today()
+{
+    std::lock_guard<std::mutex> lock(m_mtFilename);
+    return m_strToday;
 }
 
 std::string StreamHandle::generate_filename(int nType)
 {
-    std::string strMillSecond = std::to_string(Time::GetMilliTimestamp());
+    int64_t nMillSecond = Time::GetMilliTimestamp();
+    std::string strMillSecond = std::to_string(nMillSecond);
+    std::string strToday;
+    {
+        // files made in the same millisecond get a sequence suffix
+        std::lock_guard<std::mutex> lock(m_mtFilename);
+        strToday = m_strToday;
+        if (nMillSecond == m_nLastFileMs)
+            strMillSecond += "_" + std::to_string(++m_nFileSeq);
+        else {
+            m_nLastFileMs = nMillSecond;
+            m_nFileSeq = 0;
+        }
+    }
     std::string strFilename;
     switch (nType)
     {
     case kFileTypeVideo: // Ƶ
-        strFilename = m_strToday + "/" + kVideoDir + "/" + strMillSecond + ".mp4";
+        strFilename = strToday + "/" + kVideoDir + "/" + m_infoStream.strRecordPrefix + "_" + strMillSecond + kVidoeType;
         break;
     case kFileTypeRtmp:
         strFilename = "";
         break;
     default:    // Ƭ
-        strFilename = m_strToday + "/" + kPictureDir + "/" + strMillSecond + ".jpg";
+        strFilename = strToday + "/" + kPictureDir + "/" + strMillSecond + ".jpg";
         break;
     }
 
@@ -619,10 +2048,7 @@ std::string StreamHandle::generate_filename(int nType)
 
 std::string StreamHandle::get_current_path()
 {
-    char szPath[260] = { 0 };
-    _getcwd(szPath, 260);
-
-    return szPath;
+    return Storage::GetWorkingDirectory();
 }
 
 std::string StreamHandle::get_error_msg(int nErrorCode)
@@ -635,16 +2061,3 @@ std::string StreamHandle::get_error_msg(int nErrorCode)
     }
     return ss.str();
 }
-
-cv::Mat StreamHandle::avframe_to_mat(const AVFrame * frame)
-{
-    int width = frame->width;
-    int height = frame->height;
-    cv::Mat image(height, width, CV_8UC3);
-    int cvLinesizes[1];
-    cvLinesizes[0] = image.step1();
-    SwsContext* pSwsCtx = sws_getContext(width, height, (AVPixelFormat)frame->format, width, height, AVPixelFormat::AV_PIX_FMT_BGR24, SWS_FAST_BILINEAR, NULL, NULL, NULL);
-    sws_scale(pSwsCtx, frame->data, frame->linesize, 0, height, &image.data, cvLinesizes);
-    sws_freeContext(pSwsCtx);
-    return image;
-}
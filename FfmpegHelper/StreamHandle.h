@@ -1,7 +1,18 @@
 #pragma once
 #include <string>
-#include <list>
+#include <vector>
 #include "ThreadPool.h"
+#include "FrameHandle.h"
+#include "FramePool.h"
+#include "FrameDispatcher.h"
+#include "PipelineStage.h"
+#include "SnapshotWriter.h"
+#include "PreEventBuffer.h"
+#include "OutputSink.h"
+#include "StreamParamCache.h"
+#include "FileWriter.h"
+#include "AudioTranscoder.h"
+#include "MotionDetector.h"
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 extern "C" {
@@ -14,6 +25,19 @@ extern "C" {
 #include <libavutil/imgutils.h>
 }
 
+// which video packets reach the decoder
+enum VideoDecodeMode
+{
+    kDecodeAllFrame,
+    kDecodeKeyFrame,        // thumbnails and snapshots, non-key packets are dropped before the decoder
+};
+// threading of the software video decoder
+enum DecodeThreadType
+{
+    kDecodeThreadAuto,      // frame threads where the codec has them, else slices
+    kDecodeThreadFrame,     // most throughput, every extra thread adds a frame of latency
+    kDecodeThreadSlice,     // no added latency, only helps streams coded in several slices
+};
 // rtsp info
 struct StreamInfo
 {
@@ -21,6 +45,7 @@ struct StreamInfo
     std::string strInput;
     std::string strOutput;
     bool bSavePic = false;
+    SnapshotConfig infoSnapshot;
     bool bSaveVideo = false;
     bool bRtmp = false;
     int nWidth = 0;
@@ -30,17 +55,106 @@ struct StreamInfo
     int nFrameRate = 25;
     int nVideoIndex = -1;
     int nAudioIndex = -1;
+    bool bDecodeAudio = false;
+    VideoDecodeMode nDecodeMode = kDecodeAllFrame;
+    int nKeyFrameIntervalMs = 0;        // kDecodeKeyFrame: minimum time between two decoded keyframes
+    int nLongGopFallbackMs = 10000;     // kDecodeKeyFrame: no keyframe for this long, decode all frames from the next keyframe on
+    // software video decoder, not used with nHDType
+    int nDecodeThreads = 0;             // 0: not set, a single thread or the share given by StreamManager
+    DecodeThreadType nDecodeThreadType = kDecodeThreadAuto;
+    bool bFastDecode = false;           // flags2 FAST, not bit exact, for low priority streams
+    AVDiscard nSkipLoopFilter = AVDISCARD_DEFAULT;  // AVDISCARD_NONREF or _ALL trade quality for speed
+    // packets queued in front of each pipeline stage
+    int nPacketQueueSize = 256;
+    PacketOverflowPolicy nDecodeOverflowPolicy = kOverflowBlock;
+    PacketOverflowPolicy nFileOverflowPolicy = kOverflowBlock;
+    PacketOverflowPolicy nRtmpOverflowPolicy = kOverflowDropUntilKey;   // a slow server must not stall the reader
+    // recording is cut at the first keyframe after nSegmentSeconds and at the date rollover
+    int nSegmentSeconds = 0;            // 0: one file until StopDecode
+    bool bSegmentAtDateChange = true;
+    // retention of recorded segments, checked after every cut, 0: no limit
+    int nRetentionDays = 0;
+    int64_t nRetentionBytes = 0;
+    // segment names start with it and retention only removes files of this prefix,
+    // empty: a hash of strInput, so streams sharing the date directories keep apart
+    std::string strRecordPrefix;
+    // packets kept in memory for TriggerClip and motion recordings, 0: a clip starts at the next keyframe
+    int nPreEventSeconds = 0;
+    int64_t nPreEventBytes = 64 * 1024 * 1024;
+    // fragmented mp4 for recordings and clips, one fragment per GOP: a killed
+    // process leaves a file that plays up to the last fragment instead of one without moov
+    bool bFragmentedMp4 = false;
+    int nFlushIntervalMs = 0;           // avio_flush the file this often, 0: when the io buffer is full
+    // off by default. With nBufferSize recordings and clips go through FileWriter:
+    // one large aligned buffer per file, fdatasync when a segment is closed. With
+    // bFragmentedMp4 the buffer is written out at every fragment, otherwise only
+    // nFlushIntervalMs bounds what a crash loses
+    FileWriterConfig infoFileWriter;
+    // audio of the outputs, G.711/PCM becomes AAC on the worker pool by default, video is always copied
+    AudioTranscodeInfo infoAudio;
+    // motion on the decoded luma at a few frames per second, keeps the video decoder running
+    MotionConfig infoMotion;
+    bool bRecordOnMotion = false;       // bSaveVideo: a file from the last keyframe before a motion start to the stop
+    bool bGateFramesOnMotion = false;   // frames and snapshots only during motion, non-reference frames skipped while still
+    // NV12/YUV420P BT.601 frames to BGR/gray on ColorKernels instead of swscale,
+    // faster but not bit exact with it, see FrameConverter
+    bool bColorKernels = false;
+    // probing on open, 0: ffmpeg default
+    int64_t nProbeSize = 0;             // bytes
+    int64_t nAnalyzeDurationUs = 0;
+    // reuse the codec parameters of the last open of the same url and skip
+    // avformat_find_stream_info when the streams match
+    bool bCacheStreamInfo = false;
+    bool bDumpFormat = true;            // av_dump_format after open
+    // input watchdog and reconnection
+    int nIoTimeoutMs = 10000;           // interrupt an open or a read without data for this long, 0: never
+    bool bReconnect = false;            // reopen a lost input instead of ending, the outputs stay open
+    int nReconnectMinMs = 500;          // first retry delay, doubled after every failed attempt
+    int nReconnectMaxMs = 30000;
+    // more outputs fed by the same read, bRtmp adds strOutput as one of them
+    std::vector<OutputSinkInfo> vecOutput;
+};
+// time to first frame of the last connection, ms since the open started, -1: not yet
+struct OpenTiming
+{
+    bool bFromCache = false;            // StreamParamCache hit, no probing
+    int64_t nOpenMs = -1;               // open and stream info
+    int64_t nFirstPacketMs = -1;
+    int64_t nFirstKeyFrameMs = -1;
+    int64_t nFirstFrameMs = -1;         // first decoded picture, stays -1 without a decoder
+};
+// everything measured on one stream, see StreamHandle::GetMetrics
+struct StreamMetrics
+{
+    std::vector<StageStats> vecStages;
+    std::vector<HistogramSnapshot> vecStageLatency;     // per stage, named after it
+    std::vector<HistogramSnapshot> vecStepLatency;      // hw_transfer, convert, jpeg_encode, jpeg_write
+    std::vector<HistogramSnapshot> vecGlassLatency;     // capture to file write / to decoded frame
+    uint64_t nReadBytes = 0;
+    uint64_t nDecodedFrames = 0;
+    uint64_t nFileOpenFailures = 0;     // recording files that could not be opened
+    SnapshotStats statsSnapshot;
+    FramePoolStats statsFramePool;
+    uint64_t nPreEventAlloc = 0;        // packets allocated by the pre-event buffer
+    MotionStats statsMotion;
+    OpenTiming timing;
 };
 // frame convert
 struct FrameConvertInfo
 {
     AVFrame *pFrame = nullptr;
-    cv::Mat pCvMat;
     FrameConvertInfo()
     {
         pFrame = av_frame_alloc();//ڴ
     }
 };
+// result of StreamHandle::DemuxOnce
+enum DemuxResult
+{
+    kDemuxPacket,           // a packet was read and dispatched
+    kDemuxAgain,            // no data yet or stages are full, call again later
+    kDemuxEnd,              // end of input or read error
+};
 enum FileNameType
 {
     kFileTypePicture,       // picture
@@ -50,6 +164,27 @@ enum FileNameType
 class StreamHandle
 {
     const static int kInvalidStreamIndex = -1;
+    const static size_t kMaxCachedFrame = 8;
+    // in-band commands of the clip mux stage, carried as packets with these stream indexes
+    const static int kClipStartIndex = -2;
+    const static int kClipEndIndex = -3;
+    // the same for the file mux stage with bRecordOnMotion
+    const static int kRecordStartIndex = -4;
+    const static int kRecordStopIndex = -5;
+    const static int kMotionPreEventSeconds = 10;  // buffered at least with bRecordOnMotion: a GOP and the decode delay
+    const static int kClipPacketPerSecond = 100;   // room in the clip queue for the pre-event burst
+    const static int kPrepareDateSeconds = 60;     // tomorrow's directories are made this early
+    const static int kClosingSegmentMs = 2000;     // late audio still goes to the previous segment this long
+    const static int kFileRetryMinMs = 1000;       // a failed segment open is tried again after this, doubled up to
+    const static int kFileRetryMaxMs = 60000;
+    const static int kAudioOutPerPacket = 4;       // room in the AAC ring per queued input packet
+    // directories of a date made on the storage thread
+    enum DateState
+    {
+        kDatePending,
+        kDateReady,
+        kDateFailed,
+    };
 
 private:
     static int read_interrupt_cb(void* pContext);
@@ -60,8 +195,28 @@ public:
     StreamHandle();
     ~StreamHandle();
     void ListSupportedHD();
-    bool StartDecode(const StreamInfo& infoStream);
+    // pWorkerPool nullptr: the stream runs its own demux and stage threads,
+    // otherwise the stages run on the pool and the owner calls DemuxOnce
+    bool StartDecode(const StreamInfo& infoStream, ThreadPool* pWorkerPool = nullptr);
     void StopDecode();
+    // read and dispatch one packet, see DemuxResult. With a worker pool it
+    // never blocks on a reconnect, the input is reopened on the pool meanwhile
+    int DemuxOnce();
+    bool IsDemuxEnded() const { return m_bDemuxEnded; }
+    const StreamInfo& GetStreamInfo() const { return m_infoStream; }
+    AVCodecID GetVideoCodecId() const;
+    // takes effect when the video decoder opens: before the first packet is read,
+    // or from the decode start callback
+    void SetDecodeThreads(int nThreads, DecodeThreadType nThreadType);
+    // demux thread, right before the video decode stage starts (the decoder opens
+    // after it), also for a remux stream that gains a frame consumer. Set before
+    // the stream is demuxed
+    void SetDecodeStartCallback(std::function<void()> fnDecodeStart) { m_fnDecodeStart = fnDecodeStart; }
+    OpenTiming GetOpenTiming() const;
+    // lock free counters and histograms, cheap enough to poll
+    StreamMetrics GetMetrics();
+    // append in Prometheus text format, strLabels identifies the stream
+    void CollectMetrics(MetricsText& text, const std::string& strLabels);
 
     void GetVideoSize(long & width, long & height)  //ȡƵֱ
     {
@@ -69,35 +224,133 @@ public:
         height = m_infoStream.nHeight;
     }
 
-    void PushFrame(const cv::Mat& frame);
+    // Without bSavePic or an attached consumer the stream is only remuxed and
+    // no decoder is opened. Attach before popping frames, the video decoder
+    // then comes up at the next keyframe. Attached before StartDecode, the
+    // stream may have no output at all.
+    void AttachFrameConsumer();
+    void DetachFrameConsumer();
+    bool IsPassthrough() const;
+
+    void PushFrame(const FrameHandle& frame);
+    bool PopFrame(FrameHandle& frame);
+    // pop a frame converted to BGR24
     bool PopFrame(cv::Mat& frame);
+    // Frames at the subscriber's size, pixel format and rate, queued for PopFrame(nId)
+    // or passed to the callback on the decode thread. A subscription attaches a
+    // frame consumer, return its id or 0
+    int Subscribe(const SubscriberInfo& info, FrameDispatcher::FrameCallback fnCallback = nullptr);
+    bool Unsubscribe(int nId);
+    bool PopFrame(int nId, SubscribedFrame& frame, int nTimeoutMs = 0);
+    std::vector<SubscriberStats> GetSubscriberStats() { return m_dispatcherFrame.GetStats(); }
+    // queue depth and latency of demux, decode and mux stages
+    std::vector<StageStats> GetStageStats();
+    SnapshotStats GetSnapshotStats() const { return m_writerSnapshot.GetStats(); }
+    // Record a clip from nPreSeconds before now (as far as the pre-event buffer
+    // reaches, starting at a keyframe) until nPostSeconds after. A trigger
+    // during a clip extends it. Any thread, the demux thread picks it up.
+    void TriggerClip(int nPreSeconds, int nPostSeconds);
+    // starts and stops of StreamInfo::infoMotion, called on the decode stage. Set before StartDecode
+    void SetMotionCallback(std::function<void(const MotionEvent&)> fnMotion) { m_fnMotion = fnMotion; }
+    bool IsMotion() const { return m_detectorMotion.IsMotion(); }
+    // Add or remove an output while the stream runs, any thread. Every output
+    // writes on its own stage from a reference of the same packet.
+    // return the output id, -1 if the stream is not started
+    int AddOutput(const OutputSinkInfo& infoSink);
+    bool RemoveOutput(int nId);
+    std::vector<int> GetOutputIds();
 
 
 
 private:
+    using SinkList = std::vector<std::shared_ptr<OutputSink>>;
+
     // input
     bool open_input_stream();
-    bool open_codec_context(int& nStreamIndex,
+    int find_stream(enum AVMediaType nMediaType);
+    bool open_codec_context(int nStreamIndex,
         AVCodecContext **dec_ctx,
-        AVFormatContext *fmt_ctx,
         enum AVMediaType type);
+    bool open_video_decoder();
     void close_input_stream();
+    // reconnection, demux thread or a pool task started by it
+    void close_input_format();
+    bool reconnect_input();
+    // a decoder or muxer rejected parameters from StreamParamCache
+    void drop_cached_params();
+    void start_reconnect();
+    void wait_reconnect();
+    bool remap_packet(AVPacket& packet);
+    void record_first_packet(const AVPacket& packet);
+    void record_first_frame();
+    int64_t glass_latency_us(int nStreamIndex, int64_t nPts) const;
     // output
-    bool open_output_stream(AVFormatContext*& pFormatCtx, bool bRtmp = false);
+    bool open_output_stream(AVFormatContext*& pFormatCtx, std::string* pOutputPath = nullptr);
     void close_output_stream();
-    void do_decode();
+    void do_demux();
     void push_packet(const AVPacket& packet);
-    void handle_frame();
+    bool need_video_frames() const;
+    void start_video_decode_stage();
+    bool accept_video_packet(const AVPacket& packet);
+    void start_stages();
+    void stop_stages();
     bool decode_video_packet(AVPacket* packet);
     bool decode_audio_packet(const AVPacket& packet);
-    void save_stream(AVFormatContext* pFormatCtx, const AVPacket& packet);
+    int64_t frame_time_ms(const AVFrame* pFrame) const;
+    // decode stage, false: the frame is gated off
+    bool analyze_motion(const AVFrame* pFrame);
+    bool record_on_motion() const;
+    // demux thread: file, sinks and clip
+    void push_output(const AVPacket& packet);
+    bool outputs_blocking();
+    // audio transcode: opened before the outputs, the stage sends AAC back to the demux thread
+    void open_audio_transcoder();
+    void transcode_audio_packet(const AVPacket* pPacket);
+    void forward_audio(bool bWait);
+    // stream layout the outputs are built on
+    std::vector<AVCodecParameters*> get_output_par() const;
+    void save_stream(AVFormatContext* pFormatCtx, AVPacket* pPacket);
+    void stop_outputs();
+    std::shared_ptr<const SinkList> sink_list();
+    // segmented recording, file mux stage only
+    void write_file_packet(AVPacket* pPacket);
+    bool gate_file_output(const AVPacket& packet);
+    bool write_closing_segment(AVPacket* pPacket);
+    void close_closing_segment();
+    bool need_new_segment(const AVPacket& packet);
+    void start_segment(const AVPacket& packet);
+    bool rebase_packet(AVPacket* pPacket, int64_t nStartDts, AVRational tbStart);
+    bool rotate_output_file();
+    bool retry_output_file(const AVPacket& packet);
+    void file_open_failed();
+    void post_retention();
+    // event clips, demux thread
+    int64_t packet_time_ms(const AVPacket& packet);
+    void feed_clip(const AVPacket& packet, int64_t nTsMs);
+    void push_clip_command(int nCommandIndex);
+    // bRecordOnMotion, demux thread: the file stage only gets packets during motion
+    void feed_motion_file(const AVPacket& packet, int64_t nTsMs);
+    void push_file_command(int nCommandIndex);
+    // event clips, clip mux stage
+    void write_clip_packet(AVPacket* pPacket);
+    bool is_fragment_start(const AVPacket& packet) const;
+    // bFragment: a fragment was just finished, written out whatever the interval
+    void flush_output(AVFormatContext* pFormatCtx, int64_t& nLastFlushMs, bool bFragment);
+    ThreadPool* get_task_pool();
+    static void enforce_retention(int nRetentionDays, int64_t nRetentionBytes, const std::string& strPrefix,
+        const std::vector<std::string>& vecKeepFile);
+    static std::string default_record_prefix(const std::string& strInput);
     void free_frame_convert_info();
     void release_output_format_context(bool& bInited, AVFormatContext*& pFmtContext);
-    void create_directory();
+    // date directories, demux thread unless noted
+    static bool make_date_directories(const std::string& strDate);   // any thread
+    void set_today(const std::string& strToday, time_t tmNow);
+    void prepare_date(const std::string& strDate);
+    void check_date(time_t tmNow);
     std::string generate_filename(int nType = kFileTypePicture);
+    std::string get_today();
     std::string get_current_path();
     std::string get_error_msg(int nErrorCode);
-    cv::Mat avframe_to_mat(const AVFrame * frame);
 
 private:
     bool m_bExit;
@@ -105,25 +358,133 @@ private:
     std::string m_strToday;
     StreamInfo m_infoStream;
     FrameConvertInfo m_infoFrameConvert;
+    std::shared_ptr<FrameConverter> m_pFrameConverter;
     AVFormatContext* m_pInputAVFormatCtx;
     AVCodecContext* m_pVideoDecoderCtx;
     AVCodecContext* m_pAudioDecoderCtx;
+    AVFrame* m_pDecodeFrame;            // decode thread scratch, with the video decoder
+    AVFrame* m_pSwapFrame;
     AVFormatContext* m_pOutputFileAVFormatCtx;
-    AVFormatContext* m_pOutputStreamAVFormatCtx;
+    AVFormatContext* m_pOutputClipAVFormatCtx;
     AVBufferRef *m_pHDCtx;
     bool m_bInputInited;
+    // Stream layout of the first connection. Decoders and outputs only use
+    // these, a reconnect maps the packets of its streams onto them.
+    std::vector<AVCodecParameters*> m_vecStreamPar;
+    std::vector<AVRational> m_vecStreamTimeBase;
+    // demux thread
+    std::vector<int> m_vecStreamMap;    // input stream index -> layout index, -1: dropped
+    std::atomic<int64_t> m_nIoDeadlineMs;   // steady clock, checked by read_interrupt_cb, 0: none
+    int64_t m_nLastDataMs;              // steady time of the open or the last packet read
+    int64_t m_nReconnectAtMs;           // input closed, next attempt at this steady time
+    int m_nReconnectDelayMs;
+    // on a shared pool the open runs as a task, the demux side keeps off the input meanwhile
+    std::atomic<bool> m_bReconnecting;
+    std::mutex m_mtReconnect;
+    std::condition_variable m_cvReconnect;
+    bool m_bWaitReconnectKey;           // drop packets until the first keyframe of the new connection
+    int64_t m_nTsOffsetUs;              // added to the timestamps of the current connection
+    int64_t m_nLastDtsUs;
+    // time to first frame, steady clock
+    std::atomic<int64_t> m_nOpenStartMs;
+    std::atomic<int64_t> m_nOpenMs;
+    std::atomic<int64_t> m_nFirstPacketMs;
+    std::atomic<int64_t> m_nFirstKeyFrameMs;
+    std::atomic<int64_t> m_nFirstFrameMs;
+    std::atomic<bool> m_bOpenFromCache;
+    // metrics, recorded without locks
+    std::atomic<uint64_t> m_nReadBytes;
+    std::atomic<uint64_t> m_nDecodedFrames;
+    LatencyHistogram m_histHwTransfer;
+    LatencyHistogram m_histConvert;     // PopFrame(cv::Mat&)
+    LatencyHistogram m_histGlassToFile;
+    LatencyHistogram m_histGlassToFrame;
+    // wall clock of a capture time: ref wall + (pts - ref pts), set at the first packet of a connection
+    std::atomic<int64_t> m_nGlassRefWallUs;
+    std::atomic<int64_t> m_nGlassRefPtsUs;
     bool m_bOutputInited;
 
-    std::thread m_thDecode;
-    std::thread m_thHandleFrame;
-    std::mutex m_mtPacket;
-    std::condition_variable m_cvFrame;
-    std::list<AVPacket> m_listPacket;
+    // demux thread -> video decode, audio decode, file mux, rtmp mux
+    std::thread m_thDemux;
+    std::atomic<int> m_nFrameConsumer;
+    bool m_bFeedVideoDecoder;   // demux thread only
+    bool m_bVideoDecoderFailed; // video decode stage only
+    ThreadPool* m_pWorkerPool;  // shared pool of the owner, nullptr for dedicated threads
+    std::function<void()> m_fnDecodeStart;
+    std::atomic<bool> m_bDemuxEnded;
+    int64_t m_nVideoPacket;
+    // date rollover, demux thread
+    time_t m_tmDateCheck;               // nothing to do before this time
+    time_t m_tmNextDay;                 // local midnight ending m_strToday
+    std::string m_strPendingDate;       // directories requested on the storage thread
+    std::shared_ptr<std::atomic<int>> m_pPendingDate;
+    // keyframe decode mode, demux thread
+    int64_t m_nLastKeyFrameMs;
+    int64_t m_nLastDecodedKeyMs;
+    std::atomic<bool> m_bKeyFrameFallback;      // sticky until StopDecode, set at a keyframe
+    std::atomic<bool> m_bFallbackPending;       // long GOP seen, the fallback starts at the next keyframe
+    StageCounter m_counterDemux;
+    PipelineStage m_stageVideoDecode;
+    PipelineStage m_stageAudioDecode;
+    PipelineStage m_stageAudioTranscode;
+    AudioTranscoder m_transcoderAudio;
+    PacketRing m_ringAudioOut;          // transcode stage -> demux thread, drops counted in GetStageStats
+    bool m_bTranscodeAudio;
+    // motion, decode stage
+    MotionDetector m_detectorMotion;
+    std::function<void(const MotionEvent&)> m_fnMotion;
+    std::atomic<bool> m_bMotionRecord;  // the demux thread follows it with bRecordOnMotion
+    std::atomic<int64_t> m_nMotionStartMs;  // frame time of the last motion start
+    bool m_bMotionFeed;                 // demux thread, packets go to the file stage
+    bool m_bMotionFile;                 // file mux stage, between kRecordStartIndex and kRecordStopIndex
+    LatencyHistogram m_histMotion;
+    PipelineStage m_stageFileMux;
+    // rtmp and other outputs, copied on change so the demux thread takes the
+    // list under the lock and pushes outside it
+    std::mutex m_mtSink;
+    std::shared_ptr<const SinkList> m_pSinkList;
+    int m_nNextSinkId;
+    // current segment, file mux stage only
+    std::string m_strVideoFile;
+    std::string m_strSegmentDate;
+    int64_t m_nSegmentStartDts;         // AV_NOPTS_VALUE: waiting for the first keyframe
+    AVRational m_tbSegment;
+    // the previous segment, open until the audio stamped before the cut is written
+    AVFormatContext* m_pClosingFileCtx;
+    std::string m_strClosingFile;
+    int64_t m_nClosingStartDts;
+    AVRational m_tbClosing;
+    int64_t m_nFileFlushMs;             // file mux stage
+    int64_t m_nFileRetryAtMs;           // file mux stage, steady time of the next open after a failure
+    int m_nFileRetryDelayMs;            // 0: no failed open pending
+    std::atomic<uint64_t> m_nFileOpenFailures;
+    // event clips
+    PipelineStage m_stageClipMux;
+    PreEventBuffer m_bufferPreEvent;    // demux thread
+    int64_t m_nLastPacketMs;            // demux thread
+    bool m_bClipActive;                 // demux thread
+    int64_t m_nClipEndMs;               // demux thread
+    bool m_bClipOpen;                   // clip mux stage, between start and end command
+    int64_t m_nClipStartDts;            // clip mux stage
+    AVRational m_tbClip;
+    int64_t m_nClipFlushMs;             // clip mux stage
+    std::mutex m_mtClip;
+    bool m_bClipRequest;
+    int m_nClipPreSeconds;
+    int m_nClipPostSeconds;
 
     // cache the frame
     std::mutex m_mtFrame;
-    std::list<cv::Mat> m_listFrame;
+    std::vector<FrameHandle> m_vecFrame;        // ring of kMaxCachedFrame
+    size_t m_nFrameHead;
+    size_t m_nFrameCount;
+    FramePool m_poolFrame;
+    FrameDispatcher m_dispatcherFrame;
     ThreadPool m_poolSavePic;
+    SnapshotWriter m_writerSnapshot;
+    std::mutex m_mtFilename;
+    int64_t m_nLastFileMs;
+    int m_nFileSeq;
 
 
 
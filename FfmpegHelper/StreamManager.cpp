@@ -0,0 +1,351 @@
+#include "StreamManager.h"
+#include <algorithm>
+#include <cmath>
+#include "Time.h"
+
+StreamManager::StreamManager()
+    : m_bRunning(false)
+    , m_nNextId(0)
+    , m_nDecodeCoreBudget(0)
+    , m_nDecodeThreadsUsed(0)
+    , m_nMetricsIntervalMs(0)
+    , m_nNextMetricsMs(0)
+    , m_bMetricsPending(false)
+{
+}
+
+StreamManager::~StreamManager()
+{
+    Stop();
+}
+
+bool StreamManager::Start(int nIoThread, int nWorkerThread)
+{
+    if (m_bRunning)
+        return false;
+    if (nWorkerThread <= 0)
+        nWorkerThread = std::max(1u, std::thread::hardware_concurrency());
+    nIoThread = std::max(1, nIoThread);
+    m_poolWorker.Start(nWorkerThread, nWorkerThread);
+    m_bRunning = true;
+    std::lock_guard<std::mutex> lock(m_mtStreams);
+    for (int nIndex = 0; nIndex < nIoThread; ++nIndex)
+    {
+        auto pWorker = std::make_shared<IoWorker>();
+        pWorker->bDumpMetrics = 0 == nIndex;
+        pWorker->thIo = std::thread(std::bind(&StreamManager::io_loop, this, pWorker.get()));
+        m_vecIoWorker.push_back(pWorker);
+    }
+    return true;
+}
+
+void StreamManager::Stop()
+{
+    if (!m_bRunning.exchange(false))
+        return;
+    std::vector<std::shared_ptr<IoWorker>> vecIoWorker;
+    {
+        std::lock_guard<std::mutex> lock(m_mtStreams);
+        vecIoWorker.swap(m_vecIoWorker);
+    }
+    for (auto& pWorker : vecIoWorker)
+    {
+        if (pWorker->thIo.joinable())
+            pWorker->thIo.join();
+    }
+    // nobody demuxes any more, stop the streams while the pool still drains their stages.
+    // A RemoveStream in progress stops only what it still finds in vecStreams
+    for (auto& pWorker : vecIoWorker)
+    {
+        std::vector<StreamEntry> vecStreams;
+        {
+            std::lock_guard<std::mutex> lock(pWorker->mtStreams);
+            vecStreams.swap(pWorker->vecStreams);
+        }
+        for (auto& entry : vecStreams)
+            entry.pStream->StopDecode();
+    }
+    vecIoWorker.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_mtStreams);
+        m_mapStreams.clear();
+        m_mapDecodeThreads.clear();
+        m_nDecodeThreadsUsed = 0;
+    }
+    m_poolWorker.Stop();
+}
+
+int StreamManager::AddStream(const StreamInfo& infoStream)
+{
+    if (!m_bRunning)
+        return -1;
+    auto pStream = std::make_shared<StreamHandle>();
+    if (!pStream->StartDecode(infoStream, &m_poolWorker)) {
+        pStream->StopDecode();
+        return -1;
+    }
+    int nId = m_nNextId++;
+    std::shared_ptr<IoWorker> pWorker;
+    // not demuxed yet. The cores are charged when the decoder comes up, a remux
+    // stream takes none until it gains a frame consumer
+    StreamHandle* pHandle = pStream.get();
+    pStream->SetDecodeStartCallback([this, nId, pHandle]() { charge_decode_threads(nId, *pHandle); });
+    {
+        std::lock_guard<std::mutex> lock(m_mtStreams);
+        pWorker = get_io_worker(nId);
+        if (!pWorker) {
+            // stopped meanwhile
+            pStream->StopDecode();
+            return -1;
+        }
+        m_mapStreams[nId] = pStream;
+    }
+    StreamEntry entry;
+    entry.nId = nId;
+    entry.pStream = pStream;
+    {
+        // Stop takes the streams under this lock after m_bRunning is cleared
+        std::lock_guard<std::mutex> lock(pWorker->mtStreams);
+        if (m_bRunning) {
+            pWorker->vecStreams.push_back(entry);
+            return nId;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mtStreams);
+        m_mapStreams.erase(nId);
+        release_decode_threads(nId);
+    }
+    pStream->StopDecode();
+    return -1;
+}
+
+bool StreamManager::RemoveStream(int nId)
+{
+    std::shared_ptr<StreamHandle> pStream;
+    std::shared_ptr<IoWorker> pWorker;
+    {
+        std::lock_guard<std::mutex> lock(m_mtStreams);
+        auto it = m_mapStreams.find(nId);
+        if (it == m_mapStreams.end())
+            return false;
+        pStream = it->second;
+        m_mapStreams.erase(it);
+        release_decode_threads(nId);
+        pWorker = get_io_worker(nId);
+    }
+    // Stop took the streams of the worker, it stops this one as well
+    if (!pWorker)
+        return true;
+    {
+        std::lock_guard<std::mutex> lock(pWorker->mtStreams);
+        auto& vecStreams = pWorker->vecStreams;
+        auto it = std::remove_if(vecStreams.begin(), vecStreams.end(),
+            [nId](const StreamEntry& entry) { return entry.nId == nId; });
+        if (it == vecStreams.end())
+            return true;
+        vecStreams.erase(it, vecStreams.end());
+    }
+    // out of the I/O thread now, safe to stop
+    pStream->StopDecode();
+    return true;
+}
+
+std::shared_ptr<StreamHandle> StreamManager::GetStream(int nId)
+{
+    std::lock_guard<std::mutex> lock(m_mtStreams);
+    auto it = m_mapStreams.find(nId);
+    return it != m_mapStreams.end() ? it->second : nullptr;
+}
+
+bool StreamManager::QueryStream(int nId, StreamState& state)
+{
+    std::shared_ptr<StreamHandle> pStream = GetStream(nId);
+    if (!pStream)
+        return false;
+    state.nId = nId;
+    state.strInput = pStream->GetStreamInfo().strInput;
+    state.bEnded = pStream->IsDemuxEnded();
+    state.bPassthrough = pStream->IsPassthrough();
+    state.vecStages = pStream->GetStageStats();
+    std::lock_guard<std::mutex> lock(m_mtStreams);
+    auto it = m_mapDecodeThreads.find(nId);
+    state.nDecodeThreads = it != m_mapDecodeThreads.end() ? it->second : 0;
+    return true;
+}
+
+std::vector<int> StreamManager::GetStreamIds()
+{
+    std::vector<int> vecIds;
+    std::lock_guard<std::mutex> lock(m_mtStreams);
+    for (auto& item : m_mapStreams)
+        vecIds.push_back(item.first);
+    return vecIds;
+}
+
+size_t StreamManager::GetStreamCount()
+{
+    std::lock_guard<std::mutex> lock(m_mtStreams);
+    return m_mapStreams.size();
+}
+
+int StreamManager::GetThreadCount()
+{
+    std::lock_guard<std::mutex> lock(m_mtStreams);
+    return (int)m_vecIoWorker.size() + m_poolWorker.GetPoolSize();
+}
+
+std::shared_ptr<StreamManager::IoWorker> StreamManager::get_io_worker(int nId)
+{
+    if (m_vecIoWorker.empty())
+        return nullptr;
+    return m_vecIoWorker[nId % m_vecIoWorker.size()];
+}
+
+void StreamManager::collect_metrics(MetricsText& text)
+{
+    std::map<int, std::shared_ptr<StreamHandle>> mapStreams;
+    {
+        std::lock_guard<std::mutex> lock(m_mtStreams);
+        mapStreams = m_mapStreams;
+    }
+    text.AddGauge("ffh_streams", "", (double)mapStreams.size(), "Streams managed");
+    text.AddGauge("ffh_worker_queue_depth", "", (double)m_poolWorker.GetQueueSize(), "Tasks waiting for a worker");
+    FileWriterStats statsWriter = FileWriter::GetStats();
+    text.AddCounter("ffh_file_write_bytes_total", "", statsWriter.nWriteBytes, "Bytes FileWriter wrote to disk");
+    text.AddCounter("ffh_file_writes_total", "", statsWriter.nWrites, "Write calls of FileWriter");
+    text.AddCounter("ffh_file_syncs_total", "", statsWriter.nSyncs, "Segments closed with fdatasync");
+    for (auto& item : mapStreams)
+    {
+        std::string strLabels = MetricsText::Label("stream", std::to_string(item.first)) + ","
+            + MetricsText::Label("input", item.second->GetStreamInfo().strInput);
+        item.second->CollectMetrics(text, strLabels);
+    }
+}
+
+std::string StreamManager::GetMetricsText()
+{
+    MetricsText text;
+    collect_metrics(text);
+    return text.ToString();
+}
+
+bool StreamManager::WriteMetrics(const std::string& strPath)
+{
+    MetricsText text;
+    collect_metrics(text);
+    return text.WriteFile(strPath);
+}
+
+void StreamManager::SetMetricsFile(const std::string& strPath, int nIntervalMs)
+{
+    std::lock_guard<std::mutex> lock(m_mtMetrics);
+    m_strMetricsFile = strPath;
+    m_nMetricsIntervalMs = strPath.empty() ? 0 : std::max(100, nIntervalMs);
+    m_nNextMetricsMs = 0;
+}
+
+void StreamManager::dump_metrics()
+{
+    int nIntervalMs = m_nMetricsIntervalMs.load(std::memory_order_relaxed);
+    if (nIntervalMs <= 0 || m_bMetricsPending.load())
+        return;
+    int64_t nNowMs = Time::GetSteadyMilliTimestamp();
+    if (nNowMs < m_nNextMetricsMs.load())
+        return;
+    m_nNextMetricsMs = nNowMs + nIntervalMs;
+    m_bMetricsPending = true;
+    // formatting and writing never run on the I/O thread
+    bool bPosted = m_poolWorker.TryPost([this]() {
+        std::string strPath;
+        {
+            std::lock_guard<std::mutex> lock(m_mtMetrics);
+            strPath = m_strMetricsFile;
+        }
+        if (!strPath.empty() && !WriteMetrics(strPath))
+            fprintf(stderr, "Could not write metrics to %s\n", strPath.c_str());
+        m_bMetricsPending = false;
+    }, kPriorityLow);
+    if (!bPosted)
+        m_bMetricsPending = false;
+}
+
+void StreamManager::SetDecodeCoreBudget(int nCores)
+{
+    std::lock_guard<std::mutex> lock(m_mtStreams);
+    m_nDecodeCoreBudget = std::max(0, nCores);
+}
+
+int StreamManager::assign_decode_threads(StreamHandle& stream)
+{
+    const StreamInfo& infoStream = stream.GetStreamInfo();
+    // a pure remux never opens the video decoder
+    if (infoStream.nHDType != AV_HWDEVICE_TYPE_NONE || infoStream.nVideoIndex < 0 || stream.IsPassthrough())
+        return 0;
+    // chosen by the caller, still takes its cores from the budget
+    if (infoStream.nDecodeThreads > 0)
+        return infoStream.nDecodeThreads;
+    int nBudget = m_nDecodeCoreBudget > 0 ? m_nDecodeCoreBudget
+        : (int)std::max(1u, std::thread::hardware_concurrency());
+    double dPixelRate = (double)infoStream.nWidth * infoStream.nHeight * std::max(1, infoStream.nFrameRate);
+    if (AV_CODEC_ID_HEVC == stream.GetVideoCodecId())
+        dPixelRate *= 2;
+    int nWanted = std::max(1, (int)std::ceil(dPixelRate / kPixelRatePerCore));
+    int nFree = nBudget - m_nDecodeThreadsUsed;
+    int nThreads = nWanted < nFree ? nWanted : nFree;
+    if (nThreads > kMaxDecodeThreads)
+        nThreads = kMaxDecodeThreads;
+    // never less than one thread, an exhausted budget only stops the threading
+    nThreads = std::max(1, nThreads);
+    stream.SetDecodeThreads(nThreads, nThreads > 1 ? kDecodeThreadFrame : kDecodeThreadAuto);
+    return nThreads;
+}
+
+void StreamManager::charge_decode_threads(int nId, StreamHandle& stream)
+{
+    std::lock_guard<std::mutex> lock(m_mtStreams);
+    // removed meanwhile, or charged already
+    if (m_mapStreams.find(nId) == m_mapStreams.end() || m_mapDecodeThreads.count(nId) > 0)
+        return;
+    int nDecodeThreads = assign_decode_threads(stream);
+    m_mapDecodeThreads[nId] = nDecodeThreads;
+    m_nDecodeThreadsUsed += nDecodeThreads;
+}
+
+void StreamManager::release_decode_threads(int nId)
+{
+    auto it = m_mapDecodeThreads.find(nId);
+    if (it == m_mapDecodeThreads.end())
+        return;
+    m_nDecodeThreadsUsed -= it->second;
+    m_mapDecodeThreads.erase(it);
+}
+
+void StreamManager::io_loop(IoWorker* pWorker)
+{
+    while (m_bRunning)
+    {
+        if (pWorker->bDumpMetrics)
+            dump_metrics();
+        bool bBusy = false;
+        {
+            std::lock_guard<std::mutex> lock(pWorker->mtStreams);
+            for (auto& entry : pWorker->vecStreams)
+            {
+                if (entry.bEnded)
+                    continue;
+                int nResult = entry.pStream->DemuxOnce();
+                if (kDemuxPacket == nResult)
+                    bBusy = true;
+                else if (kDemuxEnd == nResult) {
+                    // the decoder finishes what is queued, the next stream may have the cores
+                    entry.bEnded = true;
+                    std::lock_guard<std::mutex> lockStreams(m_mtStreams);
+                    release_decode_threads(entry.nId);
+                }
+            }
+        }
+        if (!bBusy)
+            std::this_thread::sleep_for(std::chrono::milliseconds(kIdleSleepMs));
+    }
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "StreamHandle.h"
+#include "ThreadPool.h"
+
+// state of one managed stream
+struct StreamState
+{
+    int nId = -1;
+    std::string strInput;
+    bool bEnded = false;
+    bool bPassthrough = true;
+    int nDecodeThreads = 0;     // software decoder threads charged to the budget, 0: hardware, no decoding or ended
+    std::vector<StageStats> vecStages;
+};
+
+// Runs many StreamHandle on a fixed thread budget: a few I/O threads demux
+// all streams round robin (DemuxOnce), and every decode/mux stage runs on
+// one worker pool sized to the core count. No thread is created per stream.
+class StreamManager
+{
+    const static int kIdleSleepMs = 2;      // all streams of an I/O thread had nothing to read
+    // pixels per second one core decodes (1080p60 H.264), HEVC counts double
+    const static int64_t kPixelRatePerCore = 1920LL * 1080 * 60;
+    const static int kMaxDecodeThreads = 16;
+
+public:
+    StreamManager();
+    ~StreamManager();
+
+    // nWorkerThread 0: one per core
+    bool Start(int nIoThread = 2, int nWorkerThread = 0);
+    void Stop();
+
+    // open and start a stream, return its id or -1
+    int AddStream(const StreamInfo& infoStream);
+    bool RemoveStream(int nId);
+    std::shared_ptr<StreamHandle> GetStream(int nId);
+    bool QueryStream(int nId, StreamState& state);
+    std::vector<int> GetStreamIds();
+    size_t GetStreamCount();
+    // I/O plus worker threads owned by the manager
+    int GetThreadCount();
+    // Cores shared by the software decoders, 0: one per core. A decoding stream
+    // that does not set nDecodeThreads gets the cores its pixel rate needs (frame
+    // threads for 4K, one thread for a small substream) while the budget
+    // lasts, then a single thread. The cores are taken when the decoder starts,
+    // a remux only stream takes nothing until it gains a frame consumer, an ended
+    // or removed one gives its cores back. Applies to decoders started afterwards.
+    void SetDecodeCoreBudget(int nCores);
+
+    // metrics of all streams in Prometheus text format
+    std::string GetMetricsText();
+    bool WriteMetrics(const std::string& strPath);
+    // rewrite the file every nIntervalMs on the pool (for a textfile collector), empty path stops
+    void SetMetricsFile(const std::string& strPath, int nIntervalMs = 10000);
+
+private:
+    struct StreamEntry
+    {
+        int nId = -1;
+        std::shared_ptr<StreamHandle> pStream;
+        bool bEnded = false;        // I/O thread only
+    };
+    struct IoWorker
+    {
+        std::thread thIo;
+        std::mutex mtStreams;       // held for a whole pass, add/remove wait at most one pass
+        std::vector<StreamEntry> vecStreams;
+        bool bDumpMetrics = false;  // the first I/O thread schedules the metrics file
+    };
+    void io_loop(IoWorker* pWorker);
+    // the I/O thread of a stream id, nullptr once stopped, under m_mtStreams
+    std::shared_ptr<IoWorker> get_io_worker(int nId);
+    // I/O thread of the stream, right before its video decoder stage starts
+    void charge_decode_threads(int nId, StreamHandle& stream);
+    // under m_mtStreams
+    int assign_decode_threads(StreamHandle& stream);
+    // give the cores of a removed or ended stream back to the budget, under m_mtStreams
+    void release_decode_threads(int nId);
+    void collect_metrics(MetricsText& text);
+    void dump_metrics();
+
+private:
+    std::atomic<bool> m_bRunning;
+    std::atomic<int> m_nNextId;
+    ThreadPool m_poolWorker;
+    std::vector<std::shared_ptr<IoWorker>> m_vecIoWorker;    // under m_mtStreams
+    std::mutex m_mtStreams;
+    std::map<int, std::shared_ptr<StreamHandle>> m_mapStreams;
+    int m_nDecodeCoreBudget;
+    int m_nDecodeThreadsUsed;
+    std::map<int, int> m_mapDecodeThreads;  // stream id -> threads counted against the budget
+
+    std::mutex m_mtMetrics;
+    std::string m_strMetricsFile;
+    std::atomic<int> m_nMetricsIntervalMs;
+    std::atomic<int64_t> m_nNextMetricsMs;
+    std::atomic<bool> m_bMetricsPending;
+};
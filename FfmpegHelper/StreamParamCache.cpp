@@ -0,0 +1,102 @@
+#include "StreamParamCache.h"
+#include <cstring>
+
+StreamParamCache& StreamParamCache::Instance()
+{
+    static StreamParamCache cache;
+    return cache;
+}
+
+StreamParamCache::~StreamParamCache()
+{
+    for (auto& item : m_mapCache)
+        free_params(item.second);
+}
+
+bool StreamParamCache::Apply(const std::string& strUrl, AVFormatContext* pFormatCtx)
+{
+    std::lock_guard<std::mutex> lock(m_mtCache);
+    auto it = m_mapCache.find(strUrl);
+    if (it == m_mapCache.end() || it->second.size() != pFormatCtx->nb_streams)
+        return false;
+    const std::vector<CachedStream>& vecStream = it->second;
+    for (size_t nIndex = 0; nIndex < vecStream.size(); ++nIndex)
+    {
+        const AVCodecParameters* pCodecPar = pFormatCtx->streams[nIndex]->codecpar;
+        if (pCodecPar->codec_type != vecStream[nIndex].pCodecPar->codec_type
+            || pCodecPar->codec_id != vecStream[nIndex].pCodecPar->codec_id)
+            return false;
+        // the camera changed resolution or SPS since, probe and store again
+        if (is_stale(pCodecPar, vecStream[nIndex].pCodecPar)) {
+            free_params(it->second);
+            m_mapCache.erase(it);
+            return false;
+        }
+    }
+    for (size_t nIndex = 0; nIndex < vecStream.size(); ++nIndex)
+    {
+        // the frame rates and time base feed the rescaling and the output
+        // streams, without them a cached open would not match a probed one
+        AVStream* pStream = pFormatCtx->streams[nIndex];
+        if (avcodec_parameters_copy(pStream->codecpar, vecStream[nIndex].pCodecPar) < 0)
+            return false;
+        pStream->time_base = vecStream[nIndex].tbStream;
+        pStream->avg_frame_rate = vecStream[nIndex].rAvgFrameRate;
+        pStream->r_frame_rate = vecStream[nIndex].rFrameRate;
+    }
+    return true;
+}
+
+void StreamParamCache::Store(const std::string& strUrl, const AVFormatContext* pFormatCtx)
+{
+    std::vector<CachedStream> vecStream;
+    for (unsigned int nIndex = 0; nIndex < pFormatCtx->nb_streams; ++nIndex)
+    {
+        const AVStream* pStream = pFormatCtx->streams[nIndex];
+        AVCodecParameters* pCodecPar = avcodec_parameters_alloc();
+        if (nullptr == pCodecPar || avcodec_parameters_copy(pCodecPar, pStream->codecpar) < 0) {
+            avcodec_parameters_free(&pCodecPar);
+            free_params(vecStream);
+            return;
+        }
+        vecStream.push_back(CachedStream{ pCodecPar, pStream->time_base, pStream->avg_frame_rate, pStream->r_frame_rate });
+    }
+    std::lock_guard<std::mutex> lock(m_mtCache);
+    std::vector<CachedStream>& vecOld = m_mapCache[strUrl];
+    free_params(vecOld);
+    vecOld.swap(vecStream);
+}
+
+void StreamParamCache::Remove(const std::string& strUrl)
+{
+    std::lock_guard<std::mutex> lock(m_mtCache);
+    auto it = m_mapCache.find(strUrl);
+    if (it == m_mapCache.end())
+        return;
+    free_params(it->second);
+    m_mapCache.erase(it);
+}
+
+bool StreamParamCache::is_stale(const AVCodecParameters* pInBand, const AVCodecParameters* pCached)
+{
+    // zero or empty: the demuxer does not know it before probing
+    if (pInBand->width > 0 && pInBand->width != pCached->width)
+        return true;
+    if (pInBand->height > 0 && pInBand->height != pCached->height)
+        return true;
+    if (pInBand->sample_rate > 0 && pInBand->sample_rate != pCached->sample_rate)
+        return true;
+    if (pInBand->channels > 0 && pInBand->channels != pCached->channels)
+        return true;
+    if (pInBand->extradata_size > 0 && (pInBand->extradata_size != pCached->extradata_size
+        || 0 != memcmp(pInBand->extradata, pCached->extradata, pInBand->extradata_size)))
+        return true;
+    return false;
+}
+
+void StreamParamCache::free_params(std::vector<CachedStream>& vecStream)
+{
+    for (CachedStream& stream : vecStream)
+        avcodec_parameters_free(&stream.pCodecPar);
+    vecStream.clear();
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// Last known codec parameters and timing per input url, shared by all streams
+// of the process. A later open of the same url can fill its streams from here
+// and skip avformat_find_stream_info, which costs seconds on RTSP cameras.
+class StreamParamCache
+{
+public:
+    static StreamParamCache& Instance();
+    ~StreamParamCache();
+
+    // after avformat_open_input: fill the streams if the cached layout matches
+    // (count, type and codec of every stream, and what the demuxer already knows
+    // in band: size, sample rate, channels, extradata); false means probe as usual
+    bool Apply(const std::string& strUrl, AVFormatContext* pFormatCtx);
+    // after a successful probe
+    void Store(const std::string& strUrl, const AVFormatContext* pFormatCtx);
+    // also when a decoder or muxer rejects cached parameters, the next open probes
+    void Remove(const std::string& strUrl);
+
+private:
+    // what the probe fills in for one stream
+    struct CachedStream
+    {
+        AVCodecParameters* pCodecPar;
+        AVRational tbStream;
+        AVRational rAvgFrameRate;
+        AVRational rFrameRate;
+    };
+
+    StreamParamCache() {}
+    StreamParamCache(const StreamParamCache&) = delete;
+    StreamParamCache& operator=(const StreamParamCache&) = delete;
+    static void free_params(std::vector<CachedStream>& vecStream);
+    // the parameters set before probing differ from the cached ones
+    static bool is_stale(const AVCodecParameters* pInBand, const AVCodecParameters* pCached);
+
+private:
+    std::mutex m_mtCache;
+    std::map<std::string, std::vector<CachedStream>> m_mapCache;
+};
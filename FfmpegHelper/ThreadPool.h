@@ -1,20 +1,143 @@
 #pragma once
 #include <vector>
-#include <queue>
+#include <deque>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <condition_variable>
 #include <future>
 #include <functional>
+#include <memory>
+#include <new>
+#include <cstddef>
 #include <stdexcept>
+#include <type_traits>
 
+enum TaskPriority
+{
+    kPriorityHigh,          // live work, e.g. a snapshot somebody waits for
+    kPriorityNormal,
+    kPriorityLow,           // backlog, e.g. batched jpeg encode
+    kPriorityCount,
+};
+
+// Move-only void() callable. Callables up to kInlineSize bytes are stored in
+// place, so posting a small lambda does not allocate.
+class PoolTask
+{
+public:
+    const static size_t kInlineSize = 48;
+
+    PoolTask() : m_pOps(nullptr) {}
+    template<class F>
+    PoolTask(F&& f) : m_pOps(nullptr) { set(std::forward<F>(f)); }
+    PoolTask(PoolTask&& other) : m_pOps(nullptr) { move_from(other); }
+    PoolTask& operator=(PoolTask&& other)
+    {
+        if (this != &other) {
+            reset();
+            move_from(other);
+        }
+        return *this;
+    }
+    PoolTask(const PoolTask&) = delete;
+    PoolTask& operator=(const PoolTask&) = delete;
+    ~PoolTask() { reset(); }
+
+    explicit operator bool() const { return m_pOps != nullptr; }
+    void operator()() { m_pOps->pInvoke(m_buffer); }
+    void reset()
+    {
+        if (m_pOps) {
+            m_pOps->pDestroy(m_buffer);
+            m_pOps = nullptr;
+        }
+    }
+
+private:
+    struct Ops
+    {
+        void(*pInvoke)(void* pBuffer);
+        void(*pMove)(void* pDst, void* pSrc);
+        void(*pDestroy)(void* pBuffer);
+    };
+    template<class Fn>
+    struct InlineOps
+    {
+        static void Invoke(void* pBuffer) { (*static_cast<Fn*>(pBuffer))(); }
+        static void Move(void* pDst, void* pSrc)
+        {
+            new (pDst) Fn(std::move(*static_cast<Fn*>(pSrc)));
+            static_cast<Fn*>(pSrc)->~Fn();
+        }
+        static void Destroy(void* pBuffer) { static_cast<Fn*>(pBuffer)->~Fn(); }
+    };
+    template<class Fn>
+    struct HeapOps
+    {
+        static void Invoke(void* pBuffer) { (**static_cast<Fn**>(pBuffer))(); }
+        static void Move(void* pDst, void* pSrc) { *static_cast<Fn**>(pDst) = *static_cast<Fn**>(pSrc); }
+        static void Destroy(void* pBuffer) { delete *static_cast<Fn**>(pBuffer); }
+    };
+
+    template<class F>
+    void set(F&& f)
+    {
+        using Fn = typename std::decay<F>::type;
+        set_impl<Fn>(std::forward<F>(f), std::integral_constant<bool, sizeof(Fn) <= kInlineSize
+            && alignof(Fn) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<Fn>::value>());
+    }
+    template<class Fn, class F>
+    void set_impl(F&& f, std::true_type)
+    {
+        static const Ops ops = { &InlineOps<Fn>::Invoke, &InlineOps<Fn>::Move, &InlineOps<Fn>::Destroy };
+        new (m_buffer) Fn(std::forward<F>(f));
+        m_pOps = &ops;
+    }
+    template<class Fn, class F>
+    void set_impl(F&& f, std::false_type)
+    {
+        static const Ops ops = { &HeapOps<Fn>::Invoke, &HeapOps<Fn>::Move, &HeapOps<Fn>::Destroy };
+        *reinterpret_cast<Fn**>(m_buffer) = new Fn(std::forward<F>(f));
+        m_pOps = &ops;
+    }
+    void move_from(PoolTask& other)
+    {
+        if (other.m_pOps) {
+            other.m_pOps->pMove(m_buffer, other.m_buffer);
+            m_pOps = other.m_pOps;
+            other.m_pOps = nullptr;
+        }
+    }
 
+private:
+    const Ops* m_pOps;
+    alignas(std::max_align_t) unsigned char m_buffer[kInlineSize];
+};
 
+// Work stealing pool. Every worker slot owns one fixed ring per priority,
+// a worker runs its own tasks first and steals from the other slots when it
+// runs dry, always in priority order. The pool grows up to nMaxThread while
+// every thread is busy and shrinks back to the start size after kIdleTimeoutMs.
+// Posting from outside blocks (Post) or fails (TryPost) once nMaxQueue tasks
+// are queued, posting from a pool thread never blocks to avoid deadlocks.
 class ThreadPool
 {
+    const static size_t kLaneCapacity = 256;
+    const static int kIdleTimeoutMs = 5000;
+
 public:
     inline ThreadPool()
         : m_bStoped(false)
+        , m_nThread(0)
+        , m_nIdle(0)
+        , m_nQueued(0)
+        , m_nActive(0)
+        , m_nSpaceWaiter(0)
+        , m_nNextSlot(0)
+        , m_nMinThread(1)
+        , m_nMaxThread(1)
+        , m_nMaxQueue(1024)
     {
     }
 
@@ -24,102 +147,316 @@ public:
     }
 
 public:
-    void Start(unsigned short size = 1, int nMaxThread = 1)
+    void Start(unsigned short size = 1, int nMaxThread = 1, size_t nMaxQueue = 1024)
     {
-        m_nMaxThread = nMaxThread;
-        add_thread(size);
+        std::lock_guard<std::mutex> lock{ m_mtGrow };
+        if (!m_vecSlot.empty())
+            return;
+        m_nMinThread = size > 0 ? size : 1;
+        m_nMaxThread = nMaxThread > m_nMinThread ? nMaxThread : m_nMinThread;
+        m_nMaxQueue = nMaxQueue > 0 ? nMaxQueue : 1;
+        m_bStoped.store(false);
+        for (int nIndex = 0; nIndex < m_nMaxThread; ++nIndex)
+            m_vecSlot.emplace_back(new WorkerSlot);
+        for (int nIndex = 0; nIndex < m_nMinThread; ++nIndex)
+            add_thread(nIndex);
     }
 
+    // queued tasks are still run, then the threads exit
     void Stop()
     {
         m_bStoped.store(true);
-        m_cvTask.notify_all(); // ִ߳
-        for (std::thread& thread : m_vecPool)
+        {
+            std::lock_guard<std::mutex> lock{ m_lock };
+        }
+        m_cvTask.notify_all();
+        m_cvSpace.notify_all();
+        // exiting workers take m_mtGrow, join without holding it
+        std::vector<std::thread> vecThread;
+        {
+            std::lock_guard<std::mutex> lock{ m_mtGrow };
+            for (auto& pSlot : m_vecSlot)
+                vecThread.push_back(std::move(pSlot->thWorker));
+        }
+        for (std::thread& thread : vecThread)
         {
             if (thread.joinable())
-                thread.join(); // ȴ ǰ᣺߳һִ
+                thread.join();
         }
     }
 
-    // ύһ
-    // .get()ȡֵȴִ,ȡֵ
-    // ַʵֵԱ
-    // һʹ   bind .commit(std::bind(&Dog::sayHello, &dog));
-    // һ mem_fn .commit(std::mem_fn(&Dog::sayHello), &dog)
+    // fire and forget, wait while the queue is full, false if the pool is stopped
+    template<class F>
+    bool Post(F&& f, TaskPriority nPriority = kPriorityNormal)
+    {
+        return submit(PoolTask(std::forward<F>(f)), nPriority, true);
+    }
+
+    // fire and forget, false if the queue is full or the pool is stopped
+    template<class F>
+    bool TryPost(F&& f, TaskPriority nPriority = kPriorityNormal)
+    {
+        return submit(PoolTask(std::forward<F>(f)), nPriority, false);
+    }
+
+    // the future gives the return value once the task ran
+    // e.g. .Commit(std::bind(&Dog::sayHello, &dog)) or .Commit(std::mem_fn(&Dog::sayHello), &dog)
     template<class F, class... Args>
     auto Commit(F&& f, Args&&... args) ->std::future<decltype(f(args...))>
     {
-        if (m_bStoped.load())    // stop == true ??
-            throw std::runtime_error("commit on Threadm_vecPool is stopped.");
-
-        using RetType = decltype(f(args...)); // typename std::result_of<F(Args...)>::type,  f ķֵ
+        using RetType = decltype(f(args...));
         auto task = std::make_shared<std::packaged_task<RetType()> >(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...));    // wtf !
+            std::bind(std::forward<F>(f), std::forward<Args>(args)...));
         std::future<RetType> future = task->get_future();
-        {    // 񵽶
-             //Եǰ  lock_guard  mutex  stack װ࣬ʱ lock()ʱ unlock()
-            std::lock_guard<std::mutex> lock{ m_lock };
-            m_queTasks.emplace
-            (
-                [task]() {(*task)(); }
-            );
-        }
-#ifdef THREAD_Pool_AUTO_GROW
-        if (m_nThread < 1 && m_vecPool.size() < MAX_THREAD_NUM)
-            addThread(1);
-#endif // !THREADm_vecPool_AUTO_GROW
-        m_cvTask.notify_one(); // һִ߳
-
+        if (!submit(PoolTask([task]() { (*task)(); }), kPriorityNormal, true))
+            throw std::runtime_error("commit on ThreadPool is stopped.");
         return future;
     }
 
-    //߳
-    int GetAvailableThread() { return m_nThread; }
-    //߳
-    int GetPoolSize() { return m_vecPool.size(); }
+    // idle threads
+    int GetAvailableThread() { return m_nIdle.load(); }
+    // running threads
+    int GetPoolSize() { return m_nThread.load(); }
+    size_t GetQueueSize() { return m_nQueued.load(); }
 
 private:
-    void add_thread(int size)
-    {
-        for (; m_vecPool.size() < m_nMaxThread && size > 0; --size)
-        {   //ʼ߳
-            m_vecPool.emplace_back([this] { // ̺߳
-                while (!this->m_bStoped)
-                {
-                    std::function<void()> task;
-                    {   // ȡһִе task
-                        // unique_lock  lock_guard ĺôǣʱ unlock()  lock()
-                        std::unique_lock<std::mutex> lock{ this->m_lock };
-                        this->m_cvTask.wait(lock,
-                            [this] {return this->m_bStoped.load() || !this->m_queTasks.empty(); }
-                        ); // wait ֱ task
-                        if (this->m_bStoped && this->m_queTasks.empty())return;
-                        task = std::move(this->m_queTasks.front()); // ȡһ task
-                        this->m_queTasks.pop();
-                    }
-                    --m_nThread;
-                    task();
-                    ++m_nThread;
-                }
-            });
-            ++m_nThread;
+    // fixed ring, the owner pops the oldest task, thieves take the newest
+    struct Lane
+    {
+        std::mutex mtLane;
+        PoolTask arrTask[kLaneCapacity];
+        size_t nHead = 0;
+        size_t nCount = 0;
+
+        bool PushBack(PoolTask& task)
+        {
+            std::lock_guard<std::mutex> lock{ mtLane };
+            if (nCount == kLaneCapacity)
+                return false;
+            arrTask[(nHead + nCount) % kLaneCapacity] = std::move(task);
+            ++nCount;
+            return true;
+        }
+        bool PopFront(PoolTask& task)
+        {
+            std::lock_guard<std::mutex> lock{ mtLane };
+            if (0 == nCount)
+                return false;
+            task = std::move(arrTask[nHead]);
+            nHead = (nHead + 1) % kLaneCapacity;
+            --nCount;
+            return true;
+        }
+        bool PopBack(PoolTask& task)
+        {
+            std::lock_guard<std::mutex> lock{ mtLane };
+            if (0 == nCount)
+                return false;
+            task = std::move(arrTask[(nHead + nCount - 1) % kLaneCapacity]);
+            --nCount;
+            return true;
+        }
+    };
+    struct WorkerSlot
+    {
+        Lane arrLane[kPriorityCount];
+        std::thread thWorker;
+        bool bAlive = false;            // guarded by m_mtGrow
+    };
+    struct WorkerContext
+    {
+        ThreadPool* pPool = nullptr;
+        int nSlot = -1;
+    };
+    static WorkerContext& current_worker()
+    {
+        static thread_local WorkerContext context;
+        return context;
+    }
+
+    bool submit(PoolTask&& task, TaskPriority nPriority, bool bWait)
+    {
+        if (m_bStoped.load() || m_vecSlot.empty())
+            return false;
+        if (nPriority < kPriorityHigh || nPriority >= kPriorityCount)
+            nPriority = kPriorityNormal;
+        WorkerContext& context = current_worker();
+        bool bInPool = context.pPool == this;
+        // the slot is counted before the task is visible, a worker may take it at once
+        if (bInPool)
+            m_nQueued.fetch_add(1);
+        else if (!reserve_slot(bWait))
+            return false;
+        if (m_bStoped.load()) {
+            release_slot();
+            return false;
+        }
+        // own slot first, then round robin over the slots
+        size_t nSlotCount = m_vecSlot.size();
+        size_t nStart = bInPool ? context.nSlot : m_nNextSlot.fetch_add(1) % nSlotCount;
+        bool bQueued = false;
+        for (size_t nOffset = 0; nOffset < nSlotCount && !bQueued; ++nOffset)
+            bQueued = m_vecSlot[(nStart + nOffset) % nSlotCount]->arrLane[nPriority].PushBack(task);
+        if (!bQueued) {
+            // every ring of that priority is full, spill over
+            std::lock_guard<std::mutex> lock{ m_mtOverflow };
+            m_arrOverflow[nPriority].push_back(std::move(task));
+        }
+        int nIdle = m_nIdle.load();
+        if (nIdle > 0) {
+            {
+                std::lock_guard<std::mutex> lock{ m_lock };
+            }
+            m_cvTask.notify_one();
+        }
+        // more work queued than idle threads can pick up
+        if (m_nQueued.load() > (size_t)nIdle && m_nThread.load() < m_nMaxThread)
+            grow();
+        return true;
+    }
+
+    // posters from outside the pool are bounded by m_nMaxQueue
+    bool reserve_slot(bool bWait)
+    {
+        size_t nQueued = m_nQueued.load();
+        while (true)
+        {
+            if (nQueued < m_nMaxQueue) {
+                if (m_nQueued.compare_exchange_weak(nQueued, nQueued + 1))
+                    return true;
+                continue;
+            }
+            if (!bWait)
+                return false;
+            std::unique_lock<std::mutex> lock{ m_lock };
+            ++m_nSpaceWaiter;
+            m_cvSpace.wait(lock, [this] { return m_bStoped.load() || m_nQueued.load() < m_nMaxQueue; });
+            --m_nSpaceWaiter;
+            if (m_bStoped.load())
+                return false;
+            nQueued = m_nQueued.load();
         }
     }
 
+    // a task taken or a reservation given back
+    void release_slot()
+    {
+        m_nQueued.fetch_sub(1);
+        if (m_nSpaceWaiter.load() > 0) {
+            {
+                std::lock_guard<std::mutex> lock{ m_lock };
+            }
+            m_cvSpace.notify_one();
+        }
+    }
+
+    bool take_task(int nSlot, PoolTask& task)
+    {
+        size_t nSlotCount = m_vecSlot.size();
+        for (int nPriority = kPriorityHigh; nPriority < kPriorityCount; ++nPriority)
+        {
+            if (m_vecSlot[nSlot]->arrLane[nPriority].PopFront(task))
+                return true;
+            for (size_t nOffset = 1; nOffset < nSlotCount; ++nOffset)
+            {
+                if (m_vecSlot[(nSlot + nOffset) % nSlotCount]->arrLane[nPriority].PopBack(task))
+                    return true;
+            }
+            std::lock_guard<std::mutex> lock{ m_mtOverflow };
+            if (!m_arrOverflow[nPriority].empty()) {
+                task = std::move(m_arrOverflow[nPriority].front());
+                m_arrOverflow[nPriority].pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void grow()
+    {
+        std::unique_lock<std::mutex> lock{ m_mtGrow, std::try_to_lock };
+        if (!lock.owns_lock() || m_bStoped.load() || m_nThread.load() >= m_nMaxThread)
+            return;
+        for (size_t nIndex = 0; nIndex < m_vecSlot.size(); ++nIndex)
+        {
+            if (!m_vecSlot[nIndex]->bAlive) {
+                add_thread((int)nIndex);
+                return;
+            }
+        }
+    }
+
+    // m_mtGrow must be held
+    void add_thread(int nSlot)
+    {
+        WorkerSlot* pSlot = m_vecSlot[nSlot].get();
+        if (pSlot->thWorker.joinable())
+            pSlot->thWorker.join();     // an earlier worker of the slot already left
+        pSlot->bAlive = true;
+        ++m_nThread;
+        pSlot->thWorker = std::thread([this, nSlot] { run(nSlot); });
+    }
+
+    void run(int nSlot)
+    {
+        WorkerContext& context = current_worker();
+        context.pPool = this;
+        context.nSlot = nSlot;
+        while (true)
+        {
+            PoolTask task;
+            if (take_task(nSlot, task)) {
+                release_slot();
+                ++m_nActive;
+                task();
+                --m_nActive;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock{ m_lock };
+            if (m_bStoped.load() && 0 == m_nQueued.load())
+                break;
+            ++m_nIdle;
+            // a copy, binding the class constant to a reference would need its definition
+            int nIdleTimeoutMs = kIdleTimeoutMs;
+            bool bWoken = m_cvTask.wait_for(lock, std::chrono::milliseconds(nIdleTimeoutMs),
+                [this] { return m_bStoped.load() || m_nQueued.load() > 0; });
+            --m_nIdle;
+            if (!bWoken && try_shrink(nSlot))
+                return;
+        }
+        std::lock_guard<std::mutex> lock{ m_mtGrow };
+        m_vecSlot[nSlot]->bAlive = false;
+        --m_nThread;
+    }
+
+    bool try_shrink(int nSlot)
+    {
+        std::unique_lock<std::mutex> lock{ m_mtGrow, std::try_to_lock };
+        if (!lock.owns_lock() || m_nThread.load() <= m_nMinThread)
+            return false;
+        // the tasks left in this slot's rings are stolen by the others
+        m_vecSlot[nSlot]->bAlive = false;
+        --m_nThread;
+        return true;
+    }
+
 private:
-    using Task = std::function<void()>;
-    // ̳߳
-    std::vector<std::thread> m_vecPool;
-    // 
-    std::queue<Task> m_queTasks;
-    // ͬ
+    std::vector<std::unique_ptr<WorkerSlot>> m_vecSlot;
+    std::mutex m_mtOverflow;
+    std::deque<PoolTask> m_arrOverflow[kPriorityCount];
+    // idle workers sleep on m_cvTask, blocked posters on m_cvSpace
     std::mutex m_lock;
-    // 
     std::condition_variable m_cvTask;
-    // Ƿرύ
+    std::condition_variable m_cvSpace;
+    std::mutex m_mtGrow;
     std::atomic<bool> m_bStoped;
-    //߳
     std::atomic<int> m_nThread;
+    std::atomic<int> m_nIdle;
+    std::atomic<size_t> m_nQueued;
+    std::atomic<int> m_nActive;
+    std::atomic<int> m_nSpaceWaiter;
+    std::atomic<size_t> m_nNextSlot;
+    int m_nMinThread;
     int m_nMaxThread;
-
+    size_t m_nMaxQueue;
 };
@@ -1,25 +1,52 @@
 #pragma once
 #include <string>
 #include <chrono>
+#include <ctime>
 
 class Time
 {
 public:
-static std::string GetCurrentDate()
+// thread safe localtime
+static std::tm GetLocalTime(time_t ltime)
 {
-    time_t ltime = time(NULL);
     std::tm ltm = { 0 };
+#ifdef _WIN32
     localtime_s(&ltm, &ltime);
+#else
+    localtime_r(&ltime, &ltm);
+#endif
+    return ltm;
+}
+
+// YYYY-MM-DD, local time
+static std::string GetDate(time_t ltime)
+{
+    std::tm ltm = GetLocalTime(ltime);
     char buffer[128] = { 0 };
     strftime(buffer, sizeof(buffer), "%Y-%m-%d", &ltm);
     return buffer;
 }
 
+static std::string GetCurrentDate()
+{
+    return GetDate(time(NULL));
+}
+
+// local midnight that starts the day of ltime (nDays 0) or a later one, DST aware
+static time_t GetDayStart(time_t ltime, int nDays = 0)
+{
+    std::tm ltm = GetLocalTime(ltime);
+    ltm.tm_mday += nDays;
+    ltm.tm_hour = 0;
+    ltm.tm_min = 0;
+    ltm.tm_sec = 0;
+    ltm.tm_isdst = -1;
+    return mktime(&ltm);
+}
+
 static std::string GetCurrentSystemTime()
 {
-    time_t ltime = time(NULL);
-    std::tm ltm = { 0 };
-    localtime_s(&ltm, &ltime);
+    std::tm ltm = GetLocalTime(time(NULL));
     char buffer[128] = { 0 };
     strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &ltm);
     return buffer;
@@ -32,5 +59,14 @@ static int64_t GetMilliTimestamp()
         curr.time_since_epoch());
     return ms.count();
 }
+
+// for timeouts, not affected by clock changes
+static int64_t GetSteadyMilliTimestamp()
+{
+    auto curr = std::chrono::steady_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        curr.time_since_epoch());
+    return ms.count();
+}
 };
 